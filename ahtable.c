@@ -16,6 +16,20 @@
 const double ahtable_max_load_factor = 100000.0; /* arbitrary large number => don't resize */
 const size_t ahtable_initial_size = 4096;
 
+/* one lookup in AHTABLE_SAMPLE_MASK + 1 is sampled, and a key is moved to
+ * the front of its slot once it has been sampled this many more times than
+ * the others */
+#define AHTABLE_SAMPLE_MASK 0xf
+#define AHTABLE_REORDER_MIN 2
+
+/* each change to a table that is adopting another moves over old slots until
+ * it has read about this many keys, so expanding or splitting a table costs
+ * no single change more than that */
+#define AHTABLE_MIGRATE_WORK 64
+
+/* per thread, so sampling needs no shared writes of its own */
+static __thread unsigned int sample_tick;
+
 static size_t keylen(slot_t s) {
     if (0x1 & *s) {
         return (size_t) (*((uint16_t*) s) >> 1);
@@ -25,6 +39,24 @@ static size_t keylen(slot_t s) {
     }
 }
 
+/* the whole size of the key/value pair at s */
+static size_t entrylen(slot_t s) {
+    size_t k = keylen(s);
+    return (k < 128 ? 1 : 2) + k + sizeof(value_t);
+}
+
+
+/* A table's view of the old table it is adopting keys from. */
+typedef struct ahtable_src_t_
+{
+    ahtable_t* table;     // the old table
+    unsigned char lo, hi; // the first characters of the keys taken
+    bool all;             // take every key, as when expanding
+    bool skip;            // drop the first character of the keys taken
+    size_t next;          // the next old slot to move
+    size_t pending;       // about how many keys are left to move
+} ahtable_src_t;
+
 
 ahtable_t* ahtable_create()
 {
@@ -33,6 +65,12 @@ ahtable_t* ahtable_create()
 
 
 ahtable_t* ahtable_create_n(size_t n)
+{
+    return ahtable_create_lf(n, ahtable_max_load_factor);
+}
+
+
+ahtable_t* ahtable_create_lf(size_t n, double max_load_factor)
 {
     ahtable_t* table = malloc_or_die(sizeof(ahtable_t));
     table->flag = 0;
@@ -40,46 +78,23 @@ ahtable_t* ahtable_create_n(size_t n)
 
     table->n = n;
     table->m = 0;
-    table->max_m = (size_t) (ahtable_max_load_factor * (double) table->n);
+    table->n0 = n;
+    table->max_load_factor = max_load_factor;
+    table->max_m = (size_t) (max_load_factor * (double) table->n);
     table->slots = malloc_or_die(n * sizeof(slot_t));
     memset(table->slots, 0, n * sizeof(slot_t));
 
     table->slot_sizes = malloc_or_die(n * sizeof(size_t));
     memset(table->slot_sizes, 0, n * sizeof(size_t));
 
-    return table;
-}
-
-
-void ahtable_free(ahtable_t* table)
-{
-    if (table == NULL) return;
-    size_t i;
-    for (i = 0; i < table->n; ++i) free(table->slots[i]);
-    free(table->slots);
-    free(table->slot_sizes);
-    free(table);
-}
-
+    table->hot = NULL;
+    table->src = NULL;
+    table->refs = 0;
 
-size_t ahtable_size(const ahtable_t* table)
-{
-    return table->m;
+    return table;
 }
 
 
-void ahtable_clear(ahtable_t* table)
-{
-    size_t i;
-    for (i = 0; i < table->n; ++i) free(table->slots[i]);
-    table->n = ahtable_initial_size;
-    table->slots = realloc_or_die(table->slots, table->n * sizeof(slot_t));
-    memset(table->slots, 0, table->n * sizeof(slot_t));
-
-    table->slot_sizes = realloc_or_die(table->slot_sizes, table->n * sizeof(size_t));
-    memset(table->slot_sizes, 0, table->n * sizeof(size_t));
-}
-
 /** Inserts a key with value into slot s, and returns a pointer to the
   * space immediately after.
   */
@@ -110,94 +125,362 @@ static slot_t ins_key(slot_t s, const char* key, size_t len, value_t** val)
 }
 
 
-static void ahtable_expand(ahtable_t* table)
+/* Insert a key that is known not to be in the table yet, with value v. */
+static void append_key(ahtable_t* table, const char* key, size_t len, value_t v)
 {
-    /* Resizing a table is essentially building a brand new one.
-     * One little shortcut we can take on the memory allocation front is to
-     * figure out how much memory each slot needs in advance.
-     */
-    assert(table->n > 0);
-    size_t new_n = 2 * table->n;
-    size_t* slot_sizes = malloc_or_die(new_n * sizeof(size_t));
-    memset(slot_sizes, 0, new_n * sizeof(size_t));
+    uint32_t i = hash(key, len) % table->n;
+    size_t new_size = table->slot_sizes[i];
+    new_size += 1 + (len >= 128 ? 1 : 0);    // key length
+    new_size += len * sizeof(unsigned char); // key
+    new_size += sizeof(value_t);             // value
+
+    value_t* val;
+    table->slots[i] = realloc_or_die(table->slots[i], new_size);
+    ins_key(table->slots[i] + table->slot_sizes[i], key, len, &val);
+    *val = v;
+    table->slot_sizes[i] = new_size;
+    ++table->m;
+}
 
-    const char* key;
-    size_t len = 0;
-    size_t m = 0;
-    ahtable_iter_t* i = ahtable_iter_begin(table, false);
-    while (!ahtable_iter_finished(i)) {
-        key = ahtable_iter_key(i, &len);
-        slot_sizes[hash(key, len) % new_n] +=
-            len + sizeof(value_t) + (len >= 128 ? 2 : 1);
 
-        ++m;
-        ahtable_iter_next(i);
+/* Find the key in slot i, returning its entry or NULL. */
+static slot_t find_entry(const ahtable_t* table, size_t i, const char* key, size_t len)
+{
+    slot_t s = table->slots[i];
+    size_t k;
+    while ((size_t) (s - table->slots[i]) < table->slot_sizes[i]) {
+        k = keylen(s);
+        if (k == len && memcmp(s + (k < 128 ? 1 : 2), key, len) == 0) return s;
+        s += entrylen(s);
     }
-    assert(m == table->m);
-    ahtable_iter_free(i);
+    return NULL;
+}
 
 
-    /* allocate slots */
-    slot_t* slots = malloc_or_die(new_n * sizeof(slot_t));
-    size_t j;
-    for (j = 0; j < new_n; ++j) {
-        if (slot_sizes[j] > 0) {
-            slots[j] = malloc_or_die(slot_sizes[j]);
+/* Remove the entry at s, in slot i. */
+static void remove_entry(ahtable_t* table, size_t i, slot_t s)
+{
+    size_t e = entrylen(s);
+    memmove(s, s + e, table->slot_sizes[i] - (size_t) (s + e - table->slots[i]));
+    table->slot_sizes[i] -= e;
+    --table->m;
+    if (table->hot != NULL) table->hot[i] = 0;
+}
+
+
+/* Whether the adopting table takes a key, as the old table stores it. */
+static bool src_takes(const ahtable_src_t* src, const char* key, size_t len)
+{
+    if (src->all) return true;
+    return len > 0 &&
+           (unsigned char) key[0] >= src->lo &&
+           (unsigned char) key[0] <= src->hi;
+}
+
+
+/* Find a key, as the adopting table stores it, among those it has yet to
+ * move. Returns its entry in the old table's slot *i, or NULL. Keys in slots
+ * that have been moved are no longer there, so no cursor check is needed. */
+static slot_t src_find(const ahtable_src_t* src, const char* key, size_t len, size_t* i)
+{
+    char small[64];
+    char* k = (char*) key;
+    slot_t s = NULL;
+
+    if (src->skip) {
+        k = len + 1 <= sizeof(small) ? small : malloc_or_die(len + 1);
+        k[0] = (char) src->lo;
+        if (len > 0) memcpy(k + 1, key, len);
+        ++len;
+    }
+
+    if (src_takes(src, k, len)) {
+        *i = hash(k, len) % src->table->n;
+        s = find_entry(src->table, *i, k, len);
+    }
+
+    if (k != key && k != small) free_mem(k);
+    return s;
+}
+
+
+/* Move the keys the table takes out of its old table's slot i, returning how
+ * many keys the slot held. Keys the table doesn't take are packed down for
+ * whichever other table is adopting them. */
+static size_t src_move_slot(ahtable_t* table, size_t i)
+{
+    ahtable_src_t* src = table->src;
+    ahtable_t* old = src->table;
+    slot_t s = old->slots[i];
+    slot_t w = s;
+    size_t k, h, e, n = 0;
+
+    while ((size_t) (s - old->slots[i]) < old->slot_sizes[i]) {
+        k = keylen(s);
+        h = k < 128 ? 1 : 2;
+        e = h + k + sizeof(value_t);
+
+        if (src_takes(src, (const char*) s + h, k)) {
+            if (src->skip) {
+                append_key(table, (const char*) s + h + 1, k - 1, *(value_t*) (s + h + k));
+            }
+            else {
+                append_key(table, (const char*) s + h, k, *(value_t*) (s + h + k));
+            }
+            --old->m;
+            if (src->pending > 0) --src->pending;
         }
-        else slots[j] = NULL;
+        else {
+            if (w != s) memmove(w, s, e);
+            w += e;
+        }
+
+        s += e;
+        ++n;
     }
 
-    /* rehash values. A few shortcuts can be taken here as well, as we know
-     * there will be no collisions. Instead of the regular insertion routine,
-     * we keep track of the ends of every slot and simply insert keys.
-     * */
-    slot_t* slots_next = malloc_or_die(new_n * sizeof(slot_t));
-    memcpy(slots_next, slots, new_n * sizeof(slot_t));
-    size_t h;
-    m = 0;
-    value_t* u;
-    value_t* v;
-    i = ahtable_iter_begin(table, false);
-    while (!ahtable_iter_finished(i)) {
+    old->slot_sizes[i] = (size_t) (w - old->slots[i]);
+    if (old->slot_sizes[i] == 0) {
+        free_mem(old->slots[i]);
+        old->slots[i] = NULL;
+    }
+
+    return n;
+}
+
 
-        key = ahtable_iter_key(i, &len);
-        h = hash(key, len) % new_n;
+/* Let go of the old table, freeing it if no other table is adopting it. */
+static void src_release(ahtable_t* table)
+{
+    ahtable_src_t* src = table->src;
+    if (src == NULL) return;
+
+    table->src = NULL;
+    if (--src->table->refs == 0) ahtable_free(src->table);
+    free_mem(src);
+}
 
-        slots_next[h] = ins_key(slots_next[h], key, len, &u);
-        v = ahtable_iter_val(i);
-        *u = *v;
 
-        ++m;
-        ahtable_iter_next(i);
+/* Move over old slots until about work keys have been read. */
+static void src_step(ahtable_t* table, size_t work)
+{
+    ahtable_src_t* src = table->src;
+    size_t done = 0;
+
+    while (src != NULL && done < work) {
+        done += 1 + src_move_slot(table, src->next++);
+        if (src->next >= src->table->n) {
+            src_release(table);
+            src = NULL;
+        }
     }
-    assert(m == table->m);
-    ahtable_iter_free(i);
+}
 
 
-    free(slots_next);
-    for (j = 0; j < table->n; ++j) free(table->slots[j]);
+static void adopt(ahtable_t* table, ahtable_t* old, unsigned char lo,
+                  unsigned char hi, bool all, bool skip, size_t pending)
+{
+    /* old tables are settled first, so views never chain */
+    assert(table->src == NULL && old->src == NULL);
+
+    ahtable_src_t* src = malloc_or_die(sizeof(ahtable_src_t));
+    src->table   = old;
+    src->lo      = lo;
+    src->hi      = hi;
+    src->all     = all;
+    src->skip    = skip;
+    src->next    = 0;
+    src->pending = pending;
+
+    ++old->refs;
+    table->src = src;
+}
 
-    free(table->slots);
-    table->slots = slots;
 
-    free(table->slot_sizes);
-    table->slot_sizes = slot_sizes;
+void ahtable_adopt(ahtable_t* table, ahtable_t* old, unsigned char lo,
+                   unsigned char hi, bool skip, size_t pending)
+{
+    adopt(table, old, lo, hi, false, skip, pending);
+}
+
 
-    table->n = new_n;
-    table->max_m = (size_t) (ahtable_max_load_factor * (double) table->n);
+void ahtable_settle(ahtable_t* table)
+{
+    src_step(table, (size_t) -1);
 }
 
 
-static value_t* get_key(ahtable_t* table, const char* key, size_t len, bool insert_missing)
+ahtable_t* ahtable_dup(const ahtable_t* table)
 {
-    /* if we are at capacity, preemptively resize */
-    if (insert_missing && table->m >= table->max_m) {
-        ahtable_expand(table);
+    ahtable_t* dup = malloc_or_die(sizeof(ahtable_t));
+    memcpy(dup, table, sizeof(ahtable_t));
+    dup->src = NULL;
+    dup->refs = 0;
+
+    dup->slots = malloc_or_die(table->n * sizeof(slot_t));
+    dup->slot_sizes = malloc_or_die(table->n * sizeof(size_t));
+    memcpy(dup->slot_sizes, table->slot_sizes, table->n * sizeof(size_t));
+
+    if (table->hot != NULL) {
+        dup->hot = malloc_or_die(table->n * sizeof(uint32_t));
+        memcpy(dup->hot, table->hot, table->n * sizeof(uint32_t));
+    }
+
+    /* slots are self contained, so a byte copy is all we need */
+    size_t i;
+    for (i = 0; i < table->n; ++i) {
+        if (table->slot_sizes[i] > 0) {
+            dup->slots[i] = malloc_or_die(table->slot_sizes[i]);
+            memcpy(dup->slots[i], table->slots[i], table->slot_sizes[i]);
+        }
+        else dup->slots[i] = NULL;
+    }
+
+    /* the copy takes any keys yet to be adopted straight away */
+    const ahtable_src_t* src = table->src;
+    if (src != NULL) {
+        const ahtable_t* old = src->table;
+        size_t k, h, skip = src->skip ? 1 : 0;
+        slot_t s;
+        for (i = 0; i < old->n; ++i) {
+            s = old->slots[i];
+            while ((size_t) (s - old->slots[i]) < old->slot_sizes[i]) {
+                k = keylen(s);
+                h = k < 128 ? 1 : 2;
+                if (src_takes(src, (const char*) s + h, k)) {
+                    append_key(dup, (const char*) s + h + skip, k - skip,
+                               *(value_t*) (s + h + k));
+                }
+                s += h + k + sizeof(value_t);
+            }
+        }
+    }
+
+    return dup;
+}
+
+
+void ahtable_free(ahtable_t* table)
+{
+    if (table == NULL) return;
+    src_release(table);
+    size_t i;
+    for (i = 0; i < table->n; ++i) free_mem(table->slots[i]);
+    free_mem(table->slots);
+    free_mem(table->slot_sizes);
+    free_mem(table->hot);
+    free_mem(table);
+}
+
+
+size_t ahtable_size(const ahtable_t* table)
+{
+    return table->m + (table->src != NULL ? table->src->pending : 0);
+}
+
+
+size_t ahtable_bytes(const ahtable_t* table)
+{
+    size_t i, bytes = sizeof(ahtable_t) + table->n * (sizeof(slot_t) + sizeof(size_t));
+    for (i = 0; i < table->n; ++i) bytes += table->slot_sizes[i];
+    if (table->hot != NULL) bytes += table->n * sizeof(uint32_t);
+
+    /* an old table is split between the tables adopting it */
+    if (table->src != NULL) {
+        bytes += sizeof(ahtable_src_t) +
+                 ahtable_bytes(table->src->table) / table->src->table->refs;
+    }
+    return bytes;
+}
+
+
+void ahtable_clear(ahtable_t* table)
+{
+    src_release(table);
+    size_t i;
+    for (i = 0; i < table->n; ++i) free_mem(table->slots[i]);
+    table->n = table->n0;
+    table->m = 0;
+    table->max_m = (size_t) (table->max_load_factor * (double) table->n);
+    table->slots = realloc_or_die(table->slots, table->n * sizeof(slot_t));
+    memset(table->slots, 0, table->n * sizeof(slot_t));
+
+    table->slot_sizes = realloc_or_die(table->slot_sizes, table->n * sizeof(size_t));
+    memset(table->slot_sizes, 0, table->n * sizeof(size_t));
+
+    free_mem(table->hot);
+    table->hot = NULL;
+}
+
+
+static void ahtable_expand(ahtable_t* table)
+{
+    /* Rather than rehash every key now, the current slots become an old table
+     * of their own, which the table adopts a few slots at a time.
+     */
+    assert(table->n > 0 && table->src == NULL);
+    ahtable_t* old = malloc_or_die(sizeof(ahtable_t));
+    memcpy(old, table, sizeof(ahtable_t));
+    old->hot = NULL;
+    old->refs = 0;
+
+    table->n = 2 * table->n;
+    table->m = 0;
+    table->max_m = (size_t) (table->max_load_factor * (double) table->n);
+
+    table->slots = malloc_or_die(table->n * sizeof(slot_t));
+    memset(table->slots, 0, table->n * sizeof(slot_t));
+
+    table->slot_sizes = malloc_or_die(table->n * sizeof(size_t));
+    memset(table->slot_sizes, 0, table->n * sizeof(size_t));
+
+    /* the positions will all change, start sampling over */
+    if (table->hot != NULL) {
+        table->hot = realloc_or_die(table->hot, table->n * sizeof(uint32_t));
+        memset(table->hot, 0, table->n * sizeof(uint32_t));
+    }
+
+    adopt(table, old, 0, 0, true, false, old->m);
+}
+
+
+/* Count a lookup of the o'th key in slot i towards the slot's most accessed
+ * key, with the single counter form of Misra-Gries: the same key counts up,
+ * any other counts down until it replaces it. Lookups share the table, so
+ * this may lose a count now and then, but never tears the word. */
+static void sample_access(ahtable_t* table, size_t i, size_t o)
+{
+    uint32_t h, pos, count;
+
+    if ((++sample_tick & AHTABLE_SAMPLE_MASK) != 0 || o > 0xffff) return;
+
+    h = __atomic_load_n(&table->hot[i], __ATOMIC_RELAXED);
+    pos = h >> 16;
+    count = h & 0xffff;
+    if (pos == o) {
+        if (count < 0xffff) ++count;
+    }
+    else if (count == 0) {
+        pos = (uint32_t) o;
+        count = 1;
+    }
+    else --count;
+    __atomic_store_n(&table->hot[i], pos << 16 | count, __ATOMIC_RELAXED);
+}
+
+
+static value_t* get_key(ahtable_t* table, const char* key, size_t len,
+                        bool insert_missing, bool* added)
+{
+    if (insert_missing) {
+        /* carry on adopting, or if we are at capacity, preemptively resize */
+        if (table->src != NULL) src_step(table, AHTABLE_MIGRATE_WORK);
+        else if (table->m >= table->max_m) ahtable_expand(table);
     }
 
 
     uint32_t i = hash(key, len) % table->n;
-    size_t k;
+    size_t k, o = 0;
     slot_t s;
     value_t* val;
 
@@ -211,21 +494,44 @@ static value_t* get_key(ahtable_t* table, const char* key, size_t len, bool inse
         /* skip keys that are longer than ours */
         if (k != len) {
             s += k + sizeof(value_t);
+            ++o;
             continue;
         }
 
         /* key found. */
         if (memcmp(s, key, len) == 0) {
+            if (table->hot != NULL && !insert_missing) sample_access(table, i, o);
+            if (added != NULL) *added = false;
             return (value_t*) (s + len);
         }
         /* key not found. */
         else {
             s += k + sizeof(value_t);
+            ++o;
             continue;
         }
     }
 
 
+    /* the key may not have been adopted yet, in which case an insert moves
+     * it over now */
+    value_t v = 0;
+    size_t j;
+    slot_t t = NULL;
+    if (table->src != NULL) {
+        t = src_find(table->src, key, len, &j);
+        if (t != NULL) {
+            k = keylen(t);
+            val = (value_t*) (t + (k < 128 ? 1 : 2) + k);
+            if (!insert_missing) return val;
+
+            v = *val;
+            remove_entry(table->src->table, j, t);
+            if (table->src->pending > 0) --table->src->pending;
+        }
+    }
+
+
     if (insert_missing) {
         /* the key was not found, so we must insert it. */
         size_t new_size = table->slot_sizes[i];
@@ -237,8 +543,10 @@ static value_t* get_key(ahtable_t* table, const char* key, size_t len, bool inse
 
         ++table->m;
         ins_key(table->slots[i] + table->slot_sizes[i], key, len, &val);
+        *val = v;
         table->slot_sizes[i] = new_size;
 
+        if (added != NULL) *added = t == NULL;
         return val;
     }
     else return NULL;
@@ -247,18 +555,26 @@ static value_t* get_key(ahtable_t* table, const char* key, size_t len, bool inse
 
 value_t* ahtable_get(ahtable_t* table, const char* key, size_t len)
 {
-    return get_key(table, key, len, true);
+    return get_key(table, key, len, true, NULL);
+}
+
+
+value_t* ahtable_insert(ahtable_t* table, const char* key, size_t len, bool* added)
+{
+    return get_key(table, key, len, true, added);
 }
 
 
 value_t* ahtable_tryget(ahtable_t* table, const char* key, size_t len )
 {
-    return get_key(table, key, len, false);
+    return get_key(table, key, len, false, NULL);
 }
 
 
 int ahtable_del(ahtable_t* table, const char* key, size_t len)
 {
+    if (table->src != NULL) src_step(table, AHTABLE_MIGRATE_WORK);
+
     uint32_t i = hash(key, len) % table->n;
     size_t k;
     slot_t s;
@@ -284,6 +600,7 @@ int ahtable_del(ahtable_t* table, const char* key, size_t len)
             memmove(s, t, table->slot_sizes[i] - (size_t) (t - table->slots[i]));
             table->slot_sizes[i] -= (size_t) (t - s);
             --table->m;
+            if (table->hot != NULL) table->hot[i] = 0;
             return 0;
         }
         /* key not found. */
@@ -293,34 +610,94 @@ int ahtable_del(ahtable_t* table, const char* key, size_t len)
         }
     }
 
+    /* it may be yet to be adopted */
+    if (table->src != NULL) {
+        size_t j;
+        s = src_find(table->src, key, len, &j);
+        if (s != NULL) {
+            remove_entry(table->src->table, j, s);
+            if (table->src->pending > 0) --table->src->pending;
+            return 0;
+        }
+    }
+
     // Key was not found. Do nothing.
     return -1;
 }
 
 
-
-static int cmpkey(const void* a_, const void* b_)
+void ahtable_reorder(ahtable_t* table)
 {
-    slot_t a = *(slot_t*) a_;
-    slot_t b = *(slot_t*) b_;
+    unsigned char small[64];
+    unsigned char* tmp;
+    size_t i, o, pos, before, len;
+    uint32_t h;
+    slot_t s;
 
-    size_t ka = keylen(a), kb = keylen(b);
+    if (table->hot == NULL) {
+        table->hot = malloc_or_die(table->n * sizeof(uint32_t));
+        memset(table->hot, 0, table->n * sizeof(uint32_t));
+        return;
+    }
 
-    a += ka < 128 ? 1 : 2;
-    b += kb < 128 ? 1 : 2;
+    for (i = 0; i < table->n; ++i) {
+        h = table->hot[i];
+        table->hot[i] = 0;
+        pos = h >> 16;
+        if (pos == 0 || (h & 0xffff) < AHTABLE_REORDER_MIN) continue;
 
-    int c = memcmp(a, b, ka < kb ? ka : kb);
-    return c == 0 ? (int) ka - (int) kb : c;
+        /* find the key, which may since have been deleted */
+        s = table->slots[i];
+        for (o = 0; o < pos && (size_t) (s - table->slots[i]) < table->slot_sizes[i]; ++o) {
+            s += entrylen(s);
+        }
+        before = (size_t) (s - table->slots[i]);
+        if (before >= table->slot_sizes[i]) continue;
+
+        /* and rotate it to the front */
+        len = entrylen(s);
+        tmp = len <= sizeof(small) ? small : malloc_or_die(len);
+        memcpy(tmp, s, len);
+        memmove(table->slots[i] + len, table->slots[i], before);
+        memcpy(table->slots[i], tmp, len);
+        if (tmp != small) free_mem(tmp);
+    }
 }
 
 
+
 /* Sorted/unsorted iterators are kept private and exposed by passing the
-sorted flag to ahtable_iter_begin. */
+sorted flag to ahtable_iter_begin. Both include the keys a table has yet to
+adopt, as the table will store them. */
+
+typedef struct ahtable_sorted_key_t_
+{
+    slot_t s;    // the key's entry
+    size_t skip; // leading characters to drop from it
+} ahtable_sorted_key_t;
+
+
+static int cmpkey(const void* a_, const void* b_)
+{
+    const ahtable_sorted_key_t* a = (const ahtable_sorted_key_t*) a_;
+    const ahtable_sorted_key_t* b = (const ahtable_sorted_key_t*) b_;
+
+    size_t ka = keylen(a->s), kb = keylen(b->s);
+    slot_t sa = a->s + (ka < 128 ? 1 : 2) + a->skip;
+    slot_t sb = b->s + (kb < 128 ? 1 : 2) + b->skip;
+    ka -= a->skip;
+    kb -= b->skip;
+
+    int c = memcmp(sa, sb, ka < kb ? ka : kb);
+    return c == 0 ? (int) ka - (int) kb : c;
+}
+
 
 typedef struct ahtable_sorted_iter_t_
 {
     const ahtable_t* table; // parent
-    slot_t* xs; // pointers to keys
+    ahtable_sorted_key_t* xs; // the keys
+    size_t m; // number of keys
     size_t i; // current key
 } ahtable_sorted_iter_t;
 
@@ -329,22 +706,53 @@ static ahtable_sorted_iter_t* ahtable_sorted_iter_begin(const ahtable_t* table)
 {
     ahtable_sorted_iter_t* i = malloc_or_die(sizeof(ahtable_sorted_iter_t));
     i->table = table;
-    i->xs = malloc_or_die(table->m * sizeof(slot_t));
     i->i = 0;
 
+    const ahtable_src_t* src = table->src;
     slot_t s;
     size_t j, k, u;
+
+    /* count the keys still to be adopted */
+    i->m = table->m;
+    if (src != NULL) {
+        for (j = 0; j < src->table->n; ++j) {
+            s = src->table->slots[j];
+            while ((size_t) (s - src->table->slots[j]) < src->table->slot_sizes[j]) {
+                k = keylen(s);
+                if (src_takes(src, (const char*) s + (k < 128 ? 1 : 2), k)) ++i->m;
+                s += entrylen(s);
+            }
+        }
+    }
+
+    i->xs = malloc_or_die(i->m * sizeof(ahtable_sorted_key_t));
+
     for (j = 0, u = 0; j < table->n; ++j) {
         s = table->slots[j];
         while (s < table->slots[j] + table->slot_sizes[j]) {
-            i->xs[u++] = s;
+            i->xs[u].s = s;
+            i->xs[u++].skip = 0;
             k = keylen(s);
             s += k < 128 ? 1 : 2;
             s += k + sizeof(value_t);
         }
     }
 
-    qsort(i->xs, table->m, sizeof(slot_t), cmpkey);
+    if (src != NULL) {
+        for (j = 0; j < src->table->n; ++j) {
+            s = src->table->slots[j];
+            while ((size_t) (s - src->table->slots[j]) < src->table->slot_sizes[j]) {
+                k = keylen(s);
+                if (src_takes(src, (const char*) s + (k < 128 ? 1 : 2), k)) {
+                    i->xs[u].s = s;
+                    i->xs[u++].skip = src->skip ? 1 : 0;
+                }
+                s += entrylen(s);
+            }
+        }
+    }
+
+    qsort(i->xs, i->m, sizeof(ahtable_sorted_key_t), cmpkey);
 
     return i;
 }
@@ -352,7 +760,7 @@ static ahtable_sorted_iter_t* ahtable_sorted_iter_begin(const ahtable_t* table)
 
 static bool ahtable_sorted_iter_finished(ahtable_sorted_iter_t* i)
 {
-    return i->i >= i->table->m;
+    return i->i >= i->m;
 }
 
 
@@ -366,8 +774,8 @@ static void ahtable_sorted_iter_next(ahtable_sorted_iter_t* i)
 static void ahtable_sorted_iter_free(ahtable_sorted_iter_t* i)
 {
     if (i == NULL) return;
-    free(i->xs);
-    free(i);
+    free_mem(i->xs);
+    free_mem(i);
 }
 
 
@@ -375,10 +783,11 @@ static const char* ahtable_sorted_iter_key(ahtable_sorted_iter_t* i, size_t* len
 {
     if (ahtable_sorted_iter_finished(i)) return NULL;
 
-    slot_t s = i->xs[i->i];
-    *len = keylen(s);
+    slot_t s = i->xs[i->i].s;
+    size_t k = keylen(s);
+    *len = k - i->xs[i->i].skip;
 
-    return (const char*) (s + (*len < 128 ? 1 : 2));
+    return (const char*) (s + (k < 128 ? 1 : 2) + i->xs[i->i].skip);
 }
 
 
@@ -386,7 +795,7 @@ static value_t*  ahtable_sorted_iter_val(ahtable_sorted_iter_t* i)
 {
     if (ahtable_sorted_iter_finished(i)) return NULL;
 
-    slot_t s = i->xs[i->i];
+    slot_t s = i->xs[i->i].s;
     size_t k = keylen(s);
 
     s += k < 128 ? 1 : 2;
@@ -399,21 +808,50 @@ static value_t*  ahtable_sorted_iter_val(ahtable_sorted_iter_t* i)
 typedef struct ahtable_unsorted_iter_t_
 {
     const ahtable_t* table; // parent
-    size_t i;           // slot index
-    slot_t s;           // slot position
+    const ahtable_t* t;     // the table being walked, the parent then its old table
+    size_t skip;            // leading characters to drop from t's keys
+    size_t i;               // slot index
+    slot_t s;               // slot position
 } ahtable_unsorted_iter_t;
 
 
+/* Move on to the first key from the current position that the parent holds,
+ * going on to its old table once its own slots are done. */
+static void ahtable_unsorted_iter_find(ahtable_unsorted_iter_t* i)
+{
+    const ahtable_src_t* src = i->table->src;
+    size_t k;
+
+    while (i->i < i->t->n) {
+        if ((size_t) (i->s - i->t->slots[i->i]) >= i->t->slot_sizes[i->i]) {
+            if (++i->i < i->t->n) i->s = i->t->slots[i->i];
+            else if (i->t == i->table && src != NULL) {
+                i->t = src->table;
+                i->skip = src->skip ? 1 : 0;
+                i->i = 0;
+                i->s = i->t->slots[0];
+            }
+            continue;
+        }
+
+        if (i->t == i->table) return;
+        k = keylen(i->s);
+        if (src_takes(src, (const char*) i->s + (k < 128 ? 1 : 2), k)) return;
+        i->s += entrylen(i->s);
+    }
+}
+
+
 static ahtable_unsorted_iter_t* ahtable_unsorted_iter_begin(const ahtable_t* table)
 {
     ahtable_unsorted_iter_t* i = malloc_or_die(sizeof(ahtable_unsorted_iter_t));
     i->table = table;
+    i->t = table;
+    i->skip = 0;
+    i->i = 0;
+    i->s = table->slots[0];
 
-    for (i->i = 0; i->i < i->table->n; ++i->i) {
-        i->s = table->slots[i->i];
-        if ((size_t) (i->s - table->slots[i->i]) >= table->slot_sizes[i->i]) continue;
-        break;
-    }
+    ahtable_unsorted_iter_find(i);
 
     return i;
 }
@@ -421,7 +859,7 @@ static ahtable_unsorted_iter_t* ahtable_unsorted_iter_begin(const ahtable_t* tab
 
 static bool ahtable_unsorted_iter_finished(ahtable_unsorted_iter_t* i)
 {
-    return i->i >= i->table->n;
+    return i->i >= i->t->n;
 }
 
 
@@ -429,28 +867,16 @@ static void ahtable_unsorted_iter_next(ahtable_unsorted_iter_t* i)
 {
     if (ahtable_unsorted_iter_finished(i)) return;
 
-    /* get the key length */
-    size_t k = keylen(i->s);
-    i->s += k < 128 ? 1 : 2;
-
     /* skip to the next key */
-    i->s += k + sizeof(value_t);
-
-    if ((size_t) (i->s - i->table->slots[i->i]) >= i->table->slot_sizes[i->i]) {
-        do {
-            ++i->i;
-        } while(i->i < i->table->n &&
-                i->table->slot_sizes[i->i] == 0);
+    i->s += entrylen(i->s);
 
-        if (i->i < i->table->n) i->s = i->table->slots[i->i];
-        else i->s = NULL;
-    }
+    ahtable_unsorted_iter_find(i);
 }
 
 
 static void ahtable_unsorted_iter_free(ahtable_unsorted_iter_t* i)
 {
-    free(i);
+    free_mem(i);
 }
 
 
@@ -469,8 +895,8 @@ static const char* ahtable_unsorted_iter_key(ahtable_unsorted_iter_t* i, size_t*
         s += 1;
     }
 
-    *len = k;
-    return (const char*) s;
+    *len = k - i->skip;
+    return (const char*) (s + i->skip);
 }
 
 
@@ -533,7 +959,7 @@ void ahtable_iter_free(ahtable_iter_t* i)
     if (i == NULL) return;
     if (i->sorted) ahtable_sorted_iter_free(i->i.sorted);
     else           ahtable_unsorted_iter_free(i->i.unsorted);
-    free(i);
+    free_mem(i);
 }
 
 
@@ -25,6 +25,11 @@
  * The number of slots expands in a stepwise fashion when the number of
  # key/value pairs reaches an arbitrarily large number.
  *
+ * Expanding a table, or splitting one in two when a hat-trie bucket bursts,
+ * doesn't rehash every key at once: the new table adopts the old one, and
+ * each change to the new table moves a few more of the old slots over. Until
+ * then lookups fall back to the old table.
+ *
  * +-------+-------+-------+-------+-------+-------+
  * |   0   |   1   |   2   |   3   |  ...  |   N   |
  * +-------+-------+-------+-------+-------+-------+
@@ -52,6 +57,8 @@ extern "C" {
 
 typedef unsigned char* slot_t;
 
+struct ahtable_src_t_;
+
 typedef struct ahtable_t_
 {
     /* these fields are reserved for hattrie to fiddle with */
@@ -63,8 +70,20 @@ typedef struct ahtable_t_
     size_t m;        // number of key/value pairs stored
     size_t max_m;    // number of stored keys before we resize
 
+    size_t n0;              // number of slots to go back to on a clear
+    double max_load_factor; // keys per slot before we resize
+
     size_t*  slot_sizes;
     slot_t*  slots;
+
+    /* once ahtable_reorder has been called, the most accessed key of each
+     * slot as sampled by ahtable_tryget: its position << 16 | a count */
+    uint32_t* hot;
+
+    /* the table whose keys are still being moved into this one, if any, and
+     * how many tables are moving keys out of this one */
+    struct ahtable_src_t_* src;
+    unsigned int refs;
 } ahtable_t;
 
 extern const double ahtable_max_load_factor;
@@ -74,9 +93,17 @@ ahtable_t* ahtable_create   (void);         // Create an empty hash table.
 ahtable_t* ahtable_create_n (size_t n);     // Create an empty hash table, with
                                             //  n slots reserved.
 
+/** Create an empty hash table with n slots, growing once it holds more than
+ * max_load_factor keys per slot. ahtable_create_n uses
+ * ahtable_max_load_factor. */
+ahtable_t* ahtable_create_lf (size_t n, double max_load_factor);
+
+ahtable_t* ahtable_dup    (const ahtable_t*); // Duplicate an existing table.
 void       ahtable_free   (ahtable_t*);       // Free all memory used by a table.
 void       ahtable_clear  (ahtable_t*);       // Remove all entries.
-size_t     ahtable_size   (const ahtable_t*); // Number of stored keys.
+size_t     ahtable_size   (const ahtable_t*); // Number of stored keys,
+                                              //  estimated while adopting.
+size_t     ahtable_bytes  (const ahtable_t*); // Bytes of memory in use.
 
 
 /** Find the given key in the table, inserting it if it does not exist, and
@@ -89,6 +116,10 @@ size_t     ahtable_size   (const ahtable_t*); // Number of stored keys.
 value_t* ahtable_get (ahtable_t*, const char* key, size_t len);
 
 
+/* ahtable_get, setting added if the key was not in the table before. */
+value_t* ahtable_insert (ahtable_t*, const char* key, size_t len, bool* added);
+
+
 /* Find a given key in the table, return a NULL pointer if it does not exist. */
 value_t* ahtable_tryget (ahtable_t*, const char* key, size_t len);
 
@@ -96,6 +127,29 @@ value_t* ahtable_tryget (ahtable_t*, const char* key, size_t len);
 int ahtable_del(ahtable_t*, const char* key, size_t len);
 
 
+/** Move the most accessed key of each slot to its front, as sampled by
+ * ahtable_tryget since the last call, so that hot keys are found after
+ * reading the start of their slot. The first call only starts the sampling,
+ * which costs a write on one in 16 lookups. Reordering modifies the table,
+ * so it can't run alongside lookups.
+ */
+void ahtable_reorder(ahtable_t*);
+
+
+/** Take over the keys of old that start with a character in [lo, hi],
+ * without their first character if skip is set. They are moved over a few
+ * slots at a time as the table is changed, and looked up in old until then.
+ * pending estimates how many there are. old is no longer usable by itself,
+ * and is freed once every table adopting it is done with it.
+ */
+void ahtable_adopt(ahtable_t*, ahtable_t* old, unsigned char lo,
+                   unsigned char hi, bool skip, size_t pending);
+
+
+/* Finish moving over any keys the table has adopted. */
+void ahtable_settle(ahtable_t*);
+
+
 typedef struct ahtable_iter_t_ ahtable_iter_t;
 
 ahtable_iter_t* ahtable_iter_begin     (const ahtable_t*, bool sorted);
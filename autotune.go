@@ -0,0 +1,211 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import (
+	"fmt"
+	"io"
+	"path/filepath"
+	"sort"
+	"strings"
+	"text/tabwriter"
+	"time"
+)
+
+// The trie parameters AutotuneTrieParams sweeps, every combination of them.
+// A short key length of 0 leaves the size class rule off, others burst
+// buckets of shorter suffixes at shortBucketScale times the bucket size.
+var (
+	autotuneBucketSizes   = []int{1024, 4096, 16384, 65536}
+	autotuneInitialSlots  = []int{256, 1024, 4096}
+	autotuneLoadFactors   = []float64{4, 32, 100000}
+	autotuneShortKeyLens  = []int{0, 2}
+	autotuneShortBucketsX = 4
+)
+
+// AutotuneSample is the most keys of each set AutotuneTrieParams builds
+// tries from, taken evenly from across the set.
+var AutotuneSample = 200000
+
+// AutotuneResult is how a trie with one set of parameters fared with the keys
+// of one set.
+type AutotuneResult struct {
+	List        string
+	Role        string
+	Params      TrieParams
+	Keys        int
+	BytesPerKey float64
+	Build       time.Duration
+	Lookup      time.Duration // per lookup, as many misses as hits
+	Pareto      bool          // no other parameters do as well on all three
+}
+
+// AutotuneTrieParams builds tries with every swept combination of parameters
+// from a sample of each index snapshot in dataDir, and writes out the
+// parameters on the Pareto frontier of lookup time, build time and bytes per
+// key, with the defaults for comparison, to pick ListTrieParams from.
+func AutotuneTrieParams(dataDir string, out io.Writer) error {
+	results, err := autotuneTrieParams(dataDir)
+	if err != nil {
+		return err
+	}
+	defaults := DefaultTrieParams()
+	w := tabwriter.NewWriter(out, 0, 8, 2, ' ', 0)
+	fmt.Fprintln(w, "list\trole\tkeys\tlookup\tbuild\tbytes/key\tparams\t")
+	for _, r := range results {
+		note := ""
+		if r.Params == defaults {
+			note = " (default)"
+		} else if !r.Pareto {
+			continue
+		}
+		fmt.Fprintf(w, "%s\t%s\t%d\t%s\t%s\t%.1f\t%s%s\t\n",
+			r.List, r.Role, r.Keys, r.Lookup, r.Build, r.BytesPerKey, r.Params, note)
+	}
+	return w.Flush()
+}
+
+// autotuneTrieParams returns every result, each set's sorted by lookup time.
+func autotuneTrieParams(dataDir string) ([]AutotuneResult, error) {
+	files, err := filepath.Glob(filepath.Join(dataDir, "*.idx"))
+	if err != nil {
+		return nil, err
+	}
+	if len(files) == 0 {
+		return nil, fmt.Errorf("No index snapshots in %s", dataDir)
+	}
+	sort.Strings(files)
+
+	results := make([]AutotuneResult, 0)
+	for _, file := range files {
+		_, prefixes, fullHashes, err := readSnapshot(file)
+		if err != nil {
+			return nil, err
+		}
+		list := strings.TrimSuffix(filepath.Base(file), ".idx")
+		for _, role := range []struct {
+			name   string
+			keys   []byte
+			keyLen int
+		}{
+			{RoleLookup, prefixes, PREFIX_4B_SZ},
+			{RoleFullHashes, fullHashes, PREFIX_32B_SZ},
+		} {
+			set, err := autotuneSet(sampleKeys(role.keys, role.keyLen, AutotuneSample), role.keyLen)
+			if err != nil {
+				return nil, err
+			}
+			for i := range set {
+				set[i].List, set[i].Role = list, role.name
+			}
+			results = append(results, set...)
+		}
+	}
+	return results, nil
+}
+
+// autotuneSet times tries of the keys with each swept set of parameters.
+func autotuneSet(keys []byte, keyLen int) ([]AutotuneResult, error) {
+	results := make([]AutotuneResult, 0)
+	for _, params := range autotuneParams() {
+		r, err := benchSetOf(DefaultSetBackend, NewTrieWithParams(params), keys, keyLen)
+		if err != nil {
+			return nil, err
+		}
+		a := AutotuneResult{
+			Params: params,
+			Keys:   r.Keys,
+			Build:  r.Build,
+			Lookup: (r.Hit + r.Miss) / 2,
+		}
+		if r.Keys > 0 {
+			a.BytesPerKey = float64(r.Bytes) / float64(r.Keys)
+		}
+		results = append(results, a)
+	}
+	markPareto(results)
+	sort.SliceStable(results, func(i, j int) bool { return results[i].Lookup < results[j].Lookup })
+	return results, nil
+}
+
+// autotuneParams lists the parameters to sweep, the defaults first.
+func autotuneParams() []TrieParams {
+	defaults := DefaultTrieParams()
+	params := []TrieParams{defaults}
+	for _, bucket := range autotuneBucketSizes {
+		for _, slots := range autotuneInitialSlots {
+			for _, load := range autotuneLoadFactors {
+				for _, short := range autotuneShortKeyLens {
+					p := TrieParams{
+						MaxBucketSize:   bucket,
+						ShortBucketSize: bucket,
+						InitialSlots:    slots,
+						MaxLoadFactor:   load,
+					}
+					if short > 0 {
+						p.ShortKeyLen = short
+						p.ShortBucketSize = bucket * autotuneShortBucketsX
+					}
+					if p != defaults {
+						params = append(params, p)
+					}
+				}
+			}
+		}
+	}
+	return params
+}
+
+// markPareto marks the results no other result matches or beats on lookup
+// time, build time and bytes per key while beating on at least one.
+func markPareto(results []AutotuneResult) {
+	for i := range results {
+		a := &results[i]
+		a.Pareto = true
+		for j := range results {
+			b := &results[j]
+			if b.Lookup <= a.Lookup && b.Build <= a.Build && b.BytesPerKey <= a.BytesPerKey &&
+				(b.Lookup < a.Lookup || b.Build < a.Build || b.BytesPerKey < a.BytesPerKey) {
+				a.Pareto = false
+				break
+			}
+		}
+	}
+}
+
+// sampleKeys takes at most max of the keyLen byte keys packed in keys, evenly
+// spaced so a sorted run stays spread across the key space.
+func sampleKeys(keys []byte, keyLen int, max int) []byte {
+	n := len(keys) / keyLen
+	if max <= 0 || n <= max {
+		return keys
+	}
+	out := make([]byte, 0, max*keyLen)
+	for i := 0; i < max; i++ {
+		x := i * n / max * keyLen
+		out = append(out, keys[x:x+keyLen]...)
+	}
+	return out
+}
@@ -0,0 +1,118 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import (
+	"bytes"
+	"io/ioutil"
+	"math/rand"
+	"os"
+	"path/filepath"
+	"strings"
+	"testing"
+)
+
+func TestAutotuneTrieParams(t *testing.T) {
+	tmpDirName, err := ioutil.TempDir("", "safebrowsing")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer os.RemoveAll(tmpDirName)
+	defer func(n int, buckets []int, slots []int, loads []float64) {
+		setBenchLookups = n
+		autotuneBucketSizes, autotuneInitialSlots, autotuneLoadFactors = buckets, slots, loads
+	}(setBenchLookups, autotuneBucketSizes, autotuneInitialSlots, autotuneLoadFactors)
+	setBenchLookups = 100
+	autotuneBucketSizes = []int{64, 1024}
+	autotuneInitialSlots = []int{16}
+	autotuneLoadFactors = []float64{4}
+
+	rng := rand.New(rand.NewSource(1))
+	prefixes := make([]byte, 5000*PREFIX_4B_SZ)
+	rng.Read(prefixes)
+	fullHashes := make([]byte, 500*PREFIX_32B_SZ)
+	rng.Read(fullHashes)
+	header := &SnapshotHeader{
+		PrefixDigest:   digestKeys(prefixes, PREFIX_4B_SZ),
+		FullHashDigest: digestKeys(fullHashes, PREFIX_32B_SZ),
+	}
+	err = writeSnapshot(filepath.Join(tmpDirName, "test-list.idx"), header, prefixes, fullHashes)
+	if err != nil {
+		t.Fatal(err)
+	}
+
+	results, err := autotuneTrieParams(tmpDirName)
+	if err != nil {
+		t.Fatal(err)
+	}
+	// the defaults and two bucket sizes with and without the size class
+	// rule, for each role
+	if len(results) != 2*(1+2*2) {
+		t.Fatalf("Expected 10 results, got %d", len(results))
+	}
+	for _, r := range results[:5] {
+		if r.Role != RoleLookup || r.Keys != len(prefixes)/PREFIX_4B_SZ {
+			t.Errorf("Unexpected result %+v", r)
+		}
+	}
+
+	out := &bytes.Buffer{}
+	if err = AutotuneTrieParams(tmpDirName, out); err != nil {
+		t.Fatal(err)
+	}
+	if !strings.Contains(out.String(), "(default)") {
+		t.Errorf("Defaults not reported:\n%s", out)
+	}
+	if AutotuneTrieParams(filepath.Join(tmpDirName, "none"), out) == nil {
+		t.Errorf("No error without snapshots")
+	}
+}
+
+func TestMarkPareto(t *testing.T) {
+	results := []AutotuneResult{
+		{Lookup: 1, Build: 3, BytesPerKey: 3},
+		{Lookup: 3, Build: 1, BytesPerKey: 3},
+		{Lookup: 2, Build: 2, BytesPerKey: 3},
+		{Lookup: 2, Build: 3, BytesPerKey: 3}, // beaten by the one above
+		{Lookup: 3, Build: 3, BytesPerKey: 1},
+		{Lookup: 3, Build: 3, BytesPerKey: 1}, // ties don't beat each other
+	}
+	markPareto(results)
+	for i, pareto := range []bool{true, true, true, false, true, true} {
+		if results[i].Pareto != pareto {
+			t.Errorf("Result %d: expected pareto %v", i, pareto)
+		}
+	}
+}
+
+func TestSampleKeys(t *testing.T) {
+	keys := []byte("aabbccddeeff")
+	if s := sampleKeys(keys, 2, 3); string(s) != "aaccee" {
+		t.Errorf("Unexpected sample %q", s)
+	}
+	if s := sampleKeys(keys, 2, 10); !bytes.Equal(s, keys) {
+		t.Errorf("Small set sampled")
+	}
+}
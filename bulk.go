@@ -0,0 +1,228 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import (
+	"bytes"
+	"crypto/sha256"
+	"encoding/binary"
+	"fmt"
+	"math"
+	"sort"
+	"sync/atomic"
+)
+
+// BulkIndex holds the lists as sorted arrays, for checking large batches of
+// hashes at once with Lookup: offline scans of logs or domain lists, where
+// probing the tries for each hash in turn spends its time waiting on memory.
+// It is a copy of the lists as they were when it was made.
+type BulkIndex struct {
+	lists []bulkList
+}
+
+type bulkList struct {
+	name     string
+	prefixes []uint32
+	// the full hashes, and the first four bytes of each to join on
+	fullKeys   []uint32
+	fullHashes []byte
+}
+
+// BulkMatch is a hash found in a list by BulkIndex.Lookup.
+type BulkMatch struct {
+	// the position of the hash in the batch
+	Index int
+	List  string
+	// whether the whole hash was found rather than just its prefix
+	FullHashMatch bool
+}
+
+// NewBulkIndex copies the lists into a BulkIndex.  Lists still being served
+// from their index snapshots are copied from those.
+func (sb *SafeBrowsing) NewBulkIndex() (*BulkIndex, error) {
+	names := make([]string, 0, len(sb.Lists))
+	for name, _ := range sb.Lists {
+		names = append(names, name)
+	}
+	sort.Strings(names)
+
+	b := &BulkIndex{}
+	for _, name := range names {
+		prefixes, fullHashes, err := sb.Lists[name].sortedKeys()
+		if err != nil {
+			return nil, fmt.Errorf("Unable to index %s: %s", name, err)
+		}
+		l := bulkList{
+			name:       name,
+			prefixes:   make([]uint32, len(prefixes)/PREFIX_4B_SZ),
+			fullKeys:   make([]uint32, len(fullHashes)/PREFIX_32B_SZ),
+			fullHashes: fullHashes,
+		}
+		for i := range l.prefixes {
+			l.prefixes[i] = binary.BigEndian.Uint32(prefixes[i*PREFIX_4B_SZ:])
+		}
+		for i := range l.fullKeys {
+			l.fullKeys[i] = binary.BigEndian.Uint32(fullHashes[i*PREFIX_32B_SZ:])
+		}
+		b.lists = append(b.lists, l)
+	}
+	return b, nil
+}
+
+// sortedKeys are the list's prefixes and full hashes in order.
+func (sbl *SafeBrowsingList) sortedKeys() (prefixes []byte, fullHashes []byte, err error) {
+	if atomic.LoadInt32(&sbl.loaded) == 0 {
+		sbl.snapshotLock.RLock()
+		defer sbl.snapshotLock.RUnlock()
+		if sbl.snapshot != nil {
+			return append([]byte{}, sbl.snapshot.prefixes...),
+				append([]byte{}, sbl.snapshot.fullHashes...), nil
+		}
+	}
+	if prefixes, err = sbl.Lookup.SortedKeys(PREFIX_4B_SZ); err != nil {
+		return nil, nil, err
+	}
+	if fullHashes, err = sbl.FullHashes.SortedKeys(PREFIX_32B_SZ); err != nil {
+		return nil, nil, err
+	}
+	return prefixes, fullHashes, nil
+}
+
+// BulkCandidates canonicalizes each URL and hashes its lookup candidates,
+// for Lookup.  owners holds the position in urls each hash came from.
+func BulkCandidates(urls []string) (hashes []byte, owners []int) {
+	for i, url := range urls {
+		for _, candidate := range GenerateTestCandidates(Canonicalize(url)) {
+			sum := sha256.Sum256([]byte(candidate))
+			hashes = append(hashes, sum[:]...)
+			owners = append(owners, i)
+		}
+	}
+	return hashes, owners
+}
+
+// Lookup checks a batch of 32 byte hashes, packed one after the other,
+// against every list, as MightBeListed would without consulting the cache.
+// The hashes are sorted by prefix and merged with the sorted lists, so
+// memory is read in order rather than at random.  The matches are ordered
+// by position in the batch, with one for each list a hash is found in.
+func (b *BulkIndex) Lookup(hashes []byte) ([]BulkMatch, error) {
+	if len(hashes)%PREFIX_32B_SZ != 0 {
+		return nil, fmt.Errorf("Hashes must be %d bytes each", PREFIX_32B_SZ)
+	}
+	n := len(hashes) / PREFIX_32B_SZ
+	if uint64(n) > math.MaxUint32 {
+		return nil, fmt.Errorf("Too many hashes for one batch: %d", n)
+	}
+
+	// each hash's prefix above its position
+	keys := make([]uint64, n)
+	for i := range keys {
+		keys[i] = uint64(binary.BigEndian.Uint32(hashes[i*PREFIX_32B_SZ:]))<<32 | uint64(i)
+	}
+	keys = radixSortPrefixes(keys)
+
+	matches := make([]BulkMatch, 0)
+	for i := range b.lists {
+		matches = b.lists[i].join(keys, hashes, matches)
+	}
+	// the lists were joined in name order, which a stable sort keeps
+	sort.SliceStable(matches, func(i, j int) bool { return matches[i].Index < matches[j].Index })
+	return matches, nil
+}
+
+// join merges hashes sorted by prefix with the list.
+func (l *bulkList) join(keys []uint64, hashes []byte, matches []BulkMatch) []BulkMatch {
+	p, f := 0, 0
+	for _, k := range keys {
+		prefix, i := uint32(k>>32), int(uint32(k))
+		hash := hashes[i*PREFIX_32B_SZ : (i+1)*PREFIX_32B_SZ]
+
+		full := false
+		f = gallop(l.fullKeys, f, prefix)
+		for j := f; j < len(l.fullKeys) && l.fullKeys[j] == prefix; j++ {
+			if bytes.Equal(l.fullHashes[j*PREFIX_32B_SZ:(j+1)*PREFIX_32B_SZ], hash) {
+				full = true
+				break
+			}
+		}
+		p = gallop(l.prefixes, p, prefix)
+		if full || p < len(l.prefixes) && l.prefixes[p] == prefix {
+			matches = append(matches, BulkMatch{Index: i, List: l.name, FullHashMatch: full})
+		}
+	}
+	return matches
+}
+
+// gallop is the first position from i on whose key isn't below key.  It
+// steps ahead in doubling strides, so a batch much smaller than the list
+// skips over most of it, and a larger one reads it in order.
+func gallop(keys []uint32, i int, key uint32) int {
+	if i >= len(keys) || keys[i] >= key {
+		return i
+	}
+	// keys[lo] is below key, the answer no further than hi
+	lo, step := i, 1
+	for lo+step < len(keys) && keys[lo+step] < key {
+		lo += step
+		step *= 2
+	}
+	hi := lo + step
+	if hi > len(keys) {
+		hi = len(keys)
+	}
+	return lo + 1 + sort.Search(hi-lo-1, func(j int) bool { return keys[lo+1+j] >= key })
+}
+
+// radixSortPrefixes sorts keys by their upper 32 bits, a byte at a time
+// from the least significant, skipping bytes all the keys share.  The sort
+// is stable, so hashes with the same prefix stay in batch order.
+func radixSortPrefixes(keys []uint64) []uint64 {
+	if len(keys) < 2 {
+		return keys
+	}
+	buf := make([]uint64, len(keys))
+	for shift := uint(32); shift < 64; shift += 8 {
+		var counts [256]int
+		for _, k := range keys {
+			counts[byte(k>>shift)]++
+		}
+		if counts[byte(keys[0]>>shift)] == len(keys) {
+			continue
+		}
+		pos := 0
+		for b, c := range counts {
+			counts[b] = pos
+			pos += c
+		}
+		for _, k := range keys {
+			b := byte(k >> shift)
+			buf[counts[b]] = k
+			counts[b]++
+		}
+		keys, buf = buf, keys
+	}
+	return keys
+}
@@ -0,0 +1,184 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import (
+	"flag"
+	"fmt"
+	"math/rand"
+	"sort"
+	"testing"
+)
+
+var bulkBenchMax = flag.Int("bulkmax", 10000000,
+	"largest batch BenchmarkBulkLookup tries, up to 100000000 given the memory")
+
+// bulkTestLists makes lists of random prefixes and full hashes, some of the
+// latter without their prefix.
+func bulkTestLists(rng *rand.Rand, names []string, prefixes int) *SafeBrowsing {
+	sb := &SafeBrowsing{Lists: make(map[string]*SafeBrowsingList)}
+	for _, name := range names {
+		sbl := newSafeBrowsingList(name, name+".dat")
+		keys := make([]byte, prefixes*PREFIX_4B_SZ)
+		rng.Read(keys)
+		sbl.Lookup.SetKeys(keys, PREFIX_4B_SZ)
+		full := make([]byte, prefixes/30*PREFIX_32B_SZ)
+		rng.Read(full)
+		for i := 0; i < len(full)/2; i += PREFIX_32B_SZ {
+			copy(full[i:], keys[i/8:i/8+PREFIX_4B_SZ])
+		}
+		sbl.FullHashes.SetKeys(full, PREFIX_32B_SZ)
+		sbl.loaded = 1
+		sb.Lists[name] = sbl
+	}
+	return sb
+}
+
+// bulkTestHashes makes a batch of random hashes, one in every ten taken
+// from the lists.
+func bulkTestHashes(rng *rand.Rand, sb *SafeBrowsing, n int) []byte {
+	hashes := make([]byte, n*PREFIX_32B_SZ)
+	rng.Read(hashes)
+	for _, sbl := range sb.Lists {
+		prefixes, _ := sbl.Lookup.SortedKeys(PREFIX_4B_SZ)
+		full, _ := sbl.FullHashes.SortedKeys(PREFIX_32B_SZ)
+		for i := 0; i < n; i += 10 {
+			hash := hashes[i*PREFIX_32B_SZ : (i+1)*PREFIX_32B_SZ]
+			if x := rng.Intn(3); x == 0 && len(full) > 0 {
+				j := rng.Intn(len(full)/PREFIX_32B_SZ) * PREFIX_32B_SZ
+				copy(hash, full[j:j+PREFIX_32B_SZ])
+			} else if x == 1 {
+				j := rng.Intn(len(prefixes)/PREFIX_4B_SZ) * PREFIX_4B_SZ
+				copy(hash, prefixes[j:j+PREFIX_4B_SZ])
+			}
+		}
+	}
+	return hashes
+}
+
+// probeLookup checks each hash in turn, as MightBeListed does.
+func probeLookup(sb *SafeBrowsing, names []string, hashes []byte) []BulkMatch {
+	matches := make([]BulkMatch, 0)
+	for i := 0; i < len(hashes)/PREFIX_32B_SZ; i++ {
+		hash := hashes[i*PREFIX_32B_SZ : (i+1)*PREFIX_32B_SZ]
+		for _, name := range names {
+			sbl := sb.Lists[name]
+			if sbl.FullHashes.Get(string(hash)) {
+				matches = append(matches, BulkMatch{i, name, true})
+			} else if sbl.Lookup.Get(string(hash[:PREFIX_4B_SZ])) {
+				matches = append(matches, BulkMatch{i, name, false})
+			}
+		}
+	}
+	return matches
+}
+
+func TestBulkLookup(t *testing.T) {
+	rng := rand.New(rand.NewSource(1))
+	names := []string{"goog-malware-shavar", "googpub-phish-shavar"}
+	sb := bulkTestLists(rng, names, 20000)
+	b, err := sb.NewBulkIndex()
+	if err != nil {
+		t.Fatal(err)
+	}
+	for _, n := range []int{0, 1, 10, 1000, 100000} {
+		hashes := bulkTestHashes(rng, sb, n)
+		// and some repeats
+		if n > 10 {
+			copy(hashes[:5*PREFIX_32B_SZ], hashes[5*PREFIX_32B_SZ:10*PREFIX_32B_SZ])
+		}
+		matches, err := b.Lookup(hashes)
+		if err != nil {
+			t.Fatal(err)
+		}
+		expected := probeLookup(sb, names, hashes)
+		if len(matches) != len(expected) {
+			t.Fatalf("%d hashes: %d matches, expected %d", n, len(matches), len(expected))
+		}
+		for i := range matches {
+			if matches[i] != expected[i] {
+				t.Fatalf("%d hashes: match %d is %+v, expected %+v", n, i, matches[i], expected[i])
+			}
+		}
+		if n >= 1000 && len(matches) < n/20 {
+			t.Errorf("%d hashes: only %d matches", n, len(matches))
+		}
+	}
+	if _, err := b.Lookup(make([]byte, 33)); err == nil {
+		t.Errorf("Partial hash accepted")
+	}
+
+	hashes, owners := BulkCandidates([]string{"http://a.b.c/1/2.html?param=1", "evil.com"})
+	if len(hashes) != len(owners)*PREFIX_32B_SZ || owners[0] != 0 || owners[len(owners)-1] != 1 {
+		t.Errorf("Candidates not mapped back to their URLs: %v", owners)
+	}
+}
+
+func TestRadixSortPrefixes(t *testing.T) {
+	rng := rand.New(rand.NewSource(1))
+	keys := make([]uint64, 10000)
+	for i := range keys {
+		// few distinct prefixes, so the stability shows
+		keys[i] = uint64(rng.Intn(50))<<40 | uint64(i)
+	}
+	expected := append([]uint64{}, keys...)
+	sort.SliceStable(expected, func(i, j int) bool { return expected[i]>>32 < expected[j]>>32 })
+	sorted := radixSortPrefixes(keys)
+	for i := range sorted {
+		if sorted[i] != expected[i] {
+			t.Fatalf("Position %d: %x, expected %x", i, sorted[i], expected[i])
+		}
+	}
+}
+
+// BenchmarkBulkLookup compares Lookup with probing each hash in turn, on
+// lists about the size of goog-malware-shavar.
+func BenchmarkBulkLookup(b *testing.B) {
+	rng := rand.New(rand.NewSource(1))
+	names := []string{"goog-malware-shavar"}
+	sb := bulkTestLists(rng, names, 600000)
+	index, err := sb.NewBulkIndex()
+	if err != nil {
+		b.Fatal(err)
+	}
+	for n := 10000; n <= *bulkBenchMax; n *= 10 {
+		hashes := bulkTestHashes(rng, sb, n)
+		for _, mode := range []struct {
+			name   string
+			lookup func()
+		}{
+			{"Probe", func() { probeLookup(sb, names, hashes) }},
+			{"Merge", func() { index.Lookup(hashes) }},
+		} {
+			b.Run(fmt.Sprintf("%s/%d", mode.name, n), func(b *testing.B) {
+				for i := 0; i < b.N; i++ {
+					mode.lookup()
+				}
+				b.ReportMetric(float64(b.N)*float64(n)/b.Elapsed().Seconds(), "hashes/s")
+			})
+		}
+		hashes = nil
+	}
+}
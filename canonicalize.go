@@ -37,8 +37,17 @@ import (
 
 // Canonicalize a URL as needed for safe browsing lookups.
 // This is required before obtaining the host key or generating
-// url lookup iterations.
+// url lookup iterations.  URLs already in canonical form, as most are, are
+// returned as they are.
 func Canonicalize(fullurl string) (canonicalized string) {
+	if isCanonical(fullurl) {
+		return fullurl
+	}
+	return canonicalize(fullurl)
+}
+
+// canonicalize applies every step of canonicalization.
+func canonicalize(fullurl string) (canonicalized string) {
 	// basic trim
 	fullurl = strings.TrimSpace(fullurl)
 	// add default http protocol
@@ -67,6 +76,100 @@ func Canonicalize(fullurl string) (canonicalized string) {
 	return fullurl
 }
 
+// Repeated in each byte of a word.
+const (
+	swarOnes    = 0x0101010101010101
+	swarHigh    = 0x8080808080808080
+	swarPercent = '%' * swarOnes
+	swarHash    = '#' * swarOnes
+)
+
+// swarZero is whether any byte of x is zero.
+func swarZero(x uint64) bool {
+	return (x-swarOnes)&^x&swarHigh != 0
+}
+
+// needsEscape is whether any byte of x is one canonicalization escapes or
+// removes: <= 32 (including the whitespace trimmed and the tab, CR and LF
+// stripped), >= 127, '%' or '#'.
+func needsEscape(x uint64) bool {
+	return (x-'!'*swarOnes)&^x&swarHigh != 0 || // below '!'
+		((x+swarOnes)|x)&swarHigh != 0 || // above '~'
+		swarZero(x^swarPercent) || swarZero(x^swarHash)
+}
+
+// isCanonical is whether canonicalize would return url unchanged.  It reads
+// the URL a word at a time for bytes that would be escaped or removed, then
+// checks the host and path for the changes canonicalize makes to them.  It
+// may turn down URLs that are in fact canonical, but never accepts one that
+// isn't.
+func isCanonical(url string) bool {
+	i := 0
+	for ; i+8 <= len(url); i += 8 {
+		x := uint64(url[i]) | uint64(url[i+1])<<8 | uint64(url[i+2])<<16 |
+			uint64(url[i+3])<<24 | uint64(url[i+4])<<32 | uint64(url[i+5])<<40 |
+			uint64(url[i+6])<<48 | uint64(url[i+7])<<56
+		if needsEscape(x) {
+			return false
+		}
+	}
+	for ; i < len(url); i++ {
+		if b := url[i]; b <= 32 || b >= 127 || b == '%' || b == '#' {
+			return false
+		}
+	}
+
+	// a scheme, which stops http:// being added
+	scheme := strings.Index(url, "://")
+	if scheme < 1 || !('a' <= url[0]|0x20 && url[0]|0x20 <= 'z') {
+		return false
+	}
+	for j := 1; j < scheme; j++ {
+		if b := url[j]; !('a' <= b|0x20 && b|0x20 <= 'z' || '0' <= b && b <= '9' || '+' <= b && b <= '.') {
+			return false
+		}
+	}
+
+	// a host with no uppercase, stray dots or numbers to be read as an
+	// IP address, followed by a path
+	rest := url[scheme+3:]
+	slash := strings.IndexByte(rest, '/')
+	if slash < 1 {
+		return false
+	}
+	host := rest[:slash]
+	if host[0] == '.' || host[len(host)-1] == '.' || strings.Contains(host, "..") {
+		return false
+	}
+	hex, digits := true, false
+	for j := 0; j < len(host); j++ {
+		b := host[j]
+		if 'A' <= b && b <= 'Z' {
+			return false
+		}
+		if '0' <= b && b <= '9' || b == ':' {
+			digits = true
+		} else if !('a' <= b && b <= 'f' || b == '.') {
+			hex = false
+		}
+	}
+	if hex && digits {
+		// could be an address canonicalize writes another way
+		return false
+	}
+
+	// a path with no dot segments or repeated slashes, and which the
+	// trailing slash wouldn't be added to
+	path := rest[slash:]
+	if q := strings.IndexByte(path, '?'); q >= 0 {
+		if q == 1 {
+			return false
+		}
+		path = path[:q]
+	}
+	return !strings.Contains(path, "/.") && !strings.Contains(path, "//")
+}
+
 func canonicalizeHostname(fullurl string) (canonicalized string) {
 	// extract the hostname from the url
 	re := regexp.MustCompile("[a-zA-Z][a-zA-Z0-9+-.]*://([^/]+)/.*")
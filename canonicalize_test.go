@@ -25,6 +25,8 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 package safebrowsing
 
 import (
+	"fmt"
+	"math/rand"
 	"testing"
 )
 
@@ -237,3 +239,129 @@ func TestCanonicalize(t *testing.T) {
 	}
 
 }
+
+// randomUrl puts together a URL from parts canonicalization cares about.
+func randomUrl(rng *rand.Rand) string {
+	pick := func(parts ...string) string { return parts[rng.Intn(len(parts))] }
+	url := pick("http://", "https://", "HTTP://", "ftp://", "", "a.b-c+d://", "1x://")
+	for n := rng.Intn(4) + 1; n > 0; n-- {
+		url += pick("www", "example", "Evil", "com", "cafe", "1", "255", "", ".", "..",
+			"0x7f", "::1", ":8080", "%41", "\t", "\xc3\xa9", " ") + pick(".", "", ".")
+	}
+	for n := rng.Intn(5); n > 0; n-- {
+		url += pick("/", "/", "//", "/.", "/..", "/a", "/b.html", "?", "?q=1", "#frag",
+			"%2e", "%25", "~!@$^&*()_+", "\n", "\r", "\x7f", "\x00", "?a//b")
+	}
+	return url
+}
+
+func TestIsCanonical(t *testing.T) {
+	clean := []string{
+		"http://www.google.com/",
+		"http://evil.com/foo?bar;",
+		"http://www.gotaport.com:1234/",
+		"https://www.securesite.com/",
+		"http://host.com/twoslashes?more//slashes",
+		"http://a.b.c/1/2.html?param=1",
+	}
+	for _, url := range clean {
+		if !isCanonical(url) {
+			t.Errorf("%q not taken as canonical", url)
+		}
+	}
+	dirty := []string{
+		"http://www.GOOGLE.com/",
+		"http://www.google.com",
+		"www.google.com/",
+		"http://www.google.com/a/../b",
+		"http://www.google.com/a/./b",
+		"http://www.google.com//a",
+		"http://www.google.com/#frag",
+		"http://www.google.com/%41",
+		"http://www.google.com/a b",
+		"http://www.google.com/\xe9",
+		"http://www.google.com/\x7f",
+		"http://..www.google.com/",
+		"http://3279880203/blah",
+		"http://www.google.com/?q",
+		"http://www.google.com/\t",
+	}
+	for _, url := range dirty {
+		if isCanonical(url) {
+			t.Errorf("%q taken as canonical", url)
+		}
+	}
+
+	// whatever is taken as canonical must come through canonicalize as it
+	// went in
+	rng := rand.New(rand.NewSource(1))
+	accepted := 0
+	for i := 0; i < 50000; i++ {
+		url := randomUrl(rng)
+		if i%2 == 1 {
+			// canonical forms, most of which should be recognized
+			url = canonicalize(url)
+		}
+		if isCanonical(url) {
+			accepted++
+			if out := canonicalize(url); out != url {
+				t.Fatalf("%q taken as canonical, but canonicalizes to %q", url, out)
+			}
+		}
+	}
+	if accepted < 2000 {
+		t.Errorf("Only %d of the URLs taken as canonical", accepted)
+	}
+}
+
+func BenchmarkCanonicalize(b *testing.B) {
+	rng := rand.New(rand.NewSource(1))
+	var clean, dirty []string
+	for len(clean) < 1000 || len(dirty) < 1000 {
+		url := randomUrl(rng)
+		if isCanonical(url) {
+			clean = append(clean, url)
+		} else if url != "" {
+			dirty = append(dirty, url)
+			if c := canonicalize(url); isCanonical(c) {
+				clean = append(clean, c)
+			}
+		}
+	}
+	mixes := []struct {
+		name  string
+		clean int // in 10
+	}{
+		{"Clean", 10},
+		{"Mixed", 9},
+		{"Dirty", 0},
+	}
+	for _, mix := range mixes {
+		urls := make([]string, 1000)
+		for i := range urls {
+			if i%10 < mix.clean {
+				urls[i] = clean[i]
+			} else {
+				urls[i] = dirty[i]
+			}
+		}
+		for _, f := range []struct {
+			name string
+			f    func(string) string
+		}{
+			{"PreScan", Canonicalize},
+			{"Full", canonicalize},
+		} {
+			b.Run(fmt.Sprintf("%s/%s", mix.name, f.name), func(b *testing.B) {
+				size := 0
+				for _, url := range urls {
+					size += len(url)
+				}
+				b.SetBytes(int64(size / len(urls)))
+				for i := 0; i < b.N; i++ {
+					f.f(urls[i%len(urls)])
+				}
+			})
+		}
+	}
+}
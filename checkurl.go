@@ -27,14 +27,15 @@ package safebrowsing
 
 import (
 	"bytes"
+	"context"
 	"crypto/sha256"
 	"errors"
 	"fmt"
-	"io/ioutil"
+	"io"
 	"math/rand"
 	"net/http"
 	//	"runtime/debug"
-	"strconv"
+	"runtime/trace"
 	"strings"
 	"time"
 )
@@ -44,6 +45,8 @@ import (
 type FullHashCache struct {
 	CreationDate  time.Time
 	CacheLifeTime int
+	// the metadata gethash sent with the hash, interned in fullHashMetadata
+	metadata uint32
 }
 
 func newFullHashCache(creationDate time.Time, cacheLifeTime int) (fch *FullHashCache) {
@@ -73,85 +76,227 @@ func (sb *SafeBrowsing) MightBeListed(url string) (list string, fullHashMatch bo
 	return sb.queryUrl(url, false)
 }
 
+// IsListedUntil is IsListed, also returning how long the answer holds: for
+// an unlisted URL until the next scheduled update, for a listed one until
+// its full hash expires from the cache.  The zero time means the answer
+// shouldn't be cached at all.
+func (sb *SafeBrowsing) IsListedUntil(url string) (list string, validUntil time.Time, err error) {
+	list, _, validUntil, err = sb.explainUrl(context.Background(), url, true, nil)
+	return list, validUntil, err
+}
+
+// MightBeListedUntil is MightBeListed, also returning how long the answer
+// holds as IsListedUntil does.  A match on a hash prefix alone is never
+// valid beyond the request, since the full hashes will settle it.
+func (sb *SafeBrowsing) MightBeListedUntil(url string) (list string, fullHashMatch bool, validUntil time.Time, err error) {
+	return sb.explainUrl(context.Background(), url, false, nil)
+}
+
+// The Context variants trace the lookup as part of ctx, and label the
+// goroutine for CPU profiles while it runs, putting back the labels of ctx
+// when done.  ctx should carry the goroutine's labels, as it does under
+// pprof.Do; the plain calls leave the goroutine's labels alone.
+
+// IsListedContext is IsListed as part of ctx.
+func (sb *SafeBrowsing) IsListedContext(ctx context.Context, url string) (list string, err error) {
+	list, _, _, err = sb.explainUrl(withGoroutineLabels(ctx), url, true, nil)
+	return list, err
+}
+
+// MightBeListedContext is MightBeListed as part of ctx.
+func (sb *SafeBrowsing) MightBeListedContext(ctx context.Context, url string) (list string, fullHashMatch bool, err error) {
+	list, fullHashMatch, _, err = sb.explainUrl(withGoroutineLabels(ctx), url, false, nil)
+	return list, fullHashMatch, err
+}
+
+// IsListedUntilContext is IsListedUntil as part of ctx.
+func (sb *SafeBrowsing) IsListedUntilContext(ctx context.Context, url string) (list string, validUntil time.Time, err error) {
+	list, _, validUntil, err = sb.explainUrl(withGoroutineLabels(ctx), url, true, nil)
+	return list, validUntil, err
+}
+
+// MightBeListedUntilContext is MightBeListedUntil as part of ctx.
+func (sb *SafeBrowsing) MightBeListedUntilContext(ctx context.Context, url string) (list string, fullHashMatch bool, validUntil time.Time, err error) {
+	return sb.explainUrl(withGoroutineLabels(ctx), url, false, nil)
+}
+
 var ErrOutOfDateHashes = errors.New("Unable to check listing, list hasn't been updated for 45 mins")
 
 // Here is where we actually look up the hashes against our map.
 func (sb *SafeBrowsing) queryUrl(url string, matchFullHash bool) (list string, fullHashMatch bool, err error) {
+	list, fullHashMatch, _, err = sb.explainUrl(context.Background(), url, matchFullHash, nil)
+	return list, fullHashMatch, err
+}
+
+// explainUrl is queryUrl, recording each step in ex unless it is nil.
+func (sb *SafeBrowsing) explainUrl(ctx context.Context, url string, matchFullHash bool, ex *Explanation) (list string, fullHashMatch bool, validUntil time.Time, err error) {
 	//	defer debug.FreeOSMemory()
 
+	kind := "mightBeListed"
+	if matchFullHash {
+		kind = "isListed"
+	}
+	ctx, task := trace.NewTask(ctx, kind)
+	defer task.End()
+	ctx, s := startSpan(ctx, "lookup", "lookup", kind)
+	defer s.end()
+
 	if matchFullHash && !sb.IsUpToDate() {
 		// we haven't had a sucessful update in the last 45 mins!  abort!
-		return "", false, ErrOutOfDateHashes
+		return "", false, time.Time{}, ErrOutOfDateHashes
 	}
 
 	// first Canonicalize
+	ex.start()
+	region := trace.StartRegion(ctx, "canonicalize")
 	url = Canonicalize(url)
-
 	urls := GenerateTestCandidates(url)
+	region.End()
+	ex.canonicalized(url, urls)
+
+	region = trace.StartRegion(ctx, "hash")
+	hashes := make([]LookupHash, len(urls))
+	for i, url := range urls {
+		hashes[i] = getHash(url)
+	}
+	region.End()
+	ex.hashed(hashes)
+
 	//      sb.Logger.Debug("Checking %d iterations of url", len(urls))
 	for list, sbl := range sb.Lists {
+		found, full, err := sb.queryList(ctx, list, sbl, hashes, matchFullHash, ex)
+		if err != nil {
+			return "", false, time.Time{}, err
+		}
+		if found {
+			return list, full, sb.listedUntil(sbl, hashes, full), nil
+		}
+	}
+	return "", false, sb.NextUpdate(), nil
+}
 
-		// create the map for all prefixes we need to do the full hash lookup
-		keysToLookupMap := make(map[LookupHash]bool)
+// listedUntil is how long a match stays valid: a prefix match not at all, a
+// full hash from a gethash response while it is cached, and one from the
+// list data until the next update.
+func (sb *SafeBrowsing) listedUntil(sbl *SafeBrowsingList, hashes []LookupHash, fullHashMatch bool) time.Time {
+	if !fullHashMatch {
+		return time.Time{}
+	}
+	for _, urlHash := range hashes {
+		if fhc, ok := sbl.Cache[FullHash(urlHash)]; ok && sbl.FullHashes.Get(string(urlHash)) {
+			return fhc.CreationDate.Add(time.Duration(fhc.CacheLifeTime) * time.Second)
+		}
+	}
+	return sb.NextUpdate()
+}
 
-		for _, url := range urls {
+// NextUpdate is when the lists are next due to be updated, or the zero time
+// if that isn't known: in offline mode, before the first update and when the
+// update is overdue.
+func (sb *SafeBrowsing) NextUpdate() time.Time {
+	if OfflineMode || sb.LastUpdated.IsZero() {
+		return time.Time{}
+	}
+	next := sb.LastUpdated.Add(time.Duration(sb.UpdateDelay) * time.Second)
+	if !next.After(time.Now()) {
+		return time.Time{}
+	}
+	return next
+}
 
-			urlHash := getHash(url)
+// queryList looks up the candidate hashes in a single list.
+func (sb *SafeBrowsing) queryList(ctx context.Context, list string, sbl *SafeBrowsingList,
+	hashes []LookupHash, matchFullHash bool, ex *Explanation) (found bool, fullHashMatch bool, err error) {
 
-			prefix := urlHash[:PREFIX_4B_SZ]
-			lookupHash := string(prefix)
-			fullLookupHash := string(urlHash)
+	// how long the probes take, without waiting on gethash, paces updates
+	probeStart := time.Now()
+	defer func() { observeProbeLatency(time.Since(probeStart)) }()
 
-			fhc, ok := sbl.Cache[FullHash(fullLookupHash)]
-			if ok && !fhc.checkValidity() {
-				delete(sbl.Cache, FullHash(fullLookupHash))
-				//sbl.Logger.Debug("Delete full length hash: %s",fullLookupHash)
-				sbl.FullHashRequested.Delete(lookupHash)
-				sbl.FullHashes.Delete(fullLookupHash)
-			}
+	ctx, s := startSpan(ctx, "probe", "list", list)
+	defer s.end()
 
-			// look up full hash matches
-			if sbl.FullHashes.Get(fullLookupHash) {
-				return list, true, nil
-			}
+	// with progressive startup, answer from the index snapshot until
+	// the list is loaded; only full hashes handed over are cached
+	if found, full, serving := sbl.snapshotLookup(list, hashes, ex); serving {
+		if found && matchFullHash && !full {
+			return false, false, ErrOutOfDateHashes
+		}
+		return found, full, nil
+	}
 
-			// now see if there is a match in our prefix trie
-			if sbl.Lookup.Get(lookupHash) {
-				if !matchFullHash || OfflineMode {
-					//					sb.Logger.Debug("Partial hash hit")
-					return list, false, nil
-				}
-				// have we have already asked for full hashes for this prefix?
-				if sbl.FullHashRequested.Get(string(lookupHash)) {
-					//                                        sb.Logger.Debug("Full length hash miss")
-					continue
-				}
-
-				// we matched a prefix and need to request a full hash
-				keysToLookupMap[prefix] = true
-			}
+	// create the map for all prefixes we need to do the full hash lookup
+	keysToLookupMap := make(map[LookupHash]bool)
+
+	for i, urlHash := range hashes {
+
+		prefix := urlHash[:PREFIX_4B_SZ]
+		lookupHash := string(prefix)
+		fullLookupHash := string(urlHash)
+
+		fhc, ok := sbl.Cache[FullHash(fullLookupHash)]
+		if ok && !fhc.checkValidity() {
+			ex.probe(list, i, "cache", false, "expired")
+			delete(sbl.Cache, FullHash(fullLookupHash))
+			//sbl.Logger.Debug("Delete full length hash: %s",fullLookupHash)
+			sbl.FullHashRequested.Delete(lookupHash)
+			sbl.FullHashes.Delete(fullLookupHash)
+		} else if ok {
+			ex.probe(list, i, "cache", true, "valid")
 		}
 
-		// Check if we need to do a fullHashLookup
-		if len(keysToLookupMap) > 0 {
-			err := sb.requestFullHashes(list, keysToLookupMap)
-			if err != nil {
-				return "", false, err
+		// look up full hash matches
+		if sbl.FullHashes.Get(fullLookupHash) {
+			ex.probe(list, i, "fullHashes", true, "")
+			return true, true, nil
+		}
+		ex.probe(list, i, "fullHashes", false, "")
+
+		// now see if there is a match in our prefix trie
+		if sbl.Lookup.Get(lookupHash) {
+			ex.probe(list, i, "prefixes", true, "")
+			if !matchFullHash || OfflineMode {
+				//					sb.Logger.Debug("Partial hash hit")
+				return true, false, nil
+			}
+			// have we have already asked for full hashes for this prefix?
+			if sbl.FullHashRequested.Get(string(lookupHash)) {
+				//                                        sb.Logger.Debug("Full length hash miss")
+				ex.probe(list, i, "fullHashRequested", true, "")
+				continue
 			}
 
-			// re-check for full hash hit.
-			for _, url := range urls {
-				urlHash := getHash(url)
-				fullLookupHash := string(urlHash)
+			// we matched a prefix and need to request a full hash
+			keysToLookupMap[prefix] = true
+		} else {
+			ex.probe(list, i, "prefixes", false, "")
+		}
+	}
 
-				if sbl.FullHashes.Get(string(fullLookupHash)) {
-					return list, true, nil
-				}
+	// Check if we need to do a fullHashLookup
+	if len(keysToLookupMap) > 0 {
+		ex.startRequest(list, len(keysToLookupMap))
+		_, gethash := startSpan(ctx, "gethash", "phase", "gethash")
+		requestStart := time.Now()
+		err := sb.requestFullHashes(list, keysToLookupMap)
+		probeStart = probeStart.Add(time.Since(requestStart))
+		gethash.end()
+		ex.finishRequest(err)
+		if err != nil {
+			return false, false, err
+		}
+
+		// re-check for full hash hit.
+		for i, urlHash := range hashes {
+			fullLookupHash := string(urlHash)
+
+			if sbl.FullHashes.Get(string(fullLookupHash)) {
+				ex.probe(list, i, "fullHashes", true, "after gethash")
+				return true, true, nil
 			}
 		}
-		//			debug.FreeOSMemory()
 	}
-	return "", false, nil
+	//			debug.FreeOSMemory()
+	return false, false, nil
 }
 
 // Checks to ensure we have had a successful update in the last 45 mins
@@ -173,6 +318,8 @@ func (fhc *FullHashCache) checkValidity() bool {
 // request full hases for a set of lookup prefixes.
 func (sb *SafeBrowsing) requestFullHashes(list string, prefixes map[LookupHash]bool) error {
 
+	// the peers may have asked already
+	prefixes = sb.consultPeers(list, prefixes)
 	if len(prefixes) == 0 {
 		return nil
 	}
@@ -219,79 +366,74 @@ func (sb *SafeBrowsing) requestFullHashes(list string, prefixes map[LookupHash]b
 		return fmt.Errorf("Unable to lookup full hash, server returned %d",
 			response.StatusCode)
 	}
-	data, err := ioutil.ReadAll(response.Body)
-	if err != nil {
+	var shared *sharedResponse
+	if sb.fullHashRing != nil {
+		shared = &sharedResponse{received: time.Now()}
+	}
+	if err = sb.processFullHashesFrom(response.Body, shared); err != nil {
 		return err
 	}
-	return sb.processFullHashes(string(data))
+	sb.sharePrefixes(prefixes, shared)
+	return nil
 }
 
 // Process the retrieved full hashes, saving them to disk
 func (sb *SafeBrowsing) processFullHashes(data string) error {
-	//	defer debug.FreeOSMemory()
+	return sb.processFullHashesFrom(strings.NewReader(data), nil)
+}
 
-	pos := strings.IndexByte(data, '\n')
-	if -1 == pos {
-		return nil
-	}
-	cacheLifeTime, err := strconv.Atoi(data[0:pos])
+// processFullHashesFrom streams a gethash response into the lists as it is
+// read, also collecting it into shared unless it is nil.
+func (sb *SafeBrowsing) processFullHashesFrom(r io.Reader, shared *sharedResponse) error {
+	p := newFullHashParser(r)
+	defer p.release()
+
+	cacheLifeTime, err := p.cacheLifeTime()
 	if err != nil {
 		return err
 	}
-	data = data[pos+1:]
-
-	for pos, rec_len := 0, 0; pos < len(data); pos += rec_len {
-		nl_pos := strings.IndexByte(data[pos:], '\n')
-		if -1 == nl_pos {
-			return fmt.Errorf("Malformated response: unable to find end of header")
-		}
-		header := data[pos : pos+nl_pos]
-		// Increment by the header+newline
-		rec_len = pos + nl_pos + 1
-
-		headerArray := strings.Split(header, ":")
-		headerRecCount := len(headerArray)
-		if 3 != headerRecCount && 4 != headerRecCount {
-			return fmt.Errorf("Malformated response: %s", header)
-		}
-		// How many 32 byte hashes do we have
-		num_resp, err := strconv.Atoi(headerArray[2])
-		if err != nil {
+	shared.add("", "", cacheLifeTime)
+
+	now := time.Now()
+	var sbl *SafeBrowsingList
+	for {
+		list, hash, metadata, err := p.nextHash()
+		if err == io.EOF {
+			return nil
+		} else if err != nil {
 			return err
-		} else if 0 >= num_resp {
-			return fmt.Errorf("Malformated response: %s", header)
-		} else if (pos + (num_resp * 32)) > len(data) {
-			return fmt.Errorf("Malformated response: %s", header)
 		}
-
-		hashes := data[nl_pos+1 : nl_pos+1+(num_resp*32)]
-		// Increment by the number of 32 byte hashes
-		rec_len = rec_len + num_resp*32
-
-		if 4 == headerRecCount {
-			// We have metadata, check for a valid marker
-			if "m" != headerArray[3] {
-				return fmt.Errorf("Malformated response: %s", header)
-			}
-			for resp := 0; resp < num_resp; resp++ {
-				nl_pos = strings.IndexByte(data[pos+rec_len:], '\n')
-				if -1 == nl_pos {
-					return fmt.Errorf("Malformated response: unable to parse metadata length")
-				}
-				// How many bytes is the metadata record
-				len_meta, err := strconv.Atoi(data[pos+rec_len : pos+rec_len+nl_pos])
-				if err != nil {
-					return err
-				} else if pos+rec_len+nl_pos+len_meta > len(data) {
-					return fmt.Errorf("Malformated response: %s", header)
-				}
-				// Increment by the length field and the meta data
-				rec_len += nl_pos + 1 + len_meta
+		// records for the same list tend to come together
+		if sbl == nil || sbl.Name != string(list) {
+			if sb.Lists == nil {
+				return fmt.Errorf("Google safe browsing lists have not been initialized")
+			} else if sbl = sb.Lists[string(list)]; sbl == nil {
+				return fmt.Errorf("Google safe browsing list (%s) have not been initialized", list)
 			}
 		}
-		err = sb.readFullHashChunk(hashes, headerArray[0], cacheLifeTime)
+		key := string(hash)
+		sbl.FullHashes.Set(key)
+		fhc := newFullHashCache(now, cacheLifeTime)
+		fhc.metadata = fullHashMetadata.intern(metadata)
+		sbl.Cache[FullHash(key)] = fhc
+		if shared != nil {
+			shared.add(key, sbl.Name, cacheLifeTime)
+		}
 	}
-	return err
+}
+
+// FullHashMetadata returns the metadata gethash sent with a cached full hash
+// of the list, if it sent any.
+func (sb *SafeBrowsing) FullHashMetadata(list string, hash FullHash) (metadata string, ok bool) {
+	sbl, exists := sb.Lists[list]
+	if !exists {
+		return "", false
+	}
+	fhc, exists := sbl.Cache[hash]
+	if !exists || fhc.metadata == 0 {
+		return "", false
+	}
+	return fullHashMetadata.value(fhc.metadata), true
 }
 
 func (sb *SafeBrowsing) readFullHashChunk(hashes string, list string, cacheLifeTime int) (err error) {
@@ -351,14 +493,8 @@ func (sb *SafeBrowsing) doFullHashBackOffRequest(url string, body string) {
 			continue
 		}
 	}
-	data, err := ioutil.ReadAll(response.Body)
-	if err != nil {
-		sb.Logger.Error(
-			"Unable to request full hashes from response in back-off mode: %s",
-			err,
-		)
-	}
-	err = sb.processFullHashes(string(data))
+	err = sb.processFullHashesFrom(response.Body, nil)
+	response.Body.Close()
 	if err != nil {
 		sb.Logger.Error(
 			"Unable process full hashes from response in back-off mode: %s; trying again.",
@@ -25,7 +25,13 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 package safebrowsing
 
 import (
+	"bufio"
 	"fmt"
+	"io"
+	"os"
+	"runtime"
+	"sync"
+	"sync/atomic"
 	"time"
 )
 
@@ -42,41 +48,266 @@ type logger interface {
 	Critical(arg0 interface{}, args ...interface{}) error
 }
 
+// LogLevel orders log messages by importance, as log4go does.
+type LogLevel int
+
+const (
+	LogFinest LogLevel = iota
+	LogFine
+	LogDebug
+	LogTrace
+	LogInfo
+	LogWarn
+	LogError
+	LogCritical
+)
+
+var logLevelNames = [...]string{"FINE", "FINE", "DEBG", "TRAC", "INFO", "WARN", "EROR", "CRIT"}
+
+// MinLogLevel is the least important level DefaultLogger writes.
+var MinLogLevel LogLevel = LogInfo
+
+// ParseLogLevel parses the lowercase names of the levels, "finest" to
+// "critical", with the empty string meaning info.
+func ParseLogLevel(s string) (LogLevel, error) {
+	names := []string{"finest", "fine", "debug", "trace", "info", "warn", "error", "critical"}
+	if s == "" {
+		return LogInfo, nil
+	}
+	for level, name := range names {
+		if s == name {
+			return LogLevel(level), nil
+		}
+	}
+	return LogInfo, fmt.Errorf("Unknown log level: %s", s)
+}
+
+// levelLogger is a logger that can say whether it would record a level, so
+// that callers can skip putting together messages it would discard.
+type levelLogger interface {
+	Enabled(level LogLevel) bool
+}
+
+// logEnabled is whether l records messages of level, which loggers that
+// can't say are assumed to.
+func logEnabled(l logger, level LogLevel) bool {
+	if ll, ok := l.(levelLogger); ok {
+		return ll.Enabled(level)
+	}
+	return true
+}
+
 // Default logger provides a simple console output implementation of the logger
 // interface.  This is intended for logger dependency injection, such as log4go.
+//
+// Messages below MinLogLevel are discarded straight away.  The rest are
+// queued and formatted and written by a background goroutine, so the
+// arguments must not be changed after the call; FlushLog waits for them to
+// be written.  Should the queue fill, messages below LogWarn are dropped
+// and counted, and the others wait for room.
 type DefaultLogger struct{}
 
-func (dl *DefaultLogger) log(level string, arg0 interface{}, args ...interface{}) {
-	prefix := fmt.Sprintf(
-		"[%v] [%s] ",
-		time.Now().Format("2006-01-02 15:04:05"),
-		level)
-	fmt.Printf(prefix+arg0.(string)+"\n", args...)
+func (dl *DefaultLogger) Enabled(level LogLevel) bool {
+	return level >= MinLogLevel
+}
+
+func (dl *DefaultLogger) log(level LogLevel, arg0 interface{}, args ...interface{}) {
+	if level < MinLogLevel {
+		return
+	}
+	logQueue.start.Do(logQueue.startWriter)
+	for !logQueue.push(time.Now(), level, arg0, args) {
+		if level < LogWarn {
+			atomic.AddUint64(&logQueue.dropped, 1)
+			return
+		}
+		runtime.Gosched()
+	}
 }
 func (dl *DefaultLogger) Finest(arg0 interface{}, args ...interface{}) {
-	dl.log("FINE", arg0, args...)
+	dl.log(LogFinest, arg0, args...)
 }
 func (dl *DefaultLogger) Fine(arg0 interface{}, args ...interface{}) {
-	dl.log("FINE", arg0, args...)
+	dl.log(LogFine, arg0, args...)
 }
 func (dl *DefaultLogger) Debug(arg0 interface{}, args ...interface{}) {
-	dl.log("DEBG", arg0, args...)
+	dl.log(LogDebug, arg0, args...)
 }
 func (dl *DefaultLogger) Trace(arg0 interface{}, args ...interface{}) {
-	dl.log("TRAC", arg0, args...)
+	dl.log(LogTrace, arg0, args...)
 }
 func (dl *DefaultLogger) Info(arg0 interface{}, args ...interface{}) {
-	dl.log("INFO", arg0, args...)
+	dl.log(LogInfo, arg0, args...)
 }
 func (dl *DefaultLogger) Warn(arg0 interface{}, args ...interface{}) error {
-	dl.log("WARN", arg0, args...)
+	dl.log(LogWarn, arg0, args...)
 	return nil
 }
 func (dl *DefaultLogger) Error(arg0 interface{}, args ...interface{}) error {
-	dl.log("EROR", arg0, args...)
+	dl.log(LogError, arg0, args...)
 	return nil
 }
 func (dl *DefaultLogger) Critical(arg0 interface{}, args ...interface{}) error {
-	dl.log("CRIT", arg0, args...)
+	dl.log(LogCritical, arg0, args...)
 	return nil
 }
+
+// SetLogOutput makes DefaultLogger write to w rather than standard output,
+// once what has been logged so far is written.
+func SetLogOutput(w io.Writer) {
+	FlushLog()
+	logOutput.Store(&logWriter{w})
+}
+
+// FlushLog waits for the messages queued by DefaultLogger to be written.
+func FlushLog() {
+	logQueue.start.Do(logQueue.startWriter)
+	done := make(chan struct{})
+	for !logQueue.push(time.Time{}, LogCritical, logFlush(done), nil) {
+		runtime.Gosched()
+	}
+	<-done
+}
+
+// logFlush asks the writer to close the channel once it has written
+// everything before it.
+type logFlush chan struct{}
+
+type logWriter struct{ io.Writer }
+
+var logOutput atomic.Value
+
+func init() {
+	logOutput.Store(&logWriter{os.Stdout})
+}
+
+// The number of messages the queue holds, a power of two.
+const logQueueSize = 4096
+
+// logRing is a bounded queue for many writers and one reader, which takes
+// no locks.  Each slot carries a sequence number saying whose turn it is:
+// a writer may fill slot i%size at position i when it reads i, and the
+// reader may take it when it reads i+1.
+type logRing struct {
+	slots   [logQueueSize]logRecord
+	head    uint64 // the next position to write, claimed by writers
+	tail    uint64 // the next position to read, the reader's alone
+	dropped uint64
+
+	// set while the reader waits on wake for something to read
+	idle  int32
+	wake  chan struct{}
+	start sync.Once
+}
+
+type logRecord struct {
+	seq   uint64
+	when  time.Time
+	level LogLevel
+	arg0  interface{}
+	args  []interface{}
+}
+
+var logQueue = newLogRing()
+
+func newLogRing() *logRing {
+	r := &logRing{wake: make(chan struct{}, 1)}
+	for i := range r.slots {
+		r.slots[i].seq = uint64(i)
+	}
+	return r
+}
+
+// push queues a message, returning false if the queue is full.
+func (r *logRing) push(when time.Time, level LogLevel, arg0 interface{}, args []interface{}) bool {
+	for {
+		pos := atomic.LoadUint64(&r.head)
+		slot := &r.slots[pos%logQueueSize]
+		seq := atomic.LoadUint64(&slot.seq)
+		if seq < pos {
+			return false
+		}
+		if seq == pos && atomic.CompareAndSwapUint64(&r.head, pos, pos+1) {
+			slot.when, slot.level, slot.arg0, slot.args = when, level, arg0, args
+			atomic.StoreUint64(&slot.seq, pos+1)
+			if atomic.LoadInt32(&r.idle) == 1 && atomic.CompareAndSwapInt32(&r.idle, 1, 0) {
+				// a wake-up left over from an earlier idle does as well
+				select {
+				case r.wake <- struct{}{}:
+				default:
+				}
+			}
+			return true
+		}
+	}
+}
+
+// pop takes the next message, if one is ready.
+func (r *logRing) pop() (logRecord, bool) {
+	slot := &r.slots[r.tail%logQueueSize]
+	if atomic.LoadUint64(&slot.seq) != r.tail+1 {
+		return logRecord{}, false
+	}
+	record := *slot
+	slot.arg0, slot.args = nil, nil
+	atomic.StoreUint64(&slot.seq, r.tail+logQueueSize)
+	r.tail++
+	return record, true
+}
+
+func (r *logRing) startWriter() {
+	go r.write()
+}
+
+// write formats and writes messages as they are queued.
+func (r *logRing) write() {
+	out := logOutput.Load().(*logWriter)
+	w := bufio.NewWriter(out)
+	prefix := make([]byte, 0, 64)
+	for {
+		record, ok := r.pop()
+		if !ok {
+			if dropped := atomic.SwapUint64(&r.dropped, 0); dropped > 0 {
+				record = logRecord{when: time.Now(), level: LogWarn,
+					arg0: "Dropped %d log messages", args: []interface{}{dropped}}
+			} else {
+				w.Flush()
+				atomic.StoreInt32(&r.idle, 1)
+				if slot := &r.slots[r.tail%logQueueSize]; atomic.LoadUint64(&slot.seq) == r.tail+1 {
+					atomic.StoreInt32(&r.idle, 0)
+				} else {
+					<-r.wake
+				}
+				continue
+			}
+		}
+
+		if current := logOutput.Load().(*logWriter); current != out {
+			w.Flush()
+			out = current
+			w = bufio.NewWriter(out)
+		}
+		if done, ok := record.arg0.(logFlush); ok {
+			w.Flush()
+			close(done)
+			continue
+		}
+
+		prefix = append(prefix[:0], '[')
+		prefix = record.when.AppendFormat(prefix, "2006-01-02 15:04:05")
+		prefix = append(prefix, "] ["...)
+		prefix = append(prefix, logLevelNames[record.level]...)
+		prefix = append(prefix, "] "...)
+		w.Write(prefix)
+		switch arg0 := record.arg0.(type) {
+		case string:
+			fmt.Fprintf(w, arg0, record.args...)
+		case func() string:
+			// log4go's lazy messages
+			w.WriteString(arg0())
+		default:
+			fmt.Fprint(w, arg0)
+		}
+		w.WriteByte('\n')
+	}
+}
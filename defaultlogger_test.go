@@ -0,0 +1,221 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import (
+	"bytes"
+	"fmt"
+	"io/ioutil"
+	"os"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"testing"
+	"time"
+)
+
+// lockedBuffer collects log output, blocking writes while held.
+type lockedBuffer struct {
+	sync.Mutex
+	bytes.Buffer
+}
+
+func (b *lockedBuffer) Write(p []byte) (int, error) {
+	b.Lock()
+	defer b.Unlock()
+	return b.Buffer.Write(p)
+}
+
+func (b *lockedBuffer) lines(marker string) []string {
+	b.Lock()
+	defer b.Unlock()
+	lines := make([]string, 0)
+	for _, line := range strings.Split(b.String(), "\n") {
+		if strings.Contains(line, marker) {
+			lines = append(lines, line)
+		}
+	}
+	return lines
+}
+
+func TestDefaultLogger(t *testing.T) {
+	defer func(level LogLevel) { MinLogLevel = level }(MinLogLevel)
+	out := &lockedBuffer{}
+	SetLogOutput(out)
+	defer SetLogOutput(os.Stdout)
+	dl := &DefaultLogger{}
+
+	MinLogLevel = LogInfo
+	dl.Debug("logtest hidden")
+	dl.Info("logtest %d %s", 1, "shown")
+	dl.Warn(func() string { return "logtest lazy" })
+	if dl.Enabled(LogDebug) || !dl.Enabled(LogWarn) || logEnabled(dl, LogFine) {
+		t.Errorf("Levels not gated")
+	}
+	FlushLog()
+	lines := out.lines("logtest")
+	if len(lines) != 2 || !strings.HasSuffix(lines[0], "[INFO] logtest 1 shown") ||
+		!strings.HasSuffix(lines[1], "[WARN] logtest lazy") {
+		t.Errorf("Unexpected output %q", lines)
+	}
+
+	// many writers at once, each in order
+	MinLogLevel = LogDebug
+	var wg sync.WaitGroup
+	for w := 0; w < 8; w++ {
+		wg.Add(1)
+		go func(w int) {
+			defer wg.Done()
+			for i := 0; i < 2000; i++ {
+				dl.Error("logorder %d %d", w, i)
+			}
+		}(w)
+	}
+	wg.Wait()
+	FlushLog()
+	next := make([]int, 8)
+	lines = out.lines("logorder")
+	for _, line := range lines {
+		var w, i int
+		fmt.Sscanf(line[strings.Index(line, "logorder"):], "logorder %d %d", &w, &i)
+		if i != next[w] {
+			t.Fatalf("Writer %d: message %d out of order", w, i)
+		}
+		next[w]++
+	}
+	if len(lines) != 8*2000 {
+		t.Errorf("%d of %d messages written", len(lines), 8*2000)
+	}
+
+	// with the output stalled, debug messages are dropped rather than
+	// waited on
+	out.Lock()
+	dl.Info("logstall first")
+	time.Sleep(50 * time.Millisecond)
+	for i := 0; i < 2*logQueueSize; i++ {
+		dl.Debug("logstall %d", i)
+	}
+	out.Unlock()
+	FlushLog()
+	if n := len(out.lines("logstall")); n > logQueueSize+1 || n < logQueueSize/2 {
+		t.Errorf("%d messages written with the output stalled", n)
+	}
+	if len(out.lines("Dropped")) == 0 {
+		t.Errorf("Dropped messages not reported")
+	}
+
+	if level, err := ParseLogLevel("debug"); err != nil || level != LogDebug {
+		t.Errorf("Parsed debug as %d, %v", level, err)
+	}
+	if _, err := ParseLogLevel("loud"); err == nil {
+		t.Errorf("Unknown level parsed")
+	}
+}
+
+// syncLogger writes each message as it is logged, as DefaultLogger used to.
+type syncLogger struct{ DefaultLogger }
+
+func (sl *syncLogger) Debug(arg0 interface{}, args ...interface{}) {
+	prefix := fmt.Sprintf("[%v] [%s] ", time.Now().Format("2006-01-02 15:04:05"), "DEBG")
+	fmt.Fprintf(logOutput.Load().(*logWriter), prefix+arg0.(string)+"\n", args...)
+}
+
+func (sl *syncLogger) Enabled(level LogLevel) bool {
+	return true
+}
+
+// BenchmarkLoadFullHashes loads a list of 100k full hashes, logging each
+// to a file at debug level.
+func BenchmarkLoadFullHashes(b *testing.B) {
+	defer func(level LogLevel) { MinLogLevel = level }(MinLogLevel)
+	dir, err := ioutil.TempDir("", "safebrowsing")
+	if err != nil {
+		b.Fatal(err)
+	}
+	defer os.RemoveAll(dir)
+	out, err := os.Create(dir + "/log")
+	if err != nil {
+		b.Fatal(err)
+	}
+	defer out.Close()
+	SetLogOutput(out)
+	defer SetLogOutput(os.Stdout)
+
+	hashes := bytes.Repeat([]byte("0123456789abcdef0123456789abcdef"), 100000)
+	for i := 0; i < len(hashes); i += PREFIX_32B_SZ {
+		hashes[i], hashes[i+1], hashes[i+2] = byte(i), byte(i>>8), byte(i>>16)
+	}
+	chunk := addChunk(1, string(hashes))
+	chunk.PrefixType = PREFIX_32B.Enum()
+
+	for _, mode := range []struct {
+		name   string
+		level  LogLevel
+		logger logger
+	}{
+		{"Sync", LogDebug, &syncLogger{}},
+		{"DebugOn", LogDebug, &DefaultLogger{}},
+		{"DebugOff", LogInfo, &DefaultLogger{}},
+	} {
+		b.Run(mode.name, func(b *testing.B) {
+			MinLogLevel = mode.level
+			for i := 0; i < b.N; i++ {
+				sbl := newSafeBrowsingList("test", dir+"/test.dat")
+				sbl.Logger = mode.logger
+				sbl.tmpLookup = NewTrie()
+				sbl.tmpFullHashes = NewTrie()
+				sbl.tmpFullHashRequested = NewTrie()
+				sbl.updateLookupMap(chunk)
+				FlushLog()
+			}
+			// how many of the messages made it
+			data, _ := ioutil.ReadFile(out.Name())
+			out.Truncate(0)
+			out.Seek(0, 0)
+			b.ReportMetric(float64(bytes.Count(data, []byte("Adding full length")))/float64(b.N), "logged/op")
+		})
+	}
+}
+
+func TestLogRingPushNeverBlocks(t *testing.T) {
+	// the reader went idle again with an earlier wake-up still pending
+	r := newLogRing()
+	r.wake <- struct{}{}
+	atomic.StoreInt32(&r.idle, 1)
+
+	pushed := make(chan bool)
+	go func() { pushed <- r.push(time.Now(), LogInfo, "logwake", nil) }()
+	select {
+	case ok := <-pushed:
+		if !ok {
+			t.Errorf("Message not queued")
+		}
+	case <-time.After(time.Second):
+		t.Fatalf("Push blocked on waking the reader")
+	}
+	if record, ok := r.pop(); !ok || record.arg0 != "logwake" {
+		t.Errorf("Unexpected record %+v", record)
+	}
+}
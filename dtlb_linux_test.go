@@ -0,0 +1,70 @@
+package safebrowsing
+
+import (
+	"encoding/binary"
+	"syscall"
+	"unsafe"
+)
+
+// perfEventAttr is the leading, version 0 part of struct perf_event_attr.
+type perfEventAttr struct {
+	Type         uint32
+	Size         uint32
+	Config       uint64
+	SamplePeriod uint64
+	SampleType   uint64
+	ReadFormat   uint64
+	Flags        uint64
+	WakeupEvents uint32
+	BpType       uint32
+	Config1      uint64
+}
+
+const (
+	perfTypeHWCache = 3
+	// PERF_COUNT_HW_CACHE_DTLB | OP_READ << 8 | RESULT_MISS << 16
+	perfDTLBReadMiss = 3 | 0<<8 | 1<<16
+	// exclude_kernel | exclude_hv
+	perfExcludeKernelHV = 1<<5 | 1<<6
+)
+
+// dtlbCounter counts the data TLB read misses of the calling thread.
+type dtlbCounter struct {
+	fd int
+}
+
+func openDTLBCounter() *dtlbCounter {
+	attr := perfEventAttr{
+		Type:   perfTypeHWCache,
+		Size:   uint32(unsafe.Sizeof(perfEventAttr{})),
+		Config: perfDTLBReadMiss,
+		Flags:  perfExcludeKernelHV,
+	}
+	fd, _, errno := syscall.Syscall6(syscall.SYS_PERF_EVENT_OPEN,
+		uintptr(unsafe.Pointer(&attr)), 0, ^uintptr(0), ^uintptr(0), 0, 0)
+	if errno != 0 {
+		return &dtlbCounter{fd: -1}
+	}
+	return &dtlbCounter{fd: int(fd)}
+}
+
+func (c *dtlbCounter) Valid() bool {
+	return c.fd >= 0
+}
+
+func (c *dtlbCounter) Read() uint64 {
+	if c.fd < 0 {
+		return 0
+	}
+	buf := make([]byte, 8)
+	if n, err := syscall.Read(c.fd, buf); err != nil || n != 8 {
+		return 0
+	}
+	return binary.LittleEndian.Uint64(buf)
+}
+
+func (c *dtlbCounter) Close() {
+	if c.fd >= 0 {
+		syscall.Close(c.fd)
+	}
+}
@@ -0,0 +1,13 @@
+//go:build !linux
+// +build !linux
+
+package safebrowsing
+
+// dtlbCounter is only implemented on Linux, elsewhere it counts nothing.
+type dtlbCounter struct{}
+
+func openDTLBCounter() *dtlbCounter { return &dtlbCounter{} }
+
+func (c *dtlbCounter) Valid() bool  { return false }
+func (c *dtlbCounter) Read() uint64 { return 0 }
+func (c *dtlbCounter) Close()       {}
@@ -0,0 +1,165 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import (
+	"context"
+	"encoding/hex"
+	"time"
+)
+
+// Explanation records how a single lookup was answered: what the URL was
+// checked as, every probe made and where the time went.  It is filled in by
+// the same code path as IsListed and MightBeListed, which skip all of it
+// when not explaining.
+type Explanation struct {
+	Url        string      `json:"url"`
+	Canonical  string      `json:"canonical"`
+	Candidates []Candidate `json:"candidates"`
+	// in the order they were made
+	Probes []Probe `json:"probes"`
+	// requests for full hashes, at most one per list
+	Gethashes []Gethash `json:"gethashes,omitempty"`
+
+	List          string `json:"list,omitempty"`
+	FullHashMatch bool   `json:"fullHashMatch"`
+	Error         string `json:"error,omitempty"`
+
+	// nanoseconds spent on each phase; Probe excludes the gethash request
+	CanonicalizeTime time.Duration `json:"canonicalizeNs"`
+	HashTime         time.Duration `json:"hashNs"`
+	ProbeTime        time.Duration `json:"probeNs"`
+	NetworkTime      time.Duration `json:"networkNs"`
+
+	mark         time.Time
+	requestStart time.Time
+}
+
+// Candidate is one of the expressions a URL is checked as.
+type Candidate struct {
+	Expression string `json:"expression"`
+	Prefix     string `json:"prefix"` // hex
+}
+
+// Probe is a single check of a candidate against one of a list's
+// structures: cache, fullHashes, prefixes, fullHashRequested, or
+// snapshotFullHashes and snapshotPrefixes with progressive startup.
+type Probe struct {
+	List      string `json:"list"`
+	Candidate int    `json:"candidate"`
+	Structure string `json:"structure"`
+	Hit       bool   `json:"hit"`
+	Detail    string `json:"detail,omitempty"`
+}
+
+// Gethash is a request for full hashes a lookup had to make.
+type Gethash struct {
+	List     string `json:"list"`
+	Prefixes int    `json:"prefixes"`
+	Error    string `json:"error,omitempty"`
+}
+
+// Explain looks up a URL as MightBeListed does, returning how it went.
+func (sb *SafeBrowsing) Explain(url string) *Explanation {
+	return sb.explain(url, false)
+}
+
+// ExplainIsListed looks up a URL as IsListed does, which may request full
+// hashes, returning how it went.
+func (sb *SafeBrowsing) ExplainIsListed(url string) *Explanation {
+	return sb.explain(url, true)
+}
+
+func (sb *SafeBrowsing) explain(url string, matchFullHash bool) *Explanation {
+	ex := &Explanation{
+		Url:        url,
+		Candidates: []Candidate{},
+		Probes:     []Probe{},
+	}
+	list, full, _, err := sb.explainUrl(context.Background(), url, matchFullHash, ex)
+	ex.List = list
+	ex.FullHashMatch = full
+	if err != nil {
+		ex.Error = err.Error()
+	}
+	if !ex.mark.IsZero() {
+		ex.ProbeTime = time.Since(ex.mark) - ex.NetworkTime
+	}
+	return ex
+}
+
+// The methods below are no-ops on a nil Explanation.
+
+func (ex *Explanation) start() {
+	if ex != nil {
+		ex.mark = time.Now()
+	}
+}
+
+func (ex *Explanation) canonicalized(url string, candidates []string) {
+	if ex == nil {
+		return
+	}
+	ex.CanonicalizeTime = time.Since(ex.mark)
+	ex.Canonical = url
+	for _, c := range candidates {
+		ex.Candidates = append(ex.Candidates, Candidate{Expression: c})
+	}
+	ex.mark = time.Now()
+}
+
+func (ex *Explanation) hashed(hashes []LookupHash) {
+	if ex == nil {
+		return
+	}
+	ex.HashTime = time.Since(ex.mark)
+	for i, hash := range hashes {
+		ex.Candidates[i].Prefix = hex.EncodeToString([]byte(hash[:PREFIX_4B_SZ]))
+	}
+	ex.mark = time.Now()
+}
+
+func (ex *Explanation) probe(list string, candidate int, structure string, hit bool, detail string) {
+	if ex != nil {
+		ex.Probes = append(ex.Probes, Probe{list, candidate, structure, hit, detail})
+	}
+}
+
+func (ex *Explanation) startRequest(list string, prefixes int) {
+	if ex != nil {
+		ex.Gethashes = append(ex.Gethashes, Gethash{List: list, Prefixes: prefixes})
+		ex.requestStart = time.Now()
+	}
+}
+
+func (ex *Explanation) finishRequest(err error) {
+	if ex == nil {
+		return
+	}
+	ex.NetworkTime += time.Since(ex.requestStart)
+	if err != nil {
+		ex.Gethashes[len(ex.Gethashes)-1].Error = err.Error()
+	}
+}
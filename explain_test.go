@@ -0,0 +1,119 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import (
+	"encoding/hex"
+	"sync"
+	"testing"
+	"time"
+)
+
+func TestExplain(t *testing.T) {
+	candidates := GenerateTestCandidates(Canonicalize("http://test.com/evil"))
+	hash := getHash(candidates[len(candidates)-1])
+	chunkData := "600\n" + "googpub-phish-shavar:32:1\n" + string(hash)
+
+	sb := &SafeBrowsing{
+		LastUpdated: time.Now(),
+		Lists: map[string]*SafeBrowsingList{
+			"googpub-phish-shavar": &SafeBrowsingList{
+				Name:              "googpub-phish-shavar",
+				Lookup:            NewTrie(),
+				FullHashRequested: NewTrie(),
+				FullHashes:        NewTrie(),
+				Cache:             make(map[FullHash]*FullHashCache),
+				Logger:            new(DefaultLogger),
+				fsLock:            new(sync.Mutex),
+			},
+		},
+		Logger:  new(DefaultLogger),
+		request: NewMockRequest(chunkData),
+	}
+	sb.Lists["googpub-phish-shavar"].Lookup.Set(string(hash[:PREFIX_4B_SZ]))
+
+	ex := sb.Explain("http://TEST.com/evil")
+	if ex.Canonical != "http://test.com/evil" || len(ex.Candidates) != len(candidates) {
+		t.Fatalf("Unexpected canonical form or candidates: %+v", ex)
+	}
+	// candidates can repeat, the lookup stops at the first
+	last := 0
+	for candidates[last] != candidates[len(candidates)-1] {
+		last++
+	}
+	if ex.Candidates[last].Prefix != hex.EncodeToString([]byte(hash[:PREFIX_4B_SZ])) {
+		t.Errorf("Unexpected candidate prefix %s", ex.Candidates[last].Prefix)
+	}
+	// a miss on both structures for every candidate before it, which hits
+	// the prefixes
+	if len(ex.Probes) != 2*(last+1) {
+		t.Fatalf("Unexpected probes: %+v", ex.Probes)
+	}
+	if p := ex.Probes[len(ex.Probes)-1]; p.Structure != "prefixes" || !p.Hit || p.Candidate != last {
+		t.Errorf("Unexpected final probe %+v", p)
+	}
+	if ex.List != "googpub-phish-shavar" || ex.FullHashMatch || len(ex.Gethashes) != 0 {
+		t.Errorf("Unexpected result from Explain: %+v", ex)
+	}
+
+	ex = sb.ExplainIsListed("http://test.com/evil")
+	if len(ex.Gethashes) != 1 || ex.Gethashes[0].Prefixes != 1 || ex.Gethashes[0].Error != "" {
+		t.Fatalf("Expected a single gethash, got %+v", ex.Gethashes)
+	}
+	if p := ex.Probes[len(ex.Probes)-1]; p.Structure != "fullHashes" || !p.Hit {
+		t.Errorf("Unexpected final probe %+v", p)
+	}
+	if ex.List != "googpub-phish-shavar" || !ex.FullHashMatch || ex.Error != "" {
+		t.Errorf("Unexpected result from ExplainIsListed: %+v", ex)
+	}
+	if ex.CanonicalizeTime <= 0 || ex.HashTime <= 0 || ex.ProbeTime <= 0 || ex.NetworkTime <= 0 {
+		t.Errorf("Missing timings: %+v", ex)
+	}
+
+	// the full hash is cached now, no further request
+	ex = sb.ExplainIsListed("http://test.com/evil")
+	if len(ex.Gethashes) != 0 || !ex.FullHashMatch {
+		t.Errorf("Expected the cached full hash to match, got %+v", ex)
+	}
+	found := false
+	for _, p := range ex.Probes {
+		found = found || (p.Structure == "cache" && p.Hit)
+	}
+	if !found {
+		t.Errorf("Cache probe not recorded: %+v", ex.Probes)
+	}
+}
+
+func BenchmarkQueryUrl(b *testing.B) {
+	sb := &SafeBrowsing{
+		Lists: map[string]*SafeBrowsingList{
+			"test": newSafeBrowsingList("test", ""),
+		},
+	}
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		sb.MightBeListed("http://www.example.com/a/b/c?d=e")
+	}
+}
@@ -0,0 +1,647 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import (
+	"bytes"
+	"encoding/binary"
+	"encoding/json"
+	"fmt"
+	"io"
+	"io/ioutil"
+	"net/http"
+	"os"
+	"strconv"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"time"
+)
+
+// Fleet distribution lets one node (the builder) update from the safe
+// browsing servers and every other node (the followers) copy its lists
+// instead.
+//
+// The builder publishes a version of a list whenever its index snapshot
+// changes, keeping the latest snapshot and a delta from each of the last
+// few versions to the next in DataDir/fleet.  FleetBuilder serves them over
+// HTTP:
+//
+//	manifest             the current version, size and digests of each list
+//	<list>/<n>.idx       the snapshot of version n, while it is current
+//	<list>/<n>.delta     the changes from version n to n+1
+//
+// Followers poll the manifest, and bring each list up to date by applying
+// deltas to a copy of their tries, or by fetching the whole snapshot when
+// they are too far behind.  Every step is checked against the trie digests,
+// and the result swapped in at once, as load() does.
+
+// FollowBuilder, when set, makes NewSafeBrowsing follow the builder serving
+// at this URL (where its FleetBuilder handler is mounted) rather than
+// update from the safe browsing servers.  Requests for full hashes still go
+// to the servers.
+var FollowBuilder string = ""
+
+// How often followers check the builder for new versions.
+var FleetPollInterval = 30 * time.Second
+
+// The most a follower will read of any file from the builder, well over a
+// snapshot of the full lists.
+var FleetMaxFileSize int64 = 256 << 20
+
+// FleetVersion describes a published version of a list.
+type FleetVersion struct {
+	Version        uint64 `json:"version"`
+	Prefixes       uint64 `json:"prefixes"`
+	FullHashes     uint64 `json:"fullHashes"`
+	PrefixDigest   uint64 `json:"prefixDigest"`
+	FullHashDigest uint64 `json:"fullHashDigest"`
+}
+
+// FleetManifest is what a builder currently publishes.
+type FleetManifest struct {
+	LastUpdated time.Time               `json:"lastUpdated"`
+	UpdateDelay int                     `json:"updateDelay"`
+	Lists       map[string]FleetVersion `json:"lists"`
+}
+
+func (v FleetVersion) sameContents(header *SnapshotHeader) bool {
+	return v.Prefixes == header.Prefixes && v.FullHashes == header.FullHashes &&
+		v.PrefixDigest == header.PrefixDigest && v.FullHashDigest == header.FullHashDigest
+}
+
+const deltaMagic = "SBDL"
+const deltaVersion = 1
+
+// DeltaHeader starts a delta between two versions of a list.  It is followed
+// by the sorted removed prefixes, added prefixes, removed full hashes and
+// added full hashes.
+type DeltaHeader struct {
+	Magic              [4]byte
+	Version            uint32
+	From               uint64
+	To                 uint64
+	FromPrefixDigest   uint64
+	FromFullHashDigest uint64
+	ToPrefixes         uint64
+	ToFullHashes       uint64
+	ToPrefixDigest     uint64
+	ToFullHashDigest   uint64
+	RemovedPrefixes    uint64
+	AddedPrefixes      uint64
+	RemovedFullHashes  uint64
+	AddedFullHashes    uint64
+}
+
+// diffKeys compares two sorted runs of keys, returning the keys only in old
+// and those only in new.
+func diffKeys(old []byte, new []byte, keyLen int) (removed []byte, added []byte) {
+	i, j := 0, 0
+	for i < len(old) && j < len(new) {
+		switch c := bytes.Compare(old[i:i+keyLen], new[j:j+keyLen]); {
+		case c < 0:
+			removed = append(removed, old[i:i+keyLen]...)
+			i += keyLen
+		case c > 0:
+			added = append(added, new[j:j+keyLen]...)
+			j += keyLen
+		default:
+			i += keyLen
+			j += keyLen
+		}
+	}
+	return append(removed, old[i:]...), append(added, new[j:]...)
+}
+
+// delta is a parsed delta.
+type delta struct {
+	header                             DeltaHeader
+	removedPrefixes, addedPrefixes     []byte
+	removedFullHashes, addedFullHashes []byte
+}
+
+func writeDelta(fileName string, d *delta) error {
+	copy(d.header.Magic[:], deltaMagic)
+	d.header.Version = deltaVersion
+	d.header.RemovedPrefixes = uint64(len(d.removedPrefixes) / PREFIX_4B_SZ)
+	d.header.AddedPrefixes = uint64(len(d.addedPrefixes) / PREFIX_4B_SZ)
+	d.header.RemovedFullHashes = uint64(len(d.removedFullHashes) / PREFIX_32B_SZ)
+	d.header.AddedFullHashes = uint64(len(d.addedFullHashes) / PREFIX_32B_SZ)
+	return writeKeyFile(fileName, &d.header,
+		d.removedPrefixes, d.addedPrefixes, d.removedFullHashes, d.addedFullHashes)
+}
+
+// readDelta reads a fetched delta, trusting its counts only as far as the
+// data goes.
+func readDelta(data []byte) (*delta, error) {
+	r := bytes.NewReader(data)
+	d := &delta{}
+	if err := binary.Read(r, binary.BigEndian, &d.header); err != nil {
+		return nil, fmt.Errorf("Unable to read delta header: %s", err)
+	}
+	if string(d.header.Magic[:]) != deltaMagic {
+		return nil, fmt.Errorf("Not a delta")
+	}
+	if d.header.Version != deltaVersion {
+		return nil, fmt.Errorf("Unsupported delta version %d", d.header.Version)
+	}
+	for _, part := range []struct {
+		keys  *[]byte
+		count uint64
+		size  int
+	}{
+		{&d.removedPrefixes, d.header.RemovedPrefixes, PREFIX_4B_SZ},
+		{&d.addedPrefixes, d.header.AddedPrefixes, PREFIX_4B_SZ},
+		{&d.removedFullHashes, d.header.RemovedFullHashes, PREFIX_32B_SZ},
+		{&d.addedFullHashes, d.header.AddedFullHashes, PREFIX_32B_SZ},
+	} {
+		if part.count > uint64(r.Len())/uint64(part.size) {
+			return nil, fmt.Errorf("Truncated delta: %d keys of %d bytes in %d bytes",
+				part.count, part.size, r.Len())
+		}
+		*part.keys = make([]byte, part.count*uint64(part.size))
+		if _, err := io.ReadFull(r, *part.keys); err != nil {
+			return nil, fmt.Errorf("Truncated delta: %s", err)
+		}
+	}
+	return d, nil
+}
+
+// apply applies the delta to a list's prefixes and full hashes, which must
+// be the version it starts from.
+func (d *delta) apply(prefixes SetBackend, fullHashes SetBackend) error {
+	if prefixes.Digest() != d.header.FromPrefixDigest ||
+		fullHashes.Digest() != d.header.FromFullHashDigest {
+		return fmt.Errorf("Delta from version %d doesn't apply", d.header.From)
+	}
+	for _, part := range []struct {
+		trie  SetBackend
+		keys  []byte
+		size  int
+		apply func(h SetBackend, key string)
+	}{
+		{prefixes, d.removedPrefixes, PREFIX_4B_SZ, SetBackend.Delete},
+		{prefixes, d.addedPrefixes, PREFIX_4B_SZ, SetBackend.Set},
+		{fullHashes, d.removedFullHashes, PREFIX_32B_SZ, SetBackend.Delete},
+		{fullHashes, d.addedFullHashes, PREFIX_32B_SZ, SetBackend.Set},
+	} {
+		for i := 0; i+part.size <= len(part.keys); i += part.size {
+			part.apply(part.trie, string(part.keys[i:i+part.size]))
+		}
+	}
+	if uint64(prefixes.Size()) != d.header.ToPrefixes || prefixes.Digest() != d.header.ToPrefixDigest ||
+		uint64(fullHashes.Size()) != d.header.ToFullHashes || fullHashes.Digest() != d.header.ToFullHashDigest {
+		return fmt.Errorf("Delta to version %d doesn't match its digest", d.header.To)
+	}
+	return nil
+}
+
+// FleetBuilder publishes the lists of a SafeBrowsing instance to followers.
+// It is an http.Handler, to be mounted under a prefix with http.StripPrefix.
+type FleetBuilder struct {
+	sb  *SafeBrowsing
+	dir string
+	// how many deltas to keep for each list; followers further behind fetch
+	// the whole snapshot
+	Keep int
+
+	lock     sync.RWMutex
+	manifest FleetManifest
+}
+
+// NewFleetBuilder publishes from sb's data directory, picking up the
+// versions published by an earlier run.
+func NewFleetBuilder(sb *SafeBrowsing) (*FleetBuilder, error) {
+	fb := &FleetBuilder{
+		sb:       sb,
+		dir:      sb.DataDir + "/fleet",
+		Keep:     16,
+		manifest: FleetManifest{Lists: map[string]FleetVersion{}},
+	}
+	if err := os.MkdirAll(fb.dir, 0755); err != nil {
+		return nil, err
+	}
+	data, err := ioutil.ReadFile(fb.dir + "/manifest.json")
+	if err == nil {
+		err = json.Unmarshal(data, &fb.manifest)
+	}
+	if err != nil && !os.IsNotExist(err) {
+		return nil, fmt.Errorf("Unable to read fleet manifest: %s", err)
+	}
+	return fb, nil
+}
+
+func (fb *FleetBuilder) fileName(list string, version uint64, ext string) string {
+	return fmt.Sprintf("%s/%s-%d.%s", fb.dir, list, version, ext)
+}
+
+// Publish publishes a new version of each list whose index snapshot has
+// changed since the last.
+func (fb *FleetBuilder) Publish() error {
+	fb.lock.Lock()
+	defer fb.lock.Unlock()
+
+	changed := false
+	for name, sbl := range fb.sb.Lists {
+		published, exists := fb.manifest.Lists[name]
+		header, err := ReadSnapshotHeader(sbl.snapshotFileName())
+		if os.IsNotExist(err) || (err == nil && exists && published.sameContents(header)) {
+			continue
+		}
+		if err != nil {
+			return err
+		}
+		version, err := fb.publishList(name, sbl, published, exists)
+		if err != nil {
+			return fmt.Errorf("Unable to publish %s: %s", name, err)
+		}
+		fb.manifest.Lists[name] = version
+		changed = true
+		fb.sb.Logger.Info("Published version %d of %s", version.Version, name)
+	}
+
+	if changed || fb.manifest.LastUpdated != fb.sb.LastUpdated {
+		fb.manifest.LastUpdated = fb.sb.LastUpdated
+		fb.manifest.UpdateDelay = fb.sb.UpdateDelay
+		data, err := json.Marshal(&fb.manifest)
+		if err != nil {
+			return err
+		}
+		if err = writeKeyFile(fb.dir+"/manifest.json", nil, data); err != nil {
+			return err
+		}
+	}
+	return nil
+}
+
+func (fb *FleetBuilder) publishList(name string, sbl *SafeBrowsingList,
+	published FleetVersion, exists bool) (FleetVersion, error) {
+
+	header, prefixes, fullHashes, err := readSnapshot(sbl.snapshotFileName())
+	if err != nil {
+		return published, err
+	}
+	version := FleetVersion{
+		Version:        published.Version + 1,
+		Prefixes:       header.Prefixes,
+		FullHashes:     header.FullHashes,
+		PrefixDigest:   header.PrefixDigest,
+		FullHashDigest: header.FullHashDigest,
+	}
+
+	if exists {
+		_, oldPrefixes, oldFullHashes, err := readSnapshot(fb.fileName(name, published.Version, "idx"))
+		if err == nil {
+			d := &delta{header: DeltaHeader{
+				From:               published.Version,
+				To:                 version.Version,
+				FromPrefixDigest:   published.PrefixDigest,
+				FromFullHashDigest: published.FullHashDigest,
+				ToPrefixes:         version.Prefixes,
+				ToFullHashes:       version.FullHashes,
+				ToPrefixDigest:     version.PrefixDigest,
+				ToFullHashDigest:   version.FullHashDigest,
+			}}
+			d.removedPrefixes, d.addedPrefixes = diffKeys(oldPrefixes, prefixes, PREFIX_4B_SZ)
+			d.removedFullHashes, d.addedFullHashes = diffKeys(oldFullHashes, fullHashes, PREFIX_32B_SZ)
+			err = writeDelta(fb.fileName(name, published.Version, "delta"), d)
+		}
+		if err != nil {
+			// followers will have to fetch the snapshot
+			fb.sb.Logger.Warn("Unable to write delta for %s: %s", name, err)
+		}
+	}
+
+	if err = writeSnapshot(fb.fileName(name, version.Version, "idx"), header, prefixes, fullHashes); err != nil {
+		return published, err
+	}
+	if exists {
+		os.Remove(fb.fileName(name, published.Version, "idx"))
+	}
+	if version.Version > uint64(fb.Keep) {
+		os.Remove(fb.fileName(name, version.Version-uint64(fb.Keep)-1, "delta"))
+	}
+	return version, nil
+}
+
+// PublishLoop publishes any changes every interval, forever.
+func (fb *FleetBuilder) PublishLoop(interval time.Duration) {
+	for {
+		if err := fb.Publish(); err != nil {
+			fb.sb.Logger.Warn("Unable to publish lists: %s", err)
+		}
+		time.Sleep(interval)
+	}
+}
+
+// Manifest returns what is currently published.
+func (fb *FleetBuilder) Manifest() FleetManifest {
+	fb.lock.RLock()
+	defer fb.lock.RUnlock()
+	m := fb.manifest
+	m.Lists = make(map[string]FleetVersion, len(fb.manifest.Lists))
+	for name, v := range fb.manifest.Lists {
+		m.Lists[name] = v
+	}
+	return m
+}
+
+func (fb *FleetBuilder) ServeHTTP(w http.ResponseWriter, r *http.Request) {
+	path := strings.TrimPrefix(r.URL.Path, "/")
+	if path == "manifest" {
+		w.Header().Set("Content-Type", "application/json")
+		json.NewEncoder(w).Encode(fb.Manifest())
+		return
+	}
+
+	// <list>/<version>.<idx|delta>, for a list we publish
+	bits := strings.Split(path, "/")
+	if len(bits) != 2 {
+		http.NotFound(w, r)
+		return
+	}
+	if _, exists := fb.Manifest().Lists[bits[0]]; !exists {
+		http.NotFound(w, r)
+		return
+	}
+	dot := strings.LastIndex(bits[1], ".")
+	if dot < 0 {
+		http.NotFound(w, r)
+		return
+	}
+	version, err := strconv.ParseUint(bits[1][:dot], 10, 64)
+	ext := bits[1][dot+1:]
+	if err != nil || (ext != "idx" && ext != "delta") {
+		http.NotFound(w, r)
+		return
+	}
+	f, err := os.Open(fb.fileName(bits[0], version, ext))
+	if err != nil {
+		http.NotFound(w, r)
+		return
+	}
+	defer f.Close()
+	info, err := f.Stat()
+	if err != nil {
+		http.Error(w, err.Error(), http.StatusInternalServerError)
+		return
+	}
+	w.Header().Set("Content-Type", "application/octet-stream")
+	http.ServeContent(w, r, "", info.ModTime(), f)
+}
+
+// startFollowing sets up the lists from what an earlier run followed and
+// brings them up to date from the builder, then keeps them there.
+func (sb *SafeBrowsing) startFollowing() error {
+	for listName, _ := range SupportedLists {
+		sbl := newSafeBrowsingList(listName, sb.DataDir+"/"+listName+".dat")
+		sbl.Logger = sb.Logger
+		if err := sbl.loadFollowed(); err != nil && !os.IsNotExist(err) {
+			sb.Logger.Warn("Unable to load followed %s, fetching it again: %s", listName, err)
+		}
+		sb.Lists[listName] = sbl
+	}
+	sb.followBuilder = FollowBuilder
+	sb.followStop = make(chan struct{})
+	err := sb.syncFleet()
+	go sb.followLoop(FleetPollInterval, sb.followStop)
+	return err
+}
+
+func (sb *SafeBrowsing) followLoop(interval time.Duration, stop chan struct{}) {
+	ticker := time.NewTicker(interval)
+	defer ticker.Stop()
+	for {
+		select {
+		case <-stop:
+			return
+		case <-ticker.C:
+		}
+		if err := sb.syncFleet(); err != nil {
+			sb.Logger.Warn("Unable to follow %s: %s", sb.followBuilder, err)
+		}
+	}
+}
+
+// StopFollowing stops polling the builder, leaving the lists as they are.
+func (sb *SafeBrowsing) StopFollowing() {
+	if sb.followStop != nil {
+		close(sb.followStop)
+		sb.followStop = nil
+	}
+}
+
+func (sb *SafeBrowsing) fleetGet(path string) ([]byte, error) {
+	response, err := sb.request(strings.TrimSuffix(sb.followBuilder, "/")+"/"+path, "", false)
+	if err != nil {
+		return nil, err
+	}
+	defer response.Body.Close()
+	if response.StatusCode != 200 {
+		return nil, fmt.Errorf("Unexpected builder response code for %s: %d", path, response.StatusCode)
+	}
+	if response.ContentLength > FleetMaxFileSize {
+		return nil, fmt.Errorf("Builder's %s is %d bytes, over FleetMaxFileSize", path, response.ContentLength)
+	}
+	data, err := ioutil.ReadAll(io.LimitReader(response.Body, FleetMaxFileSize+1))
+	if err == nil && int64(len(data)) > FleetMaxFileSize {
+		err = fmt.Errorf("Builder's %s is over FleetMaxFileSize", path)
+	}
+	return data, err
+}
+
+// syncFleet brings every list up to the builder's current version.
+func (sb *SafeBrowsing) syncFleet() error {
+	data, err := sb.fleetGet("manifest")
+	if err != nil {
+		return err
+	}
+	manifest := FleetManifest{}
+	if err = json.Unmarshal(data, &manifest); err != nil {
+		return fmt.Errorf("Unable to read fleet manifest: %s", err)
+	}
+
+	for name, version := range manifest.Lists {
+		sbl, exists := sb.Lists[name]
+		if !exists {
+			continue
+		}
+		if serr := sbl.follow(sb, version); serr != nil {
+			sb.Logger.Warn("Unable to follow %s: %s", name, serr)
+			err = serr
+		}
+	}
+	if err == nil {
+		// as fresh as the builder
+		sb.UpdateDelay = manifest.UpdateDelay
+		sb.LastUpdated = manifest.LastUpdated
+	}
+	return err
+}
+
+// follow brings a list up to the given version, applying deltas when they
+// reach that far and fetching the whole snapshot otherwise.
+func (sbl *SafeBrowsingList) follow(sb *SafeBrowsing, version FleetVersion) error {
+	current := sbl.fleetVersion
+	if current == version {
+		return nil
+	}
+
+	var prefixes, fullHashes SetBackend
+	applied := false
+	if current.Version > 0 && current.Version < version.Version &&
+		version.Version-current.Version <= uint64(maxFleetDeltas) {
+		prefixes, fullHashes = sbl.Lookup.Clone(), sbl.fleetFullHashes.Clone()
+		err := sbl.applyDeltas(sb, prefixes, fullHashes, current.Version, version)
+		if err != nil {
+			sbl.Logger.Info("Deltas for %s didn't apply, fetching the snapshot: %s", sbl.Name, err)
+		}
+		applied = err == nil
+	}
+	if !applied {
+		data, err := sb.fleetGet(fmt.Sprintf("%s/%d.idx", sbl.Name, version.Version))
+		if err != nil {
+			return err
+		}
+		header, p, f, err := readSnapshotFrom(bytes.NewReader(data), int64(len(data)), sbl.Name)
+		if err != nil {
+			return err
+		}
+		if !version.sameContents(header) {
+			return fmt.Errorf("Snapshot of %s doesn't match the manifest", sbl.Name)
+		}
+		prefixes, fullHashes = triesFromKeys(sbl.Name, p, f, newUpdatePacer())
+	}
+
+	sbl.swapFollowed(version, prefixes, fullHashes)
+	return nil
+}
+
+// applyDeltas applies the deltas from version from up to version to.
+func (sbl *SafeBrowsingList) applyDeltas(sb *SafeBrowsing, prefixes SetBackend, fullHashes SetBackend,
+	from uint64, to FleetVersion) error {
+
+	for v := from; v < to.Version; v++ {
+		data, err := sb.fleetGet(fmt.Sprintf("%s/%d.delta", sbl.Name, v))
+		if err != nil {
+			return err
+		}
+		d, err := readDelta(data)
+		if err != nil {
+			return err
+		}
+		if d.header.From != v || d.header.To != v+1 {
+			return fmt.Errorf("Delta %d is from version %d to %d", v, d.header.From, d.header.To)
+		}
+		if err = d.apply(prefixes, fullHashes); err != nil {
+			return err
+		}
+	}
+	if uint64(prefixes.Size()) != to.Prefixes || prefixes.Digest() != to.PrefixDigest ||
+		uint64(fullHashes.Size()) != to.FullHashes || fullHashes.Digest() != to.FullHashDigest {
+		return fmt.Errorf("Deltas don't arrive at the manifest's version %d", to.Version)
+	}
+	return nil
+}
+
+// How many deltas a follower applies before it fetches the snapshot
+// instead.
+var maxFleetDeltas = 16
+
+// triesFromKeys builds the prefix and full hash sets of a list from the keys
+// of a snapshot.
+func triesFromKeys(list string, prefixes []byte, fullHashes []byte, pace *updatePacer) (SetBackend, SetBackend) {
+	p, f := newListSet(list, RoleLookup), newListSet(list, RoleFullHashes)
+	for i := 0; i+PREFIX_4B_SZ <= len(prefixes); i += PREFIX_4B_SZ {
+		p.Set(string(prefixes[i : i+PREFIX_4B_SZ]))
+		pace.step(1)
+	}
+	for i := 0; i+PREFIX_32B_SZ <= len(fullHashes); i += PREFIX_32B_SZ {
+		f.Set(string(fullHashes[i : i+PREFIX_32B_SZ]))
+		pace.step(1)
+	}
+	p.Freeze()
+	f.Freeze()
+	return p, f
+}
+
+// swapFollowed makes a new version the list's, and saves it so the next run
+// can carry on from it.  The full hashes of the version are kept apart from
+// those gethash responses add, as deltas apply to the former.
+func (sbl *SafeBrowsingList) swapFollowed(version FleetVersion, prefixes SetBackend, fullHashes SetBackend) {
+	sbl.fsLock.Lock()
+	defer sbl.fsLock.Unlock()
+
+	sbl.Lookup = prefixes
+	sbl.FullHashes = fullHashes.Clone()
+	sbl.FullHashRequested = newListSet(sbl.Name, RoleFullHashRequested)
+	sbl.fleetFullHashes = fullHashes
+	sbl.fleetVersion = version
+	atomic.StoreInt32(&sbl.loaded, 1)
+	sbl.dropSnapshot()
+	sbl.Logger.Info("Following version %d of %s", version.Version, sbl.Name)
+
+	if err := sbl.saveSnapshot(); err != nil {
+		sbl.Logger.Warn("Unable to save index snapshot for %s: %s", sbl.Name, err)
+		return
+	}
+	followed := []byte(strconv.FormatUint(version.Version, 10))
+	if err := writeKeyFile(sbl.followedFileName(), nil, followed); err != nil {
+		sbl.Logger.Warn("Unable to save followed version of %s: %s", sbl.Name, err)
+	}
+}
+
+func (sbl *SafeBrowsingList) followedFileName() string {
+	return strings.TrimSuffix(sbl.FileName, ".dat") + ".fleet"
+}
+
+// loadFollowed loads the version an earlier run followed, from its index
+// snapshot.
+func (sbl *SafeBrowsingList) loadFollowed() error {
+	data, err := ioutil.ReadFile(sbl.followedFileName())
+	if err != nil {
+		return err
+	}
+	v, err := strconv.ParseUint(strings.TrimSpace(string(data)), 10, 64)
+	if err != nil {
+		return err
+	}
+	header, prefixes, fullHashes, err := readSnapshot(sbl.snapshotFileName())
+	if err != nil {
+		return err
+	}
+
+	sbl.Lookup, sbl.fleetFullHashes = triesFromKeys(sbl.Name, prefixes, fullHashes, newUpdatePacer())
+	sbl.FullHashes = sbl.fleetFullHashes.Clone()
+	sbl.fleetVersion = FleetVersion{
+		Version:        v,
+		Prefixes:       header.Prefixes,
+		FullHashes:     header.FullHashes,
+		PrefixDigest:   header.PrefixDigest,
+		FullHashDigest: header.FullHashDigest,
+	}
+	atomic.StoreInt32(&sbl.loaded, 1)
+	return nil
+}
@@ -0,0 +1,251 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import (
+	"bytes"
+	"encoding/binary"
+	"io/ioutil"
+	"net/http"
+	"net/http/httptest"
+	"os"
+	"strings"
+	"sync"
+	"testing"
+	"time"
+)
+
+import proto "github.com/golang/protobuf/proto"
+
+func TestDiffKeys(t *testing.T) {
+	removed, added := diffKeys([]byte("aaaabbbbdddd"), []byte("bbbbcccceeee"), 4)
+	if string(removed) != "aaaadddd" || string(added) != "cccceeee" {
+		t.Errorf("Unexpected diff: removed %q, added %q", removed, added)
+	}
+}
+
+func TestReadDeltaCorrupt(t *testing.T) {
+	header := DeltaHeader{Version: deltaVersion, AddedPrefixes: 2}
+	copy(header.Magic[:], deltaMagic)
+	buf := bytes.Buffer{}
+	binary.Write(&buf, binary.BigEndian, &header)
+	buf.WriteString("aaaabbbb")
+	if d, err := readDelta(buf.Bytes()); err != nil || string(d.addedPrefixes) != "aaaabbbb" {
+		t.Fatalf("Unable to read delta: %v", err)
+	}
+
+	// counts beyond the data are refused before anything is allocated
+	for _, count := range []uint64{3, 1 << 40, ^uint64(0)} {
+		header.AddedPrefixes = count
+		buf.Reset()
+		binary.Write(&buf, binary.BigEndian, &header)
+		buf.WriteString("aaaabbbb")
+		if _, err := readDelta(buf.Bytes()); err == nil {
+			t.Errorf("Delta claiming %d prefixes read", count)
+		}
+	}
+}
+
+func TestFleetGetLimit(t *testing.T) {
+	defer func(limit int64) { FleetMaxFileSize = limit }(FleetMaxFileSize)
+	FleetMaxFileSize = 16
+
+	sb := &SafeBrowsing{followBuilder: "http://builder/fleet"}
+	sb.request = NewMockRequest(strings.Repeat("x", 16))
+	if data, err := sb.fleetGet("manifest"); err != nil || len(data) != 16 {
+		t.Errorf("Unable to fetch %d bytes: %v", len(data), err)
+	}
+	sb.request = NewMockRequest(strings.Repeat("x", 17))
+	if _, err := sb.fleetGet("manifest"); err == nil {
+		t.Errorf("Fetched more than FleetMaxFileSize")
+	}
+}
+
+// fleetTest runs a builder over HTTP, counting the requests for each kind of
+// file.
+type fleetTest struct {
+	builder  *SafeBrowsing
+	fb       *FleetBuilder
+	server   *httptest.Server
+	lock     sync.Mutex
+	requests map[string]int
+	dirs     []string
+}
+
+func newFleetTest(t *testing.T) *fleetTest {
+	ft := &fleetTest{requests: map[string]int{}}
+	ft.builder = &SafeBrowsing{
+		DataDir: ft.tempDir(t),
+		Lists:   map[string]*SafeBrowsingList{},
+		Logger:  new(DefaultLogger),
+	}
+	for name, _ := range SupportedLists {
+		ft.builder.Lists[name] = newSafeBrowsingList(name, ft.builder.DataDir+"/"+name+".dat")
+	}
+	var err error
+	if ft.fb, err = NewFleetBuilder(ft.builder); err != nil {
+		t.Fatal(err)
+	}
+	handler := http.StripPrefix("/fleet", ft.fb)
+	ft.server = httptest.NewServer(http.HandlerFunc(func(w http.ResponseWriter, r *http.Request) {
+		ft.lock.Lock()
+		ft.requests[r.URL.Path[strings.LastIndex(r.URL.Path, ".")+1:]]++
+		ft.lock.Unlock()
+		handler.ServeHTTP(w, r)
+	}))
+	return ft
+}
+
+func (ft *fleetTest) tempDir(t *testing.T) string {
+	dir, err := ioutil.TempDir("", "safebrowsing")
+	if err != nil {
+		t.Fatal(err)
+	}
+	ft.dirs = append(ft.dirs, dir)
+	return dir
+}
+
+func (ft *fleetTest) close() {
+	ft.server.Close()
+	for _, dir := range ft.dirs {
+		os.RemoveAll(dir)
+	}
+}
+
+// update loads chunks into every list of the builder and publishes them.
+func (ft *fleetTest) update(t *testing.T, chunks ...*ChunkData) {
+	for _, sbl := range ft.builder.Lists {
+		if err := sbl.load(chunks); err != nil {
+			t.Fatal(err)
+		}
+	}
+	ft.builder.LastUpdated = time.Now()
+	ft.builder.UpdateDelay = 1800
+	if err := ft.fb.Publish(); err != nil {
+		t.Fatal(err)
+	}
+}
+
+func (ft *fleetTest) counts() (snapshots int, deltas int) {
+	ft.lock.Lock()
+	defer ft.lock.Unlock()
+	snapshots, deltas = ft.requests["idx"], ft.requests["delta"]
+	ft.requests = map[string]int{}
+	return snapshots, deltas
+}
+
+func (ft *fleetTest) check(t *testing.T, follower *SafeBrowsing, version uint64) {
+	for name, sbl := range ft.builder.Lists {
+		followed := follower.Lists[name]
+		if followed.fleetVersion.Version != version {
+			t.Errorf("%s is following version %d, expected %d", name, followed.fleetVersion.Version, version)
+		}
+		if followed.Lookup.Digest() != sbl.Lookup.Digest() || followed.Lookup.Size() != sbl.Lookup.Size() ||
+			followed.FullHashes.Digest() != sbl.FullHashes.Digest() {
+			t.Errorf("%s doesn't match the builder", name)
+		}
+	}
+	if !follower.IsUpToDate() {
+		t.Errorf("Follower isn't up to date with the builder")
+	}
+}
+
+func TestFleet(t *testing.T) {
+	ft := newFleetTest(t)
+	defer ft.close()
+
+	defer func(builder string, interval time.Duration) {
+		FollowBuilder, FleetPollInterval = builder, interval
+	}(FollowBuilder, FleetPollInterval)
+	FollowBuilder, FleetPollInterval = ft.server.URL+"/fleet", time.Hour
+
+	fullHash := &ChunkData{
+		ChunkNumber: proto.Int32(3),
+		ChunkType:   CHUNK_TYPE_ADD.Enum(),
+		PrefixType:  PREFIX_32B.Enum(),
+		Hashes:      []byte("0123456789abcdef0123456789abcdef"),
+	}
+	ft.update(t, addChunk(1, "aaaabbbbcccc"), fullHash)
+
+	// a new follower fetches the snapshot
+	dir := ft.tempDir(t)
+	follower, err := NewSafeBrowsing("", dir)
+	if err != nil {
+		t.Fatal(err)
+	}
+	follower.StopFollowing()
+	ft.check(t, follower, 1)
+	if snapshots, deltas := ft.counts(); snapshots != len(SupportedLists) || deltas != 0 {
+		t.Errorf("Expected snapshots only, fetched %d snapshots and %d deltas", snapshots, deltas)
+	}
+
+	// and then deltas
+	sub := addChunk(2, "bbbb")
+	sub.ChunkType = CHUNK_TYPE_SUB.Enum()
+	ft.update(t, addChunk(4, "dddd"), sub)
+	ft.update(t, addChunk(5, "eeee"))
+	if err = follower.syncFleet(); err != nil {
+		t.Fatal(err)
+	}
+	ft.check(t, follower, 3)
+	if snapshots, deltas := ft.counts(); snapshots != 0 || deltas != 2*len(SupportedLists) {
+		t.Errorf("Expected deltas only, fetched %d snapshots and %d deltas", snapshots, deltas)
+	}
+
+	// a restarted follower carries on from where it was
+	follower, err = NewSafeBrowsing("", dir)
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer follower.StopFollowing()
+	ft.check(t, follower, 3)
+	if snapshots, deltas := ft.counts(); snapshots != 0 || deltas != 0 {
+		t.Errorf("Restarted follower fetched %d snapshots and %d deltas", snapshots, deltas)
+	}
+
+	// missing deltas fall back to the snapshot
+	ft.update(t, addChunk(6, "ffff"))
+	for name, _ := range SupportedLists {
+		os.Remove(ft.fb.fileName(name, 3, "delta"))
+	}
+	if err = follower.syncFleet(); err != nil {
+		t.Fatal(err)
+	}
+	ft.check(t, follower, 4)
+	if snapshots, _ := ft.counts(); snapshots != len(SupportedLists) {
+		t.Errorf("Expected to fetch snapshots, fetched %d", snapshots)
+	}
+
+	// a restarted builder keeps its versions
+	fb, err := NewFleetBuilder(ft.builder)
+	if err != nil {
+		t.Fatal(err)
+	}
+	for name, v := range fb.Manifest().Lists {
+		if v.Version != 4 {
+			t.Errorf("Restarted builder has %s at version %d", name, v.Version)
+		}
+	}
+}
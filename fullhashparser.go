@@ -0,0 +1,274 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import (
+	"bufio"
+	"bytes"
+	"fmt"
+	"io"
+	"sync"
+)
+
+// Limits on a gethash response, so that a broken or hostile one can't make
+// the parser hold more than a record at a time.
+const (
+	// bytes in the cache lifetime line or a record header
+	maxFullHashHeader = 256
+	// hashes in one record
+	maxFullHashesPerRecord = 1024
+	// bytes of metadata for one hash, and for all those of a record
+	maxFullHashMetadata       = 4096
+	maxFullHashRecordMetadata = 64 * 1024
+)
+
+// fullHashParser streams a gethash response: the cache lifetime on a line of
+// its own, then any number of records, each a "list:32:count[:m]" header
+// followed by count 32 byte hashes and, with the m, a "length\n" and that
+// many bytes of metadata for each hash in turn.
+//
+// Everything is read through one buffered reader into buffers kept from one
+// response to the next, so next returns slices into them that stay valid
+// until it is called again.
+type fullHashParser struct {
+	r *bufio.Reader
+
+	// the record being returned
+	list     []byte
+	hashes   []byte
+	metadata []byte
+	metaEnds []int // where each hash's metadata ends
+	next     int   // the next hash to return
+}
+
+var fullHashParsers = sync.Pool{
+	New: func() interface{} {
+		return &fullHashParser{r: bufio.NewReaderSize(nil, 4096)}
+	},
+}
+
+func newFullHashParser(r io.Reader) *fullHashParser {
+	p := fullHashParsers.Get().(*fullHashParser)
+	p.r.Reset(r)
+	p.hashes, p.metadata, p.metaEnds = p.hashes[:0], p.metadata[:0], p.metaEnds[:0]
+	p.next = 0
+	return p
+}
+
+// release returns the parser for another response.  None of what it
+// returned may be used afterwards.
+func (p *fullHashParser) release() {
+	p.r.Reset(nil)
+	fullHashParsers.Put(p)
+}
+
+// line reads up to the next newline, returning it without the newline.  It
+// returns io.EOF only at the very end of the response.
+func (p *fullHashParser) line() ([]byte, error) {
+	line, err := p.r.ReadSlice('\n')
+	switch {
+	case err == bufio.ErrBufferFull || len(line) > maxFullHashHeader:
+		return nil, fmt.Errorf("Malformated response: header too long")
+	case err == io.EOF && len(line) == 0:
+		return nil, io.EOF
+	case err == io.EOF:
+		return nil, fmt.Errorf("Malformated response: unable to find end of header")
+	case err != nil:
+		return nil, err
+	}
+	return line[:len(line)-1], nil
+}
+
+// parseCount parses a small decimal number without allocating.
+func parseCount(b []byte, max int) (int, bool) {
+	if len(b) == 0 {
+		return 0, false
+	}
+	n := 0
+	for _, c := range b {
+		if c < '0' || c > '9' {
+			return 0, false
+		}
+		n = n*10 + int(c-'0')
+		if n > max {
+			return 0, false
+		}
+	}
+	return n, true
+}
+
+// cacheLifeTime reads the first line of the response.  An empty response
+// has a lifetime of 0 and no records.
+func (p *fullHashParser) cacheLifeTime() (int, error) {
+	line, err := p.line()
+	if err == io.EOF {
+		return 0, nil
+	} else if err != nil {
+		return 0, err
+	}
+	lifeTime, ok := parseCount(line, 1<<30)
+	if !ok {
+		return 0, fmt.Errorf("Malformated response: cache lifetime %q", line)
+	}
+	return lifeTime, nil
+}
+
+// record reads the next record into the parser's buffers.
+func (p *fullHashParser) record() error {
+	header, err := p.line()
+	if err != nil {
+		return err
+	}
+	var fields [4][]byte
+	n := 0
+	rest := header
+	for ; n < len(fields)-1; n++ {
+		i := bytes.IndexByte(rest, ':')
+		if i < 0 {
+			break
+		}
+		fields[n], rest = rest[:i], rest[i+1:]
+	}
+	// any fifth field stays joined to the fourth, failing its check
+	fields[n] = rest
+	n++
+	if n != 3 && n != 4 || len(fields[0]) == 0 {
+		return fmt.Errorf("Malformated response: %q", header)
+	}
+	if hashLen, ok := parseCount(fields[1], PREFIX_32B_SZ); !ok || hashLen != PREFIX_32B_SZ {
+		return fmt.Errorf("Malformated response: %q", header)
+	}
+	count, ok := parseCount(fields[2], maxFullHashesPerRecord)
+	if !ok || count == 0 {
+		return fmt.Errorf("Malformated response: %q", header)
+	}
+	hasMetadata := n == 4
+	if hasMetadata && string(fields[3]) != "m" {
+		return fmt.Errorf("Malformated response: %q", header)
+	}
+	// the header is in the reader's buffer, which the reads below reuse
+	p.list = append(p.list[:0], fields[0]...)
+
+	if cap(p.hashes) < count*PREFIX_32B_SZ {
+		p.hashes = make([]byte, count*PREFIX_32B_SZ)
+	}
+	p.hashes = p.hashes[:count*PREFIX_32B_SZ]
+	if _, err = io.ReadFull(p.r, p.hashes); err != nil {
+		return fmt.Errorf("Malformated response: truncated hashes for %s", p.list)
+	}
+
+	p.metadata, p.metaEnds = p.metadata[:0], p.metaEnds[:0]
+	for i := 0; hasMetadata && i < count; i++ {
+		line, err := p.line()
+		if err == io.EOF {
+			return fmt.Errorf("Malformated response: unable to parse metadata length")
+		} else if err != nil {
+			return err
+		}
+		size, ok := parseCount(line, maxFullHashMetadata)
+		if !ok || len(p.metadata)+size > maxFullHashRecordMetadata {
+			return fmt.Errorf("Malformated response: metadata length %q", line)
+		}
+		start := len(p.metadata)
+		p.metadata = append(p.metadata, make([]byte, size)...)
+		if _, err = io.ReadFull(p.r, p.metadata[start:]); err != nil {
+			return fmt.Errorf("Malformated response: truncated metadata for %s", p.list)
+		}
+		p.metaEnds = append(p.metaEnds, len(p.metadata))
+	}
+	p.next = 0
+	return nil
+}
+
+// nextHash returns the list, hash and metadata (nil if there is none) of the
+// next full hash in the response, or io.EOF after the last.
+func (p *fullHashParser) nextHash() (list []byte, hash []byte, metadata []byte, err error) {
+	if p.next*PREFIX_32B_SZ >= len(p.hashes) {
+		if err = p.record(); err != nil {
+			return nil, nil, nil, err
+		}
+	}
+	i := p.next
+	p.next++
+	hash = p.hashes[i*PREFIX_32B_SZ : (i+1)*PREFIX_32B_SZ]
+	if len(p.metaEnds) > 0 {
+		start := 0
+		if i > 0 {
+			start = p.metaEnds[i-1]
+		}
+		metadata = p.metadata[start:p.metaEnds[i]]
+	}
+	return p.list, hash, metadata, nil
+}
+
+// metadataTable interns the metadata of full hashes, which takes few
+// distinct values, so that each cached hash holds just an index.  Index 0 is
+// no metadata.
+type metadataTable struct {
+	l      sync.RWMutex
+	ids    map[string]uint32
+	values []string
+}
+
+// Distinct metadata values past this many are dropped.
+const maxInternedMetadata = 1 << 16
+
+var fullHashMetadata = &metadataTable{
+	ids:    make(map[string]uint32),
+	values: []string{""},
+}
+
+func (t *metadataTable) intern(metadata []byte) uint32 {
+	if len(metadata) == 0 {
+		return 0
+	}
+	t.l.RLock()
+	id, ok := t.ids[string(metadata)]
+	t.l.RUnlock()
+	if ok {
+		return id
+	}
+	t.l.Lock()
+	defer t.l.Unlock()
+	if id, ok = t.ids[string(metadata)]; ok {
+		return id
+	}
+	if len(t.values) > maxInternedMetadata {
+		return 0
+	}
+	id = uint32(len(t.values))
+	t.values = append(t.values, string(metadata))
+	t.ids[t.values[id]] = id
+	return id
+}
+
+func (t *metadataTable) value(id uint32) string {
+	t.l.RLock()
+	defer t.l.RUnlock()
+	if int(id) >= len(t.values) {
+		return ""
+	}
+	return t.values[id]
+}
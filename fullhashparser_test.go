@@ -0,0 +1,284 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import (
+	"bytes"
+	"fmt"
+	"io"
+	"io/ioutil"
+	"math/rand"
+	"strconv"
+	"strings"
+	"testing"
+)
+
+type parsedFullHash struct {
+	list, hash, metadata string
+}
+
+// parseFullHashesSimply parses a whole gethash response held in memory, the
+// way the full hash code used to, as an oracle for the streaming parser.
+func parseFullHashesSimply(data string) (lifeTime int, out []parsedFullHash, err error) {
+	malformed := fmt.Errorf("Malformated response")
+	if data == "" {
+		return 0, nil, nil
+	}
+	pos := strings.IndexByte(data, '\n')
+	if pos < 0 || pos > maxFullHashHeader {
+		return 0, nil, malformed
+	}
+	if lifeTime, err = strconv.Atoi(data[:pos]); err != nil || lifeTime < 0 || lifeTime > 1<<30 || data[0] == '+' {
+		return 0, nil, malformed
+	}
+	data = data[pos+1:]
+	for len(data) > 0 {
+		pos = strings.IndexByte(data, '\n')
+		if pos < 0 || pos > maxFullHashHeader {
+			return 0, nil, malformed
+		}
+		header := strings.Split(data[:pos], ":")
+		data = data[pos+1:]
+		if len(header) != 3 && len(header) != 4 || header[0] == "" || header[1] != "32" {
+			return 0, nil, malformed
+		}
+		count, err := strconv.Atoi(header[2])
+		if err != nil || count <= 0 || count > maxFullHashesPerRecord || header[2][0] == '+' ||
+			len(header) == 4 && header[3] != "m" || count*32 > len(data) {
+			return 0, nil, malformed
+		}
+		hashes := data[:count*32]
+		data = data[count*32:]
+		record := make([]parsedFullHash, count)
+		total := 0
+		for i := range record {
+			record[i] = parsedFullHash{header[0], hashes[i*32 : (i+1)*32], ""}
+			if len(header) == 3 {
+				continue
+			}
+			pos = strings.IndexByte(data, '\n')
+			if pos < 0 || pos > maxFullHashHeader {
+				return 0, nil, malformed
+			}
+			size, err := strconv.Atoi(data[:pos])
+			total += size
+			if err != nil || size < 0 || size > maxFullHashMetadata || data[0] == '+' || data[0] == '-' ||
+				total > maxFullHashRecordMetadata || pos+1+size > len(data) {
+				return 0, nil, malformed
+			}
+			record[i].metadata = data[pos+1 : pos+1+size]
+			data = data[pos+1+size:]
+		}
+		out = append(out, record...)
+	}
+	return lifeTime, out, nil
+}
+
+func parseFullHashesStreaming(r io.Reader) (lifeTime int, out []parsedFullHash, err error) {
+	p := newFullHashParser(r)
+	defer p.release()
+	if lifeTime, err = p.cacheLifeTime(); err != nil {
+		return 0, nil, err
+	}
+	for {
+		list, hash, metadata, err := p.nextHash()
+		if err == io.EOF {
+			return lifeTime, out, nil
+		} else if err != nil {
+			return 0, nil, err
+		}
+		out = append(out, parsedFullHash{string(list), string(hash), string(metadata)})
+	}
+}
+
+// fullHashResponse makes a gethash response with records for each list in
+// turn, every other one with metadata.
+func fullHashResponse(rng *rand.Rand, lists []string, records int, perRecord int) string {
+	buf := &bytes.Buffer{}
+	fmt.Fprintf(buf, "%d\n", 600)
+	hash := make([]byte, 32)
+	for r := 0; r < records; r++ {
+		list := lists[r%len(lists)]
+		if r%2 == 0 {
+			fmt.Fprintf(buf, "%s:32:%d\n", list, perRecord)
+		} else {
+			fmt.Fprintf(buf, "%s:32:%d:m\n", list, perRecord)
+		}
+		for i := 0; i < perRecord; i++ {
+			rng.Read(hash)
+			buf.Write(hash)
+		}
+		for i := 0; r%2 == 1 && i < perRecord; i++ {
+			metadata := fmt.Sprintf("\x08%c", '0'+rng.Intn(3))
+			fmt.Fprintf(buf, "%d\n%s", len(metadata), metadata)
+		}
+	}
+	return buf.String()
+}
+
+// oneByteReader hands over a byte per Read, to split every field.
+type oneByteReader struct{ r io.Reader }
+
+func (o oneByteReader) Read(p []byte) (int, error) {
+	if len(p) == 0 {
+		return 0, nil
+	}
+	return o.r.Read(p[:1])
+}
+
+func TestFullHashParser(t *testing.T) {
+	rng := rand.New(rand.NewSource(1))
+	response := fullHashResponse(rng, []string{"goog-malware-shavar", "googpub-phish-shavar"}, 20, 3)
+	lifeTime, want, err := parseFullHashesSimply(response)
+	if err != nil || lifeTime != 600 || len(want) != 60 {
+		t.Fatalf("Unexpected test response: %d hashes, %s", len(want), err)
+	}
+	for _, r := range []io.Reader{strings.NewReader(response), oneByteReader{strings.NewReader(response)}} {
+		lifeTime, got, err := parseFullHashesStreaming(r)
+		if err != nil || lifeTime != 600 || fmt.Sprint(got) != fmt.Sprint(want) {
+			t.Errorf("Parsed %d hashes differently: %s", len(got), err)
+		}
+	}
+
+	for _, bad := range []string{
+		"x\n",
+		"600",
+		"600\nlist:32:1\n",
+		"600\nlist:32:0\n",
+		"600\nlist:16:1\n" + strings.Repeat("a", 16),
+		"600\n:32:1\n" + strings.Repeat("a", 32),
+		"600\nlist:32:1:x\n" + strings.Repeat("a", 32),
+		"600\nlist:32:1:m:m\n" + strings.Repeat("a", 32) + "0\n",
+		"600\nlist:32:1:m\n" + strings.Repeat("a", 32),
+		"600\nlist:32:1:m\n" + strings.Repeat("a", 32) + "5\nab",
+		"600\nlist:32:1:m\n" + strings.Repeat("a", 32) + "99999\n",
+		"600\nlist:32:99999\n",
+		"600\n" + strings.Repeat("l", 5000) + ":32:1\n",
+	} {
+		if _, _, err := parseFullHashesStreaming(strings.NewReader(bad)); err == nil {
+			t.Errorf("No error parsing %q", bad)
+		}
+	}
+}
+
+func TestProcessFullHashes(t *testing.T) {
+	sb := &SafeBrowsing{Lists: make(map[string]*SafeBrowsingList)}
+	for _, name := range []string{"goog-malware-shavar", "googpub-phish-shavar"} {
+		sb.Lists[name] = newSafeBrowsingList(name, name+".dat")
+	}
+	rng := rand.New(rand.NewSource(2))
+	response := fullHashResponse(rng, []string{"goog-malware-shavar", "googpub-phish-shavar"}, 10, 4)
+	if err := sb.processFullHashes(response); err != nil {
+		t.Fatal(err)
+	}
+	_, want, _ := parseFullHashesSimply(response)
+	for _, h := range want {
+		sbl := sb.Lists[h.list]
+		if !sbl.FullHashes.Get(h.hash) || sbl.Cache[FullHash(h.hash)] == nil {
+			t.Fatalf("Hash for %s not stored", h.list)
+		}
+		metadata, ok := sb.FullHashMetadata(h.list, FullHash(h.hash))
+		if metadata != h.metadata || ok != (h.metadata != "") {
+			t.Errorf("Metadata %q for %s, expected %q", metadata, h.list, h.metadata)
+		}
+	}
+	if err := sb.processFullHashes("600\nunknown-list:32:1\n" + strings.Repeat("a", 32)); err == nil {
+		t.Errorf("No error for an unknown list")
+	}
+	if id := fullHashMetadata.intern([]byte("\x081")); id != fullHashMetadata.intern([]byte("\x081")) || id == 0 {
+		t.Errorf("Metadata not interned")
+	}
+}
+
+func FuzzFullHashParser(f *testing.F) {
+	rng := rand.New(rand.NewSource(3))
+	f.Add(fullHashResponse(rng, []string{"goog-malware-shavar", "googpub-phish-shavar"}, 4, 2))
+	f.Add("600\nlist:32:1:m\n" + strings.Repeat("a", 32) + "2\nab")
+	f.Add("600\nlist:32:1\n" + strings.Repeat("a", 32))
+	f.Add("")
+	f.Fuzz(func(t *testing.T, response string) {
+		lifeTime, want, wantErr := parseFullHashesSimply(response)
+		gotLifeTime, got, err := parseFullHashesStreaming(strings.NewReader(response))
+		if (err == nil) != (wantErr == nil) {
+			t.Fatalf("Error %v, expected %v", err, wantErr)
+		}
+		if err == nil && (gotLifeTime != lifeTime || fmt.Sprint(got) != fmt.Sprint(want)) {
+			t.Fatalf("Parsed differently")
+		}
+	})
+}
+
+func benchmarkFullHashes(b *testing.B, parse func(response string) error) {
+	rng := rand.New(rand.NewSource(4))
+	response := fullHashResponse(rng, []string{"goog-malware-shavar", "googpub-phish-shavar"}, 2000, 8)
+	b.SetBytes(int64(len(response)))
+	b.ReportAllocs()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		if err := parse(response); err != nil {
+			b.Fatal(err)
+		}
+	}
+}
+
+// BenchmarkFullHashParser compares reading a large response for two lists
+// whole and splitting it up, as was done, with streaming it.
+func BenchmarkFullHashParser(b *testing.B) {
+	b.Run("ReadAll", func(b *testing.B) {
+		benchmarkFullHashes(b, func(response string) error {
+			data, err := ioutil.ReadAll(strings.NewReader(response))
+			if err == nil {
+				_, _, err = parseFullHashesSimply(string(data))
+			}
+			return err
+		})
+	})
+	b.Run("Stream", func(b *testing.B) {
+		benchmarkFullHashes(b, func(response string) error {
+			p := newFullHashParser(strings.NewReader(response))
+			defer p.release()
+			if _, err := p.cacheLifeTime(); err != nil {
+				return err
+			}
+			for {
+				if _, _, _, err := p.nextHash(); err == io.EOF {
+					return nil
+				} else if err != nil {
+					return err
+				}
+			}
+		})
+	})
+}
+
+func BenchmarkProcessFullHashes(b *testing.B) {
+	sb := &SafeBrowsing{Lists: make(map[string]*SafeBrowsingList)}
+	for _, name := range []string{"goog-malware-shavar", "googpub-phish-shavar"} {
+		sb.Lists[name] = newSafeBrowsingList(name, name+".dat")
+	}
+	benchmarkFullHashes(b, func(response string) error {
+		return sb.processFullHashesFrom(strings.NewReader(response), nil)
+	})
+}
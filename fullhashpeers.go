@@ -0,0 +1,434 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import (
+	"bytes"
+	"context"
+	"crypto/sha256"
+	"crypto/subtle"
+	"encoding/binary"
+	"encoding/hex"
+	"encoding/json"
+	"fmt"
+	"net"
+	"net/http"
+	"net/url"
+	"sort"
+	"strings"
+	"sync"
+	"time"
+)
+
+// Full hashes can be shared between the instances of a fleet, so a newly
+// listed URL costs one gethash request across all of them rather than one
+// each.  Each instance holds a share of the verified full hashes, keyed by
+// the hash prefix they were requested for and assigned to instances by a
+// consistent hash ring.  Before requesting full hashes an instance asks the
+// owner of each prefix, and afterwards hands the response to the owners.
+// A single peer makes it a central cache service instead.
+//
+// Entries expire exactly when the gethash response that produced them
+// does: whoever uses one caches the full hashes only for what is left of
+// their lifetime.  A peer that can't be reached is a cache miss.
+//
+// Only the peers may read or write an instance's share: those sending
+// FullHashPeerSecret, or when it isn't set, those at the addresses of
+// FullHashPeers.
+
+// FullHashPeers, when not empty, are the URLs the instances sharing full
+// hashes serve their SharedFullHashes handler at, including this one, which
+// is FullHashPeerSelf.
+var FullHashPeers []string = nil
+var FullHashPeerSelf string = ""
+
+// FullHashPeerSecret, when set, is sent by the peers as a bearer token and
+// required of them instead of a peer address.
+var FullHashPeerSecret string = ""
+
+// How long to wait for the peers before requesting full hashes anyway.
+var FullHashPeerTimeout = 250 * time.Millisecond
+
+// FullHashPeerMaxLifeTime is the longest a shared entry is kept, however
+// far off the expiry it was put with.  No gethash response asks for longer.
+var FullHashPeerMaxLifeTime = time.Hour
+
+// SharedFullHash is a full hash listed in one list.
+type SharedFullHash struct {
+	List string `json:"list"`
+	Hash string `json:"hash"` // hex
+}
+
+// SharedPrefix is what a gethash request returned for one prefix; Hashes
+// may well be empty.
+type SharedPrefix struct {
+	Expires time.Time        `json:"expires"`
+	Hashes  []SharedFullHash `json:"hashes"`
+}
+
+// sharedStore is this instance's share of the entries.
+type sharedStore struct {
+	lock    sync.Mutex
+	entries map[LookupHash]SharedPrefix
+	puts    int
+
+	// who may use it, see allowed
+	secret string
+	peers  map[string]bool
+}
+
+// allowed is whether a request comes from one of the peers.
+func (s *sharedStore) allowed(r *http.Request) bool {
+	if s.secret != "" {
+		token := strings.TrimPrefix(r.Header.Get("Authorization"), "Bearer ")
+		return subtle.ConstantTimeCompare([]byte(token), []byte(s.secret)) == 1
+	}
+	host, _, err := net.SplitHostPort(r.RemoteAddr)
+	return err == nil && s.peers[host]
+}
+
+func (s *sharedStore) get(prefix LookupHash) (SharedPrefix, bool) {
+	s.lock.Lock()
+	defer s.lock.Unlock()
+	entry, ok := s.entries[prefix]
+	if ok && !time.Now().Before(entry.Expires) {
+		delete(s.entries, prefix)
+		return entry, false
+	}
+	return entry, ok
+}
+
+func (s *sharedStore) put(prefix LookupHash, entry SharedPrefix) {
+	s.lock.Lock()
+	defer s.lock.Unlock()
+	if old, ok := s.entries[prefix]; ok && old.Expires.After(entry.Expires) {
+		return
+	}
+	s.entries[prefix] = entry
+
+	// sweep out what has expired now and then
+	if s.puts++; s.puts%1024 == 0 {
+		now := time.Now()
+		for p, e := range s.entries {
+			if !now.Before(e.Expires) {
+				delete(s.entries, p)
+			}
+		}
+	}
+}
+
+// ServeHTTP answers GET and PUT of /<hex prefix>.
+func (s *sharedStore) ServeHTTP(w http.ResponseWriter, r *http.Request) {
+	if !s.allowed(r) {
+		http.Error(w, "Forbidden", http.StatusForbidden)
+		return
+	}
+	raw, err := hex.DecodeString(strings.TrimPrefix(r.URL.Path, "/"))
+	if err != nil || len(raw) != PREFIX_4B_SZ {
+		http.NotFound(w, r)
+		return
+	}
+	prefix := LookupHash(raw)
+
+	switch r.Method {
+	case "GET":
+		entry, ok := s.get(prefix)
+		if !ok {
+			http.NotFound(w, r)
+			return
+		}
+		w.Header().Set("Content-Type", "application/json")
+		json.NewEncoder(w).Encode(&entry)
+	case "PUT":
+		received := time.Now()
+		entry := SharedPrefix{}
+		if err := json.NewDecoder(r.Body).Decode(&entry); err != nil {
+			http.Error(w, err.Error(), http.StatusBadRequest)
+			return
+		}
+		if latest := received.Add(FullHashPeerMaxLifeTime); entry.Expires.After(latest) {
+			entry.Expires = latest
+		}
+		s.put(prefix, entry)
+	default:
+		http.Error(w, "Method not allowed", http.StatusMethodNotAllowed)
+	}
+}
+
+// How many points each peer has on the ring, to even out their shares.
+const ringReplicas = 64
+
+type ringPoint struct {
+	hash uint64
+	peer string
+}
+
+// fullHashRing finds the owner of each prefix among the peers.
+type fullHashRing struct {
+	self   string
+	points []ringPoint
+	store  *sharedStore
+	client *http.Client
+	secret string
+
+	// the puts still under way
+	sharing sync.WaitGroup
+}
+
+func ringHash(key string) uint64 {
+	sum := sha256.Sum256([]byte(key))
+	return binary.BigEndian.Uint64(sum[:8])
+}
+
+// peerAddresses resolves the hosts of the peers' URLs, once, for telling
+// their requests apart.
+func peerAddresses(peers []string) map[string]bool {
+	addresses := make(map[string]bool)
+	for _, peer := range peers {
+		u, err := url.Parse(peer)
+		if err != nil || u.Hostname() == "" {
+			continue
+		}
+		hosts, err := net.LookupHost(u.Hostname())
+		if err != nil {
+			continue
+		}
+		for _, host := range hosts {
+			addresses[host] = true
+		}
+	}
+	return addresses
+}
+
+func newFullHashRing(self string, peers []string, secret string) *fullHashRing {
+	ring := &fullHashRing{
+		self: self,
+		store: &sharedStore{
+			entries: make(map[LookupHash]SharedPrefix),
+			secret:  secret,
+		},
+		client: &http.Client{Transport: Transport, Timeout: FullHashPeerTimeout},
+		secret: secret,
+	}
+	if secret == "" {
+		ring.store.peers = peerAddresses(peers)
+	}
+	for _, peer := range peers {
+		for i := 0; i < ringReplicas; i++ {
+			ring.points = append(ring.points, ringPoint{ringHash(fmt.Sprintf("%s#%d", peer, i)), peer})
+		}
+	}
+	sort.Slice(ring.points, func(i, j int) bool { return ring.points[i].hash < ring.points[j].hash })
+	return ring
+}
+
+func (ring *fullHashRing) owner(prefix LookupHash) string {
+	h := ringHash(string(prefix))
+	i := sort.Search(len(ring.points), func(i int) bool { return ring.points[i].hash >= h })
+	if i == len(ring.points) {
+		i = 0
+	}
+	return ring.points[i].peer
+}
+
+// request makes a request of a prefix's owner, with the secret if there is
+// one.
+func (ring *fullHashRing) request(ctx context.Context, method string, owner string,
+	prefix LookupHash, body []byte) (*http.Response, error) {
+	request, err := http.NewRequest(method, strings.TrimSuffix(owner, "/")+"/"+hex.EncodeToString([]byte(prefix)),
+		bytes.NewReader(body))
+	if err != nil {
+		return nil, err
+	}
+	if ring.secret != "" {
+		request.Header.Set("Authorization", "Bearer "+ring.secret)
+	}
+	return ring.client.Do(request.WithContext(ctx))
+}
+
+func (ring *fullHashRing) get(ctx context.Context, prefix LookupHash) (SharedPrefix, bool) {
+	owner := ring.owner(prefix)
+	if owner == ring.self {
+		return ring.store.get(prefix)
+	}
+	entry := SharedPrefix{}
+	response, err := ring.request(ctx, "GET", owner, prefix, nil)
+	if err != nil {
+		return entry, false
+	}
+	defer response.Body.Close()
+	if response.StatusCode != 200 || json.NewDecoder(response.Body).Decode(&entry) != nil {
+		return entry, false
+	}
+	return entry, time.Now().Before(entry.Expires)
+}
+
+func (ring *fullHashRing) put(prefix LookupHash, entry SharedPrefix) error {
+	owner := ring.owner(prefix)
+	if owner == ring.self {
+		ring.store.put(prefix, entry)
+		return nil
+	}
+	body, err := json.Marshal(&entry)
+	if err != nil {
+		return err
+	}
+	response, err := ring.request(context.Background(), "PUT", owner, prefix, body)
+	if err != nil {
+		return err
+	}
+	response.Body.Close()
+	if response.StatusCode != 200 {
+		return fmt.Errorf("Peer %s returned %d", owner, response.StatusCode)
+	}
+	return nil
+}
+
+// SharedFullHashes returns the handler serving this instance's share of
+// the full hashes, to be mounted at FullHashPeerSelf, or nil when full
+// hashes aren't shared.
+func (sb *SafeBrowsing) SharedFullHashes() http.Handler {
+	if sb.fullHashRing == nil {
+		return nil
+	}
+	return sb.fullHashRing.store
+}
+
+// consultPeers takes the full hashes the peers already have for any of the
+// prefixes, returning the prefixes still to request.  The owners are asked
+// all at once, and those yet to answer after FullHashPeerTimeout are misses.
+func (sb *SafeBrowsing) consultPeers(list string, prefixes map[LookupHash]bool) map[LookupHash]bool {
+	if sb.fullHashRing == nil {
+		return prefixes
+	}
+	ctx, cancel := context.WithTimeout(context.Background(), FullHashPeerTimeout)
+	defer cancel()
+
+	type answer struct {
+		prefix LookupHash
+		entry  SharedPrefix
+		ok     bool
+	}
+	answers := make(chan answer, len(prefixes))
+	for prefix, _ := range prefixes {
+		go func(prefix LookupHash) {
+			entry, ok := sb.fullHashRing.get(ctx, prefix)
+			answers <- answer{prefix, entry, ok}
+		}(prefix)
+	}
+
+	remaining := make(map[LookupHash]bool, len(prefixes))
+	for prefix, _ := range prefixes {
+		remaining[prefix] = true
+	}
+	for waiting := len(prefixes); waiting > 0; waiting-- {
+		select {
+		case a := <-answers:
+			if !a.ok || sb.useSharedPrefix(a.prefix, a.entry) != nil {
+				continue
+			}
+			sb.Lists[list].FullHashRequested.Set(string(a.prefix))
+			delete(remaining, a.prefix)
+		case <-ctx.Done():
+			return remaining
+		}
+	}
+	return remaining
+}
+
+// useSharedPrefix caches an entry's full hashes for what is left of their
+// lifetime, in whole seconds.  Nothing is cached unless the entry is for
+// lists we have and every hash has the prefix.
+func (sb *SafeBrowsing) useSharedPrefix(prefix LookupHash, entry SharedPrefix) error {
+	lifeTime := int(time.Until(entry.Expires) / time.Second)
+	if lifeTime <= 0 {
+		return fmt.Errorf("Expired")
+	}
+	hashes := make([]string, len(entry.Hashes))
+	for i, h := range entry.Hashes {
+		hash, err := hex.DecodeString(h.Hash)
+		if err != nil || len(hash) != PREFIX_32B_SZ || !strings.HasPrefix(string(hash), string(prefix)) {
+			return fmt.Errorf("Malformed shared full hash %q", h.Hash)
+		}
+		if _, ok := sb.Lists[h.List]; !ok {
+			return fmt.Errorf("Shared full hash for unknown list %q", h.List)
+		}
+		hashes[i] = string(hash)
+	}
+	for i, h := range entry.Hashes {
+		if err := sb.readFullHashChunk(hashes[i], h.List, lifeTime); err != nil {
+			return err
+		}
+	}
+	return nil
+}
+
+// sharedResponse collects a gethash response for the peers.
+type sharedResponse struct {
+	received time.Time
+	lifeTime int
+	hashes   []SharedFullHash
+}
+
+func (sr *sharedResponse) add(hashes string, list string, lifeTime int) {
+	if sr == nil {
+		return
+	}
+	sr.lifeTime = lifeTime
+	for i := 0; i+PREFIX_32B_SZ <= len(hashes); i += PREFIX_32B_SZ {
+		sr.hashes = append(sr.hashes, SharedFullHash{list, hex.EncodeToString([]byte(hashes[i : i+PREFIX_32B_SZ]))})
+	}
+}
+
+// sharePrefixes hands the response for each requested prefix to its owner,
+// in the background so as not to hold up the lookup.
+func (sb *SafeBrowsing) sharePrefixes(prefixes map[LookupHash]bool, sr *sharedResponse) {
+	if sb.fullHashRing == nil || sr.lifeTime <= 0 {
+		return
+	}
+	expires := sr.received.Add(time.Duration(sr.lifeTime) * time.Second)
+	entries := make(map[LookupHash]SharedPrefix, len(prefixes))
+	for prefix, _ := range prefixes {
+		entry := SharedPrefix{Expires: expires, Hashes: []SharedFullHash{}}
+		p := hex.EncodeToString([]byte(prefix))
+		for _, h := range sr.hashes {
+			if strings.HasPrefix(h.Hash, p) {
+				entry.Hashes = append(entry.Hashes, h)
+			}
+		}
+		entries[prefix] = entry
+	}
+
+	ring := sb.fullHashRing
+	for prefix, entry := range entries {
+		ring.sharing.Add(1)
+		go func(prefix LookupHash, entry SharedPrefix) {
+			defer ring.sharing.Done()
+			if err := ring.put(prefix, entry); err != nil {
+				sb.Logger.Debug("Unable to share full hashes: %s", err)
+			}
+		}(prefix, entry)
+	}
+}
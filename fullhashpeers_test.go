@@ -0,0 +1,274 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import (
+	"context"
+	"encoding/hex"
+	"net/http"
+	"net/http/httptest"
+	"strings"
+	"sync/atomic"
+	"testing"
+	"time"
+)
+
+// peerTest is one of several instances sharing full hashes, each served by
+// its own HTTP server and counting its own gethash requests.
+type peerTest struct {
+	sb        *SafeBrowsing
+	server    *httptest.Server
+	gethashes int32
+}
+
+func newPeerTests(n int, response string, prefix LookupHash) []*peerTest {
+	peers := make([]*peerTest, n)
+	urls := make([]string, n)
+	for i, _ := range peers {
+		pt := &peerTest{}
+		pt.sb = &SafeBrowsing{
+			LastUpdated: time.Now(),
+			Lists: map[string]*SafeBrowsingList{
+				"googpub-phish-shavar": newSafeBrowsingList("googpub-phish-shavar", ""),
+			},
+			Logger: new(DefaultLogger),
+		}
+		pt.sb.Lists["googpub-phish-shavar"].Lookup.Set(string(prefix))
+		mock := NewMockRequest(response)
+		pt.sb.request = func(url string, body string, post bool) (*http.Response, error) {
+			atomic.AddInt32(&pt.gethashes, 1)
+			return mock(url, body, post)
+		}
+		pt.server = httptest.NewServer(http.HandlerFunc(func(w http.ResponseWriter, r *http.Request) {
+			pt.sb.SharedFullHashes().ServeHTTP(w, r)
+		}))
+		peers[i] = pt
+		urls[i] = pt.server.URL
+	}
+	for i, pt := range peers {
+		pt.sb.fullHashRing = newFullHashRing(urls[i], urls, "")
+	}
+	return peers
+}
+
+// isListed looks a URL up, waiting for the full hashes to be shared.
+func (pt *peerTest) isListed(url string) (string, error) {
+	list, err := pt.sb.IsListed(url)
+	pt.sb.fullHashRing.sharing.Wait()
+	return list, err
+}
+
+func closePeerTests(peers []*peerTest) {
+	for _, pt := range peers {
+		pt.server.Close()
+	}
+}
+
+func countGethashes(peers []*peerTest) (n int32) {
+	for _, pt := range peers {
+		n += atomic.LoadInt32(&pt.gethashes)
+	}
+	return n
+}
+
+func TestSharedFullHashes(t *testing.T) {
+	url := GenerateTestCandidates(Canonicalize("http://test.com/"))[0]
+	hash := getHash(url)
+	prefix := LookupHash(hash[:PREFIX_4B_SZ])
+	peers := newPeerTests(3, "600\n"+"googpub-phish-shavar:32:1\n"+string(hash), prefix)
+	defer closePeerTests(peers)
+
+	for i, pt := range peers {
+		list, err := pt.isListed(url)
+		if err != nil || list != "googpub-phish-shavar" {
+			t.Errorf("Peer %d: unexpected answer %q: %v", i, list, err)
+		}
+	}
+	if n := countGethashes(peers); n != 1 {
+		t.Errorf("Expected a single gethash request across the peers, got %d", n)
+	}
+
+	// the full hash is only cached for what was left of its lifetime
+	for i, pt := range peers {
+		_, validUntil, err := pt.sb.IsListedUntil(url)
+		if err != nil || validUntil.After(time.Now().Add(600*time.Second)) {
+			t.Errorf("Peer %d: full hash valid until %s: %v", i, validUntil, err)
+		}
+	}
+}
+
+func TestSharedFullHashesNegative(t *testing.T) {
+	url := GenerateTestCandidates(Canonicalize("http://test.com/"))[0]
+	prefix := LookupHash(getHash(url)[:PREFIX_4B_SZ])
+	peers := newPeerTests(3, "600\n", prefix)
+	defer closePeerTests(peers)
+
+	for i, pt := range peers {
+		list, err := pt.isListed(url)
+		if err != nil || list != "" {
+			t.Errorf("Peer %d: unexpected answer %q: %v", i, list, err)
+		}
+	}
+	if n := countGethashes(peers); n != 1 {
+		t.Errorf("Expected a single gethash request across the peers, got %d", n)
+	}
+}
+
+func TestSharedFullHashesExpire(t *testing.T) {
+	url := GenerateTestCandidates(Canonicalize("http://test.com/"))[0]
+	hash := getHash(url)
+	prefix := LookupHash(hash[:PREFIX_4B_SZ])
+	peers := newPeerTests(2, "600\n"+"googpub-phish-shavar:32:1\n"+string(hash), prefix)
+	defer closePeerTests(peers)
+
+	// an entry that has just expired must not be served
+	expired := SharedPrefix{
+		Expires: time.Now().Add(-time.Second),
+		Hashes:  []SharedFullHash{{"googpub-phish-shavar", "00"}},
+	}
+	for _, pt := range peers {
+		pt.sb.fullHashRing.store.entries[prefix] = expired
+	}
+	if _, ok := peers[0].sb.fullHashRing.get(context.Background(), prefix); ok {
+		t.Error("Expired entry returned")
+	}
+	if _, err := peers[0].isListed(url); err != nil {
+		t.Fatal(err)
+	}
+	if n := countGethashes(peers); n != 1 {
+		t.Errorf("Expected the full hashes to be requested again, got %d requests", n)
+	}
+
+	// and the new response replaces it
+	entry, ok := peers[1].sb.fullHashRing.get(context.Background(), prefix)
+	if !ok || len(entry.Hashes) != 1 || entry.Hashes[0].Hash != hex.EncodeToString([]byte(hash)) {
+		t.Errorf("Unexpected shared entry %+v", entry)
+	}
+}
+
+func TestFullHashRingOwner(t *testing.T) {
+	peers := []string{"http://a", "http://b", "http://c"}
+	ring := newFullHashRing("http://a", peers, "")
+	other := newFullHashRing("http://b", peers, "")
+	owned := map[string]int{}
+	for i := 0; i < 3000; i++ {
+		prefix := LookupHash([]byte{byte(i >> 8), byte(i), 0, 1})
+		owned[ring.owner(prefix)]++
+		if other.owner(prefix) != ring.owner(prefix) {
+			t.Errorf("Peers disagree on the owner of %x", prefix)
+		}
+	}
+	for _, peer := range peers {
+		if owned[peer] < 500 {
+			t.Errorf("Peer %s owns only %d of 3000 prefixes", peer, owned[peer])
+		}
+	}
+}
+
+func TestSharedFullHashesAccess(t *testing.T) {
+	prefix := "00000001"
+	entry := `{"expires":"2099-01-01T00:00:00Z","hashes":[]}`
+	put := func(store *sharedStore, remoteAddr string, secret string) int {
+		r := httptest.NewRequest("PUT", "/"+prefix, strings.NewReader(entry))
+		r.RemoteAddr = remoteAddr
+		if secret != "" {
+			r.Header.Set("Authorization", "Bearer "+secret)
+		}
+		w := httptest.NewRecorder()
+		store.ServeHTTP(w, r)
+		return w.Code
+	}
+
+	// only the peers' addresses may use the store
+	ring := newFullHashRing("http://10.0.0.1:8080/fullhashes",
+		[]string{"http://10.0.0.1:8080/fullhashes", "http://10.0.0.2:8080/fullhashes"}, "")
+	if code := put(ring.store, "192.0.2.1:1234", ""); code != http.StatusForbidden {
+		t.Errorf("PUT from a stranger returned %d", code)
+	}
+	if code := put(ring.store, "10.0.0.2:1234", ""); code != 200 {
+		t.Errorf("PUT from a peer returned %d", code)
+	}
+
+	// and however far off its expiry, the entry is only kept so long
+	raw, _ := hex.DecodeString(prefix)
+	stored, ok := ring.store.get(LookupHash(raw))
+	if !ok || stored.Expires.After(time.Now().Add(FullHashPeerMaxLifeTime)) {
+		t.Errorf("Entry kept until %s", stored.Expires)
+	}
+
+	// or with a secret, only those that know it
+	ring = newFullHashRing("http://10.0.0.1:8080/fullhashes",
+		[]string{"http://10.0.0.1:8080/fullhashes"}, "sesame")
+	if code := put(ring.store, "10.0.0.1:1234", "wrong"); code != http.StatusForbidden {
+		t.Errorf("PUT with the wrong secret returned %d", code)
+	}
+	if code := put(ring.store, "192.0.2.1:1234", "sesame"); code != 200 {
+		t.Errorf("PUT with the secret returned %d", code)
+	}
+}
+
+func TestSharedFullHashesUnknownList(t *testing.T) {
+	url := GenerateTestCandidates(Canonicalize("http://test.com/"))[0]
+	hash := getHash(url)
+	prefix := LookupHash(hash[:PREFIX_4B_SZ])
+	peers := newPeerTests(1, "600\n", prefix)
+	defer closePeerTests(peers)
+
+	peers[0].sb.fullHashRing.store.put(prefix, SharedPrefix{
+		Expires: time.Now().Add(time.Minute),
+		Hashes:  []SharedFullHash{{"goog-unknown-shavar", hex.EncodeToString([]byte(hash))}},
+	})
+	if remaining := peers[0].sb.consultPeers("googpub-phish-shavar", map[LookupHash]bool{prefix: true}); !remaining[prefix] {
+		t.Error("Entry for an unknown list used")
+	}
+}
+
+func TestSharedFullHashesConcurrent(t *testing.T) {
+	// a peer that never answers in time
+	hung := httptest.NewServer(http.HandlerFunc(func(w http.ResponseWriter, r *http.Request) {
+		time.Sleep(4 * FullHashPeerTimeout)
+	}))
+	defer hung.Close()
+
+	sb := &SafeBrowsing{
+		Lists: map[string]*SafeBrowsingList{
+			"googpub-phish-shavar": newSafeBrowsingList("googpub-phish-shavar", ""),
+		},
+		Logger: new(DefaultLogger),
+	}
+	sb.fullHashRing = newFullHashRing("http://self", []string{hung.URL}, "")
+	prefixes := make(map[LookupHash]bool)
+	for i := 0; i < 8; i++ {
+		prefixes[LookupHash([]byte{0, 0, 0, byte(i)})] = true
+	}
+
+	start := time.Now()
+	if remaining := sb.consultPeers("googpub-phish-shavar", prefixes); len(remaining) != len(prefixes) {
+		t.Errorf("Expected every prefix still to request, got %d", len(remaining))
+	}
+	if took := time.Since(start); took > 2*FullHashPeerTimeout {
+		t.Errorf("Consulting the peers took %s", took)
+	}
+}
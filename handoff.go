@@ -0,0 +1,352 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import (
+	"encoding/gob"
+	"fmt"
+	"io"
+	"net"
+	"os"
+	"syscall"
+	"time"
+)
+
+// HandoffSocket, when set, is the path of a Unix socket over which a
+// server hands its listening sockets, index snapshots and cached full hashes
+// to a new server started to replace it.  The new server calls
+// ReceiveHandoff before NewSafeBrowsing and serves at once from the
+// snapshots, while the old one finishes the requests it has and exits; see
+// ServeHandoff.
+var HandoffSocket string = ""
+
+// How long either side of a handoff waits on the other.
+var handoffTimeout = 30 * time.Second
+
+// How many file descriptors a handoff can carry.
+const handoffMaxFiles = 64
+
+// handoffState is what a server hands to its replacement.  The files, the
+// listeners and then the snapshots, travel separately as rights.
+type handoffState struct {
+	Listeners  int
+	Snapshots  []string // the lists whose snapshots follow the listeners
+	FullHashes []handedFullHash
+
+	snapshots map[string]*os.File
+}
+
+// handedFullHash is a full hash from a gethash response, with its cache
+// lifetime.
+type handedFullHash struct {
+	List          string
+	Hash          FullHash
+	CreationDate  time.Time
+	CacheLifeTime int
+	Metadata      string
+}
+
+// handedOver is the state received by ReceiveHandoff, for NewSafeBrowsing.
+var handedOver *handoffState
+
+// Handoff is a server being taken over from.
+type Handoff struct {
+	// the listeners of the old server, in the order it gave them
+	Listeners []net.Listener
+
+	conn *net.UnixConn
+}
+
+// ReceiveHandoff takes over from the server listening on HandoffSocket, if
+// there is one, returning nil otherwise.  NewSafeBrowsing then starts
+// progressively from the old server's snapshots and cached full hashes.
+// Once the listeners are being served, Complete lets the old server go.
+func ReceiveHandoff() (*Handoff, error) {
+	if HandoffSocket == "" {
+		return nil, nil
+	}
+	conn, err := net.DialUnix("unix", nil, &net.UnixAddr{Name: HandoffSocket, Net: "unix"})
+	if err != nil {
+		// nothing is running to take over from
+		return nil, nil
+	}
+	conn.SetDeadline(time.Now().Add(handoffTimeout))
+
+	files, err := receiveFiles(conn)
+	if err == nil {
+		state := &handoffState{}
+		if err = gob.NewDecoder(conn).Decode(state); err == nil {
+			h := &Handoff{conn: conn}
+			err = state.take(files, h)
+			if err == nil {
+				handedOver = state
+				return h, nil
+			}
+		}
+	}
+	for _, f := range files {
+		f.Close()
+	}
+	conn.Close()
+	return nil, fmt.Errorf("Unable to take over from %s: %s", HandoffSocket, err)
+}
+
+// take sorts the files received into listeners and snapshots.
+func (state *handoffState) take(files []*os.File, h *Handoff) error {
+	if len(files) != state.Listeners+len(state.Snapshots) {
+		return fmt.Errorf("Expected %d files, received %d", state.Listeners+len(state.Snapshots), len(files))
+	}
+	for _, f := range files[:state.Listeners] {
+		l, err := net.FileListener(f)
+		if err != nil {
+			for _, l := range h.Listeners {
+				l.Close()
+			}
+			return err
+		}
+		f.Close()
+		h.Listeners = append(h.Listeners, l)
+	}
+	state.snapshots = make(map[string]*os.File, len(state.Snapshots))
+	for i, list := range state.Snapshots {
+		state.snapshots[list] = files[state.Listeners+i]
+	}
+	return nil
+}
+
+// Complete tells the old server its listeners are being served, and waits
+// for it to stop listening on HandoffSocket, so that ServeHandoff can be
+// called.
+func (h *Handoff) Complete() error {
+	defer h.conn.Close()
+	h.conn.SetDeadline(time.Now().Add(handoffTimeout))
+	if _, err := h.conn.Write([]byte{1}); err != nil {
+		return err
+	}
+	// the old server closes the connection once it has let go
+	var b [1]byte
+	if _, err := h.conn.Read(b[:]); err != nil && err != io.EOF {
+		return err
+	}
+	return nil
+}
+
+// ServeHandoff listens on HandoffSocket for a server to replace this one.
+// It hands over the listeners, each list's current index snapshot and the
+// cached full hashes, and once the new server is serving, calls drain,
+// which should stop serving and wait for the requests in flight, and
+// returns.  From the handoff on this server no longer changes the data
+// directory.  A replacement that fails part way leaves this one serving.
+func (sb *SafeBrowsing) ServeHandoff(listeners []net.Listener, drain func()) error {
+	os.Remove(HandoffSocket)
+	l, err := net.ListenUnix("unix", &net.UnixAddr{Name: HandoffSocket, Net: "unix"})
+	if err != nil {
+		return err
+	}
+	defer l.Close()
+
+	for {
+		conn, err := l.AcceptUnix()
+		if err != nil {
+			return err
+		}
+		unlock := sb.lockLists()
+		err = sb.handOff(conn, listeners)
+		if err == nil {
+			sb.Logger.Info("Handed over to a new server, draining")
+			l.Close()
+			conn.Close()
+			drain()
+			// the lists stay locked, the new server owns the files now
+			return nil
+		}
+		unlock()
+		conn.Close()
+		sb.Logger.Warn("Handoff failed, carrying on serving: %s", err)
+	}
+}
+
+// lockLists stops any changes to the data directory, returning the unlock.
+func (sb *SafeBrowsing) lockLists() func() {
+	for _, sbl := range sb.Lists {
+		sbl.fsLock.Lock()
+	}
+	return func() {
+		for _, sbl := range sb.Lists {
+			sbl.fsLock.Unlock()
+		}
+	}
+}
+
+// handOff sends the state to the new server and waits for it to take over.
+func (sb *SafeBrowsing) handOff(conn *net.UnixConn, listeners []net.Listener) error {
+	conn.SetDeadline(time.Now().Add(handoffTimeout))
+
+	state := &handoffState{Listeners: len(listeners)}
+	files := make([]*os.File, 0, len(listeners)+len(sb.Lists))
+	defer func() {
+		for _, f := range files {
+			f.Close()
+		}
+	}()
+	for _, l := range listeners {
+		fl, ok := l.(interface {
+			File() (*os.File, error)
+		})
+		if !ok {
+			return fmt.Errorf("Unable to hand over a %T", l)
+		}
+		f, err := fl.File()
+		if err != nil {
+			return err
+		}
+		files = append(files, f)
+	}
+	for name, sbl := range sb.Lists {
+		f, err := os.Open(sbl.snapshotFileName())
+		if err == nil {
+			files = append(files, f)
+			state.Snapshots = append(state.Snapshots, name)
+		}
+		for hash, fhc := range sbl.Cache {
+			if fhc.checkValidity() && sbl.FullHashes.Get(string(hash)) {
+				state.FullHashes = append(state.FullHashes, handedFullHash{
+					List:          name,
+					Hash:          hash,
+					CreationDate:  fhc.CreationDate,
+					CacheLifeTime: fhc.CacheLifeTime,
+					Metadata:      fullHashMetadata.value(fhc.metadata),
+				})
+			}
+		}
+	}
+
+	if err := sendFiles(conn, files); err != nil {
+		return err
+	}
+	if err := gob.NewEncoder(conn).Encode(state); err != nil {
+		return err
+	}
+	var ack [1]byte
+	if _, err := conn.Read(ack[:]); err != nil {
+		return fmt.Errorf("New server gave up: %s", err)
+	}
+	return nil
+}
+
+// sendFiles passes files over conn as rights, along with a single byte.
+func sendFiles(conn *net.UnixConn, files []*os.File) error {
+	if len(files) > handoffMaxFiles {
+		return fmt.Errorf("Too many files to hand over: %d", len(files))
+	}
+	fds := make([]int, len(files))
+	for i, f := range files {
+		fds[i] = int(f.Fd())
+	}
+	var rights []byte
+	if len(fds) > 0 {
+		rights = syscall.UnixRights(fds...)
+	}
+	_, _, err := conn.WriteMsgUnix([]byte{byte(len(fds))}, rights, nil)
+	return err
+}
+
+// receiveFiles receives the files sent by sendFiles.
+func receiveFiles(conn *net.UnixConn) ([]*os.File, error) {
+	var b [1]byte
+	oob := make([]byte, syscall.CmsgSpace(handoffMaxFiles*4))
+	_, oobn, _, _, err := conn.ReadMsgUnix(b[:], oob)
+	if err != nil {
+		return nil, err
+	}
+	messages, err := syscall.ParseSocketControlMessage(oob[:oobn])
+	if err != nil {
+		return nil, err
+	}
+	files := make([]*os.File, 0, int(b[0]))
+	for _, m := range messages {
+		fds, err := syscall.ParseUnixRights(&m)
+		if err != nil {
+			return files, err
+		}
+		for _, fd := range fds {
+			syscall.CloseOnExec(fd)
+			files = append(files, os.NewFile(uintptr(fd), "handoff"))
+		}
+	}
+	if len(files) != int(b[0]) {
+		return files, fmt.Errorf("Expected %d files, received %d", b[0], len(files))
+	}
+	return files, nil
+}
+
+// mapHandedOver maps the snapshot handed over for a list, if there was one.
+func mapHandedOver(list string) (*mappedSnapshot, bool, error) {
+	if handedOver == nil {
+		return nil, false, nil
+	}
+	f, ok := handedOver.snapshots[list]
+	if !ok {
+		return nil, false, nil
+	}
+	delete(handedOver.snapshots, list)
+	defer f.Close()
+	m, err := mapSnapshotFile(f, list+" snapshot")
+	return m, true, err
+}
+
+// takeHandedOver puts the full hashes handed over into their lists.
+func (sb *SafeBrowsing) takeHandedOver() {
+	if handedOver == nil {
+		return
+	}
+	for _, fh := range handedOver.FullHashes {
+		if sbl, ok := sb.Lists[fh.List]; ok {
+			sbl.Cache[fh.Hash] = &FullHashCache{
+				CreationDate:  fh.CreationDate,
+				CacheLifeTime: fh.CacheLifeTime,
+				metadata:      fullHashMetadata.intern([]byte(fh.Metadata)),
+			}
+			sbl.FullHashes.Set(string(fh.Hash))
+		}
+	}
+	sb.Logger.Info("Took over %d cached full hashes", len(handedOver.FullHashes))
+	for _, f := range handedOver.snapshots {
+		f.Close()
+	}
+	handedOver = nil
+}
+
+// restoreCachedFullHashes puts the cached full hashes back into lists just
+// loaded from disk, which starts them without any.
+func (sb *SafeBrowsing) restoreCachedFullHashes() {
+	for _, sbl := range sb.Lists {
+		for hash, fhc := range sbl.Cache {
+			if fhc.checkValidity() {
+				sbl.FullHashes.Set(string(hash))
+			}
+		}
+	}
+}
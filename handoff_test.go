@@ -0,0 +1,201 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import (
+	"bytes"
+	"context"
+	"io/ioutil"
+	"net"
+	"net/http"
+	"os"
+	"os/exec"
+	"path/filepath"
+	"testing"
+	"time"
+)
+
+// The new server of TestHandoff is the test binary run again, with this set
+// to the data directory.
+const handoffTestEnv = "SAFEBROWSING_HANDOFF_TEST"
+
+// handoffFullHash is cached from a gethash response by the old server.
+var handoffFullHash = FullHash(bytes.Repeat([]byte{7}, PREFIX_32B_SZ))
+
+func handoffGet(t *testing.T, url string) string {
+	response, err := http.Get(url)
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer response.Body.Close()
+	body, err := ioutil.ReadAll(response.Body)
+	if err != nil {
+		t.Fatal(err)
+	}
+	return string(body)
+}
+
+func TestHandoff(t *testing.T) {
+	dir, err := ioutil.TempDir("", "safebrowsing")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer os.RemoveAll(dir)
+	defer func(socket string) { HandoffSocket = socket }(HandoffSocket)
+	HandoffSocket = filepath.Join(dir, "handoff.sock")
+
+	// the old server, with a list loaded and a full hash cached
+	sbl := newSafeBrowsingList("goog-malware-shavar", filepath.Join(dir, "goog-malware-shavar.dat"))
+	if err = sbl.load([]*ChunkData{addChunk(1, "aaaa")}); err != nil {
+		t.Fatal(err)
+	}
+	sbl.FullHashes.Set(string(handoffFullHash))
+	sbl.Cache[handoffFullHash] = newFullHashCache(time.Now(), 600)
+	sb := &SafeBrowsing{
+		DataDir: dir,
+		Lists:   map[string]*SafeBrowsingList{sbl.Name: sbl},
+		Logger:  &DefaultLogger{},
+	}
+
+	listener, err := net.Listen("tcp", "127.0.0.1:0")
+	if err != nil {
+		t.Fatal(err)
+	}
+	url := "http://" + listener.Addr().String()
+	release := make(chan bool)
+	mux := http.NewServeMux()
+	mux.HandleFunc("/", func(w http.ResponseWriter, r *http.Request) { w.Write([]byte("old")) })
+	mux.HandleFunc("/slow", func(w http.ResponseWriter, r *http.Request) {
+		<-release
+		w.Write([]byte("old"))
+	})
+	server := &http.Server{Handler: mux}
+	go server.Serve(listener)
+	handedOff := make(chan error, 1)
+	go func() {
+		handedOff <- sb.ServeHandoff([]net.Listener{listener}, func() {
+			close(release)
+			server.Shutdown(context.Background())
+		})
+	}()
+	if got := handoffGet(t, url); got != "old" {
+		t.Fatalf("Old server answered %q", got)
+	}
+
+	// a request in flight across the handoff
+	slow := make(chan string, 1)
+	go func() { slow <- handoffGet(t, url+"/slow") }()
+	time.Sleep(50 * time.Millisecond)
+
+	child := exec.Command(os.Args[0], "-test.run=^TestHandoffChild$", "-test.v")
+	child.Env = append(os.Environ(), handoffTestEnv+"="+dir)
+	output := &bytes.Buffer{}
+	child.Stdout, child.Stderr = output, output
+	if err = child.Start(); err != nil {
+		t.Fatal(err)
+	}
+	defer child.Process.Kill()
+
+	select {
+	case err = <-handedOff:
+		if err != nil {
+			t.Fatalf("Handoff failed: %s\n%s", err, output)
+		}
+	case <-time.After(20 * time.Second):
+		t.Fatalf("No handoff:\n%s", output)
+	}
+	if got := <-slow; got != "old" {
+		t.Errorf("Request in flight answered %q", got)
+	}
+	// the old server has stopped changing the data directory
+	if sbl.fsLock.TryLock() {
+		t.Errorf("Old server still updating its lists")
+	}
+
+	if got := handoffGet(t, url); got != "new" {
+		t.Errorf("Served %q after the handoff", got)
+	}
+	handoffGet(t, url+"/quit")
+	if err = child.Wait(); err != nil {
+		t.Errorf("New server failed: %s\n%s", err, output)
+	}
+}
+
+// TestHandoffChild is the new server of TestHandoff.
+func TestHandoffChild(t *testing.T) {
+	dir := os.Getenv(handoffTestEnv)
+	if dir == "" {
+		t.Skip("Run by TestHandoff")
+	}
+	HandoffSocket = filepath.Join(dir, "handoff.sock")
+	OfflineMode = true
+
+	h, err := ReceiveHandoff()
+	if err != nil || h == nil || len(h.Listeners) != 1 {
+		t.Fatalf("Nothing handed over: %v %s", h, err)
+	}
+	// the snapshot handed over has to serve, not the file on disk, nor the
+	// list, which can't load while this holds the only update worker
+	os.Remove(filepath.Join(dir, "goog-malware-shavar.idx"))
+	loaded := acquireUpdateWorker()
+	sb, err := NewSafeBrowsing("", dir)
+	if err != nil {
+		t.Fatal(err)
+	}
+	sbl := sb.Lists["goog-malware-shavar"]
+	if sbl.servingState() != ServingSnapshot {
+		t.Errorf("Not serving from the snapshot handed over")
+	}
+	hashes := []LookupHash{LookupHash("aaaa" + string(bytes.Repeat([]byte{0}, 28)))}
+	if found, full, _ := sbl.snapshotLookup(sbl.Name, hashes, nil); !found || full {
+		t.Errorf("Prefix missing from the snapshot handed over")
+	}
+	hashes = []LookupHash{LookupHash(handoffFullHash)}
+	if found, full, _ := sbl.snapshotLookup(sbl.Name, hashes, nil); !found || !full {
+		t.Errorf("Cached full hash not handed over")
+	}
+	loaded()
+
+	quit := make(chan bool)
+	mux := http.NewServeMux()
+	mux.HandleFunc("/", func(w http.ResponseWriter, r *http.Request) { w.Write([]byte("new")) })
+	mux.HandleFunc("/quit", func(w http.ResponseWriter, r *http.Request) { close(quit) })
+	server := &http.Server{Handler: mux}
+	go server.Serve(h.Listeners[0])
+	if err = h.Complete(); err != nil {
+		t.Error(err)
+	}
+	<-quit
+	server.Close()
+
+	// once loaded, the cached full hash is put back
+	deadline := time.Now().Add(10 * time.Second)
+	for !(sbl.servingState() == ServingReady && sbl.FullHashes.Get(string(handoffFullHash))) {
+		if time.Now().After(deadline) {
+			t.Fatalf("Cached full hash lost loading the list")
+		}
+		time.Sleep(10 * time.Millisecond)
+	}
+}
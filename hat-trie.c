@@ -8,14 +8,21 @@
 #include "hat-trie.h"
 #include "ahtable.h"
 #include "misc.h"
+#include "murmurhash3.h"
 #include "pstdint.h"
 #include <assert.h>
 #include <string.h>
 
 #define HT_UNUSED(x) x=x
 
-/* maximum number of keys that may be stored in a bucket before it is burst */
+/* maximum number of keys that may be stored in a bucket before it is burst,
+ * unless the trie's parameters say otherwise */
 static const size_t MAX_BUCKET_SIZE = 16384;
+/* number of keys a bursting bucket samples to choose where to split */
+#define HATTRIE_SPLIT_SAMPLE 512
+/* key for the hash summed into the trie digest. It is fixed so digests can be
+ * compared between processes and against snapshots on disk. */
+static const uint64_t DIGEST_KEY = 0x5afeb2013e1d1a57ULL;
 #define NODE_MAXCHAR 0xff // 0x7f for 7-bit ASCII
 #define NODE_CHILDS (NODE_MAXCHAR+1)
 
@@ -52,8 +59,10 @@ typedef struct trie_node_t_
 
 struct hattrie_t_
 {
-    node_ptr root; // root node
-    size_t m;      // number of stored keys
+    node_ptr root;   // root node
+    size_t m;        // number of stored keys
+    uint64_t digest; // sum of the key digests of all stored keys
+    hattrie_params_t params;
 };
 
 /* Create a new trie node with all pointers pointing to the given child (which
@@ -139,22 +148,61 @@ static node_ptr hattrie_find(hattrie_t* T, const char **key, size_t *len)
     return node;
 }
 
-hattrie_t* hattrie_create()
+/* give an empty trie its root node */
+static void hattrie_init(hattrie_t* T)
 {
-    hattrie_t* T = malloc_or_die(sizeof(hattrie_t));
     T->m = 0;
+    T->digest = 0;
 
     node_ptr node;
-    node.b = ahtable_create();
+    node.b = ahtable_create_lf(T->params.initial_size, T->params.max_load_factor);
     node.b->flag = NODE_TYPE_HYBRID_BUCKET;
     node.b->c0 = 0x00;
     node.b->c1 = NODE_MAXCHAR;
     T->root.t = alloc_trie_node(T, node);
+}
+
+
+void hattrie_default_params(hattrie_params_t* params)
+{
+    params->max_bucket_size   = MAX_BUCKET_SIZE;
+    params->short_key_len     = 0;
+    params->short_bucket_size = MAX_BUCKET_SIZE;
+    params->initial_size      = ahtable_initial_size;
+    params->max_load_factor   = ahtable_max_load_factor;
+}
+
+
+hattrie_t* hattrie_create()
+{
+    return hattrie_create_params(NULL);
+}
+
+
+hattrie_t* hattrie_create_params(const hattrie_params_t* params)
+{
+    hattrie_t* T = malloc_or_die(sizeof(hattrie_t));
+    if (params) T->params = *params;
+    else hattrie_default_params(&T->params);
+
+    /* a bucket must be able to hold one key, and have a slot to put it in */
+    if (T->params.max_bucket_size < 1) T->params.max_bucket_size = 1;
+    if (T->params.short_bucket_size < 1) T->params.short_bucket_size = 1;
+    if (T->params.initial_size < 1) T->params.initial_size = 1;
+    if (!(T->params.max_load_factor > 0.0)) T->params.max_load_factor = ahtable_max_load_factor;
+
+    hattrie_init(T);
 
     return T;
 }
 
 
+void hattrie_params(const hattrie_t* T, hattrie_params_t* params)
+{
+    *params = T->params;
+}
+
+
 static void hattrie_free_node(node_ptr node)
 {
     if (*node.flag & NODE_TYPE_TRIE) {
@@ -166,7 +214,7 @@ static void hattrie_free_node(node_ptr node)
              * to build a very deep trie. */
             if (node.t->xs[i].t) hattrie_free_node(node.t->xs[i]);
         }
-        free(node.t);
+        free_mem(node.t);
     }
     else {
         ahtable_free(node.b);
@@ -177,9 +225,134 @@ static void hattrie_free_node(node_ptr node)
 void hattrie_free(hattrie_t* T)
 {
     hattrie_free_node(T->root);
-    free(T);
+    free_mem(T);
+}
+
+
+void hattrie_clear(hattrie_t* T)
+{
+    hattrie_free_node(T->root);
+    hattrie_init(T);
+}
+
+
+static node_ptr hattrie_dup_node(node_ptr node)
+{
+    node_ptr dup;
+    if (*node.flag & NODE_TYPE_TRIE) {
+        dup.t = malloc_or_die(sizeof(trie_node_t));
+        dup.t->flag = node.t->flag;
+        dup.t->val  = node.t->val;
+
+        size_t i;
+        for (i = 0; i < NODE_CHILDS; ++i) {
+            /* keep hybrid buckets shared between the same characters */
+            if (i > 0 && node.t->xs[i].t == node.t->xs[i - 1].t) {
+                dup.t->xs[i] = dup.t->xs[i - 1];
+            }
+            else dup.t->xs[i] = hattrie_dup_node(node.t->xs[i]);
+        }
+    }
+    else {
+        dup.b = ahtable_dup(node.b);
+    }
+    return dup;
+}
+
+
+hattrie_t* hattrie_dup(const hattrie_t* T)
+{
+    hattrie_t* dup = malloc_or_die(sizeof(hattrie_t));
+    dup->root   = hattrie_dup_node(T->root);
+    dup->m      = T->m;
+    dup->digest = T->digest;
+    dup->params = T->params;
+
+    return dup;
+}
+
+/* Count every key stored below the given node. This only visits trie nodes
+ * and reads bucket sizes, it never walks bucket contents. */
+static size_t hattrie_node_size(node_ptr node)
+{
+    if (*node.flag & NODE_TYPE_TRIE) {
+        size_t m = node.t->flag & NODE_HAS_VAL ? 1 : 0;
+        size_t i;
+        for (i = 0; i < NODE_CHILDS; ++i) {
+            if (i > 0 && node.t->xs[i].t == node.t->xs[i - 1].t) continue;
+            m += hattrie_node_size(node.t->xs[i]);
+        }
+        return m;
+    }
+
+    return ahtable_size(node.b);
+}
+
+
+/* Spread n keys evenly over the range weights w[lo..hi]. */
+static void hattrie_spread(double* w, unsigned int lo, unsigned int hi, size_t n)
+{
+    double d = (double) n / (double) (hi - lo + 1);
+    for (; lo <= hi; ++lo) w[lo] += d;
+}
+
+
+size_t hattrie_partition(const hattrie_t* T, size_t k, unsigned int* bounds)
+{
+    if (k < 1) k = 1;
+
+    /* estimated number of keys for every two byte prefix */
+    double* w = malloc_or_die(HATTRIE_RANGE_END * sizeof(double));
+    memset(w, 0, HATTRIE_RANGE_END * sizeof(double));
+
+    trie_node_t* root = T->root.t;
+    if (root->flag & NODE_HAS_VAL) w[0] += 1.0;
+
+    unsigned int a, b, c, d;
+    node_ptr child, grandchild;
+    for (a = 0; a < NODE_CHILDS; a = b + 1) {
+        child = root->xs[a];
+        for (b = a; b + 1 < NODE_CHILDS && root->xs[b + 1].t == child.t; ++b);
+
+        /* a bucket below the root: we only know how many keys start with
+         * one of the characters [a, b] */
+        if (!(*child.flag & NODE_TYPE_TRIE)) {
+            hattrie_spread(w, a << 8, (b << 8) | 0xff, ahtable_size(child.b));
+            continue;
+        }
+
+        /* trie nodes are never shared between characters, so a == b here */
+        if (child.t->flag & NODE_HAS_VAL) w[a << 8] += 1.0;
+        for (c = 0; c < NODE_CHILDS; c = d + 1) {
+            grandchild = child.t->xs[c];
+            for (d = c; d + 1 < NODE_CHILDS && child.t->xs[d + 1].t == grandchild.t; ++d);
+            hattrie_spread(w, (a << 8) | c, (a << 8) | d,
+                           hattrie_node_size(grandchild));
+        }
+    }
+
+    double total = 0.0;
+    for (a = 0; a < HATTRIE_RANGE_END; ++a) total += w[a];
+
+    /* cut whenever the running total crosses the next multiple of total / k,
+     * a single heavy prefix may cross several at once */
+    size_t n = 0, t = 1;
+    double cum = 0.0;
+    bounds[n++] = 0;
+    for (a = 0; a + 1 < HATTRIE_RANGE_END && t < k && total > 0.0; ++a) {
+        cum += w[a];
+        if (cum < total * (double) t / (double) k) continue;
+
+        bounds[n++] = a + 1;
+        while (t < k && cum >= total * (double) t / (double) k) ++t;
+    }
+    bounds[n] = HATTRIE_RANGE_END;
+
+    free_mem(w);
+    return n;
 }
 
+
 /* Perform one split operation on the given node with the given parent.
  */
 static void hattrie_split(hattrie_t* T, node_ptr parent, node_ptr node)
@@ -210,27 +383,33 @@ static void hattrie_split(hattrie_t* T, node_ptr parent, node_ptr node)
         return;
     }
 
-    /* This is a hybrid bucket. Perform a proper split. */
+    /* This is a hybrid bucket. Perform a proper split, without touching most
+     * of its keys: the new buckets adopt them a few slots at a time as they
+     * are changed. A bucket that bursts again before it is done adopting has
+     * to finish first, as buckets only ever adopt from one other. */
+    ahtable_settle(node.b);
 
-    /* count the number of occourances of every leading character */
+    /* estimate how often every leading character occurs from the first few
+     * keys, which being in hash order are as good as any */
     unsigned int cs[NODE_CHILDS]; // occurance count for leading chars
     memset(cs, 0, NODE_CHILDS * sizeof(unsigned int));
     size_t len;
     const char* key;
 
+    unsigned int all_m = 0;
     ahtable_iter_t* i = ahtable_iter_begin(node.b, false);
-    while (!ahtable_iter_finished(i)) {
+    while (!ahtable_iter_finished(i) && all_m < HATTRIE_SPLIT_SAMPLE) {
         key = ahtable_iter_key(i, &len);
         assert(len > 0);
         cs[(unsigned char) key[0]] += 1;
+        ++all_m;
         ahtable_iter_next(i);
     }
     ahtable_iter_free(i);
 
     /* choose a split point */
-    unsigned int left_m, right_m, all_m;
+    unsigned int left_m, right_m;
     unsigned char j = node.b->c0;
-    all_m   = ahtable_size(node.b);
     left_m  = cs[j];
     right_m = all_m - left_m;
     int d;
@@ -248,6 +427,10 @@ static void hattrie_split(hattrie_t* T, node_ptr parent, node_ptr node)
     /* now split into two node cooresponding to ranges [0, j] and
      * [j + 1, NODE_MAXCHAR], respectively. */
 
+    size_t m = ahtable_size(node.b);
+    size_t left_n = all_m > 0 ? (size_t) ((double) m * left_m / all_m) : 0;
+    size_t right_n = m - left_n;
+
 
     /* create new left and right nodes */
 
@@ -255,25 +438,26 @@ static void hattrie_split(hattrie_t* T, node_ptr parent, node_ptr node)
      * the keys. In such a case, do not build a new table, just use the old one.
      * */
     size_t num_slots;
+    double max_load_factor = T->params.max_load_factor;
 
 
-    for (num_slots = ahtable_initial_size;
-            (double) left_m > ahtable_max_load_factor * (double) num_slots;
+    for (num_slots = T->params.initial_size;
+            (double) left_n > max_load_factor * (double) num_slots;
             num_slots *= 2);
 
     node_ptr left, right;
-    left.b  = ahtable_create_n(num_slots);
+    left.b  = ahtable_create_lf(num_slots, max_load_factor);
     left.b->c0   = node.b->c0;
     left.b->c1   = j;
     left.b->flag = left.b->c0 == left.b->c1 ?
                       NODE_TYPE_PURE_BUCKET : NODE_TYPE_HYBRID_BUCKET;
 
 
-    for (num_slots = ahtable_initial_size;
-            (double) right_m > ahtable_max_load_factor * (double) num_slots;
+    for (num_slots = T->params.initial_size;
+            (double) right_n > max_load_factor * (double) num_slots;
             num_slots *= 2);
 
-    right.b = ahtable_create_n(num_slots);
+    right.b = ahtable_create_lf(num_slots, max_load_factor);
     right.b->c0   = j + 1;
     right.b->c1   = node.b->c1;
     right.b->flag = right.b->c0 == right.b->c1 ?
@@ -287,51 +471,129 @@ static void hattrie_split(hattrie_t* T, node_ptr parent, node_ptr node)
     for (; c <= node.b->c1; ++c)      parent.t->xs[c] = right;
 
 
+    /* hand the keys over to the new left or right node, pure buckets
+     * dropping their leading character; the old bucket goes once both are
+     * done with it */
+    ahtable_adopt(left.b, node.b, left.b->c0, left.b->c1,
+                  (*left.flag & NODE_TYPE_PURE_BUCKET) != 0, left_n);
+    ahtable_adopt(right.b, node.b, right.b->c0, right.b->c1,
+                  (*right.flag & NODE_TYPE_PURE_BUCKET) != 0, right_n);
+}
 
-    /* distribute keys to the new left or right node */
-    value_t* u;
-    value_t* v;
-    i = ahtable_iter_begin(node.b, false);
-    while (!ahtable_iter_finished(i)) {
-        key = ahtable_iter_key(i, &len);
-        u   = ahtable_iter_val(i);
-        assert(len > 0);
-
-        /* left */
-        if ((unsigned char) key[0] <= j) {
-            if (*left.flag & NODE_TYPE_PURE_BUCKET) {
-                v = ahtable_get(left.b, key + 1, len - 1);
-            }
-            else {
-                v = ahtable_get(left.b, key, len);
-            }
-            *v = *u;
+static void hattrie_reorder_node(node_ptr node)
+{
+    if (*node.flag & NODE_TYPE_TRIE) {
+        size_t i;
+        for (i = 0; i < NODE_CHILDS; ++i) {
+            if (i > 0 && node.t->xs[i].t == node.t->xs[i - 1].t) continue;
+            if (node.t->xs[i].t) hattrie_reorder_node(node.t->xs[i]);
         }
+    }
+    else {
+        ahtable_reorder(node.b);
+    }
+}
 
-        /* right */
-        else {
-            if (*right.flag & NODE_TYPE_PURE_BUCKET) {
-                v = ahtable_get(right.b, key + 1, len - 1);
-            }
-            else {
-                v = ahtable_get(right.b, key, len);
-            }
-            *v = *u;
+
+void hattrie_reorder(hattrie_t* T)
+{
+    hattrie_reorder_node(T->root);
+}
+
+
+/* reorder the bucket numbered *i in walk order, counting down *i over the
+ * buckets passed on the way; returns true once it has been found */
+static bool hattrie_reorder_nth(node_ptr node, size_t* i)
+{
+    if (*node.flag & NODE_TYPE_TRIE) {
+        size_t c;
+        for (c = 0; c < NODE_CHILDS; ++c) {
+            if (c > 0 && node.t->xs[c].t == node.t->xs[c - 1].t) continue;
+            if (node.t->xs[c].t && hattrie_reorder_nth(node.t->xs[c], i)) return true;
         }
+        return false;
+    }
+    if (*i == 0) {
+        ahtable_reorder(node.b);
+        return true;
+    }
+    --*i;
+    return false;
+}
 
-        ahtable_iter_next(i);
+
+size_t hattrie_reorder_step(hattrie_t* T, size_t i)
+{
+    size_t n = i;
+    return hattrie_reorder_nth(T->root, &n) ? i + 1 : 0;
+}
+
+
+size_t hattrie_size(const hattrie_t* T)
+{
+    return T->m;
+}
+
+
+static size_t hattrie_node_bytes(node_ptr node)
+{
+    size_t i, bytes;
+    if (*node.flag & NODE_TYPE_TRIE) {
+        bytes = sizeof(trie_node_t);
+        for (i = 0; i < NODE_CHILDS; ++i) {
+            if (i > 0 && node.t->xs[i].t == node.t->xs[i - 1].t) continue;
+            if (node.t->xs[i].t) bytes += hattrie_node_bytes(node.t->xs[i]);
+        }
+        return bytes;
     }
+    return ahtable_bytes(node.b);
+}
 
-    ahtable_iter_free(i);
-    ahtable_free(node.b);
+
+size_t hattrie_bytes(const hattrie_t* T)
+{
+    return sizeof(hattrie_t) + hattrie_node_bytes(T->root);
+}
+
+
+uint64_t hattrie_digest(const hattrie_t* T)
+{
+    return T->digest;
+}
+
+
+uint64_t hattrie_key_digest(const char* key, size_t len)
+{
+    return hash64(key, len, DIGEST_KEY);
 }
 
+
+/* the size at which a bucket is burst before inserting a key with len bytes
+ * left to consume */
+static inline size_t hattrie_burst_size(const hattrie_t* T, size_t len)
+{
+    if (len <= T->params.short_key_len) return T->params.short_bucket_size;
+    return T->params.max_bucket_size;
+}
+
+
+static value_t* hattrie_get_key(hattrie_t* T, const char* key, size_t len);
+
 value_t* hattrie_get(hattrie_t* T, const char* key, size_t len)
+{
+    size_t m_old = T->m;
+    value_t* val = hattrie_get_key(T, key, len);
+    if (T->m != m_old) T->digest += hattrie_key_digest(key, len);
+    return val;
+}
+
+
+static value_t* hattrie_get_key(hattrie_t* T, const char* key, size_t len)
 {
     node_ptr parent = T->root;
     assert(*parent.flag & NODE_TYPE_TRIE);
 
-    if (len == 0) return &parent.t->val;
+    if (len == 0) return hattrie_useval(T, parent);
 
     /* consume all trie nodes, now parent must be trie and child anything */
     node_ptr node = hattrie_consume(&parent, &key, &len, 0);
@@ -349,7 +611,7 @@ value_t* hattrie_get(hattrie_t* T, const char* key, size_t len)
 
 
     /* preemptively split the bucket if it is full */
-    while (ahtable_size(node.b) >= MAX_BUCKET_SIZE) {
+    while (ahtable_size(node.b) >= hattrie_burst_size(T, len)) {
         hattrie_split(T, parent, node);
 
         /* after the split, the node pointer is invalidated, so we search from
@@ -370,15 +632,15 @@ value_t* hattrie_get(hattrie_t* T, const char* key, size_t len)
     assert(*node.flag & NODE_TYPE_PURE_BUCKET || *node.flag & NODE_TYPE_HYBRID_BUCKET);
 
     assert(len > 0);
-    size_t m_old = node.b->m;
+    bool added;
     value_t* val;
     if (*node.flag & NODE_TYPE_PURE_BUCKET) {
-        val = ahtable_get(node.b, key + 1, len - 1);
+        val = ahtable_insert(node.b, key + 1, len - 1, &added);
     }
     else {
-        val = ahtable_get(node.b, key, len);
+        val = ahtable_insert(node.b, key, len, &added);
     }
-    T->m += (node.b->m - m_old);
+    if (added) ++T->m;
 
     return val;
 }
@@ -406,6 +668,10 @@ int hattrie_del(hattrie_t* T, const char* key, size_t len)
     node_ptr parent = T->root;
     assert(*parent.flag & NODE_TYPE_TRIE);
 
+    const char* key0 = key;
+    size_t len0 = len;
+    int ret;
+
     /* find node for deletion */
     node_ptr node = hattrie_find(T, &key, &len);
     if (node.flag == NULL) {
@@ -414,13 +680,15 @@ int hattrie_del(hattrie_t* T, const char* key, size_t len)
 
     /* if consumed on a trie node, clear the value */
     if (*node.flag & NODE_TYPE_TRIE) {
-        return hattrie_clrval(T, node);
+        ret = hattrie_clrval(T, node);
+    }
+    else {
+        /* remove from bucket */
+        ret = ahtable_del(node.b, key, len);
+        if (ret == 0) --T->m;
     }
 
-    /* remove from bucket */
-    size_t m_old = ahtable_size(node.b);
-    int ret =  ahtable_del(node.b, key, len);
-    T->m -= (m_old - ahtable_size(node.b));
+    if (ret == 0) T->digest -= hattrie_key_digest(key0, len0);
 
     /* merge empty buckets */
     /*! \todo */
@@ -460,9 +728,59 @@ struct hattrie_iter_t_
     bool sorted;
     ahtable_iter_t* i;
     hattrie_node_stack_t* stack;
+
+    /* only keys in the range [lo, hi) are returned */
+    unsigned int lo;
+    unsigned int hi;
 };
 
 
+static bool hattrie_iter_ranged(const hattrie_iter_t* i)
+{
+    return i->lo > 0 || i->hi < HATTRIE_RANGE_END;
+}
+
+
+/* Check if any key below child j of a trie node at the given level may fall in
+ * the iterator's range. Only the first two levels decide the range, anything
+ * deeper is entirely inside or outside of it. */
+static bool hattrie_iter_child_in_range(hattrie_iter_t* i, node_ptr node,
+                                        size_t level, int j)
+{
+    if (!hattrie_iter_ranged(i) || level > 1) return true;
+
+    /* a hybrid bucket is pushed once for all the characters it covers */
+    int a = j;
+    while (a > 0 && node.t->xs[a - 1].t == node.t->xs[j].t) --a;
+
+    unsigned int lo, hi;
+    if (level == 0) {
+        lo = (unsigned int) a << 8;
+        hi = ((unsigned int) j << 8) | 0xff;
+    }
+    else {
+        unsigned int c = (unsigned char) i->key[0];
+        lo = (c << 8) | (unsigned int) a;
+        hi = (c << 8) | (unsigned int) j;
+    }
+
+    return lo < i->hi && hi >= i->lo;
+}
+
+
+static bool hattrie_iter_in_range(hattrie_iter_t* i)
+{
+    if (!hattrie_iter_ranged(i)) return true;
+
+    size_t len;
+    const unsigned char* key = (const unsigned char*) hattrie_iter_key(i, &len);
+    unsigned int p = (len > 0 ? (unsigned int) key[0] << 8 : 0) |
+                     (len > 1 ? (unsigned int) key[1] : 0);
+
+    return p >= i->lo && p < i->hi;
+}
+
+
 static void hattrie_iter_pushchar(hattrie_iter_t* i, size_t level, char c)
 {
     if (i->keysize < level) {
@@ -493,7 +811,7 @@ static void hattrie_iter_nextnode(hattrie_iter_t* i)
     c     = i->stack->c;
     level = i->stack->level;
 
-    free(i->stack);
+    free_mem(i->stack);
     i->stack = next;
 
     if (*node.flag & NODE_TYPE_TRIE) {
@@ -511,6 +829,9 @@ static void hattrie_iter_nextnode(hattrie_iter_t* i)
             /* skip repeated pointers to hybrid bucket */
             if (j < NODE_MAXCHAR && node.t->xs[j].t == node.t->xs[j + 1].t) continue;
 
+            /* skip whole subtrees outside of a ranged iteration */
+            if (!hattrie_iter_child_in_range(i, node, level, j)) continue;
+
             // push stack
             next = i->stack;
             i->stack = malloc_or_die(sizeof(hattrie_node_stack_t));
@@ -534,10 +855,22 @@ static void hattrie_iter_nextnode(hattrie_iter_t* i)
 
 
 hattrie_iter_t* hattrie_iter_begin(const hattrie_t* T, bool sorted)
+{
+    return hattrie_iter_begin_range(T, sorted, 0, HATTRIE_RANGE_END);
+}
+
+
+static void hattrie_iter_step(hattrie_iter_t* i);
+
+
+hattrie_iter_t* hattrie_iter_begin_range(const hattrie_t* T, bool sorted,
+                                         unsigned int lo, unsigned int hi)
 {
     hattrie_iter_t* i = malloc_or_die(sizeof(hattrie_iter_t));
     i->T = T;
     i->sorted = sorted;
+    i->lo = lo;
+    i->hi = hi;
     i->i = NULL;
     i->keysize = 16;
     i->key = malloc_or_die(i->keysize * sizeof(char));
@@ -565,11 +898,24 @@ hattrie_iter_t* hattrie_iter_begin(const hattrie_t* T, bool sorted)
         i->i = NULL;
     }
 
+    while (!hattrie_iter_finished(i) && !hattrie_iter_in_range(i)) {
+        hattrie_iter_step(i);
+    }
+
     return i;
 }
 
 
 void hattrie_iter_next(hattrie_iter_t* i)
+{
+    do {
+        hattrie_iter_step(i);
+    } while (!hattrie_iter_finished(i) && !hattrie_iter_in_range(i));
+}
+
+
+/* advance to the next key, ignoring the iterator's range */
+static void hattrie_iter_step(hattrie_iter_t* i)
 {
     if (hattrie_iter_finished(i)) return;
 
@@ -611,12 +957,12 @@ void hattrie_iter_free(hattrie_iter_t* i)
     hattrie_node_stack_t* next;
     while (i->stack) {
         next = i->stack->next;
-        free(i->stack);
+        free_mem(i->stack);
         i->stack = next;
     }
 
-    free(i->key);
-    free(i);
+    free_mem(i->key);
+    free_mem(i);
 }
 
 
@@ -654,3 +1000,209 @@ value_t* hattrie_iter_val(hattrie_iter_t* i)
 
     return ahtable_iter_val(i->i);
 }
+
+
+/* Set algebra.
+ *
+ * Keys collected while iterating are buffered here (each prefixed by its
+ * length) and only applied once the iterator is gone, as deleting from a
+ * bucket invalidates iterators over it. */
+
+typedef struct hattrie_keybuf_t_
+{
+    char*  buf;
+    size_t len;
+    size_t size;
+} hattrie_keybuf_t;
+
+
+static void hattrie_keybuf_push(hattrie_keybuf_t* kb, const char* key, size_t len)
+{
+    size_t need = kb->len + sizeof(size_t) + len;
+    if (kb->size < need) {
+        while (kb->size < need) kb->size = kb->size ? 2 * kb->size : 4096;
+        kb->buf = realloc_or_die(kb->buf, kb->size);
+    }
+    memcpy(kb->buf + kb->len, &len, sizeof(size_t));
+    memcpy(kb->buf + kb->len + sizeof(size_t), key, len);
+    kb->len = need;
+}
+
+
+/* delete every buffered key from T and release the buffer */
+static void hattrie_keybuf_del(hattrie_keybuf_t* kb, hattrie_t* T)
+{
+    size_t len;
+    const char* p = kb->buf;
+    while (p < kb->buf + kb->len) {
+        memcpy(&len, p, sizeof(size_t));
+        p += sizeof(size_t);
+        hattrie_del(T, p, len);
+        p += len;
+    }
+    free_mem(kb->buf);
+}
+
+
+/* copy all keys of T that are (or are not) present in A into a buffer */
+static void hattrie_collect(hattrie_t* T, const hattrie_t* A, bool present,
+                            hattrie_keybuf_t* kb)
+{
+    const char* key;
+    size_t len;
+    hattrie_iter_t* i = hattrie_iter_begin(T, false);
+    for (; !hattrie_iter_finished(i); hattrie_iter_next(i)) {
+        key = hattrie_iter_key(i, &len);
+        if ((hattrie_tryget((hattrie_t*) A, key, len) != NULL) == present) {
+            hattrie_keybuf_push(kb, key, len);
+        }
+    }
+    hattrie_iter_free(i);
+}
+
+
+/* replace the contents of T with those of D, which is consumed */
+static void hattrie_swap_in(hattrie_t* T, hattrie_t* D)
+{
+    hattrie_free_node(T->root);
+    T->root   = D->root;
+    T->m      = D->m;
+    T->digest = D->digest;
+    free_mem(D);
+}
+
+
+/* insert the keys of A into T, with A's values for the keys T lacks, or for
+ * every key if overwrite is set */
+static void hattrie_insert_all(hattrie_t* T, const hattrie_t* A, bool overwrite)
+{
+    const char* key;
+    size_t len, m;
+    value_t* val;
+    hattrie_iter_t* i = hattrie_iter_begin(A, false);
+    for (; !hattrie_iter_finished(i); hattrie_iter_next(i)) {
+        key = hattrie_iter_key(i, &len);
+        m   = T->m;
+        val = hattrie_get(T, key, len);
+        if (overwrite || T->m != m) *val = *hattrie_iter_val(i);
+    }
+    hattrie_iter_free(i);
+}
+
+
+void hattrie_union(hattrie_t* T, const hattrie_t* A)
+{
+    if (T == A || A->m == 0) return;
+
+    /* nothing to merge with, take the whole structure */
+    if (T->m == 0) {
+        hattrie_swap_in(T, hattrie_dup(A));
+        return;
+    }
+
+    /* walk the smaller side: a larger A is copied whole and T's keys put
+     * back into the copy, keeping their values */
+    if (T->m < A->m) {
+        hattrie_t* D = hattrie_dup(A);
+        hattrie_insert_all(D, T, true);
+        hattrie_swap_in(T, D);
+        return;
+    }
+
+    hattrie_insert_all(T, A, false);
+}
+
+
+void hattrie_difference(hattrie_t* T, const hattrie_t* A)
+{
+    if (T == A) {
+        hattrie_clear(T);
+        return;
+    }
+    if (T->m == 0 || A->m == 0) return;
+
+    /* walk whichever side is smaller */
+    if (A->m <= T->m) {
+        const char* key;
+        size_t len;
+        hattrie_iter_t* i = hattrie_iter_begin(A, false);
+        for (; !hattrie_iter_finished(i); hattrie_iter_next(i)) {
+            key = hattrie_iter_key(i, &len);
+            hattrie_del(T, key, len);
+        }
+        hattrie_iter_free(i);
+    }
+    else {
+        hattrie_keybuf_t kb = {NULL, 0, 0};
+        hattrie_collect(T, A, true, &kb);
+        hattrie_keybuf_del(&kb, T);
+    }
+}
+
+
+void hattrie_intersect(hattrie_t* T, const hattrie_t* A)
+{
+    if (T == A || T->m == 0) return;
+    if (A->m == 0) {
+        hattrie_clear(T);
+        return;
+    }
+
+    /* a much smaller A is cheaper to rebuild from than to delete against */
+    if (A->m < T->m / 2) {
+        hattrie_t* R = hattrie_create_params(&T->params);
+        const char* key;
+        size_t len;
+        value_t* val;
+        hattrie_iter_t* i = hattrie_iter_begin(A, false);
+        for (; !hattrie_iter_finished(i); hattrie_iter_next(i)) {
+            key = hattrie_iter_key(i, &len);
+            val = hattrie_tryget(T, key, len);
+            if (val != NULL) *hattrie_get(R, key, len) = *val;
+        }
+        hattrie_iter_free(i);
+        hattrie_swap_in(T, R);
+        return;
+    }
+
+    hattrie_keybuf_t kb = {NULL, 0, 0};
+    hattrie_collect(T, A, false, &kb);
+    hattrie_keybuf_del(&kb, T);
+}
+
+
+/* The new tries start as a byte copy of one operand's structure, which is far
+ * cheaper than re-inserting its keys, and then take the in-place operation. */
+
+hattrie_t* hattrie_union_new(const hattrie_t* A, const hattrie_t* B)
+{
+    /* copy the larger operand, values still coming from A */
+    if (A->m < B->m) {
+        hattrie_t* R = hattrie_dup(B);
+        hattrie_insert_all(R, A, true);
+        return R;
+    }
+
+    hattrie_t* R = hattrie_dup(A);
+    hattrie_insert_all(R, B, false);
+    return R;
+}
+
+
+hattrie_t* hattrie_difference_new(const hattrie_t* A, const hattrie_t* B)
+{
+    hattrie_t* R = hattrie_dup(A);
+    hattrie_difference(R, B);
+    return R;
+}
+
+
+hattrie_t* hattrie_intersect_new(const hattrie_t* A, const hattrie_t* B)
+{
+    /* values come from A, so only start from B if there is nothing to keep */
+    if (A->m == 0 || B->m == 0) return hattrie_create_params(&A->params);
+
+    hattrie_t* R = hattrie_dup(A);
+    hattrie_intersect(R, B);
+    return R;
+}
@@ -28,7 +28,28 @@ extern "C" {
 
 typedef struct hattrie_t_ hattrie_t;
 
+/** How a trie bursts its buckets and sizes their hash tables. A bucket is
+ * burst once it holds max_bucket_size keys; if short_key_len is non-zero,
+ * inserting a key with at most that many bytes left to consume bursts at
+ * short_bucket_size instead, since short suffixes pack many more to a slot.
+ * Buckets start with initial_size slots, or as many more as keep a split
+ * bucket under max_load_factor keys per slot, and double their slots on
+ * reaching it. */
+typedef struct hattrie_params_t_
+{
+    size_t max_bucket_size;
+    size_t short_key_len;
+    size_t short_bucket_size;
+    size_t initial_size;
+    double max_load_factor;
+} hattrie_params_t;
+
+/** The parameters hattrie_create uses. */
+void hattrie_default_params (hattrie_params_t*);
+
 hattrie_t* hattrie_create (void);             //< Create an empty hat-trie.
+hattrie_t* hattrie_create_params (const hattrie_params_t*); //< With the given parameters.
+void       hattrie_params (const hattrie_t*, hattrie_params_t*); //< Read a trie's parameters.
 void       hattrie_free   (hattrie_t*);       //< Free all memory used by a trie.
 hattrie_t* hattrie_dup    (const hattrie_t*); //< Duplicate an existing trie.
 void       hattrie_clear  (hattrie_t*);       //< Remove all entries.
@@ -52,6 +73,52 @@ value_t* hattrie_tryget (hattrie_t*, const char* key, size_t len);
  */
 int hattrie_del(hattrie_t* T, const char* key, size_t len);
 
+size_t   hattrie_size   (const hattrie_t*); //< Number of stored keys.
+size_t   hattrie_bytes  (const hattrie_t*); //< Bytes of memory in use.
+
+/** Move the most accessed keys to the front of their bucket slots, see
+ * ahtable_reorder. The first call starts sampling lookups, as does the next
+ * call after a bucket is split, and calling it periodically keeps up with
+ * what is being looked up. It modifies the trie like hattrie_get.
+ */
+void     hattrie_reorder(hattrie_t*);
+
+/** hattrie_reorder one bucket at a time: reorders bucket i, in the order the
+ * trie is walked, and returns i + 1, or 0 once there are no more buckets.
+ * Starting at 0 and passing back what it returns covers the whole trie, so
+ * that a caller can let others at the trie between buckets. A bucket split
+ * or merged between steps may be reordered twice or not at all that round.
+ */
+size_t   hattrie_reorder_step(hattrie_t*, size_t i);
+
+/** Order-independent digest of the stored keys: the sum of
+ * hattrie_key_digest over every key, kept up to date on each insert and
+ * delete. Two tries holding the same keys have the same digest, however they
+ * were built. */
+uint64_t hattrie_digest (const hattrie_t*);
+
+/** Keyed 64 bit hash of a single key, as summed into hattrie_digest. */
+uint64_t hattrie_key_digest (const char* key, size_t len);
+
+
+/** Set algebra. The in-place forms update T with the keys of A, the others
+ * build a new trie from A and B and leave both alone. Where a key is present
+ * on both sides its value is taken from the first operand.
+ *
+ * The in-place forms walk the smaller side and probe the other; for a union
+ * into a smaller T that means copying A's structure and putting T's keys
+ * back. The new tries start from a structural copy of an operand rather than
+ * re-inserting its keys, the larger one for a union and otherwise the first,
+ * and an empty operand short-circuits to copying or clearing the whole
+ * structure.
+ */
+void       hattrie_union          (hattrie_t* T, const hattrie_t* A);
+void       hattrie_difference     (hattrie_t* T, const hattrie_t* A);
+void       hattrie_intersect      (hattrie_t* T, const hattrie_t* A);
+hattrie_t* hattrie_union_new      (const hattrie_t* A, const hattrie_t* B);
+hattrie_t* hattrie_difference_new (const hattrie_t* A, const hattrie_t* B);
+hattrie_t* hattrie_intersect_new  (const hattrie_t* A, const hattrie_t* B);
+
 typedef struct hattrie_iter_t_ hattrie_iter_t;
 
 hattrie_iter_t* hattrie_iter_begin     (const hattrie_t*, bool sorted);
@@ -61,6 +128,26 @@ void            hattrie_iter_free      (hattrie_iter_t*);
 const char*     hattrie_iter_key       (hattrie_iter_t*, size_t* len);
 value_t*        hattrie_iter_val       (hattrie_iter_t*);
 
+
+/* Keys are assigned to ranges by the value of their first two bytes, taken
+ * big-endian with missing bytes counting as zero, so ranges are disjoint and
+ * concatenating them in order preserves sorted order. */
+#define HATTRIE_RANGE_END 0x10000
+
+/** Split the key space into at most k disjoint ranges holding roughly equal
+ * numbers of keys. The estimate is taken from the root and second level
+ * fan-out and bucket sizes, so no keys are visited. Range i covers
+ * [bounds[i], bounds[i + 1]); bounds must have room for k + 1 entries.
+ * Returns the number of ranges written.
+ */
+size_t hattrie_partition(const hattrie_t*, size_t k, unsigned int* bounds);
+
+/** Iterate only the keys falling in the range [lo, hi), as defined above.
+ * Iterators over disjoint ranges are independent of each other and may be
+ * used concurrently as long as the trie is not modified. */
+hattrie_iter_t* hattrie_iter_begin_range (const hattrie_t*, bool sorted,
+                                          unsigned int lo, unsigned int hi);
+
 #ifdef __cplusplus
 }
 #endif
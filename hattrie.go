@@ -31,11 +31,47 @@ int get(hattrie_t* h, char* key, size_t len) {
 }
 
 void delete(hattrie_t* h, char* key, size_t len) {
-	value_t* val;
-	val = hattrie_tryget(h, key, len);
-	if (val != 0) {
-		*val = 0;
+	hattrie_del(h, key, len);
+}
+
+// Copy every key of exactly keylen bytes into out, in sorted order. Returns
+// the number of keys copied, or -1 if a key of another length is found.
+long dump(hattrie_t* h, char* out, size_t keylen, size_t max) {
+	hattrie_iter_t* i;
+	const char* key;
+	size_t len;
+	long n = 0;
+	for (i = hattrie_iter_begin(h, true); !hattrie_iter_finished(i); hattrie_iter_next(i)) {
+		key = hattrie_iter_key(i, &len);
+		if (len != keylen || (size_t) n >= max) {
+			n = -1;
+			break;
+		}
+		memcpy(out + n * keylen, key, keylen);
+		n++;
 	}
+	hattrie_iter_free(i);
+	return n;
+}
+
+// Count how many of the n keys of keylen bytes packed in keys are present.
+size_t count(hattrie_t* h, char* keys, size_t keylen, size_t n) {
+	size_t i, found = 0;
+	for (i = 0; i < n; i++) {
+		if (hattrie_tryget(h, keys + i * keylen, keylen) != NULL) found++;
+	}
+	return found;
+}
+
+// Set or delete each of the n keys of keylen bytes packed in keys.
+void set_keys(hattrie_t* h, char* keys, size_t keylen, size_t n) {
+	size_t i;
+	for (i = 0; i < n; i++) *hattrie_get(h, keys + i * keylen, keylen) = 1;
+}
+
+void delete_keys(hattrie_t* h, char* keys, size_t keylen, size_t n) {
+	size_t i;
+	for (i = 0; i < n; i++) hattrie_del(h, keys + i * keylen, keylen);
 }
 
 char* hattrie_iter_key_string(hattrie_iter_t* i, size_t* len) {
@@ -51,6 +87,7 @@ char* hattrie_iter_key_string(hattrie_iter_t* i, size_t* len) {
 import "C"
 
 import (
+	"fmt"
 	"runtime"
 	"sync"
 	"unsafe"
@@ -66,12 +103,85 @@ func finalizeHatTrie(c *HatTrie) {
 }
 
 func NewTrie() *HatTrie {
-	trie := C.start()
-	out := &HatTrie{
-		trie: trie,
+	return wrapTrie(C.start())
+}
+
+// TrieParams tune how a trie bursts its buckets into trie nodes and sizes
+// their hash tables.  A zero field takes its default, which suits text more
+// than our 4 and 32 byte binary keys; webserver -autotune measures others
+// against the lists being served.
+type TrieParams struct {
+	// keys a bucket holds before it is burst
+	MaxBucketSize int
+	// if non-zero, inserting a key with at most ShortKeyLen bytes left below
+	// its bucket bursts it at ShortBucketSize instead
+	ShortKeyLen     int
+	ShortBucketSize int
+	// hash slots in a new bucket
+	InitialSlots int
+	// keys per slot before a bucket doubles its slots
+	MaxLoadFactor float64
+}
+
+// DefaultTrieParams are the parameters NewTrie uses.
+func DefaultTrieParams() TrieParams {
+	var p C.hattrie_params_t
+	C.hattrie_default_params(&p)
+	return trieParamsFromC(&p)
+}
+
+func trieParamsFromC(p *C.hattrie_params_t) TrieParams {
+	return TrieParams{
+		MaxBucketSize:   int(p.max_bucket_size),
+		ShortKeyLen:     int(p.short_key_len),
+		ShortBucketSize: int(p.short_bucket_size),
+		InitialSlots:    int(p.initial_size),
+		MaxLoadFactor:   float64(p.max_load_factor),
 	}
-	runtime.SetFinalizer(out, finalizeHatTrie)
-	return out
+}
+
+func (p TrieParams) String() string {
+	s := fmt.Sprintf("bucket=%d slots=%d load=%g", p.MaxBucketSize, p.InitialSlots, p.MaxLoadFactor)
+	if p.ShortKeyLen > 0 {
+		s += fmt.Sprintf(" short=%d:%d", p.ShortKeyLen, p.ShortBucketSize)
+	}
+	return s
+}
+
+// NewTrieWithParams returns an empty trie tuned by p.  Copies and the results
+// of set operations keep the parameters of the trie they start from.
+func NewTrieWithParams(p TrieParams) *HatTrie {
+	d := DefaultTrieParams()
+	if p.MaxBucketSize <= 0 {
+		p.MaxBucketSize = d.MaxBucketSize
+	}
+	if p.ShortKeyLen <= 0 {
+		p.ShortKeyLen = 0
+	}
+	if p.ShortBucketSize <= 0 {
+		p.ShortBucketSize = p.MaxBucketSize
+	}
+	if p.InitialSlots <= 0 {
+		p.InitialSlots = d.InitialSlots
+	}
+	if p.MaxLoadFactor <= 0 {
+		p.MaxLoadFactor = d.MaxLoadFactor
+	}
+	cp := C.hattrie_params_t{
+		max_bucket_size:   C.size_t(p.MaxBucketSize),
+		short_key_len:     C.size_t(p.ShortKeyLen),
+		short_bucket_size: C.size_t(p.ShortBucketSize),
+		initial_size:      C.size_t(p.InitialSlots),
+		max_load_factor:   C.double(p.MaxLoadFactor),
+	}
+	return wrapTrie(C.hattrie_create_params(&cp))
+}
+
+// Params returns the parameters the trie was created with.
+func (h *HatTrie) Params() TrieParams {
+	var p C.hattrie_params_t
+	C.hattrie_params(h.trie, &p)
+	return trieParamsFromC(&p)
 }
 
 func (h *HatTrie) Delete(key string) {
@@ -102,8 +212,212 @@ func (h *HatTrie) Get(key string) bool {
 	return val == 1
 }
 
+// lockPair write-locks h and read-locks o, always in the same order so that
+// operations running in opposite directions can't deadlock.
+func lockPair(h *HatTrie, o *HatTrie) (unlock func()) {
+	if h == o {
+		h.l.Lock()
+		return h.l.Unlock
+	}
+	if uintptr(unsafe.Pointer(h)) < uintptr(unsafe.Pointer(o)) {
+		h.l.Lock()
+		o.l.RLock()
+	} else {
+		o.l.RLock()
+		h.l.Lock()
+	}
+	return func() {
+		o.l.RUnlock()
+		h.l.Unlock()
+	}
+}
+
+// rlockPair read-locks both tries in a consistent order.
+func rlockPair(a *HatTrie, b *HatTrie) (unlock func()) {
+	if a == b {
+		a.l.RLock()
+		return a.l.RUnlock
+	}
+	if uintptr(unsafe.Pointer(a)) > uintptr(unsafe.Pointer(b)) {
+		a, b = b, a
+	}
+	a.l.RLock()
+	b.l.RLock()
+	return func() {
+		b.l.RUnlock()
+		a.l.RUnlock()
+	}
+}
+
+func wrapTrie(trie *C.hattrie_t) *HatTrie {
+	out := &HatTrie{
+		trie: trie,
+	}
+	runtime.SetFinalizer(out, finalizeHatTrie)
+	return out
+}
+
+// Copy returns an independent copy of the trie.
+func (h *HatTrie) Copy() *HatTrie {
+	h.l.RLock()
+	defer h.l.RUnlock()
+
+	return wrapTrie(C.hattrie_dup(h.trie))
+}
+
+// Clone is Copy, as a SetBackend.
+func (h *HatTrie) Clone() SetBackend {
+	return h.Copy()
+}
+
+// Union adds every key of o to h.
+func (h *HatTrie) Union(o *HatTrie) {
+	defer lockPair(h, o)()
+	C.hattrie_union(h.trie, o.trie)
+}
+
+// Difference removes every key of o from h.
+func (h *HatTrie) Difference(o *HatTrie) {
+	defer lockPair(h, o)()
+	C.hattrie_difference(h.trie, o.trie)
+}
+
+// Intersect removes every key from h that is not also in o.
+func (h *HatTrie) Intersect(o *HatTrie) {
+	defer lockPair(h, o)()
+	C.hattrie_intersect(h.trie, o.trie)
+}
+
+// UnionTries returns a new trie holding the keys of both a and b.
+func UnionTries(a *HatTrie, b *HatTrie) *HatTrie {
+	defer rlockPair(a, b)()
+	return wrapTrie(C.hattrie_union_new(a.trie, b.trie))
+}
+
+// DifferenceTries returns a new trie holding the keys of a that are not in b.
+func DifferenceTries(a *HatTrie, b *HatTrie) *HatTrie {
+	defer rlockPair(a, b)()
+	return wrapTrie(C.hattrie_difference_new(a.trie, b.trie))
+}
+
+// IntersectTries returns a new trie holding the keys in both a and b.
+func IntersectTries(a *HatTrie, b *HatTrie) *HatTrie {
+	defer rlockPair(a, b)()
+	return wrapTrie(C.hattrie_intersect_new(a.trie, b.trie))
+}
+
+// Reorder moves the keys Get has found most often since the last call to
+// the front of their hash slots, so that they are found sooner.  Lookups are
+// only sampled once it has been called, one in 16 of them updating a count,
+// so calling it now and then on a trie that is mostly read adapts it to
+// what is being looked up.  It takes the trie's write lock one bucket at a
+// time, so lookups only wait for the bucket being reordered rather than the
+// whole trie.
+func (h *HatTrie) Reorder() {
+	for i := C.size_t(0); ; {
+		h.l.Lock()
+		i = C.hattrie_reorder_step(h.trie, i)
+		h.l.Unlock()
+		if i == 0 {
+			return
+		}
+	}
+}
+
+// Size returns the number of keys stored in the trie.
+func (h *HatTrie) Size() int {
+	h.l.RLock()
+	defer h.l.RUnlock()
+
+	return int(C.hattrie_size(h.trie))
+}
+
+// Digest returns an order-independent digest of the keys in the trie.  It is
+// maintained on every Set and Delete, so comparing the contents of two tries
+// (or a trie and a snapshot) costs O(1).
+func (h *HatTrie) Digest() uint64 {
+	h.l.RLock()
+	defer h.l.RUnlock()
+
+	return uint64(C.hattrie_digest(h.trie))
+}
+
+// keyDigest is the contribution of a single key to a trie's Digest.
+func keyDigest(key []byte) uint64 {
+	if len(key) == 0 {
+		return uint64(C.hattrie_key_digest(nil, 0))
+	}
+	return uint64(C.hattrie_key_digest((*C.char)(unsafe.Pointer(&key[0])), C.size_t(len(key))))
+}
+
+// Stats reports the keys and the memory holding them.
+func (h *HatTrie) Stats() SetStats {
+	h.l.RLock()
+	defer h.l.RUnlock()
+
+	return SetStats{Keys: int(C.hattrie_size(h.trie)), Bytes: int64(C.hattrie_bytes(h.trie))}
+}
+
+// Freeze does nothing, a trie is as quick to read after changes as before.
+func (h *HatTrie) Freeze() {}
+
+// SetKeys sets each of the keyLen byte keys packed in keys, in a single call.
+func (h *HatTrie) SetKeys(keys []byte, keyLen int) {
+	if len(keys) < keyLen {
+		return
+	}
+	h.l.Lock()
+	defer h.l.Unlock()
+
+	C.set_keys(h.trie, (*C.char)(unsafe.Pointer(&keys[0])), C.size_t(keyLen), C.size_t(len(keys)/keyLen))
+}
+
+// DeleteKeys deletes each of the keyLen byte keys packed in keys.
+func (h *HatTrie) DeleteKeys(keys []byte, keyLen int) {
+	if len(keys) < keyLen {
+		return
+	}
+	h.l.Lock()
+	defer h.l.Unlock()
+
+	C.delete_keys(h.trie, (*C.char)(unsafe.Pointer(&keys[0])), C.size_t(keyLen), C.size_t(len(keys)/keyLen))
+}
+
+// SortedKeys returns all keys concatenated in sorted order.  Every key must be
+// keyLen bytes long.
+func (h *HatTrie) SortedKeys(keyLen int) ([]byte, error) {
+	h.l.RLock()
+	defer h.l.RUnlock()
+
+	size := int(C.hattrie_size(h.trie))
+	if size == 0 {
+		return []byte{}, nil
+	}
+	out := make([]byte, size*keyLen)
+	n := C.dump(h.trie, (*C.char)(unsafe.Pointer(&out[0])), C.size_t(keyLen), C.size_t(size))
+	if n < 0 {
+		return nil, fmt.Errorf("Trie holds keys that are not %d bytes long", keyLen)
+	}
+	return out[:int(n)*keyLen], nil
+}
+
+// CountKeys returns how many of the keyLen byte keys packed in keys are in the
+// trie, looking them all up in a single call.
+func (h *HatTrie) CountKeys(keys []byte, keyLen int) int {
+	if len(keys) < keyLen {
+		return 0
+	}
+	h.l.RLock()
+	defer h.l.RUnlock()
+
+	n := C.count(h.trie, (*C.char)(unsafe.Pointer(&keys[0])), C.size_t(keyLen), C.size_t(len(keys)/keyLen))
+	return int(n)
+}
+
 type HatTrieIterator struct {
 	iterator *C.hattrie_iter_t
+	// keeps the trie from being finalized while we walk it
+	trie *HatTrie
 }
 
 func finalizeHatTrieIterator(i *HatTrieIterator) {
@@ -114,11 +428,57 @@ func (h *HatTrie) Iterator() *HatTrieIterator {
 	out := C.hattrie_iter_begin(h.trie, true)
 	hi := &HatTrieIterator{
 		iterator: out,
+		trie:     h,
 	}
 	runtime.SetFinalizer(hi, finalizeHatTrieIterator)
 	return hi
 }
 
+// Partition splits the trie into at most k disjoint key ranges holding
+// roughly equal numbers of keys and returns an independent iterator over each
+// range, in key order.  The split is estimated from the shape of the trie
+// rather than by visiting keys.  The iterators may be drained concurrently as
+// long as the trie is not modified in the meantime.
+func (h *HatTrie) Partition(k int, sorted bool) []*HatTrieIterator {
+	if k < 1 {
+		k = 1
+	}
+	h.l.RLock()
+	defer h.l.RUnlock()
+
+	bounds := make([]C.uint, k+1)
+	n := int(C.hattrie_partition(h.trie, C.size_t(k), &bounds[0]))
+	out := make([]*HatTrieIterator, n)
+	for x := 0; x < n; x++ {
+		hi := &HatTrieIterator{
+			iterator: C.hattrie_iter_begin_range(
+				h.trie, C.bool(sorted), bounds[x], bounds[x+1]),
+			trie: h,
+		}
+		runtime.SetFinalizer(hi, finalizeHatTrieIterator)
+		out[x] = hi
+	}
+	return out
+}
+
+// Iterate calls f with each key, in order, until it returns false.  The
+// trie must not be changed by f.
+func (h *HatTrie) Iterate(f func(key string) bool) {
+	h.l.RLock()
+	defer h.l.RUnlock()
+	i := C.hattrie_iter_begin(h.trie, true)
+	defer C.hattrie_iter_free(i)
+	for ; !C.hattrie_iter_finished(i); C.hattrie_iter_next(i) {
+		keylen := C.size_t(0)
+		ckey := C.hattrie_iter_key_string(i, &keylen)
+		key := C.GoStringN(ckey, C.int(keylen))
+		C.free(unsafe.Pointer(ckey))
+		if !f(key) {
+			return
+		}
+	}
+}
+
 func (i *HatTrieIterator) Next() string {
 	if C.hattrie_iter_finished(i.iterator) {
 		return ""
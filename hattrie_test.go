@@ -1,7 +1,12 @@
 package safebrowsing
 
 import (
+	"crypto/sha256"
+	"math/rand"
+	"sort"
+	"sync"
 	"testing"
+	"time"
 )
 
 func TestNewTrie(t *testing.T) {
@@ -47,3 +52,690 @@ func TestIterator(t *testing.T) {
 		t.Fatal("iterator failed")
 	}
 }
+
+func randomTrie(n int, keyLen int, seed int64) (*HatTrie, map[string]bool) {
+	r := rand.New(rand.NewSource(seed))
+	trie := NewTrie()
+	keys := make(map[string]bool, n)
+	buf := make([]byte, keyLen)
+	for len(keys) < n {
+		r.Read(buf)
+		key := string(buf)
+		keys[key] = true
+		trie.Set(key)
+	}
+	return trie, keys
+}
+
+func TestPartition(t *testing.T) {
+	trie, keys := randomTrie(100000, 4, 1)
+	// a few short keys to exercise values stored on trie nodes
+	for _, key := range []string{"\x00", "\x01", "\x01\x02", "\xff"} {
+		trie.Set(key)
+		keys[key] = true
+	}
+
+	for _, k := range []int{1, 2, 3, 8, 64} {
+		parts := trie.Partition(k, true)
+		if len(parts) < 1 || len(parts) > k {
+			t.Fatalf("Partition(%d) returned %d ranges", k, len(parts))
+		}
+		seen := make(map[string]bool, len(keys))
+		last := ""
+		for _, i := range parts {
+			for key := i.Next(); key != ""; key = i.Next() {
+				if seen[key] {
+					t.Fatalf("Partition(%d) returned %x twice", k, key)
+				}
+				if key < last {
+					t.Fatalf("Partition(%d) out of order: %x after %x", k, key, last)
+				}
+				seen[key] = true
+				last = key
+			}
+		}
+		if len(seen) != len(keys) {
+			t.Fatalf("Partition(%d) returned %d keys, expected %d", k, len(seen), len(keys))
+		}
+	}
+
+	// ranges should come out reasonably balanced for random keys
+	parts := trie.Partition(4, false)
+	for x, i := range parts {
+		n := 0
+		for key := i.Next(); key != ""; key = i.Next() {
+			n++
+		}
+		if n < len(keys)/8 || n > len(keys)/2 {
+			t.Errorf("Partition range %d unbalanced: %d of %d keys", x, n, len(keys))
+		}
+	}
+}
+
+func TestPartitionEmpty(t *testing.T) {
+	parts := NewTrie().Partition(4, true)
+	if len(parts) != 1 {
+		t.Fatalf("Expected a single range for an empty trie, got %d", len(parts))
+	}
+	if key := parts[0].Next(); key != "" {
+		t.Fatal("Empty trie returned a key")
+	}
+}
+
+var checksumTrie *HatTrie
+
+func benchmarkPartitionChecksum(b *testing.B, k int) {
+	if checksumTrie == nil {
+		checksumTrie, _ = randomTrie(1000000, 4, 1)
+	}
+	b.ResetTimer()
+	for n := 0; n < b.N; n++ {
+		parts := checksumTrie.Partition(k, true)
+		sums := make([][]byte, len(parts))
+		wg := sync.WaitGroup{}
+		for x, i := range parts {
+			wg.Add(1)
+			go func(x int, i *HatTrieIterator) {
+				defer wg.Done()
+				hasher := sha256.New()
+				for key := i.Next(); key != ""; key = i.Next() {
+					hasher.Write([]byte(key))
+				}
+				sums[x] = hasher.Sum(nil)
+			}(x, i)
+		}
+		wg.Wait()
+		hasher := sha256.New()
+		for _, sum := range sums {
+			hasher.Write(sum)
+		}
+		hasher.Sum(nil)
+	}
+}
+
+func BenchmarkPartitionChecksum1(b *testing.B) { benchmarkPartitionChecksum(b, 1) }
+func BenchmarkPartitionChecksum2(b *testing.B) { benchmarkPartitionChecksum(b, 2) }
+func BenchmarkPartitionChecksum4(b *testing.B) { benchmarkPartitionChecksum(b, 4) }
+func BenchmarkPartitionChecksum8(b *testing.B) { benchmarkPartitionChecksum(b, 8) }
+
+func TestDigest(t *testing.T) {
+	a := NewTrie()
+	b := NewTrie()
+	if a.Digest() != 0 || a.Size() != 0 {
+		t.Fatal("Empty trie has a digest")
+	}
+	keys := []string{"", "a", "ab", "abc", "test", "1234", "zzzzzzzz"}
+	for _, key := range keys {
+		a.Set(key)
+	}
+	for x := len(keys) - 1; x >= 0; x-- {
+		b.Set(keys[x])
+		// setting twice must not count twice
+		b.Set(keys[x])
+	}
+	b.Set("extra")
+	if a.Digest() == b.Digest() {
+		t.Fatal("Digest does not depend on contents")
+	}
+	b.Delete("extra")
+	b.Delete("not there")
+	if a.Digest() != b.Digest() || a.Size() != b.Size() {
+		t.Fatal("Digest depends on insertion order")
+	}
+	if a.Size() != len(keys) {
+		t.Fatalf("Expected %d keys, got %d", len(keys), a.Size())
+	}
+	for _, key := range keys {
+		a.Delete(key)
+	}
+	if a.Digest() != 0 || a.Size() != 0 {
+		t.Fatal("Digest not cleared by deletes")
+	}
+}
+
+func TestDigestAcrossBursts(t *testing.T) {
+	// enough keys to burst buckets several times over
+	trie, keys := randomTrie(50000, 4, 2)
+	var digest uint64
+	for key := range keys {
+		digest += keyDigest([]byte(key))
+	}
+	if trie.Digest() != digest {
+		t.Fatal("Digest changed while bursting buckets")
+	}
+}
+
+func trieKeys(trie *HatTrie) map[string]bool {
+	keys := make(map[string]bool)
+	i := trie.Iterator()
+	for key := i.Next(); key != ""; key = i.Next() {
+		keys[key] = true
+	}
+	return keys
+}
+
+func checkTrie(t *testing.T, name string, trie *HatTrie, expected map[string]bool) {
+	keys := trieKeys(trie)
+	if len(keys) != len(expected) || trie.Size() != len(expected) {
+		t.Fatalf("%s: got %d keys (size %d), expected %d",
+			name, len(keys), trie.Size(), len(expected))
+	}
+	var digest uint64
+	for key := range expected {
+		if !keys[key] || !trie.Get(key) {
+			t.Fatalf("%s: missing %x", name, key)
+		}
+		digest += keyDigest([]byte(key))
+	}
+	if trie.Digest() != digest {
+		t.Fatalf("%s: digest out of sync", name)
+	}
+}
+
+func TestSetAlgebra(t *testing.T) {
+	// overlapping sets, large enough to hold burst buckets
+	a, aKeys := randomTrie(40000, 4, 3)
+	b := NewTrie()
+	bKeys := make(map[string]bool)
+	x := 0
+	for key := range aKeys {
+		if x%2 == 0 {
+			b.Set(key)
+			bKeys[key] = true
+		}
+		x++
+	}
+	extra, extraKeys := randomTrie(20000, 4, 4)
+	b.Union(extra)
+	for key := range extraKeys {
+		bKeys[key] = true
+	}
+	checkTrie(t, "union into", b, bKeys)
+
+	union := make(map[string]bool)
+	difference := make(map[string]bool)
+	intersection := make(map[string]bool)
+	for key := range aKeys {
+		union[key] = true
+		if bKeys[key] {
+			intersection[key] = true
+		} else {
+			difference[key] = true
+		}
+	}
+	for key := range bKeys {
+		union[key] = true
+	}
+
+	checkTrie(t, "UnionTries", UnionTries(a, b), union)
+	checkTrie(t, "DifferenceTries", DifferenceTries(a, b), difference)
+	checkTrie(t, "IntersectTries", IntersectTries(a, b), intersection)
+
+	c := a.Copy()
+	c.Union(b)
+	checkTrie(t, "Union", c, union)
+	c = a.Copy()
+	c.Difference(b)
+	checkTrie(t, "Difference", c, difference)
+	c = a.Copy()
+	c.Intersect(b)
+	checkTrie(t, "Intersect", c, intersection)
+
+	// the copies must not have disturbed the original
+	checkTrie(t, "original", a, aKeys)
+
+	// a small trie against a much larger one
+	shared := ""
+	for key := range intersection {
+		shared = key
+		break
+	}
+	small := NewTrie()
+	small.Set("nope")
+	small.Set(shared)
+
+	c = a.Copy()
+	c.Intersect(small)
+	checkTrie(t, "Intersect with small", c, map[string]bool{shared: true})
+	small.Difference(a)
+	checkTrie(t, "small Difference", small, map[string]bool{"nope": true})
+
+	// unions copy the larger side whichever operand it is
+	withSmall := map[string]bool{"nope": true}
+	for key := range aKeys {
+		withSmall[key] = true
+	}
+	checkTrie(t, "UnionTries small first", UnionTries(small, a), withSmall)
+	checkTrie(t, "UnionTries small second", UnionTries(a, small), withSmall)
+	small.Union(a)
+	checkTrie(t, "small Union", small, withSmall)
+	checkTrie(t, "original after small Union", a, aKeys)
+}
+
+func TestSetAlgebraEdgeCases(t *testing.T) {
+	empty := NewTrie()
+	a := NewTrie()
+	a.Set("a")
+	a.Set("ab")
+	expected := map[string]bool{"a": true, "ab": true}
+
+	checkTrie(t, "union with empty", UnionTries(empty, a), expected)
+	checkTrie(t, "difference with empty", DifferenceTries(a, empty), expected)
+	checkTrie(t, "intersect with empty", IntersectTries(a, empty), map[string]bool{})
+
+	c := NewTrie()
+	c.Union(a)
+	checkTrie(t, "union into empty", c, expected)
+	c.Union(c)
+	checkTrie(t, "union with itself", c, expected)
+	c.Intersect(c)
+	checkTrie(t, "intersect with itself", c, expected)
+	c.Intersect(empty)
+	checkTrie(t, "intersect into empty", c, map[string]bool{})
+	c = a.Copy()
+	c.Difference(c)
+	checkTrie(t, "difference with itself", c, map[string]bool{})
+	c.Set("new")
+	checkTrie(t, "reuse after clear", c, map[string]bool{"new": true})
+}
+
+var setAlgebraA, setAlgebraB *HatTrie
+
+// two 1M key sets sharing half their keys
+func setAlgebraFixture() (*HatTrie, *HatTrie) {
+	if setAlgebraA == nil {
+		setAlgebraA, _ = randomTrie(1000000, 4, 5)
+		setAlgebraB, _ = randomTrie(500000, 4, 6)
+		i := setAlgebraA.Iterator()
+		for n := 0; n < 500000; n++ {
+			setAlgebraB.Set(i.Next())
+		}
+	}
+	return setAlgebraA, setAlgebraB
+}
+
+func BenchmarkUnionTries(b *testing.B) {
+	x, y := setAlgebraFixture()
+	b.ResetTimer()
+	for n := 0; n < b.N; n++ {
+		UnionTries(x, y)
+	}
+}
+
+func BenchmarkUnionInPlace(b *testing.B) {
+	x, y := setAlgebraFixture()
+	b.ResetTimer()
+	for n := 0; n < b.N; n++ {
+		b.StopTimer()
+		c := x.Copy()
+		b.StartTimer()
+		c.Union(y)
+	}
+}
+
+func BenchmarkUnionKeyByKey(b *testing.B) {
+	x, y := setAlgebraFixture()
+	b.ResetTimer()
+	for n := 0; n < b.N; n++ {
+		b.StopTimer()
+		c := x.Copy()
+		b.StartTimer()
+		i := y.Iterator()
+		for key := i.Next(); key != ""; key = i.Next() {
+			c.Set(key)
+		}
+	}
+}
+
+func BenchmarkDifferenceTries(b *testing.B) {
+	x, y := setAlgebraFixture()
+	b.ResetTimer()
+	for n := 0; n < b.N; n++ {
+		DifferenceTries(x, y)
+	}
+}
+
+func BenchmarkDifferenceInPlace(b *testing.B) {
+	x, y := setAlgebraFixture()
+	b.ResetTimer()
+	for n := 0; n < b.N; n++ {
+		b.StopTimer()
+		c := x.Copy()
+		b.StartTimer()
+		c.Difference(y)
+	}
+}
+
+func BenchmarkDifferenceKeyByKey(b *testing.B) {
+	x, y := setAlgebraFixture()
+	b.ResetTimer()
+	for n := 0; n < b.N; n++ {
+		b.StopTimer()
+		c := x.Copy()
+		b.StartTimer()
+		i := y.Iterator()
+		for key := i.Next(); key != ""; key = i.Next() {
+			c.Delete(key)
+		}
+	}
+}
+
+func BenchmarkIntersectTries(b *testing.B) {
+	x, y := setAlgebraFixture()
+	b.ResetTimer()
+	for n := 0; n < b.N; n++ {
+		IntersectTries(x, y)
+	}
+}
+
+func BenchmarkIntersectInPlace(b *testing.B) {
+	x, y := setAlgebraFixture()
+	b.ResetTimer()
+	for n := 0; n < b.N; n++ {
+		b.StopTimer()
+		c := x.Copy()
+		b.StartTimer()
+		c.Intersect(y)
+	}
+}
+
+func BenchmarkIntersectKeyByKey(b *testing.B) {
+	x, y := setAlgebraFixture()
+	b.ResetTimer()
+	for n := 0; n < b.N; n++ {
+		b.StopTimer()
+		c := x.Copy()
+		b.StartTimer()
+		missing := make([]string, 0)
+		i := c.Iterator()
+		for key := i.Next(); key != ""; key = i.Next() {
+			if !y.Get(key) {
+				missing = append(missing, key)
+			}
+		}
+		for _, key := range missing {
+			c.Delete(key)
+		}
+	}
+}
+
+func TestReorder(t *testing.T) {
+	r := rand.New(rand.NewSource(1))
+	trie := NewTrie()
+	keys := make([]string, 50000)
+	for i := range keys {
+		key := make([]byte, PREFIX_32B_SZ)
+		r.Read(key)
+		keys[i] = string(key)
+		trie.Set(keys[i])
+	}
+	digest := trie.Digest()
+
+	// look the last keys of their slots up repeatedly, with a delete in
+	// between to show a reorder copes with keys having moved
+	trie.Reorder()
+	for round := 0; round < 3; round++ {
+		for i := 0; i < 200000; i++ {
+			trie.Get(keys[len(keys)-1-i%100])
+		}
+		trie.Delete(keys[round])
+		trie.Reorder()
+		trie.Set(keys[round])
+	}
+
+	if trie.Size() != len(keys) || trie.Digest() != digest {
+		t.Fatalf("Reordering changed the keys: %d keys, digest %x", trie.Size(), trie.Digest())
+	}
+	for _, key := range keys {
+		if !trie.Get(key) {
+			t.Fatalf("Lost key %x", key)
+		}
+	}
+	if copied := trie.Copy(); copied.Digest() != digest {
+		t.Error("Copy of a reordered trie differs")
+	}
+}
+
+// TestReorderConcurrent reorders while keys are added, splitting buckets
+// between the steps of a reorder, and looked up.
+func TestReorderConcurrent(t *testing.T) {
+	trie := NewTrie()
+	keys := make([]string, 40000)
+	r := rand.New(rand.NewSource(3))
+	for i := range keys {
+		key := make([]byte, PREFIX_32B_SZ)
+		r.Read(key)
+		keys[i] = string(key)
+	}
+	for _, key := range keys[:len(keys)/2] {
+		trie.Set(key)
+	}
+
+	var wg sync.WaitGroup
+	done := make(chan struct{})
+	wg.Add(2)
+	go func() {
+		defer wg.Done()
+		for _, key := range keys[len(keys)/2:] {
+			trie.Set(key)
+		}
+		close(done)
+	}()
+	go func() {
+		defer wg.Done()
+		for i := 0; ; i++ {
+			select {
+			case <-done:
+				return
+			default:
+			}
+			if !trie.Get(keys[i%100]) {
+				t.Errorf("Lost key %x during a reorder", keys[i%100])
+				return
+			}
+		}
+	}()
+	for {
+		trie.Reorder()
+		select {
+		case <-done:
+			wg.Wait()
+			expected := make(map[string]bool, len(keys))
+			for _, key := range keys {
+				expected[key] = true
+			}
+			checkTrie(t, "reordered", trie, expected)
+			return
+		default:
+		}
+	}
+}
+
+// benchmarkZipfLookup looks full hashes up with a Zipf distribution, the
+// way a few popular sites make up most lookups, reordering the trie every
+// so often or not at all.
+func benchmarkZipfLookup(b *testing.B, reorder bool) {
+	r := rand.New(rand.NewSource(2))
+	trie := NewTrie()
+	keys := make([]byte, 200000*PREFIX_32B_SZ)
+	r.Read(keys)
+	for i := 0; i < len(keys); i += PREFIX_32B_SZ {
+		trie.Set(string(keys[i : i+PREFIX_32B_SZ]))
+	}
+
+	// a batch of lookups, each key chosen by its rank
+	zipf := rand.NewZipf(r, 1.1, 1, uint64(len(keys)/PREFIX_32B_SZ-1))
+	batch := make([]byte, 4096*PREFIX_32B_SZ)
+	for i := 0; i < len(batch); i += PREFIX_32B_SZ {
+		k := int(zipf.Uint64()) * PREFIX_32B_SZ
+		copy(batch[i:], keys[k:k+PREFIX_32B_SZ])
+	}
+
+	if reorder {
+		trie.Reorder()
+		for i := 0; i < 3; i++ {
+			for j := 0; j < 20; j++ {
+				trie.CountKeys(batch, PREFIX_32B_SZ)
+			}
+			trie.Reorder()
+		}
+	}
+
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		if trie.CountKeys(batch, PREFIX_32B_SZ) != len(batch)/PREFIX_32B_SZ {
+			b.Fatal("Keys missing")
+		}
+	}
+	b.ReportMetric(float64(b.Elapsed().Nanoseconds())/float64(b.N*len(batch)/PREFIX_32B_SZ), "ns/lookup")
+}
+
+func BenchmarkZipfLookup(b *testing.B)          { benchmarkZipfLookup(b, false) }
+func BenchmarkZipfLookupReordered(b *testing.B) { benchmarkZipfLookup(b, true) }
+
+func TestTrieParams(t *testing.T) {
+	if p := NewTrie().Params(); p != DefaultTrieParams() || p.MaxBucketSize != 16384 {
+		t.Fatalf("Unexpected default parameters %s", p)
+	}
+	// tiny buckets with few slots that grow quickly, and a size class rule,
+	// so every policy is exercised
+	params := TrieParams{
+		MaxBucketSize:   16,
+		ShortKeyLen:     2,
+		ShortBucketSize: 64,
+		InitialSlots:    2,
+		MaxLoadFactor:   2,
+	}
+	rng := rand.New(rand.NewSource(1))
+	for _, keyLen := range []int{PREFIX_4B_SZ, PREFIX_32B_SZ} {
+		trie := NewTrieWithParams(params)
+		if trie.Params() != params {
+			t.Fatalf("Parameters %s not kept, got %s", params, trie.Params())
+		}
+		keys := make([]byte, 20000*keyLen)
+		rng.Read(keys)
+		trie.SetKeys(keys, keyLen)
+		if trie.Digest() != digestKeys(keys, keyLen) {
+			t.Fatalf("Trie of %d byte keys lost some", keyLen)
+		}
+		if trie.CountKeys(keys, keyLen) != trie.Size() {
+			t.Fatalf("Trie of %d byte keys can't find them all", keyLen)
+		}
+		c := trie.Copy()
+		if c.Params() != params {
+			t.Errorf("Copy lost the parameters")
+		}
+		trie.DeleteKeys(keys, keyLen)
+		if trie.Size() != 0 || trie.Digest() != 0 {
+			t.Errorf("Trie of %d byte keys not emptied", keyLen)
+		}
+		if c.CountKeys(keys, keyLen) != c.Size() {
+			t.Errorf("Copy can't find its keys")
+		}
+	}
+
+	// zero fields take their defaults
+	p := NewTrieWithParams(TrieParams{MaxBucketSize: 100}).Params()
+	if p.MaxBucketSize != 100 || p.ShortBucketSize != 100 ||
+		p.InitialSlots != DefaultTrieParams().InitialSlots ||
+		p.MaxLoadFactor != DefaultTrieParams().MaxLoadFactor {
+		t.Errorf("Unexpected parameters %s", p)
+	}
+}
+
+func TestIncrementalBursts(t *testing.T) {
+	// small buckets with many slots, then a bucket too big to burst with
+	// tables that grow quickly, so that the checks find buckets still
+	// adopting the keys of the one they burst from or of their old table
+	for _, params := range []TrieParams{
+		{MaxBucketSize: 256, InitialSlots: 1024},
+		{MaxBucketSize: 1 << 20, InitialSlots: 8, MaxLoadFactor: 2},
+	} {
+		testIncrementalBursts(t, params)
+	}
+}
+
+func testIncrementalBursts(t *testing.T, params TrieParams) {
+	rng := rand.New(rand.NewSource(1))
+	trie := NewTrieWithParams(params)
+	expected := make(map[string]bool)
+	buf := make([]byte, 6)
+	for n := 1; n <= 30000; n++ {
+		keyLen := 1 + rng.Intn(len(buf))
+		rng.Read(buf[:keyLen])
+		key := string(buf[:keyLen])
+		if rng.Intn(4) == 0 {
+			trie.Delete(key)
+			delete(expected, key)
+		} else {
+			trie.Set(key)
+			expected[key] = true
+		}
+		if n%1500 != 0 {
+			continue
+		}
+
+		checkTrie(t, "trie", trie, expected)
+		checkTrie(t, "copy", trie.Copy(), expected)
+		// and the sorted iterator
+		n, prev := 0, ""
+		for _, i := range trie.Partition(1, true) {
+			for key := i.Next(); key != ""; key = i.Next() {
+				if !expected[key] || n > 0 && prev >= key {
+					t.Fatalf("Unexpected or unsorted key %x", key)
+				}
+				n, prev = n+1, key
+			}
+		}
+		if n != len(expected) {
+			t.Fatalf("Sorted iterator gave %d of %d keys", n, len(expected))
+		}
+		// and the unsorted one
+		n = 0
+		for _, i := range trie.Partition(3, false) {
+			for key := i.Next(); key != ""; key = i.Next() {
+				if !expected[key] {
+					t.Fatalf("Unexpected key %x", key)
+				}
+				n++
+			}
+		}
+		if n != len(expected) {
+			t.Fatalf("Unsorted iterator gave %d of %d keys", n, len(expected))
+		}
+	}
+}
+
+// BenchmarkInsertLatency reports the slowest inserts into a growing trie,
+// which are the ones that burst a bucket or expand its table.
+func BenchmarkInsertLatency(b *testing.B) {
+	for _, c := range []struct {
+		name   string
+		params TrieParams
+	}{
+		{"default", DefaultTrieParams()},
+		{"expanding", TrieParams{InitialSlots: 256, MaxLoadFactor: 4}},
+	} {
+		b.Run(c.name, func(b *testing.B) {
+			const n = 1000000
+			keys := make([]byte, n*PREFIX_4B_SZ)
+			rand.New(rand.NewSource(1)).Read(keys)
+			latencies := make([]time.Duration, 0, n*b.N)
+			b.ResetTimer()
+			for i := 0; i < b.N; i++ {
+				trie := NewTrieWithParams(c.params)
+				for j := 0; j < len(keys); j += PREFIX_4B_SZ {
+					start := time.Now()
+					trie.Set(string(keys[j : j+PREFIX_4B_SZ]))
+					latencies = append(latencies, time.Since(start))
+				}
+			}
+			b.StopTimer()
+			sort.Slice(latencies, func(i, j int) bool { return latencies[i] < latencies[j] })
+			b.ReportMetric(float64(latencies[len(latencies)/2].Nanoseconds()), "p50-ns")
+			b.ReportMetric(float64(latencies[len(latencies)*999/1000].Nanoseconds()), "p99.9-ns")
+			b.ReportMetric(float64(latencies[len(latencies)*9999/10000].Nanoseconds()), "p99.99-ns")
+			b.ReportMetric(float64(latencies[len(latencies)-1].Nanoseconds()), "max-ns")
+		})
+	}
+}
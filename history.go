@@ -0,0 +1,398 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import (
+	"bufio"
+	"bytes"
+	"encoding/binary"
+	"errors"
+	"fmt"
+	"io"
+	"os"
+	"sort"
+	"strings"
+	"sync"
+	"time"
+)
+
+// KeepHistory records which prefixes and full hashes each list held after
+// every update, so IsListedAt can answer for any time since.  The history is
+// kept next to the list's data file.
+var KeepHistory bool = false
+
+// HistoryRetention is how far back the history goes, or everything if zero.
+var HistoryRetention = 90 * 24 * time.Hour
+
+// ErrNoHistory is returned by IsListedAt for a time before any list history
+// was kept.
+var ErrNoHistory = errors.New("No history of the lists kept back to then")
+
+// the time an update is recorded at, replaced in tests
+var historyNow = time.Now
+
+// A list's history is a table of epochs, one for each update that changed
+// the list, and a run of rows for each key length.  A row is a key and the
+// epochs it was added in and removed in, so a key that comes and goes has a
+// row for every time it was on the list.  Rows are sorted by key and then
+// epoch, and never change once written: recording an update merges the sorted
+// keys of the new version with the old rows into new ones.
+const historyOpen = ^uint32(0)
+
+type historyRun struct {
+	keyLen int
+	keys   []byte
+	// the epoch each row's key was added in, and removed in or historyOpen
+	added   []uint32
+	removed []uint32
+}
+
+func (r *historyRun) rows() int {
+	return len(r.added)
+}
+
+func (r *historyRun) key(i int) []byte {
+	return r.keys[i*r.keyLen : (i+1)*r.keyLen]
+}
+
+// at is whether key was present in epoch e, in about the time of a binary
+// search.
+func (r *historyRun) at(e uint32, key []byte) bool {
+	n := r.rows()
+	i := sort.Search(n, func(i int) bool {
+		return bytes.Compare(r.key(i), key) >= 0
+	})
+	for ; i < n && bytes.Equal(r.key(i), key); i++ {
+		if r.added[i] <= e && e < r.removed[i] {
+			return true
+		}
+	}
+	return false
+}
+
+// record returns the run with epoch e holding the sorted keys, and whether
+// that changed anything.  Rows removed before epoch drop are pruned.
+func (r *historyRun) record(e uint32, keys []byte, drop uint32) (*historyRun, bool) {
+	n, m := r.rows(), len(keys)/r.keyLen
+	out := &historyRun{
+		keyLen:  r.keyLen,
+		keys:    make([]byte, 0, len(r.keys)+len(keys)),
+		added:   make([]uint32, 0, n+m),
+		removed: make([]uint32, 0, n+m),
+	}
+	emit := func(key []byte, added uint32, removed uint32) {
+		if removed < drop {
+			return
+		}
+		out.keys = append(out.keys, key...)
+		out.added = append(out.added, added)
+		out.removed = append(out.removed, removed)
+	}
+
+	changed := false
+	i, j := 0, 0
+	for i < n || j < m {
+		c := -1
+		if i == n {
+			c = 1
+		} else if j < m {
+			c = bytes.Compare(r.key(i), keys[j*r.keyLen:(j+1)*r.keyLen])
+		}
+		switch {
+		case c < 0:
+			// gone from the list, or already gone
+			removed := r.removed[i]
+			if removed == historyOpen {
+				removed = e
+				changed = true
+			}
+			emit(r.key(i), r.added[i], removed)
+			i++
+		case c > 0:
+			emit(keys[j*r.keyLen:(j+1)*r.keyLen], e, historyOpen)
+			changed = true
+			j++
+		default:
+			// still on the list, or back on it after its last row
+			key := r.key(i)
+			open := false
+			for ; i < n && bytes.Equal(r.key(i), key); i++ {
+				open = r.removed[i] == historyOpen
+				emit(key, r.added[i], r.removed[i])
+			}
+			if !open {
+				emit(key, e, historyOpen)
+				changed = true
+			}
+			j++
+		}
+	}
+	return out, changed
+}
+
+type listHistory struct {
+	l        sync.RWMutex
+	fileName string
+	loaded   bool
+
+	// when each epoch began, in Unix nanoseconds
+	epochs []int64
+	// rows removed before this time, in Unix nanoseconds, have been pruned
+	since      int64
+	prefixes   *historyRun
+	fullHashes *historyRun
+}
+
+func newListHistory(fileName string) *listHistory {
+	return &listHistory{
+		fileName:   fileName,
+		prefixes:   &historyRun{keyLen: PREFIX_4B_SZ},
+		fullHashes: &historyRun{keyLen: PREFIX_32B_SZ},
+	}
+}
+
+func (sbl *SafeBrowsingList) historyFileName() string {
+	return strings.TrimSuffix(sbl.FileName, ".dat") + ".hist"
+}
+
+// recordHistory adds the sorted prefixes and full hashes of the list's new
+// version to its history.  fsLock must be held.
+func (sbl *SafeBrowsingList) recordHistory(prefixes []byte, fullHashes []byte) {
+	if !KeepHistory || isUpdateChild || sbl.history == nil {
+		return
+	}
+	if err := sbl.history.record(historyNow(), prefixes, fullHashes); err != nil {
+		sbl.Logger.Warn("Unable to record the history of %s: %s", sbl.Name, err)
+	}
+}
+
+// record adds a new epoch beginning at now, if the keys differ from the last
+// one, and saves the history.  Lookups carry on against the old rows while
+// the new ones are merged, as there is only ever one writer.
+func (h *listHistory) record(now time.Time, prefixes []byte, fullHashes []byte) error {
+	loadErr := h.load()
+
+	h.l.RLock()
+	e := uint32(len(h.epochs))
+	since, drop := h.since, uint32(0)
+	if HistoryRetention > 0 {
+		cutoff := now.Add(-HistoryRetention).UnixNano()
+		drop = uint32(sort.Search(len(h.epochs), func(i int) bool { return h.epochs[i] > cutoff }))
+		if cutoff > since {
+			since = cutoff
+		}
+	}
+	p, pChanged := h.prefixes.record(e, prefixes, drop)
+	f, fChanged := h.fullHashes.record(e, fullHashes, drop)
+	h.l.RUnlock()
+	if !pChanged && !fChanged && e > 0 {
+		return loadErr
+	}
+
+	h.l.Lock()
+	h.epochs = append(h.epochs, now.UnixNano())
+	h.since, h.prefixes, h.fullHashes = since, p, f
+	err := h.save()
+	h.l.Unlock()
+	if loadErr != nil {
+		return loadErr
+	}
+	return err
+}
+
+// epochAt is the epoch the list was in at t, false if t is before the
+// history.
+func (h *listHistory) epochAt(t time.Time) (uint32, bool) {
+	ns := t.UnixNano()
+	e := sort.Search(len(h.epochs), func(i int) bool { return h.epochs[i] > ns })
+	if e == 0 || ns < h.since {
+		return 0, false
+	}
+	return uint32(e - 1), true
+}
+
+// listedAt looks up candidate hashes as the list stood at t.  ok is false if
+// the list has no history back to then.
+func (h *listHistory) listedAt(hashes []LookupHash, t time.Time) (found, fullHashMatch, ok bool) {
+	h.load()
+	h.l.RLock()
+	defer h.l.RUnlock()
+	e, ok := h.epochAt(t)
+	if !ok {
+		return false, false, false
+	}
+	for _, urlHash := range hashes {
+		if h.fullHashes.at(e, []byte(urlHash)) {
+			return true, true, true
+		}
+	}
+	for _, urlHash := range hashes {
+		if h.prefixes.at(e, []byte(urlHash[:PREFIX_4B_SZ])) {
+			return true, false, true
+		}
+	}
+	return false, false, true
+}
+
+// IsListedAt reports which list, if any, a URL was on at time t, from the
+// history kept with KeepHistory.  As with MightBeListed, a match is only on a
+// hash prefix unless fullHashMatch is set; full hashes from gethash
+// responses aren't part of the history.  ErrNoHistory is returned if no
+// list matched and some list has no history back to t.
+func (sb *SafeBrowsing) IsListedAt(url string, t time.Time) (list string, fullHashMatch bool, err error) {
+	urls := GenerateTestCandidates(Canonicalize(url))
+	hashes := make([]LookupHash, len(urls))
+	for i, url := range urls {
+		hashes[i] = getHash(url)
+	}
+
+	for name, sbl := range sb.Lists {
+		if sbl.history == nil {
+			err = ErrNoHistory
+			continue
+		}
+		found, full, ok := sbl.history.listedAt(hashes, t)
+		if !ok {
+			err = ErrNoHistory
+			continue
+		}
+		if found {
+			return name, full, nil
+		}
+	}
+	return "", false, err
+}
+
+// The history file has a fixed size header, then the epochs, then the keys,
+// added and removed epochs of the prefix rows and then those of the full
+// hash rows.  All integers are big endian.
+const historyMagic = "SBHI"
+const historyVersion = 1
+
+type historyHeader struct {
+	Magic      [4]byte
+	Version    uint32
+	Since      int64
+	Epochs     uint64
+	Prefixes   uint64
+	FullHashes uint64
+}
+
+// load reads the history from its file the first time it is needed.  A
+// history that can't be read is started afresh.
+func (h *listHistory) load() error {
+	h.l.Lock()
+	defer h.l.Unlock()
+	if h.loaded {
+		return nil
+	}
+	h.loaded = true
+
+	f, err := os.Open(h.fileName)
+	if os.IsNotExist(err) {
+		return nil
+	} else if err != nil {
+		return err
+	}
+	defer f.Close()
+	if err = h.readFrom(bufio.NewReader(f)); err != nil {
+		return fmt.Errorf("Unable to read list history %s, starting afresh: %s", h.fileName, err)
+	}
+	return nil
+}
+
+func (h *listHistory) readFrom(r io.Reader) error {
+	header := historyHeader{}
+	if err := binary.Read(r, binary.BigEndian, &header); err != nil {
+		return err
+	}
+	if string(header.Magic[:]) != historyMagic {
+		return fmt.Errorf("Not a list history")
+	}
+	if header.Version != historyVersion {
+		return fmt.Errorf("Unsupported list history version %d", header.Version)
+	}
+	epochs := make([]int64, header.Epochs)
+	if err := binary.Read(r, binary.BigEndian, epochs); err != nil {
+		return err
+	}
+	prefixes, err := readHistoryRun(r, PREFIX_4B_SZ, header.Prefixes)
+	if err != nil {
+		return err
+	}
+	fullHashes, err := readHistoryRun(r, PREFIX_32B_SZ, header.FullHashes)
+	if err != nil {
+		return err
+	}
+	h.epochs, h.since, h.prefixes, h.fullHashes = epochs, header.Since, prefixes, fullHashes
+	return nil
+}
+
+func readHistoryRun(r io.Reader, keyLen int, rows uint64) (*historyRun, error) {
+	run := &historyRun{
+		keyLen:  keyLen,
+		keys:    make([]byte, rows*uint64(keyLen)),
+		added:   make([]uint32, rows),
+		removed: make([]uint32, rows),
+	}
+	if _, err := io.ReadFull(r, run.keys); err != nil {
+		return nil, err
+	}
+	if err := binary.Read(r, binary.BigEndian, run.added); err != nil {
+		return nil, err
+	}
+	if err := binary.Read(r, binary.BigEndian, run.removed); err != nil {
+		return nil, err
+	}
+	return run, nil
+}
+
+// save atomically replaces the history file.  h.l must be held.
+func (h *listHistory) save() error {
+	header := &historyHeader{
+		Version:    historyVersion,
+		Since:      h.since,
+		Epochs:     uint64(len(h.epochs)),
+		Prefixes:   uint64(h.prefixes.rows()),
+		FullHashes: uint64(h.fullHashes.rows()),
+	}
+	copy(header.Magic[:], historyMagic)
+
+	epochs := make([]byte, 8*len(h.epochs))
+	for i, t := range h.epochs {
+		binary.BigEndian.PutUint64(epochs[8*i:], uint64(t))
+	}
+	return writeKeyFile(h.fileName, header, epochs,
+		h.prefixes.keys, uint32Bytes(h.prefixes.added), uint32Bytes(h.prefixes.removed),
+		h.fullHashes.keys, uint32Bytes(h.fullHashes.added), uint32Bytes(h.fullHashes.removed))
+}
+
+func uint32Bytes(xs []uint32) []byte {
+	out := make([]byte, 4*len(xs))
+	for i, x := range xs {
+		binary.BigEndian.PutUint32(out[4*i:], x)
+	}
+	return out
+}
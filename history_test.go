@@ -0,0 +1,186 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import proto "github.com/golang/protobuf/proto"
+
+import (
+	"io/ioutil"
+	"math/rand"
+	"os"
+	"sort"
+	"testing"
+	"time"
+)
+
+func TestHistoryRun(t *testing.T) {
+	rng := rand.New(rand.NewSource(1))
+	universe := make([]string, 200)
+	for i := range universe {
+		key := make([]byte, PREFIX_4B_SZ)
+		rng.Read(key)
+		universe[i] = string(key)
+	}
+
+	// versions in which keys come and go, and some repeat the last
+	run := &historyRun{keyLen: PREFIX_4B_SZ}
+	present := make(map[string]bool)
+	versions := []map[string]bool{}
+	for v := 0; v < 30; v++ {
+		if v%7 != 6 {
+			for _, key := range universe {
+				if rng.Intn(5) == 0 {
+					present[key] = !present[key]
+				}
+			}
+		}
+		keys := make([]string, 0, len(present))
+		for key, on := range present {
+			if on {
+				keys = append(keys, key)
+			}
+		}
+		sort.Strings(keys)
+		sorted := []byte{}
+		for _, key := range keys {
+			sorted = append(sorted, key...)
+		}
+
+		next, changed := run.record(uint32(len(versions)), sorted, 0)
+		if changed != (v%7 != 6) {
+			t.Fatalf("Version %d changed: %v", v, changed)
+		}
+		if !changed {
+			continue
+		}
+		run = next
+		version := make(map[string]bool, len(keys))
+		for _, key := range keys {
+			version[key] = true
+		}
+		versions = append(versions, version)
+	}
+
+	check := func(run *historyRun, from int) {
+		for e := from; e < len(versions); e++ {
+			for _, key := range universe {
+				if run.at(uint32(e), []byte(key)) != versions[e][key] {
+					t.Fatalf("Key %x in epoch %d: expected %v", key, e, versions[e][key])
+				}
+			}
+		}
+	}
+	check(run, 0)
+
+	// pruning rows removed before epoch 10 leaves epoch 9 on as it was
+	pruned, _ := run.record(uint32(len(versions)), nil, 10)
+	versions = append(versions, map[string]bool{})
+	if pruned.rows() >= run.rows() {
+		t.Errorf("No rows pruned")
+	}
+	check(pruned, 9)
+}
+
+func TestIsListedAt(t *testing.T) {
+	dir, err := ioutil.TempDir("", "history")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer os.RemoveAll(dir)
+
+	defer func(keep bool) { KeepHistory, historyNow = keep, time.Now }(KeepHistory)
+	KeepHistory = true
+	start := time.Date(2026, 3, 1, 0, 0, 0, 0, time.UTC)
+	now := start
+	historyNow = func() time.Time { return now }
+
+	evil := getHash(GenerateTestCandidates(Canonicalize("http://evil.com/"))[0])
+	bad := getHash(GenerateTestCandidates(Canonicalize("http://bad.com/"))[0])
+
+	sbl := newSafeBrowsingList("test", dir+"/test.dat")
+	updates := []*ChunkData{
+		{
+			ChunkNumber: proto.Int32(1),
+			ChunkType:   CHUNK_TYPE_ADD.Enum(),
+			PrefixType:  PREFIX_4B.Enum(),
+			Hashes:      []byte(evil[:PREFIX_4B_SZ]),
+		},
+		{
+			ChunkNumber: proto.Int32(2),
+			ChunkType:   CHUNK_TYPE_ADD.Enum(),
+			PrefixType:  PREFIX_32B.Enum(),
+			Hashes:      []byte(bad),
+		},
+		{
+			ChunkNumber: proto.Int32(1),
+			ChunkType:   CHUNK_TYPE_SUB.Enum(),
+			PrefixType:  PREFIX_4B.Enum(),
+			Hashes:      []byte(evil[:PREFIX_4B_SZ]),
+		},
+		// changes nothing, so starts no epoch
+		nil,
+	}
+	for _, chunk := range updates {
+		now = now.Add(time.Hour)
+		chunks := []*ChunkData{}
+		if chunk != nil {
+			chunks = append(chunks, chunk)
+		}
+		if err := sbl.load(chunks); err != nil {
+			t.Fatal(err)
+		}
+	}
+
+	check := func(sbl *SafeBrowsingList) {
+		sb := &SafeBrowsing{Lists: map[string]*SafeBrowsingList{"test": sbl}}
+		for _, c := range []struct {
+			url   string
+			at    time.Duration
+			list  string
+			full  bool
+			noHit bool
+		}{
+			{"http://evil.com/", 0, "", false, true},
+			{"http://evil.com/", 90 * time.Minute, "test", false, false},
+			{"http://bad.com/", 90 * time.Minute, "", false, false},
+			{"http://bad.com/", 150 * time.Minute, "test", true, false},
+			{"http://evil.com/", 150 * time.Minute, "test", false, false},
+			{"http://evil.com/", 210 * time.Minute, "", false, false},
+			{"http://bad.com/", 100 * time.Hour, "test", true, false},
+		} {
+			list, full, err := sb.IsListedAt(c.url, start.Add(c.at))
+			if list != c.list || full != c.full || (err == ErrNoHistory) != c.noHit {
+				t.Errorf("%s at %s: got %q, %v, %v", c.url, c.at, list, full, err)
+			}
+		}
+	}
+	check(sbl)
+	if n := len(sbl.history.epochs); n != 3 {
+		t.Errorf("Expected 3 epochs, got %d", n)
+	}
+
+	// and again from the history on disk
+	check(newSafeBrowsingList("test", dir+"/test.dat"))
+}
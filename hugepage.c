@@ -0,0 +1,287 @@
+/*
+ * See hugepage.h for a description of the region allocator.
+ */
+
+#include "hugepage.h"
+#include "pstdint.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/mman.h>
+#define HUGEPAGE_HAVE_MMAP
+#endif
+
+/* one transparent huge page */
+#define REGION_SHIFT 21
+#define REGION_SIZE ((size_t) 1 << REGION_SHIFT)
+#define REGION_MASK (~(uintptr_t) (REGION_SIZE - 1))
+
+/* Size classes are multiples of 16 bytes up to 128, then four classes per
+ * power of two up to 256KB. */
+#define SMALL_CLASSES  8
+#define MAX_CLASS_SIZE ((size_t) 256 << 10)
+#define NUM_CLASSES    (SMALL_CLASSES + 4 * 11)
+
+/* The regions we own are found without a lock, through a two level map of
+ * every region sized piece of a 48 bit address space to its size class plus
+ * one, or 0 if it isn't ours. Entries are only ever set, and leaves only
+ * ever added, so a reader that sees one sees it whole. Regions mapped above
+ * 48 bits aren't used. */
+#define MAP_ADDRESS_BITS 48
+#define MAP_LEAF_BITS    14
+#define MAP_ROOT_BITS    (MAP_ADDRESS_BITS - REGION_SHIFT - MAP_LEAF_BITS)
+
+typedef struct free_block_t_
+{
+    struct free_block_t_* next;
+} free_block_t;
+
+/* Each class has a lock of its own, and a cache line of its own, so that
+ * tries allocating different sizes don't wait on each other. */
+typedef struct size_class_t_
+{
+    pthread_mutex_t lock;
+    free_block_t*   free; // blocks given back
+    char*           next; // unused space in the newest region of this class
+    char*           end;
+} __attribute__((aligned(64))) size_class_t;
+
+static int mode = HUGEPAGE_OFF;
+static size_class_t classes[NUM_CLASSES] = {
+    [0 ... NUM_CLASSES - 1] = { .lock = PTHREAD_MUTEX_INITIALIZER }
+};
+
+/* serialises adding regions to the map */
+static pthread_mutex_t map_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned char*  map_root[(size_t) 1 << MAP_ROOT_BITS];
+static size_t          num_regions     = 0;
+static size_t          hugetlb_regions = 0;
+
+
+static size_t class_index(size_t n)
+{
+    if (n <= 16)  return 0;
+    if (n <= 128) return (n + 15) / 16 - 1;
+
+    /* n lies in (2^p, 2^(p + 1)] */
+    unsigned int p = 7;
+    while (((size_t) 1 << (p + 1)) < n) ++p;
+    size_t step = (size_t) 1 << (p - 2);
+
+    return SMALL_CLASSES + 4 * (p - 7) + (n - 1 - ((size_t) 1 << p)) / step;
+}
+
+
+static size_t class_size(size_t c)
+{
+    if (c < SMALL_CLASSES) return 16 * (c + 1);
+
+    c -= SMALL_CLASSES;
+    unsigned int p = 7 + (unsigned int) (c / 4);
+    return ((size_t) 1 << p) + (c % 4 + 1) * ((size_t) 1 << (p - 2));
+}
+
+
+/* Record a new region of class c in the map, returning false if it can't
+ * be. */
+static bool region_add(uintptr_t base, size_t c, bool hugetlb)
+{
+    uint64_t r = (uint64_t) base >> REGION_SHIFT;
+    if (r >> (MAP_ROOT_BITS + MAP_LEAF_BITS) != 0) return false;
+
+    pthread_mutex_lock(&map_lock);
+    unsigned char** root = &map_root[r >> MAP_LEAF_BITS];
+    unsigned char* leaf = *root;
+    if (leaf == NULL) {
+        leaf = calloc((size_t) 1 << MAP_LEAF_BITS, 1);
+        if (leaf == NULL) {
+            pthread_mutex_unlock(&map_lock);
+            return false;
+        }
+        __atomic_store_n(root, leaf, __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&leaf[r & (((uint64_t) 1 << MAP_LEAF_BITS) - 1)],
+                     (unsigned char) (c + 1), __ATOMIC_RELEASE);
+    if (hugetlb) __atomic_add_fetch(&hugetlb_regions, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&num_regions, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&map_lock);
+
+    return true;
+}
+
+
+/* Map a new 2MB aligned region, returning NULL if we can't. */
+static char* region_map(bool* hugetlb)
+{
+#ifdef HUGEPAGE_HAVE_MMAP
+    void* p;
+    *hugetlb = false;
+
+#ifdef MAP_HUGETLB
+    /* hugetlbfs mappings are aligned to the huge page size already */
+    if (hugepage_mode() == HUGEPAGE_HUGETLB) {
+        p = mmap(NULL, REGION_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED && ((uintptr_t) p & ~REGION_MASK) == 0) {
+            *hugetlb = true;
+            return p;
+        }
+        if (p != MAP_FAILED) munmap(p, REGION_SIZE);
+    }
+#endif
+
+    /* over-allocate so the region can be aligned, then trim both ends */
+    p = mmap(NULL, 2 * REGION_SIZE, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return NULL;
+
+    uintptr_t start = (uintptr_t) p;
+    uintptr_t base  = (start + REGION_SIZE - 1) & REGION_MASK;
+    if (base > start) munmap(p, base - start);
+    munmap((void*) (base + REGION_SIZE), start + REGION_SIZE - base);
+
+#ifdef MADV_HUGEPAGE
+    /* failing this just leaves us with ordinary pages */
+    madvise((void*) base, REGION_SIZE, MADV_HUGEPAGE);
+#endif
+
+    return (char*) base;
+#else
+    *hugetlb = false;
+    return NULL;
+#endif
+}
+
+
+static void region_unmap(char* base)
+{
+#ifdef HUGEPAGE_HAVE_MMAP
+    munmap(base, REGION_SIZE);
+#endif
+}
+
+
+/* Take a block of class c, or return NULL. Requires the class's lock. */
+static void* class_alloc(size_t c)
+{
+    size_class_t* sc = &classes[c];
+    size_t size = class_size(c);
+
+    if (sc->free != NULL) {
+        void* p = sc->free;
+        sc->free = sc->free->next;
+        return p;
+    }
+
+    if (sc->next == NULL || sc->next + size > sc->end) {
+        bool hugetlb;
+        char* base = region_map(&hugetlb);
+        if (base == NULL) return NULL;
+        if (!region_add((uintptr_t) base, c, hugetlb)) {
+            region_unmap(base);
+            return NULL;
+        }
+
+        sc->next = base;
+        sc->end  = base + REGION_SIZE;
+    }
+
+    void* p = sc->next;
+    sc->next += size;
+    return p;
+}
+
+
+/* Find the size class of a block we own, or return -1, without locking. */
+static long block_class(void* ptr)
+{
+    if (__atomic_load_n(&num_regions, __ATOMIC_ACQUIRE) == 0) return -1;
+
+    uint64_t r = (uint64_t) (uintptr_t) ptr >> REGION_SHIFT;
+    if (r >> (MAP_ROOT_BITS + MAP_LEAF_BITS) != 0) return -1;
+
+    const unsigned char* leaf = __atomic_load_n(&map_root[r >> MAP_LEAF_BITS], __ATOMIC_ACQUIRE);
+    if (leaf == NULL) return -1;
+
+    unsigned char c = __atomic_load_n(&leaf[r & (((uint64_t) 1 << MAP_LEAF_BITS) - 1)],
+                                      __ATOMIC_ACQUIRE);
+    return (long) c - 1;
+}
+
+
+void hugepage_set_mode(int m)
+{
+    __atomic_store_n(&mode, m, __ATOMIC_RELAXED);
+}
+
+
+int hugepage_mode()
+{
+    return __atomic_load_n(&mode, __ATOMIC_RELAXED);
+}
+
+
+size_t hugepage_reserved()
+{
+    return __atomic_load_n(&num_regions, __ATOMIC_RELAXED) * REGION_SIZE;
+}
+
+
+size_t hugepage_hugetlb()
+{
+    return __atomic_load_n(&hugetlb_regions, __ATOMIC_RELAXED) * REGION_SIZE;
+}
+
+
+void* hugepage_malloc(size_t n)
+{
+    if (hugepage_mode() == HUGEPAGE_OFF || n > MAX_CLASS_SIZE) return malloc(n);
+
+    size_t c = class_index(n);
+    pthread_mutex_lock(&classes[c].lock);
+    void* p = class_alloc(c);
+    pthread_mutex_unlock(&classes[c].lock);
+
+    return p != NULL ? p : malloc(n);
+}
+
+
+void* hugepage_realloc(void* ptr, size_t n)
+{
+    if (ptr == NULL) return hugepage_malloc(n);
+
+    long cls = block_class(ptr);
+    if (cls < 0) return realloc(ptr, n);
+
+    /* blocks only ever move up a class, it's all the slots do */
+    size_t size = class_size((size_t) cls);
+    if (n <= size) return ptr;
+
+    void* p = hugepage_malloc(n);
+    if (p == NULL) return NULL;
+    memcpy(p, ptr, size);
+    hugepage_free(ptr);
+
+    return p;
+}
+
+
+void hugepage_free(void* ptr)
+{
+    if (ptr == NULL) return;
+
+    long cls = block_class(ptr);
+    if (cls < 0) {
+        free(ptr);
+        return;
+    }
+
+    size_class_t* sc = &classes[cls];
+    free_block_t* b = ptr;
+    pthread_mutex_lock(&sc->lock);
+    b->next = sc->free;
+    sc->free = b;
+    pthread_mutex_unlock(&sc->lock);
+}
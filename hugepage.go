@@ -0,0 +1,93 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+/*
+#include "hugepage.h"
+*/
+import "C"
+
+import (
+	"fmt"
+)
+
+// HugePageMode selects the memory backing the lookup tries.  The full lists
+// span hundreds of megabytes of randomly accessed memory, so with ordinary
+// 4KB pages most lookups miss the TLB; backing the tries with 2MB pages
+// removes most of those misses.
+type HugePageMode int
+
+const (
+	// HugePagesOff uses the system allocator, the default.
+	HugePagesOff HugePageMode = C.HUGEPAGE_OFF
+	// HugePagesTransparent asks the kernel to back the tries with transparent
+	// huge pages (madvise(MADV_HUGEPAGE)).
+	HugePagesTransparent HugePageMode = C.HUGEPAGE_TRANSPARENT
+	// HugePagesHugeTLB takes pages from the hugetlbfs pool, which must have
+	// been reserved (vm.nr_hugepages), falling back to transparent huge pages
+	// once the pool runs dry.
+	HugePagesHugeTLB HugePageMode = C.HUGEPAGE_HUGETLB
+)
+
+func (m HugePageMode) String() string {
+	switch m {
+	case HugePagesOff:
+		return "off"
+	case HugePagesTransparent:
+		return "transparent"
+	case HugePagesHugeTLB:
+		return "hugetlb"
+	}
+	return fmt.Sprintf("HugePageMode(%d)", int(m))
+}
+
+// ParseHugePageMode parses the names returned by HugePageMode.String, with
+// the empty string meaning off.
+func ParseHugePageMode(s string) (HugePageMode, error) {
+	switch s {
+	case "", "off":
+		return HugePagesOff, nil
+	case "transparent":
+		return HugePagesTransparent, nil
+	case "hugetlb":
+		return HugePagesHugeTLB, nil
+	}
+	return HugePagesOff, fmt.Errorf("Unknown huge page mode: %s", s)
+}
+
+// SetHugePages selects the memory backing for tries built from now on.  It
+// should be called before NewSafeBrowsing so the lists are loaded into huge
+// pages; existing tries are unaffected.  Where the kernel doesn't support the
+// requested mode, allocation quietly falls back to ordinary pages.
+func SetHugePages(mode HugePageMode) {
+	C.hugepage_set_mode(C.int(mode))
+}
+
+// HugePageStats returns the bytes reserved in huge page regions, and how many
+// of those came from the hugetlbfs pool.  Regions are never returned to the
+// system, so this is a high water mark.
+func HugePageStats() (reserved uint64, hugetlb uint64) {
+	return uint64(C.hugepage_reserved()), uint64(C.hugepage_hugetlb())
+}
@@ -0,0 +1,44 @@
+/*
+ * Huge page backed memory for the hat-trie and its tables.
+ *
+ * The lookup structures for a full list span hundreds of megabytes of memory
+ * that is accessed at random, so with 4KB pages nearly every probe misses the
+ * TLB. When enabled, allocations are carved out of 2MB aligned regions that
+ * are backed by huge pages, either transparently (madvise(MADV_HUGEPAGE)) or
+ * explicitly from the hugetlbfs pool (MAP_HUGETLB). Each region serves a
+ * single size class, freed blocks are kept on a per-class free list for reuse
+ * and regions are never returned to the system. Each class has its own lock,
+ * and telling whether a block came from a region takes none, so tries built
+ * on several threads at once don't queue behind each other.
+ *
+ * Anything that cannot be served from a region falls back to malloc, as does
+ * everything when huge pages are off (the default). Blocks always go back to
+ * wherever they came from, so the mode may be changed at any time; it only
+ * affects new allocations.
+ */
+
+#ifndef HATTRIE_HUGEPAGE_H
+#define HATTRIE_HUGEPAGE_H
+
+#include <stdlib.h>
+
+#define HUGEPAGE_OFF         0
+#define HUGEPAGE_TRANSPARENT 1
+#define HUGEPAGE_HUGETLB     2
+
+/* Select the backing for new allocations. Requesting HUGEPAGE_HUGETLB falls
+ * back to transparent huge pages whenever the pool is exhausted, and those
+ * fall back to ordinary pages where the kernel doesn't support them. */
+void   hugepage_set_mode (int mode);
+int    hugepage_mode     (void);
+
+/* Total bytes reserved in regions, and how many of those came from the
+ * hugetlbfs pool. */
+size_t hugepage_reserved (void);
+size_t hugepage_hugetlb  (void);
+
+void*  hugepage_malloc   (size_t n);
+void*  hugepage_realloc  (void* ptr, size_t n);
+void   hugepage_free     (void* ptr);
+
+#endif
@@ -0,0 +1,183 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import (
+	"fmt"
+	"math/rand"
+	"runtime"
+	"sync"
+	"testing"
+)
+
+func TestParseHugePageMode(t *testing.T) {
+	for _, mode := range []HugePageMode{HugePagesOff, HugePagesTransparent, HugePagesHugeTLB} {
+		parsed, err := ParseHugePageMode(mode.String())
+		if err != nil || parsed != mode {
+			t.Errorf("Parsing %s gave %s, %v", mode, parsed, err)
+		}
+	}
+	if _, err := ParseHugePageMode("huge"); err == nil {
+		t.Error("Expected an error for an unknown mode")
+	}
+}
+
+func TestHugePages(t *testing.T) {
+	defer SetHugePages(HugePagesOff)
+
+	for _, mode := range []HugePageMode{HugePagesTransparent, HugePagesHugeTLB} {
+		SetHugePages(mode)
+		trie, keys := randomTrie(100000, 4, 42)
+		copied := trie.Copy()
+		if runtime.GOOS == "linux" {
+			if reserved, _ := HugePageStats(); reserved == 0 {
+				t.Errorf("%s: nothing reserved in huge page regions", mode)
+			}
+		}
+
+		// switching back must leave the existing tries working, with blocks
+		// going back to the regions they came from as the tries change
+		SetHugePages(HugePagesOff)
+		more, moreKeys := randomTrie(50000, 4, 43)
+		trie.Union(more)
+		for key := range moreKeys {
+			keys[key] = true
+		}
+		checkTrie(t, mode.String()+" union", trie, keys)
+
+		deleted := 0
+		for key := range keys {
+			if deleted%2 == 0 {
+				trie.Delete(key)
+				delete(keys, key)
+			}
+			deleted++
+		}
+		checkTrie(t, mode.String()+" delete", trie, keys)
+
+		packed := make([]byte, 0, 4*len(keys))
+		for key := range keys {
+			packed = append(packed, key...)
+		}
+		if n := trie.CountKeys(packed, 4); n != len(keys) {
+			t.Errorf("%s: found %d of %d keys", mode, n, len(keys))
+		}
+		if copied.Size() != 100000 {
+			t.Errorf("%s: copy holds %d keys", mode, copied.Size())
+		}
+	}
+}
+
+func TestHugePagesConcurrent(t *testing.T) {
+	defer SetHugePages(HugePagesOff)
+	SetHugePages(HugePagesTransparent)
+
+	// tries built, changed and freed on several threads share the regions
+	wg := sync.WaitGroup{}
+	for i := 0; i < 8; i++ {
+		wg.Add(1)
+		go func(seed int64) {
+			defer wg.Done()
+			trie, keys := randomTrie(20000, 4, seed)
+			deleted := 0
+			for key := range keys {
+				if deleted%3 == 0 {
+					trie.Delete(key)
+					delete(keys, key)
+				}
+				deleted++
+			}
+			more, moreKeys := randomTrie(20000, 4, seed+100)
+			trie.Union(more)
+			for key := range moreKeys {
+				keys[key] = true
+			}
+			checkTrie(t, fmt.Sprintf("thread %d", seed), trie, keys)
+		}(int64(i))
+	}
+	wg.Wait()
+}
+
+// hugePageTries holds one lookup fixture per mode, as they take a while to
+// build and the benchmarks run several times.
+var hugePageTries = map[HugePageMode]*HatTrie{}
+
+func benchmarkHugePageLookup(b *testing.B, mode HugePageMode) {
+	const size = 4000000
+	const batch = 100000
+
+	trie, ok := hugePageTries[mode]
+	if !ok {
+		SetHugePages(mode)
+		trie, _ = randomTrie(size, 4, 1)
+		SetHugePages(HugePagesOff)
+		hugePageTries[mode] = trie
+	}
+
+	// half of the probes are listed, like a full hash check after a prefix hit
+	r := rand.New(rand.NewSource(2))
+	probes := make([]byte, 4*batch)
+	r.Read(probes)
+	listed, _ := trie.SortedKeys(4)
+	for i := 0; i < batch; i += 2 {
+		j := r.Intn(len(listed) / 4)
+		copy(probes[4*i:4*i+4], listed[4*j:4*j+4])
+	}
+
+	// the counter follows this thread, so keep the lookups on it
+	runtime.LockOSThread()
+	defer runtime.UnlockOSThread()
+	counter := openDTLBCounter()
+	defer counter.Close()
+
+	b.ResetTimer()
+	start := counter.Read()
+	for i := 0; i < b.N; i++ {
+		trie.CountKeys(probes, 4)
+	}
+	misses := counter.Read() - start
+	b.StopTimer()
+
+	lookups := float64(b.N) * batch
+	b.ReportMetric(float64(b.Elapsed().Nanoseconds())/lookups, "ns/lookup")
+	if counter.Valid() {
+		b.ReportMetric(float64(misses)/lookups, "dTLB-misses/lookup")
+	}
+}
+
+// Compare lookup latency and dTLB misses with and without huge pages.  The
+// miss counts need perf events (kernel.perf_event_paranoid <= 2); without
+// them only the latency is reported.
+func BenchmarkHugePageLookupOff(b *testing.B) {
+	benchmarkHugePageLookup(b, HugePagesOff)
+}
+
+func BenchmarkHugePageLookupTransparent(b *testing.B) {
+	benchmarkHugePageLookup(b, HugePagesTransparent)
+}
+
+func BenchmarkHugePageLookupHugeTLB(b *testing.B) {
+	benchmarkHugePageLookup(b, HugePagesHugeTLB)
+}
@@ -6,12 +6,13 @@
  */
 
 #include "misc.h"
+#include "hugepage.h"
 #include <stdlib.h>
 
 
 void* malloc_or_die(size_t n)
 {
-    void* p = malloc(n);
+    void* p = hugepage_malloc(n);
     if (p == NULL && n != 0) {
         fprintf(stderr, "Cannot allocate %zu bytes.\n", n);
         exit(EXIT_FAILURE);
@@ -22,7 +23,7 @@ void* malloc_or_die(size_t n)
 
 void* realloc_or_die(void* ptr, size_t n)
 {
-    void* p = realloc(ptr, n);
+    void* p = hugepage_realloc(ptr, n);
     if (p == NULL && n != 0) {
         fprintf(stderr, "Cannot allocate %zu bytes.\n", n);
         exit(EXIT_FAILURE);
@@ -31,6 +32,14 @@ void* realloc_or_die(void* ptr, size_t n)
 }
 
 
+/* Memory from the functions above must be freed with this, as it may have
+ * come from a huge page region. */
+void free_mem(void* ptr)
+{
+    hugepage_free(ptr);
+}
+
+
 FILE* fopen_or_die(const char* path, const char* mode)
 {
     FILE* f = fopen(path, mode);
@@ -15,6 +15,7 @@
 
 void* malloc_or_die(size_t);
 void* realloc_or_die(void*, size_t);
+void  free_mem(void*);
 FILE* fopen_or_die(const char*, const char*);
 
 #endif
@@ -2,6 +2,7 @@
  * by its author, Austin Appleby. */
 
 #include "murmurhash3.h"
+#include <string.h>
 
 static inline uint32_t fmix(uint32_t h)
 {
@@ -75,3 +76,47 @@ uint32_t hash(const char* data, size_t len_)
     return h1;
 }
 
+
+
+/* This is MurmurHash64A, from the same author. */
+uint64_t hash64(const char* data, size_t len, uint64_t seed)
+{
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+
+    uint64_t h = seed ^ (len * m);
+
+    const uint8_t* p   = (const uint8_t*) data;
+    const uint8_t* end = p + (len / 8) * 8;
+
+    for (; p != end; p += 8)
+    {
+        uint64_t k;
+        memcpy(&k, p, sizeof(k));
+
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+
+        h ^= k;
+        h *= m;
+    }
+
+    switch(len & 7)
+    {
+        case 7: h ^= (uint64_t) p[6] << 48;
+        case 6: h ^= (uint64_t) p[5] << 40;
+        case 5: h ^= (uint64_t) p[4] << 32;
+        case 4: h ^= (uint64_t) p[3] << 24;
+        case 3: h ^= (uint64_t) p[2] << 16;
+        case 2: h ^= (uint64_t) p[1] << 8;
+        case 1: h ^= (uint64_t) p[0];
+              h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+
+    return h;
+}
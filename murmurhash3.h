@@ -7,6 +7,7 @@
 #include "pstdint.h"
 
 uint32_t hash(const char* data, size_t len);
+uint64_t hash64(const char* data, size_t len, uint64_t seed);
 
 #endif
 
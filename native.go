@@ -0,0 +1,151 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+//go:generate go run native/gencase.go
+
+/*
+#include <stdlib.h>
+#include <string.h>
+#include "sblookup.h"
+
+// Candidates packed as a native endian length followed by the bytes.
+typedef struct candidates_t_ {
+	char* buf;
+	size_t n;
+	size_t cap;
+} candidates_t;
+
+static void collect(const char* candidate, size_t len, void* arg) {
+	candidates_t* c = arg;
+	size_t need = c->n + sizeof(size_t) + len;
+	if (need > c->cap) {
+		c->cap = 2 * need;
+		c->buf = realloc(c->buf, c->cap);
+	}
+	memcpy(c->buf + c->n, &len, sizeof(size_t));
+	memcpy(c->buf + c->n + sizeof(size_t), candidate, len);
+	c->n = need;
+}
+
+static char* candidates(const char* url, size_t len, size_t* outlen) {
+	candidates_t c = {NULL, 0, 0};
+	sb_candidates(url, len, collect, &c);
+	*outlen = c.n;
+	return c.buf;
+}
+*/
+import "C"
+
+import (
+	"fmt"
+	"unsafe"
+)
+
+// The native lookup library (sblookup.h) is compiled into the package along
+// with the tries it is built on.  These wrappers exist so the tests can hold
+// it to the Go implementation; native programs link it directly, see
+// native/Makefile.
+
+func nativeCanonicalize(url string) string {
+	curl := C.CString(url)
+	defer C.free(unsafe.Pointer(curl))
+
+	var n C.size_t
+	out := C.sb_canonicalize(curl, C.size_t(len(url)), &n)
+	defer C.sb_free(unsafe.Pointer(out))
+	return C.GoStringN(out, C.int(n))
+}
+
+func nativeCandidates(url string) []string {
+	curl := C.CString(url)
+	defer C.free(unsafe.Pointer(curl))
+
+	var n C.size_t
+	buf := C.candidates(curl, C.size_t(len(url)), &n)
+	defer C.free(unsafe.Pointer(buf))
+	packed := C.GoBytes(unsafe.Pointer(buf), C.int(n))
+
+	urls := []string{}
+	size := int(unsafe.Sizeof(C.size_t(0)))
+	for len(packed) > 0 {
+		l := int(*(*C.size_t)(unsafe.Pointer(&packed[0])))
+		urls = append(urls, string(packed[size:size+l]))
+		packed = packed[size+l:]
+	}
+	return urls
+}
+
+func nativeHash(data []byte) []byte {
+	out := make([]byte, 32)
+	var p unsafe.Pointer
+	if len(data) > 0 {
+		p = unsafe.Pointer(&data[0])
+	}
+	C.sb_hash(p, C.size_t(len(data)), (*C.uchar)(unsafe.Pointer(&out[0])))
+	return out
+}
+
+type nativeIndex struct {
+	index *C.sb_index_t
+}
+
+func openNativeIndex(dataDir string) (*nativeIndex, error) {
+	cdir := C.CString(dataDir)
+	defer C.free(unsafe.Pointer(cdir))
+
+	var index *C.sb_index_t
+	if err := C.sb_index_open(cdir, &index); err != 0 {
+		return nil, fmt.Errorf("%s: %s", dataDir, C.GoString(C.sb_strerror(err)))
+	}
+	return &nativeIndex{index: index}, nil
+}
+
+func (n *nativeIndex) lists() []string {
+	lists := []string{}
+	for i := 0; i < int(C.sb_index_lists(n.index)); i++ {
+		lists = append(lists, C.GoString(C.sb_index_list(n.index, C.size_t(i))))
+	}
+	return lists
+}
+
+// mightBeListed answers as SafeBrowsing.MightBeListed does.
+func (n *nativeIndex) mightBeListed(url string) (list string, fullHashMatch bool) {
+	curl := C.CString(url)
+	defer C.free(unsafe.Pointer(curl))
+
+	var clist *C.char
+	switch C.sb_lookup(n.index, curl, C.size_t(len(url)), &clist) {
+	case C.SB_PREFIX_MATCH:
+		return C.GoString(clist), false
+	case C.SB_FULL_MATCH:
+		return C.GoString(clist), true
+	}
+	return "", false
+}
+
+func (n *nativeIndex) close() {
+	C.sb_index_free(n.index)
+}
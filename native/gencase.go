@@ -0,0 +1,40 @@
+//go:build ignore
+
+// gencase writes sbcase.h, the lower case mapping used by the native
+// canonicalization, from the tables of the unicode package so that it lower
+// cases exactly as strings.ToLower does.  Run it from the repository root
+// with "go run native/gencase.go" after upgrading Go.
+package main
+
+import (
+	"bytes"
+	"fmt"
+	"io/ioutil"
+	"log"
+	"unicode"
+)
+
+func main() {
+	buf := bytes.Buffer{}
+	fmt.Fprintf(&buf, "/*\n * Code generated by native/gencase.go from the Go %s unicode tables; DO NOT EDIT.\n */\n\n", unicode.Version)
+	buf.WriteString("#ifndef SB_CASE_H\n#define SB_CASE_H\n\n")
+	buf.WriteString("/* upper and lower case alternate through the range */\n")
+	fmt.Fprintf(&buf, "#define SB_UPPER_LOWER 0x%x\n\n", unicode.MaxRune+1)
+	buf.WriteString("typedef struct sb_case_range_t_\n{\n    uint32_t lo;\n    uint32_t hi;\n    int32_t  delta;\n} sb_case_range_t;\n\n")
+	buf.WriteString("static const sb_case_range_t sb_lower_ranges[] = {\n")
+	n := 0
+	for _, r := range unicode.CaseRanges {
+		delta := r.Delta[unicode.LowerCase]
+		if delta == 0 {
+			continue
+		}
+		fmt.Fprintf(&buf, "    {0x%04x, 0x%04x, %d},\n", r.Lo, r.Hi, delta)
+		n++
+	}
+	buf.WriteString("};\n\n")
+	fmt.Fprintf(&buf, "#define SB_LOWER_RANGES %d\n\n#endif\n", n)
+
+	if err := ioutil.WriteFile("sbcase.h", buf.Bytes(), 0644); err != nil {
+		log.Fatal(err)
+	}
+}
@@ -0,0 +1,94 @@
+/*
+ * sbcheck: check URLs against the index snapshots in a safe browsing data
+ * directory, without going through the Go library.
+ *
+ *     sbcheck [-c] DATADIR [URL...]
+ *
+ * Each URL on the command line, or else each line of standard input, is
+ * printed back as "<result>\t<list>\t<url>" where the result is "listed"
+ * (a full hash match), "prefix" (may be listed, the full hash has to be
+ * requested before showing a warning) or "clean". With -c the canonical
+ * form and lookup candidates are printed instead.
+ */
+
+#include "sblookup.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+
+static void usage()
+{
+    fprintf(stderr, "Usage: sbcheck [-c] DATADIR [URL...]\n");
+    exit(EXIT_FAILURE);
+}
+
+
+static void print_candidate(const char* candidate, size_t len, void* arg)
+{
+    (void) arg;
+    printf("\t%.*s\n", (int) len, candidate);
+}
+
+
+static void check(const sb_index_t* index, bool canonical, const char* url, size_t len)
+{
+    static const char* results[] = {"clean", "prefix", "listed"};
+    const char* list;
+    char* canon;
+    size_t canonlen;
+    int r;
+
+    if (canonical) {
+        canon = sb_canonicalize(url, len, &canonlen);
+        printf("%s\n", canon);
+        sb_candidates(canon, canonlen, print_candidate, NULL);
+        sb_free(canon);
+        return;
+    }
+
+    r = sb_lookup(index, url, len, &list);
+    printf("%s\t%s\t%.*s\n", results[r], list != NULL ? list : "-", (int) len, url);
+}
+
+
+int main(int argc, char* argv[])
+{
+    sb_index_t* index = NULL;
+    bool canonical = false;
+    char line[65536];
+    size_t len;
+    int i = 1, err;
+
+    if (i < argc && strcmp(argv[i], "-c") == 0) {
+        canonical = true;
+        ++i;
+    }
+    if (i >= argc) usage();
+
+    if (sb_abi_version() != SB_ABI_VERSION) {
+        fprintf(stderr, "sbcheck: built against ABI %d but linked with %d\n",
+                SB_ABI_VERSION, sb_abi_version());
+        return EXIT_FAILURE;
+    }
+
+    err = sb_index_open(argv[i], &index);
+    if (err != 0) {
+        fprintf(stderr, "sbcheck: %s: %s\n", argv[i], sb_strerror(err));
+        return EXIT_FAILURE;
+    }
+    ++i;
+
+    if (i < argc) {
+        for (; i < argc; ++i) check(index, canonical, argv[i], strlen(argv[i]));
+    } else {
+        while (fgets(line, sizeof(line), stdin) != NULL) {
+            len = strlen(line);
+            while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) --len;
+            check(index, canonical, line, len);
+        }
+    }
+
+    sb_index_free(index);
+    return EXIT_SUCCESS;
+}
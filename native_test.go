@@ -0,0 +1,282 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import (
+	"bytes"
+	"crypto/sha256"
+	"io/ioutil"
+	"math/rand"
+	"os"
+	"reflect"
+	"sync"
+	"testing"
+)
+
+// Pieces the conformance URLs are made of, picked to hit every branch of
+// the canonicalization and its quirks.
+var nativeUrlPieces = []string{
+	"http://", "https://", "ftp+x://", "://", "1a://", "/", "//", "./", "../",
+	"/./", "/../", "..", ".", "...", "%", "%2", "%25", "%2e", "%2E", "%2F",
+	"%3A", "%41", "%80", "%00", "%0a", "%25%32%35", "?", "??", "#", " ",
+	"\t", "\n", "\r", "\v", "A", "Z", "z", "0", "1", "255", "256", "01",
+	"3279880203", "18446744073709551616", "192.168.0.1", "1.2.3", "::1",
+	"::ffff:1.2.3.4", "1:2:3:4:5:6:7:8", "1::", "::", "fe80::1%eth0",
+	"[::1]", ":", ":80", "@", "=", "&", "-", "+", ",", "www", "com", "co.uk",
+	"a.b.c.d.e.f.g", "GOOgle", "\x01", "\x7f", "\x80", "\xff", "\xc3",
+	"\xc3\xa9", "\xc3\x89", "\xce\xa9", "\xd0\x96", "\xc4\xb0", "\xe1\xba\x9e",
+	"\xe2\x80\x83", "\xc2\xa0", "\xc2\x85", "\xe3\x80\x80", "\xed\xa0\x80",
+	"\xf0\x9f\x98\x80", "\xef\xbc\xa1",
+}
+
+func nativeTestUrls(n int, seed int64) []string {
+	r := rand.New(rand.NewSource(seed))
+	urls := []string{
+		"", " ", "http://", "http:///", "a://b", "http://host/%25%32%35",
+		"http://www.google.com/blah/..", "www.google.com", "http://\x01\x80.com/",
+		"  http://www.google.com/  ", "http://host.com//twoslashes?more//slashes",
+		"http://a.b.c/1/2.html?param=1", "http://a.b.c.d.e.f.g/1/2/3/4/5.html",
+		"http://www.gotaport.com:1234/", "http://%31%36%38%2e%31%38%38%2e%39%39%2e%32%36/",
+		"http://a..b./", "http://.a.b/", "http://a.com/?x=http://b.com/c",
+		"http://ht/x/../", "xhttp://h/./.", "9http://h/a/b/c/d/e",
+	}
+	for len(urls) < n {
+		buf := bytes.Buffer{}
+		if r.Intn(3) > 0 {
+			buf.WriteString("http://")
+		}
+		for i := r.Intn(12); i >= 0; i-- {
+			buf.WriteString(nativeUrlPieces[r.Intn(len(nativeUrlPieces))])
+		}
+		urls = append(urls, buf.String())
+	}
+	return urls
+}
+
+// canonicalizes reports whether Canonicalize copes with url; it panics on
+// URLs with a scheme after the fragment, leaving nothing to compare against.
+func canonicalizes(url string) (ok bool) {
+	defer func() {
+		if recover() != nil {
+			ok = false
+		}
+	}()
+	Canonicalize(url)
+	return true
+}
+
+func TestNativeCanonicalize(t *testing.T) {
+	for _, url := range nativeTestUrls(20000, 1) {
+		if !canonicalizes(url) {
+			continue
+		}
+		canonical := Canonicalize(url)
+		if native := nativeCanonicalize(url); native != canonical {
+			t.Fatalf("Canonicalize(%q) = %q, native %q", url, canonical, native)
+		}
+
+		// candidates of canonical and raw URLs alike
+		for _, u := range []string{canonical, url} {
+			candidates := GenerateTestCandidates(u)
+			native := nativeCandidates(u)
+			if len(candidates) != 0 && !reflect.DeepEqual(candidates, native) {
+				t.Fatalf("GenerateTestCandidates(%q) = %q, native %q", u, candidates, native)
+			}
+			if len(candidates) == 0 && len(native) != 0 {
+				t.Fatalf("GenerateTestCandidates(%q) is empty, native %q", u, native)
+			}
+		}
+	}
+}
+
+func TestNativeHash(t *testing.T) {
+	r := rand.New(rand.NewSource(1))
+	for n := 0; n < 300; n++ {
+		data := make([]byte, n)
+		r.Read(data)
+		expected := sha256.Sum256(data)
+		if native := nativeHash(data); !bytes.Equal(native, expected[:]) {
+			t.Fatalf("SHA-256 of %d bytes: %x, native %x", n, expected, native)
+		}
+	}
+}
+
+// nativeFixture writes snapshots of two lists, listing some of urls by full
+// hash and some by prefix, and returns the SafeBrowsing holding them.
+func nativeFixture(t testing.TB, dir string, urls []string) *SafeBrowsing {
+	sb := &SafeBrowsing{
+		DataDir: dir,
+		Lists:   map[string]*SafeBrowsingList{},
+		Logger:  new(DefaultLogger),
+	}
+	for _, name := range []string{"goog-malware-shavar", "googpub-phish-shavar"} {
+		sb.Lists[name] = &SafeBrowsingList{
+			Name:              name,
+			FileName:          dir + "/" + name + ".dat",
+			Lookup:            NewTrie(),
+			FullHashRequested: NewTrie(),
+			FullHashes:        NewTrie(),
+			Cache:             make(map[FullHash]*FullHashCache),
+			Logger:            new(DefaultLogger),
+			fsLock:            new(sync.Mutex),
+		}
+	}
+
+	// spread the URLs over both lists by host
+	r := rand.New(rand.NewSource(2))
+	for i, url := range urls {
+		if i%3 == 0 || !canonicalizes(url) {
+			continue
+		}
+		candidates := GenerateTestCandidates(Canonicalize(url))
+		if len(candidates) == 0 {
+			continue
+		}
+		sbl := sb.Lists["goog-malware-shavar"]
+		if len(ExtractHostKey(Canonicalize(url)))%2 == 0 {
+			sbl = sb.Lists["googpub-phish-shavar"]
+		}
+		hash := getHash(candidates[r.Intn(len(candidates))])
+		if i%3 == 1 {
+			sbl.FullHashes.Set(string(hash))
+		} else {
+			sbl.Lookup.Set(string(hash[:PREFIX_4B_SZ]))
+		}
+	}
+
+	for _, sbl := range sb.Lists {
+		if err := sbl.saveSnapshot(); err != nil {
+			t.Fatal(err)
+		}
+	}
+	return sb
+}
+
+func TestNativeLookup(t *testing.T) {
+	dir, err := ioutil.TempDir("", "safebrowsing")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer os.RemoveAll(dir)
+
+	urls := []string{}
+	r := rand.New(rand.NewSource(3))
+	hosts := []string{"a.com", "evil.b.com", "c.d.e.f.co.uk", "10.1.2.3", "x.y"}
+	paths := []string{"/", "/1", "/1/2.html", "/1/2/3/4.html?q=1", "/a?b"}
+	for i := 0; i < 2000; i++ {
+		urls = append(urls, "http://"+hosts[r.Intn(len(hosts))]+string('a'+rune(r.Intn(26)))+
+			".net"+paths[r.Intn(len(paths))])
+	}
+	urls = append(urls, nativeTestUrls(2000, 4)...)
+	sb := nativeFixture(t, dir, urls)
+
+	index, err := openNativeIndex(dir)
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer index.close()
+	if lists := index.lists(); !reflect.DeepEqual(lists, []string{"goog-malware-shavar", "googpub-phish-shavar"}) {
+		t.Fatalf("Native index holds %v", lists)
+	}
+
+	// MightBeListed checks the lists in no particular order, while the native
+	// lookups take them in name order, so ask Go about each list on its own
+	names := []string{"goog-malware-shavar", "googpub-phish-shavar"}
+	single := map[string]*SafeBrowsing{}
+	for _, name := range names {
+		single[name] = &SafeBrowsing{
+			Lists:  map[string]*SafeBrowsingList{name: sb.Lists[name]},
+			Logger: sb.Logger,
+		}
+	}
+
+	listed := 0
+	for _, url := range urls {
+		if !canonicalizes(url) {
+			continue
+		}
+		list, full := "", false
+		for _, name := range names {
+			l, f, err := single[name].MightBeListed(url)
+			if err != nil {
+				t.Fatal(err)
+			}
+			if l != "" {
+				list, full = l, f
+				break
+			}
+		}
+		nativeList, nativeFull := index.mightBeListed(url)
+		if list != nativeList || full != nativeFull {
+			t.Fatalf("MightBeListed(%q) = %q, %v; native %q, %v", url, list, full, nativeList, nativeFull)
+		}
+		if list != "" {
+			listed++
+		}
+	}
+	if listed < len(urls)/2 {
+		t.Errorf("Only %d of %d URLs listed", listed, len(urls))
+	}
+
+	// a damaged snapshot is refused
+	fileName := sb.Lists["goog-malware-shavar"].snapshotFileName()
+	data, err := ioutil.ReadFile(fileName)
+	if err != nil {
+		t.Fatal(err)
+	}
+	data[len(data)-1] ^= 1
+	if err = ioutil.WriteFile(fileName, data, 0644); err != nil {
+		t.Fatal(err)
+	}
+	if _, err = openNativeIndex(dir); err == nil {
+		t.Error("Opened a snapshot that doesn't match its digest")
+	}
+}
+
+func BenchmarkNativeLookup(b *testing.B) {
+	dir, err := ioutil.TempDir("", "safebrowsing")
+	if err != nil {
+		b.Fatal(err)
+	}
+	defer os.RemoveAll(dir)
+
+	urls := []string{}
+	for _, url := range nativeTestUrls(10000, 5) {
+		if canonicalizes(url) {
+			urls = append(urls, url)
+		}
+	}
+	nativeFixture(b, dir, urls)
+	index, err := openNativeIndex(dir)
+	if err != nil {
+		b.Fatal(err)
+	}
+	defer index.close()
+
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		index.mightBeListed(urls[i%len(urls)])
+	}
+}
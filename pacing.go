@@ -0,0 +1,367 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import (
+	"context"
+	"encoding/gob"
+	"fmt"
+	"os"
+	"os/exec"
+	"runtime"
+	"runtime/debug"
+	"strconv"
+	"sync"
+	"sync/atomic"
+	"syscall"
+	"time"
+)
+
+// Rebuilding a list's tries after an update is heavy on both CPU and
+// allocation, and runs alongside the lookups.  To keep it from stretching
+// their latency it is paced: only UpdateWorkers lists are rebuilt at once,
+// each yielding the processor after every UpdateBatch prefixes and full
+// hashes it inserts, and backing off for a while when lookups or GC pauses
+// are running slow.
+
+// UpdateWorkers is how many lists can be rebuilt at the same time.
+var UpdateWorkers = 1
+
+// UpdateBatch is how many prefixes and full hashes a rebuild inserts
+// between yields.
+var UpdateBatch = 4096
+
+// A rebuild backs off while probing a list takes longer than
+// UpdateLatencyLimit on average, or after a GC pause longer than
+// UpdateGCPauseLimit, waiting twice as long each time up to
+// UpdateMaxBackoff.
+var UpdateLatencyLimit = 1 * time.Millisecond
+var UpdateGCPauseLimit = 5 * time.Millisecond
+var UpdateMaxBackoff = 200 * time.Millisecond
+
+// UpdateInChild rebuilds each list in a child process instead, at a lower
+// priority and with UpdateWorkers threads, which hands back the new index
+// snapshot.  The program has to call RunUpdateChild first thing in main.
+var UpdateInChild = false
+
+var updateWorkers chan struct{}
+var updateWorkersOnce sync.Once
+
+// acquireUpdateWorker waits for a free worker, returning the function that
+// releases it.
+func acquireUpdateWorker() func() {
+	updateWorkersOnce.Do(func() {
+		n := UpdateWorkers
+		if n < 1 {
+			n = 1
+		}
+		updateWorkers = make(chan struct{}, n)
+	})
+	updateWorkers <- struct{}{}
+	return func() { <-updateWorkers }
+}
+
+// The recent probe latency, a moving average in nanoseconds, and when it
+// was last observed.
+var probeLatency int64
+var probeLatencyObserved int64
+
+// observeProbeLatency adds a list probe to the average.  Concurrent probes
+// can lose each other's samples, which an average can afford.
+func observeProbeLatency(d time.Duration) {
+	old := atomic.LoadInt64(&probeLatency)
+	atomic.CompareAndSwapInt64(&probeLatency, old, old+(int64(d)-old)/8)
+	atomic.StoreInt64(&probeLatencyObserved, time.Now().UnixNano())
+}
+
+// recentProbeLatency is the average, which stops counting once lookups
+// have stopped for a second.
+func recentProbeLatency() time.Duration {
+	if time.Now().UnixNano()-atomic.LoadInt64(&probeLatencyObserved) > int64(time.Second) {
+		return 0
+	}
+	return time.Duration(atomic.LoadInt64(&probeLatency))
+}
+
+// updatePacer paces a single rebuild.  Its methods do nothing on a nil
+// pacer.
+type updatePacer struct {
+	inserted int
+	backoff  time.Duration
+	numGC    int64
+	gcStats  debug.GCStats
+
+	// for the log
+	yields int
+	paused time.Duration
+}
+
+func newUpdatePacer() *updatePacer {
+	p := &updatePacer{}
+	debug.ReadGCStats(&p.gcStats)
+	p.numGC = p.gcStats.NumGC
+	return p
+}
+
+// step counts n more prefixes or hashes inserted, yielding after each
+// batch.
+func (p *updatePacer) step(n int) {
+	if p == nil {
+		return
+	}
+	p.inserted += n
+	if p.inserted < UpdateBatch {
+		return
+	}
+	p.inserted = 0
+	p.yields++
+	runtime.Gosched()
+
+	if !p.underPressure() {
+		p.backoff = 0
+		return
+	}
+	if p.backoff == 0 {
+		p.backoff = time.Millisecond
+	} else if p.backoff *= 2; p.backoff > UpdateMaxBackoff {
+		p.backoff = UpdateMaxBackoff
+	}
+	time.Sleep(p.backoff)
+	p.paused += p.backoff
+}
+
+// underPressure is whether lookups are slow or the collector paused for
+// too long since the last batch.
+func (p *updatePacer) underPressure() bool {
+	if recentProbeLatency() > UpdateLatencyLimit {
+		return true
+	}
+	debug.ReadGCStats(&p.gcStats)
+	slowGC := p.gcStats.NumGC != p.numGC && len(p.gcStats.Pause) > 0 && p.gcStats.Pause[0] > UpdateGCPauseLimit
+	p.numGC = p.gcStats.NumGC
+	return slowGC
+}
+
+// insertedChunk steps on by the prefixes or full hashes of a chunk.
+func (p *updatePacer) insertedChunk(chunk *ChunkData) {
+	if chunk.GetPrefixType() == PREFIX_32B {
+		p.step(len(chunk.Hashes) / PREFIX_32B_SZ)
+	} else {
+		p.step(len(chunk.Hashes) / PREFIX_4B_SZ)
+	}
+}
+
+func (p *updatePacer) String() string {
+	if p == nil {
+		return "unpaced"
+	}
+	return fmt.Sprintf("%d yields, paused for %s", p.yields, p.paused)
+}
+
+// Set in the environment of update children, and in them by RunUpdateChild.
+const updateChildEnv = "SAFEBROWSING_UPDATE_CHILD"
+
+var isUpdateChild = false
+
+// childUpdate is what an update child is sent on its standard input.
+type childUpdate struct {
+	Name         string
+	FileName     string
+	DeleteChunks map[ChunkData_ChunkType]map[ChunkNum]bool
+	Chunks       []*storedChunk
+}
+
+// childResult is what it hands back on file descriptor 3, along with the
+// data file and index snapshot it has written.
+type childResult struct {
+	ChunkRanges       map[ChunkData_ChunkType]string
+	FullHashRequested []byte
+	Error             string
+}
+
+// RunUpdateChild carries out an update when the program has been started
+// as an update child, returning true when it has and the program should
+// exit, and false in any other case.  With UpdateInChild set it has to be
+// called before anything else in main:
+//
+//	if safebrowsing.RunUpdateChild() {
+//		return
+//	}
+func RunUpdateChild() bool {
+	if os.Getenv(updateChildEnv) == "" {
+		return false
+	}
+	isUpdateChild = true
+
+	// the lookups are in the parent, this only has to keep out of their way
+	syscall.Setpriority(syscall.PRIO_PROCESS, 0, 10)
+
+	result := &childResult{}
+	if err := runUpdateChild(result); err != nil {
+		result.Error = err.Error()
+	}
+	out := os.NewFile(3, "result")
+	if err := gob.NewEncoder(out).Encode(result); err != nil {
+		fmt.Fprintf(os.Stderr, "Unable to return update result: %s\n", err)
+	}
+	out.Close()
+	FlushLog()
+	return true
+}
+
+func runUpdateChild(result *childResult) error {
+	job := &childUpdate{}
+	if err := gob.NewDecoder(os.Stdin).Decode(job); err != nil {
+		return err
+	}
+	chunks := make([]*ChunkData, len(job.Chunks))
+	for i, stored := range job.Chunks {
+		chunk, err := stored.chunk()
+		if err != nil {
+			return err
+		}
+		chunks[i] = chunk
+	}
+
+	sbl := newSafeBrowsingList(job.Name, job.FileName)
+	sbl.DeleteChunks = job.DeleteChunks
+	if err := sbl.load(chunks); err != nil {
+		return err
+	}
+	requested, err := sbl.FullHashRequested.SortedKeys(PREFIX_32B_SZ)
+	if err != nil {
+		return err
+	}
+	result.ChunkRanges = sbl.ChunkRanges
+	result.FullHashRequested = requested
+	return nil
+}
+
+// startUpdateChild runs an update in a child process, which leaves the new
+// data file and index snapshot behind.
+func (sbl *SafeBrowsingList) startUpdateChild(newChunks []*ChunkData) (*childResult, error) {
+	executable, err := os.Executable()
+	if err != nil {
+		return nil, err
+	}
+	resultRead, resultWrite, err := os.Pipe()
+	if err != nil {
+		return nil, err
+	}
+	defer resultRead.Close()
+
+	cmd := exec.Command(executable)
+	cmd.Env = append(os.Environ(), updateChildEnv+"=1", "GOMAXPROCS="+strconv.Itoa(UpdateWorkers))
+	cmd.Stdout = os.Stdout
+	cmd.Stderr = os.Stderr
+	cmd.ExtraFiles = []*os.File{resultWrite}
+	stdin, err := cmd.StdinPipe()
+	if err != nil {
+		resultWrite.Close()
+		return nil, err
+	}
+	if err = cmd.Start(); err != nil {
+		resultWrite.Close()
+		return nil, err
+	}
+	resultWrite.Close()
+
+	job := &childUpdate{
+		Name:         sbl.Name,
+		FileName:     sbl.FileName,
+		DeleteChunks: sbl.DeleteChunks,
+		Chunks:       make([]*storedChunk, len(newChunks)),
+	}
+	for i, chunk := range newChunks {
+		job.Chunks[i] = storeChunk(chunk)
+	}
+	sendErr := gob.NewEncoder(stdin).Encode(job)
+	stdin.Close()
+
+	result := &childResult{}
+	resultErr := gob.NewDecoder(resultRead).Decode(result)
+	waitErr := cmd.Wait()
+	switch {
+	case sendErr != nil:
+		return nil, sendErr
+	case resultErr != nil:
+		return nil, fmt.Errorf("No result from update child (%v): %s", waitErr, resultErr)
+	case result.Error != "":
+		return nil, fmt.Errorf("Update child failed: %s", result.Error)
+	}
+	return result, waitErr
+}
+
+// loadInChild is load, with the data file rewritten and the new index
+// snapshot built by a child process.  Only loading the snapshot into new
+// tries is left to do here.
+func (sbl *SafeBrowsingList) loadInChild(ctx context.Context, newChunks []*ChunkData) error {
+	ctx, s := startSpan(ctx, "load", "list", sbl.Name)
+	defer s.end()
+
+	sbl.Logger.Info("Reloading %s in a child process", sbl.Name)
+	sbl.fsLock.Lock()
+	defer sbl.fsLock.Unlock()
+
+	_, phase := startSpan(ctx, "child", "phase", "child")
+	result, err := sbl.startUpdateChild(newChunks)
+	phase.end()
+	if err != nil {
+		return err
+	}
+
+	_, phase = startSpan(ctx, "insert", "phase", "insert")
+	_, prefixes, fullHashes, err := readSnapshot(sbl.snapshotFileName())
+	if err != nil {
+		phase.end()
+		return err
+	}
+	defer acquireUpdateWorker()()
+	pace := newUpdatePacer()
+	lookup, full := triesFromKeys(sbl.Name, prefixes, fullHashes, pace)
+	requested := newListSet(sbl.Name, RoleFullHashRequested)
+	for i := 0; i+PREFIX_32B_SZ <= len(result.FullHashRequested); i += PREFIX_32B_SZ {
+		requested.Set(string(result.FullHashRequested[i : i+PREFIX_32B_SZ]))
+	}
+	phase.end()
+
+	_, phase = startSpan(ctx, "swap", "phase", "swap")
+	sbl.Lookup = lookup
+	sbl.FullHashes = full
+	sbl.FullHashRequested = requested
+	atomic.StoreInt32(&sbl.loaded, 1)
+	sbl.dropSnapshot()
+	if len(newChunks) > 0 {
+		sbl.clearStaging()
+	}
+	sbl.ChunkRanges = result.ChunkRanges
+	sbl.DeleteChunks = make(map[ChunkData_ChunkType]map[ChunkNum]bool)
+	sbl.recordHistory(prefixes, fullHashes)
+	phase.end()
+
+	sbl.Logger.Info("Loaded %d prefixes and %d full hashes of %s from the child process (%s)",
+		len(prefixes)/PREFIX_4B_SZ, len(fullHashes)/PREFIX_32B_SZ, sbl.Name, pace)
+	return nil
+}
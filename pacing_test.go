@@ -0,0 +1,108 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import (
+	"context"
+	"os"
+	"testing"
+	"time"
+)
+
+// The test binary doubles as the update child.
+func TestMain(m *testing.M) {
+	if RunUpdateChild() {
+		return
+	}
+	os.Exit(m.Run())
+}
+
+func TestUpdatePacerBacksOff(t *testing.T) {
+	defer func(batch int, limit time.Duration) {
+		UpdateBatch, UpdateLatencyLimit = batch, limit
+	}(UpdateBatch, UpdateLatencyLimit)
+	UpdateBatch = 10
+	UpdateLatencyLimit = time.Millisecond
+
+	// lookups running fast
+	pace := newUpdatePacer()
+	for i := 0; i < 100; i++ {
+		observeProbeLatency(0)
+		pace.step(1)
+	}
+	if pace.yields != 10 || pace.paused != 0 {
+		t.Errorf("Fast lookups: %s", pace)
+	}
+
+	// and slow, which backs off longer each batch
+	for i := 0; i < 64; i++ {
+		observeProbeLatency(10 * time.Millisecond)
+	}
+	pace = newUpdatePacer()
+	pace.step(30)
+	pace.step(10)
+	if pace.paused < 3*time.Millisecond {
+		t.Errorf("Slow lookups: %s", pace)
+	}
+
+	// lookups that have stopped don't hold an update up
+	probeLatencyObserved = time.Now().Add(-2 * time.Second).UnixNano()
+	pace = newUpdatePacer()
+	pace.step(10)
+	if pace.paused != 0 {
+		t.Errorf("Stale latency: %s", pace)
+	}
+}
+
+func TestLoadInChild(t *testing.T) {
+	sbl, dir := stagingTestList(t, &redirectServer{})
+	defer os.RemoveAll(dir)
+	if err := sbl.load([]*ChunkData{addChunk(1, "aaaa")}); err != nil {
+		t.Fatal(err)
+	}
+
+	sbl.DeleteChunks = map[ChunkData_ChunkType]map[ChunkNum]bool{CHUNK_TYPE_ADD: {1: true}}
+	if err := sbl.loadInChild(context.Background(), []*ChunkData{addChunk(2, "bbbbcccc")}); err != nil {
+		t.Fatal(err)
+	}
+	if sbl.Lookup.Get("aaaa") || !sbl.Lookup.Get("bbbb") || !sbl.Lookup.Get("cccc") {
+		t.Error("Update not loaded from the child")
+	}
+	if sbl.ChunkRanges[CHUNK_TYPE_ADD] != "2" {
+		t.Errorf("Unexpected chunk ranges %v", sbl.ChunkRanges)
+	}
+	if err := sbl.VerifySnapshot(); err != nil {
+		t.Error(err)
+	}
+
+	// and the data file it left is the one loaded from now on
+	reloaded := newSafeBrowsingList("test", sbl.FileName)
+	if err := reloaded.load(nil); err != nil {
+		t.Fatal(err)
+	}
+	if reloaded.Lookup.Size() != 2 || reloaded.Lookup.Digest() != sbl.Lookup.Digest() {
+		t.Error("Data file not written by the child")
+	}
+}
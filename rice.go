@@ -0,0 +1,259 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import (
+	"encoding/binary"
+	"fmt"
+	"math"
+	"math/bits"
+	"sort"
+)
+
+// Chunks are stored in the data files as storedChunks.  The 4 byte prefixes
+// of a chunk look random, so rather than storing them as they are they are
+// sorted and the differences between them Golomb-Rice coded: a difference d
+// is written as d>>k in unary, one bits ended by a zero, followed by the low
+// k bits of d.  With k near log2 of the average difference this takes about
+// k+2 bits per prefix, a little over half the 32 of the raw prefix.
+//
+// The field names match ChunkData, so gob decodes data files written before
+// the prefixes were coded as storedChunks with the raw Hashes.
+type storedChunk struct {
+	ChunkNumber *int32
+	ChunkType   *ChunkData_ChunkType
+	PrefixType  *ChunkData_PrefixType
+	Hashes      []byte
+	AddNumbers  []int32
+
+	// the Rice coded prefixes, in place of Hashes
+	Rice          []byte
+	RiceParameter uint8
+	RiceCount     uint32
+}
+
+// storeChunk codes the prefixes of a chunk, leaving full length hashes as
+// they are.
+func storeChunk(chunk *ChunkData) *storedChunk {
+	sc := &storedChunk{
+		ChunkNumber: chunk.ChunkNumber,
+		ChunkType:   chunk.ChunkType,
+		PrefixType:  chunk.PrefixType,
+		Hashes:      chunk.Hashes,
+		AddNumbers:  chunk.AddNumbers,
+	}
+	n := len(chunk.Hashes) / PREFIX_4B_SZ
+	if chunk.GetPrefixType() != PREFIX_4B || n == 0 || len(chunk.Hashes)%PREFIX_4B_SZ != 0 ||
+		(len(chunk.AddNumbers) != 0 && len(chunk.AddNumbers) != n) {
+		return sc
+	}
+
+	// sub chunks carry an add chunk number for each prefix, which has to
+	// stay with it
+	prefixes := make([]uint32, n)
+	for i := range prefixes {
+		prefixes[i] = binary.BigEndian.Uint32(chunk.Hashes[i*PREFIX_4B_SZ:])
+	}
+	if len(chunk.AddNumbers) == n {
+		sc.AddNumbers = append([]int32(nil), chunk.AddNumbers...)
+		sort.Sort(prefixesWithAddNumbers{prefixes, sc.AddNumbers})
+	} else {
+		sort.Slice(prefixes, func(i, j int) bool { return prefixes[i] < prefixes[j] })
+	}
+
+	sc.RiceParameter, sc.Rice = riceEncode(prefixes)
+	sc.RiceCount = uint32(n)
+	sc.Hashes = nil
+	return sc
+}
+
+type prefixesWithAddNumbers struct {
+	prefixes   []uint32
+	addNumbers []int32
+}
+
+func (p prefixesWithAddNumbers) Len() int           { return len(p.prefixes) }
+func (p prefixesWithAddNumbers) Less(i, j int) bool { return p.prefixes[i] < p.prefixes[j] }
+func (p prefixesWithAddNumbers) Swap(i, j int) {
+	p.prefixes[i], p.prefixes[j] = p.prefixes[j], p.prefixes[i]
+	p.addNumbers[i], p.addNumbers[j] = p.addNumbers[j], p.addNumbers[i]
+}
+
+// chunk decodes the stored chunk.
+func (sc *storedChunk) chunk() (*ChunkData, error) {
+	chunk := &ChunkData{
+		ChunkNumber: sc.ChunkNumber,
+		ChunkType:   sc.ChunkType,
+		PrefixType:  sc.PrefixType,
+		Hashes:      sc.Hashes,
+		AddNumbers:  sc.AddNumbers,
+	}
+	if sc.RiceCount > 0 {
+		chunk.Hashes = make([]byte, int(sc.RiceCount)*PREFIX_4B_SZ)
+		if err := riceDecode(sc.Rice, sc.RiceParameter, chunk.Hashes); err != nil {
+			return nil, fmt.Errorf("Chunk %d: %s", chunk.GetChunkNumber(), err)
+		}
+	}
+	return chunk, nil
+}
+
+// riceParameter picks k for the differences between sorted values, which
+// are spread evenly on average.
+func riceParameter(values []uint32) uint8 {
+	mean := uint64(values[len(values)-1]) / uint64(len(values))
+	if mean == 0 {
+		return 0
+	}
+	return uint8(bits.Len64(mean) - 1)
+}
+
+// riceEncode codes sorted values, the first as its difference from zero.
+func riceEncode(values []uint32) (k uint8, data []byte) {
+	k = riceParameter(values)
+
+	// bits are written from the top of acc down
+	var acc uint64
+	var used uint
+	put := func(v uint64, n uint) {
+		for n > 0 {
+			m := 64 - used
+			if m > n {
+				m = n
+			}
+			acc |= (v >> (n - m) & (1<<m - 1)) << (64 - used - m)
+			used += m
+			n -= m
+			for used >= 8 {
+				data = append(data, byte(acc>>56))
+				acc <<= 8
+				used -= 8
+			}
+		}
+	}
+
+	last := uint32(0)
+	for _, v := range values {
+		d := uint64(v - last)
+		last = v
+		for q := d >> k; q > 0; {
+			n := q
+			if n > 32 {
+				n = 32
+			}
+			put(1<<n-1, uint(n))
+			q -= n
+		}
+		put(0, 1)
+		put(d, uint(k))
+	}
+	if used > 0 {
+		data = append(data, byte(acc>>56))
+	}
+	return k, data
+}
+
+// riceOnes is the number of leading one bits of each byte.
+var riceOnes [256]uint8
+
+func init() {
+	for b := 0; b < 256; b++ {
+		riceOnes[b] = uint8(bits.LeadingZeros8(^uint8(b)))
+	}
+}
+
+// riceReader reads bits from the top of a 64 bit window.
+type riceReader struct {
+	data   []byte
+	pos    int
+	window uint64
+	avail  uint
+}
+
+// refill tops the window up to at least 57 bits while the data lasts.
+func (r *riceReader) refill() {
+	if r.pos+8 <= len(r.data) {
+		r.window |= binary.BigEndian.Uint64(r.data[r.pos:]) >> r.avail
+		n := (63 - r.avail) >> 3
+		r.pos += int(n)
+		r.avail += n << 3
+		return
+	}
+	for r.avail <= 56 && r.pos < len(r.data) {
+		r.window |= uint64(r.data[r.pos]) << (56 - r.avail)
+		r.avail += 8
+		r.pos++
+	}
+}
+
+// riceDecode decodes len(out)/4 values into out as big endian prefixes.
+// The quotients are read a byte at a time through riceOnes from a 64 bit
+// window, which is topped up before each value so that in all but the
+// rarest cases the whole value is in it.
+func riceDecode(data []byte, k uint8, out []byte) error {
+	if k > 31 {
+		return fmt.Errorf("Invalid Rice parameter %d", k)
+	}
+	r := riceReader{data: data}
+	value := uint64(0)
+	for o := 0; o+PREFIX_4B_SZ <= len(out); o += PREFIX_4B_SZ {
+		r.refill()
+		q := uint64(0)
+		ones := uint(riceOnes[r.window>>56])
+		for ones == 8 {
+			if r.avail < 8 {
+				return fmt.Errorf("Rice coded prefixes truncated")
+			}
+			q += 8
+			r.window <<= 8
+			r.avail -= 8
+			r.refill()
+			ones = uint(riceOnes[r.window>>56])
+		}
+		if ones >= r.avail {
+			return fmt.Errorf("Rice coded prefixes truncated")
+		}
+		q += uint64(ones)
+		r.window <<= ones + 1
+		r.avail -= ones + 1
+
+		if r.avail < uint(k) {
+			r.refill()
+			if r.avail < uint(k) {
+				return fmt.Errorf("Rice coded prefixes truncated")
+			}
+		}
+		if k > 0 {
+			q = q<<k | r.window>>(64-k)
+			r.window <<= k
+			r.avail -= uint(k)
+		}
+		value += q
+		if value > math.MaxUint32 {
+			return fmt.Errorf("Rice coded prefixes out of range")
+		}
+		binary.BigEndian.PutUint32(out[o:], uint32(value))
+	}
+	return nil
+}
@@ -0,0 +1,193 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import (
+	"bytes"
+	"encoding/binary"
+	"encoding/gob"
+	"math/rand"
+	"sort"
+	"testing"
+)
+
+// randomPrefixChunk returns an add chunk of n random prefixes, or a sub
+// chunk with an add chunk number for each.
+func randomPrefixChunk(r *rand.Rand, n int, sub bool) *ChunkData {
+	chunkNum := int32(r.Intn(100000))
+	chunkType, prefixType := CHUNK_TYPE_ADD, PREFIX_4B
+	chunk := &ChunkData{
+		ChunkNumber: &chunkNum,
+		ChunkType:   &chunkType,
+		PrefixType:  &prefixType,
+		Hashes:      make([]byte, n*PREFIX_4B_SZ),
+	}
+	r.Read(chunk.Hashes)
+	if sub {
+		chunkType = CHUNK_TYPE_SUB
+		for i := 0; i < n; i++ {
+			chunk.AddNumbers = append(chunk.AddNumbers, int32(i))
+		}
+	}
+	return chunk
+}
+
+// prefixPairs lists a chunk's prefixes with their add chunk numbers, sorted.
+func prefixPairs(chunk *ChunkData) []string {
+	pairs := []string{}
+	for i := 0; i < len(chunk.Hashes)/PREFIX_4B_SZ; i++ {
+		pair := string(chunk.Hashes[i*PREFIX_4B_SZ : (i+1)*PREFIX_4B_SZ])
+		if chunk.AddNumbers != nil {
+			pair += string([]byte{byte(chunk.AddNumbers[i] >> 8), byte(chunk.AddNumbers[i])})
+		}
+		pairs = append(pairs, pair)
+	}
+	sort.Strings(pairs)
+	return pairs
+}
+
+func TestRiceRoundTrip(t *testing.T) {
+	r := rand.New(rand.NewSource(1))
+	for _, n := range []int{1, 2, 3, 100, 5000} {
+		for _, sub := range []bool{false, true} {
+			chunk := randomPrefixChunk(r, n, sub)
+			stored := storeChunk(chunk)
+			if stored.RiceCount != uint32(n) || stored.Hashes != nil {
+				t.Fatalf("%d prefixes not coded", n)
+			}
+			decoded, err := stored.chunk()
+			if err != nil {
+				t.Fatal(err)
+			}
+			if decoded.GetChunkNumber() != chunk.GetChunkNumber() || decoded.GetChunkType() != chunk.GetChunkType() {
+				t.Errorf("Chunk header changed: %v", decoded)
+			}
+			expected, got := prefixPairs(chunk), prefixPairs(decoded)
+			if len(expected) != len(got) {
+				t.Fatalf("Decoded %d prefixes, expected %d", len(got), len(expected))
+			}
+			for i := range expected {
+				if expected[i] != got[i] {
+					t.Fatalf("%d prefixes (sub %v): decoded %x, expected %x", n, sub, got[i], expected[i])
+				}
+			}
+		}
+	}
+}
+
+func TestRiceEdgeValues(t *testing.T) {
+	for _, values := range [][]uint32{
+		{0},
+		{0, 0, 0},
+		{0xffffffff},
+		{0, 0xffffffff},
+		{7, 7, 8, 0xfffffffe, 0xffffffff},
+	} {
+		k, data := riceEncode(values)
+		out := make([]byte, len(values)*PREFIX_4B_SZ)
+		if err := riceDecode(data, k, out); err != nil {
+			t.Fatalf("%v: %s", values, err)
+		}
+		for i, v := range values {
+			if got := binary.BigEndian.Uint32(out[i*PREFIX_4B_SZ:]); got != v {
+				t.Errorf("%v: decoded %d as %d", values, v, got)
+			}
+		}
+
+	}
+}
+
+func TestRiceTruncated(t *testing.T) {
+	chunk := randomPrefixChunk(rand.New(rand.NewSource(2)), 100, false)
+	stored := storeChunk(chunk)
+	stored.Rice = stored.Rice[:len(stored.Rice)/2]
+	if _, err := stored.chunk(); err == nil {
+		t.Error("Truncated prefixes decoded")
+	}
+}
+
+func TestStoredChunkReadsOldFiles(t *testing.T) {
+	r := rand.New(rand.NewSource(3))
+	chunk := randomPrefixChunk(r, 10, true)
+
+	// data files used to hold the ChunkData itself
+	buf := &bytes.Buffer{}
+	if err := gob.NewEncoder(buf).Encode(chunk); err != nil {
+		t.Fatal(err)
+	}
+	stored := &storedChunk{}
+	if err := gob.NewDecoder(buf).Decode(stored); err != nil {
+		t.Fatal(err)
+	}
+	decoded, err := stored.chunk()
+	if err != nil {
+		t.Fatal(err)
+	}
+	if !bytes.Equal(decoded.Hashes, chunk.Hashes) || len(decoded.AddNumbers) != 10 ||
+		decoded.GetChunkNumber() != chunk.GetChunkNumber() || decoded.GetChunkType() != CHUNK_TYPE_SUB {
+		t.Errorf("Old chunk not decoded: %v", decoded)
+	}
+}
+
+// benchmarkChunkFile encodes chunks of random prefixes the way the data files
+// store them, reporting the file size, and times decoding them.
+func benchmarkChunkFile(b *testing.B, store func(*ChunkData) interface{}) {
+	r := rand.New(rand.NewSource(4))
+	buf := &bytes.Buffer{}
+	enc := gob.NewEncoder(buf)
+	prefixes := 0
+	for i := 0; i < 100; i++ {
+		chunk := randomPrefixChunk(r, 2000+r.Intn(2000), false)
+		prefixes += len(chunk.Hashes) / PREFIX_4B_SZ
+		if err := enc.Encode(store(chunk)); err != nil {
+			b.Fatal(err)
+		}
+	}
+	file := buf.Bytes()
+
+	b.SetBytes(int64(prefixes * PREFIX_4B_SZ))
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		dec := gob.NewDecoder(bytes.NewReader(file))
+		for {
+			stored := &storedChunk{}
+			if err := dec.Decode(stored); err != nil {
+				break
+			}
+			if _, err := stored.chunk(); err != nil {
+				b.Fatal(err)
+			}
+		}
+	}
+	b.ReportMetric(float64(len(file)*8)/float64(prefixes), "bits/prefix")
+}
+
+func BenchmarkChunkFileRaw(b *testing.B) {
+	benchmarkChunkFile(b, func(chunk *ChunkData) interface{} { return chunk })
+}
+
+func BenchmarkChunkFileRice(b *testing.B) {
+	benchmarkChunkFile(b, func(chunk *ChunkData) interface{} { return storeChunk(chunk) })
+}
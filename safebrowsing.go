@@ -28,14 +28,17 @@ package safebrowsing
 import (
 	"bufio"
 	"bytes"
+	"context"
 	"fmt"
 	"io"
 	"math/rand"
 	"net/http"
 	"os"
 	//	"runtime/debug"
+	"runtime/trace"
 	"strconv"
 	"strings"
+	"sync"
 	"time"
 )
 
@@ -57,6 +60,20 @@ type SafeBrowsing struct {
 	request func(string, string, bool) (*http.Response, error)
 
 	Logger logger
+
+	// shares full hashes with FullHashPeers
+	fullHashRing *fullHashRing
+
+	// the builder followed, and closed by StopFollowing
+	followBuilder string
+	followStop    chan struct{}
+
+	// closed by StopReordering
+	reorderStop chan struct{}
+
+	// guards the outcome of progressive startup
+	startupLock sync.Mutex
+	startupErr  error
 }
 
 var SupportedLists map[string]bool = map[string]bool{
@@ -69,6 +86,18 @@ var Client string = "api"
 var AppVersion string = "1.5.2"
 var ProtocolVersion string = "3.0"
 var OfflineMode bool = false
+
+// ProgressiveStartup makes NewSafeBrowsing return at once, answering
+// MightBeListed from the index snapshots in the data directory while the
+// lists are loaded (and updated, outside offline mode) in the background.
+// Readiness reports how far along that is.
+var ProgressiveStartup bool = false
+
+// ReorderInterval, when not zero, is how often the tries move the keys
+// looked up most to the front of their hash slots, see HatTrie.Reorder.
+// Each round walks every bucket of every trie; a lookup waits for at most
+// the one bucket being reordered.  StopReordering ends the rounds.
+var ReorderInterval time.Duration = 0
 var Transport *http.Transport = &http.Transport{}
 
 func NewSafeBrowsing(apiKey string, dataDirectory string) (sb *SafeBrowsing, err error) {
@@ -83,6 +112,18 @@ func NewSafeBrowsing(apiKey string, dataDirectory string) (sb *SafeBrowsing, err
 		Logger:          Logger,
 	}
 
+	if os.Getenv(updateChildEnv) != "" && !isUpdateChild {
+		return nil, fmt.Errorf("Started as an update child, RunUpdateChild must be called first")
+	}
+
+	if len(FullHashPeers) > 0 {
+		sb.fullHashRing = newFullHashRing(FullHashPeerSelf, FullHashPeers, FullHashPeerSecret)
+	}
+	if ReorderInterval > 0 {
+		sb.reorderStop = make(chan struct{})
+		go sb.reorderLoop(ReorderInterval, sb.reorderStop)
+	}
+
 	// if the dataDirectory does not currently exist, have a go at creating it:
 	err = os.MkdirAll(dataDirectory, os.ModeDir|0700)
 	if err != nil {
@@ -91,21 +132,20 @@ func NewSafeBrowsing(apiKey string, dataDirectory string) (sb *SafeBrowsing, err
 			dataDirectory)
 	}
 
+	if FollowBuilder != "" {
+		err = sb.startFollowing()
+		return sb, err
+	}
+
+	if ProgressiveStartup || handedOver != nil {
+		sb.startProgressive()
+		return sb, nil
+	}
+
 	// if we are in offline mode we want to just load up the lists we
 	// currently have and work with that
 	if OfflineMode {
-		for listName, _ := range SupportedLists {
-			fileName := sb.DataDir + "/" + listName + ".dat"
-			tmpList := newSafeBrowsingList(listName, fileName)
-			tmpList.Logger = sb.Logger
-			err := tmpList.load(nil)
-			if err != nil {
-				sb.Logger.Warn("Error loading list %s: %s", listName, err)
-				continue
-			}
-			sb.Lists[listName] = tmpList
-		}
-		//		debug.FreeOSMemory()
+		sb.loadOffline()
 		return sb, nil
 	}
 
@@ -115,6 +155,26 @@ func NewSafeBrowsing(apiKey string, dataDirectory string) (sb *SafeBrowsing, err
 	return sb, err
 }
 
+func (sb *SafeBrowsing) loadOffline() {
+	for listName, _ := range SupportedLists {
+		tmpList, exists := sb.Lists[listName]
+		if !exists {
+			fileName := sb.DataDir + "/" + listName + ".dat"
+			tmpList = newSafeBrowsingList(listName, fileName)
+			tmpList.Logger = sb.Logger
+		}
+		err := tmpList.loadExisting()
+		if err != nil {
+			sb.Logger.Warn("Error loading list %s: %s", listName, err)
+			continue
+		}
+		if !exists {
+			sb.Lists[listName] = tmpList
+		}
+	}
+	//		debug.FreeOSMemory()
+}
+
 func (sb *SafeBrowsing) UpdateProcess() (err error) {
 
 	sb.Logger.Info("Requesting list of lists from server...")
@@ -126,7 +186,12 @@ func (sb *SafeBrowsing) UpdateProcess() (err error) {
 	if err != nil {
 		return err
 	}
-	err, status := sb.update()
+	return sb.startUpdates()
+}
+
+// startUpdates brings the loaded lists up to date and keeps them there.
+func (sb *SafeBrowsing) startUpdates() error {
+	err, status := sb.update(context.Background())
 	if (err != nil) && (status != 503) {
 		return err
 	} else if status == 503 {
@@ -166,6 +231,10 @@ func (sb *SafeBrowsing) processSafeBrowsingLists(body io.Reader) (err error) {
 		if _, exists := SupportedLists[listName]; !exists {
 			continue
 		}
+		// already set up for progressive startup
+		if _, exists := sb.Lists[listName]; exists {
+			continue
+		}
 		fileName := sb.DataDir + "/" + listName + ".dat"
 		tmpList := newSafeBrowsingList(listName, fileName)
 		tmpList.Logger = sb.Logger
@@ -178,7 +247,7 @@ func (sb *SafeBrowsing) loadExistingData() error {
 
 	sb.Logger.Info("Loading existing data....")
 	for _, sbl := range sb.Lists {
-		err := sbl.load(nil)
+		err := sbl.loadExisting()
 		if err != nil {
 			return fmt.Errorf("Error loading list from %s: %s", sb.DataDir, err)
 		}
@@ -187,15 +256,22 @@ func (sb *SafeBrowsing) loadExistingData() error {
 	return nil
 }
 
-func (sb *SafeBrowsing) update() (err error, status int) {
+// update fetches and applies the pending updates, traced as part of ctx.
+func (sb *SafeBrowsing) update(ctx context.Context) (err error, status int) {
+
+	ctx, task := trace.NewTask(ctx, "update")
+	defer task.End()
 
 	sb.Logger.Info("Requesting updates...")
-	if err, status = sb.requestRedirectList(); err != nil {
+	region := trace.StartRegion(ctx, "redirects")
+	err, status = sb.requestRedirectList()
+	region.End()
+	if err != nil {
 		return fmt.Errorf("Unable to retrieve updates: %s", err.Error()), status
 	}
 
 	for listName, list := range sb.Lists {
-		if err = list.loadDataFromRedirectLists(); err != nil {
+		if err = list.loadDataFromRedirectLists(ctx); err != nil {
 			return fmt.Errorf("Unable to process updates for %s: %s", listName, err.Error()), status
 		}
 	}
@@ -216,11 +292,16 @@ func (sb *SafeBrowsing) requestRedirectList() (err error, status int) {
 	listsStr := ""
 	for list, sbl := range sb.Lists {
 		listsStr += string(list) + ";"
-		addChunkRange := sbl.ChunkRanges[CHUNK_TYPE_ADD]
+		ranges := sbl.ChunkRanges
+		if sbl.resetPending {
+			// ask for the whole list again, less what has come since
+			ranges = sbl.resetRanges
+		}
+		addChunkRange := ranges[CHUNK_TYPE_ADD]
 		if addChunkRange != "" {
 			listsStr += "a:" + addChunkRange + ":"
 		}
-		subChunkRange := sbl.ChunkRanges[CHUNK_TYPE_SUB]
+		subChunkRange := ranges[CHUNK_TYPE_SUB]
 		if subChunkRange != "" {
 			listsStr += "s:" + subChunkRange
 		}
@@ -273,8 +354,7 @@ func (sb *SafeBrowsing) processRedirectList(buf io.Reader) error {
 		case "i":
 			if RedirectList != nil {
 				// save to DataRedirects
-				sb.Lists[currentListName].DataRedirects = RedirectList
-				sb.Lists[currentListName].DeleteChunks = currentDeletes
+				sb.setPendingUpdate(currentListName, RedirectList, currentDeletes)
 			}
 			// reinitialize temporary var
 			RedirectList = make([]string, 0)
@@ -303,39 +383,76 @@ func (sb *SafeBrowsing) processRedirectList(buf io.Reader) error {
 	}
 
 	// add the final list
-	sb.Lists[currentListName].DataRedirects = RedirectList
-	sb.Lists[currentListName].DeleteChunks = currentDeletes
+	sb.setPendingUpdate(currentListName, RedirectList, currentDeletes)
 	if err := scanner.Err(); err != nil && err != io.EOF {
 		return fmt.Errorf("Unable to parse list response: %s", err)
 	}
 	return nil
 }
 
-func (sb *SafeBrowsing) reset() {
+// setPendingUpdate records the redirects and deletes for a list from the
+// redirect list, staging them to disk.
+func (sb *SafeBrowsing) setPendingUpdate(listName string, redirects []string,
+	deletes map[ChunkData_ChunkType]map[ChunkNum]bool) {
 
-	// reinitalize all lists
-	for _, sbl := range sb.Lists {
+	sbl, exists := sb.Lists[listName]
+	if !exists {
+		sb.Logger.Warn("Ignoring updates for unknown list %s", listName)
+		return
+	}
+	sbl.DataRedirects = redirects
+	sbl.DeleteChunks = deletes
+	sbl.stageManifest()
+}
 
-		// clear cache
-		sbl.Cache = make(map[FullHash]*FullHashCache)
+func (sb *SafeBrowsing) reset() {
 
-		sbl.Lookup = NewTrie()
-		sbl.FullHashes = NewTrie()
-		sbl.FullHashRequested = NewTrie()
+	// Every list is downloaded again from scratch.  The current data keeps
+	// serving until all of it has been, see stageReset and finishReset.
+	for _, sbl := range sb.Lists {
+		sbl.resetPending = true
 		sbl.DataRedirects = make([]string, 0)
 		sbl.DeleteChunks = make(map[ChunkData_ChunkType]map[ChunkNum]bool)
 		sbl.DeleteChunks[CHUNK_TYPE_ADD] = make(map[ChunkNum]bool, 0)
 		sbl.DeleteChunks[CHUNK_TYPE_SUB] = make(map[ChunkNum]bool, 0)
-		// kill off the chunks
-		sbl.ChunkRanges = map[ChunkData_ChunkType]string{
-			CHUNK_TYPE_ADD: "",
-			CHUNK_TYPE_SUB: "",
+		// anything staged was for the data we're replacing, as is
+		// anything downloaded since an earlier reset
+		sbl.clearStaging()
+		sbl.clearReset()
+		sbl.stageManifest()
+	}
+}
+
+// reorderLoop keeps the tries ordered for the lookups being made.  Tries
+// swapped in by an update start sampling at the next round; sets of other
+// backends are left as they are.
+func (sb *SafeBrowsing) reorderLoop(interval time.Duration, stop chan struct{}) {
+	ticker := time.NewTicker(interval)
+	defer ticker.Stop()
+	for {
+		select {
+		case <-stop:
+			return
+		case <-ticker.C:
 		}
-		// delete any files we have loaded for this map
-		if sbl.FileName != "" {
-			os.Remove(sbl.FileName)
+		for _, sbl := range sb.Lists {
+			for _, set := range []SetBackend{sbl.Lookup, sbl.FullHashes} {
+				if r, ok := set.(interface {
+					Reorder()
+				}); ok {
+					r.Reorder()
+				}
+			}
 		}
-		//		debug.FreeOSMemory()
+	}
+}
+
+// StopReordering stops the reordering ReorderInterval started, leaving the
+// tries ordered as they are.
+func (sb *SafeBrowsing) StopReordering() {
+	if sb.reorderStop != nil {
+		close(sb.reorderStop)
+		sb.reorderStop = nil
 	}
 }
 
@@ -343,12 +460,14 @@ func (sb *SafeBrowsing) reloadLoop() {
 
 	r := rand.New(rand.NewSource(time.Now().UnixNano()))
 	randomFloat := r.Float64()
+	// the goroutine is ours to label
+	ctx := withGoroutineLabels(context.Background())
 	for {
 		// wait the update delay
 		duration := time.Duration(sb.UpdateDelay) * time.Second
 		sb.Logger.Info("Next update in %d seconds", sb.UpdateDelay)
 		time.Sleep(duration)
-		err, status := sb.update()
+		err, status := sb.update(ctx)
 		for x := 0; status == 503; x++ {
 			// first we wait 1 min, than some time between 30-60 mins
 			// doubling until we stop at 480 mins or succeed
@@ -362,7 +481,7 @@ func (sb *SafeBrowsing) reloadLoop() {
 				err,
 			)
 			time.Sleep(time.Duration(mins) * time.Minute)
-			err, status = sb.update()
+			err, status = sb.update(ctx)
 		}
 		//		debug.FreeOSMemory()
 	}
@@ -191,3 +191,71 @@ func TestUrlListed(t *testing.T) {
 	}
 	os.RemoveAll(tmpDirName)
 }
+
+func TestListedUntil(t *testing.T) {
+	url := GenerateTestCandidates(Canonicalize("http://test.com/"))[0]
+	hash := getHash(url)
+	chunkData := "600\n" + "googpub-phish-shavar:32:1\n" + string(hash)
+
+	ss := &SafeBrowsing{
+		LastUpdated: time.Now(),
+		UpdateDelay: 1800,
+		Lists: map[string]*SafeBrowsingList{
+			"googpub-phish-shavar": newSafeBrowsingList("googpub-phish-shavar", ""),
+		},
+		Logger:  new(DefaultLogger),
+		request: NewMockRequest(chunkData),
+	}
+	ss.Lists["googpub-phish-shavar"].Lookup.Set(string(hash[:PREFIX_4B_SZ]))
+
+	// unlisted until the next update
+	list, _, validUntil, err := ss.MightBeListedUntil("http://example.com/")
+	if err != nil || list != "" || !validUntil.Equal(ss.LastUpdated.Add(1800*time.Second)) {
+		t.Errorf("Unexpected negative answer %q, valid until %s: %v", list, validUntil, err)
+	}
+
+	// a prefix match can't be cached
+	list, _, validUntil, err = ss.MightBeListedUntil(url)
+	if err != nil || list == "" || !validUntil.IsZero() {
+		t.Errorf("Unexpected prefix match %q, valid until %s: %v", list, validUntil, err)
+	}
+
+	// a confirmed match holds as long as the full hash is cached
+	before := time.Now()
+	list, validUntil, err = ss.IsListedUntil(url)
+	if err != nil || list == "" {
+		t.Fatalf("Full hash not found: %v", err)
+	}
+	if validUntil.Before(before.Add(600*time.Second)) || validUntil.After(time.Now().Add(600*time.Second)) {
+		t.Errorf("Full hash valid until %s, expected 600 seconds", validUntil)
+	}
+
+	// nothing holds once the update is overdue
+	ss.LastUpdated = time.Now().Add(-time.Hour)
+	if !ss.NextUpdate().IsZero() {
+		t.Errorf("Overdue update still expected at %s", ss.NextUpdate())
+	}
+}
+
+func TestStopReordering(t *testing.T) {
+	sb := &SafeBrowsing{Lists: make(map[string]*SafeBrowsingList)}
+	sbl := newSafeBrowsingList("test", "")
+	sbl.Lookup.Set("abcd")
+	sb.Lists["test"] = sbl
+
+	stop := make(chan struct{})
+	sb.reorderStop = stop
+	stopped := make(chan struct{})
+	go func() {
+		sb.reorderLoop(time.Millisecond, stop)
+		close(stopped)
+	}()
+	time.Sleep(10 * time.Millisecond)
+	sb.StopReordering()
+	select {
+	case <-stopped:
+	case <-time.After(time.Second):
+		t.Fatal("Reordering carried on after StopReordering")
+	}
+	sb.StopReordering()
+}
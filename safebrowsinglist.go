@@ -26,17 +26,17 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 package safebrowsing
 
 import (
+	"context"
 	"encoding/gob"
 	"fmt"
 	"io"
-	"io/ioutil"
+	"net/http"
 	"os"
 	"sync"
+	"sync/atomic"
 	//	"runtime/debug"
 )
 
-import "encoding/hex"
-
 type SafeBrowsingList struct {
 	Name     string
 	FileName string
@@ -46,15 +46,35 @@ type SafeBrowsingList struct {
 	ChunkRanges   map[ChunkData_ChunkType]string
 
 	// lookup map only contain prefix hash
-	Lookup            *HatTrie
-	FullHashRequested *HatTrie
-	FullHashes        *HatTrie
+	Lookup            SetBackend
+	FullHashRequested SetBackend
+	FullHashes        SetBackend
 	Cache             map[FullHash]*FullHashCache
 
 	// Temporary lookup tables (used during update only).
-	tmpLookup            *HatTrie
-	tmpFullHashes        *HatTrie
-	tmpFullHashRequested *HatTrie
+	tmpLookup            SetBackend
+	tmpFullHashes        SetBackend
+	tmpFullHashRequested SetBackend
+
+	// set by a reset until the list has been downloaded again, and the
+	// chunks downloaded so far, see staging.go
+	resetPending bool
+	resetRanges  map[ChunkData_ChunkType]string
+	request      func(string, string, bool) (*http.Response, error)
+
+	// the version followed from a fleet builder, and its full hashes
+	fleetVersion    FleetVersion
+	fleetFullHashes SetBackend
+
+	// Serves lookups until the list is first loaded, with progressive
+	// startup.  snapshotLock guards the mapping while it is in use.
+	snapshot     *mappedSnapshot
+	snapshotLock sync.RWMutex
+	// set once the tries have been loaded
+	loaded int32
+
+	// what the list held after each update, with KeepHistory
+	history *listHistory
 
 	Logger logger
 	// fsLock is wrapped around the filesystem modifications
@@ -67,23 +87,32 @@ func newSafeBrowsingList(name string, filename string) (sbl *SafeBrowsingList) {
 		Name:              name,
 		FileName:          filename,
 		DataRedirects:     make([]string, 0),
-		Lookup:            NewTrie(),
-		FullHashRequested: NewTrie(),
-		FullHashes:        NewTrie(),
+		Lookup:            newListSet(name, RoleLookup),
+		FullHashRequested: newListSet(name, RoleFullHashRequested),
+		FullHashes:        newListSet(name, RoleFullHashes),
 		Cache:             make(map[FullHash]*FullHashCache),
 		DeleteChunks:      make(map[ChunkData_ChunkType]map[ChunkNum]bool),
 		Logger:            &DefaultLogger{},
 		fsLock:            new(sync.Mutex),
+		request:           request,
 	}
+	sbl.history = newListHistory(sbl.historyFileName())
 	sbl.DeleteChunks[CHUNK_TYPE_ADD] = make(map[ChunkNum]bool)
 	sbl.DeleteChunks[CHUNK_TYPE_SUB] = make(map[ChunkNum]bool)
 	return sbl
 }
 
-func (sbl *SafeBrowsingList) loadDataFromRedirectLists() error {
+func (sbl *SafeBrowsingList) loadDataFromRedirectLists(ctx context.Context) error {
 	//	defer debug.FreeOSMemory()
 
+	ctx, s := startSpan(ctx, "list", "list", sbl.Name)
+	defer s.end()
+
 	if len(sbl.DataRedirects) < 1 {
+		if sbl.resetPending {
+			// the servers have sent all of the list since the reset
+			return sbl.finishReset(ctx)
+		}
 		sbl.Logger.Info("No pending updates available")
 		return nil
 	}
@@ -91,44 +120,69 @@ func (sbl *SafeBrowsingList) loadDataFromRedirectLists() error {
 	newChunks := make([]*ChunkData, 0)
 
 	for _, url := range sbl.DataRedirects {
-		response, err := request(url, "", false)
+		_, download := startSpan(ctx, "download", "phase", "download")
+		data, err := sbl.fetchRedirect(url)
+		download.end()
 		if err != nil {
 			return err
 		}
-		defer response.Body.Close()
-		if response.StatusCode != 200 {
-			return fmt.Errorf("Unexpected server response code: %d",
-				response.StatusCode)
-		}
-		data, err := ioutil.ReadAll(response.Body)
-		length := uint32(len(data))
-		len := length
-		for len != 0 {
-			chunk, new_len, err := ReadChunk(data[(length-len):], len)
-			if err != nil {
-				return err
-			}
-			len = new_len
-			newChunks = append(newChunks, chunk)
+		_, decode := startSpan(ctx, "decode", "phase", "decode")
+		chunks, err := readChunks(data)
+		decode.end()
+		if err != nil {
+			// download it again next time rather than fail on it for good
+			sbl.unstage(url)
+			return err
 		}
+		newChunks = append(newChunks, chunks...)
 	}
-	if newChunks[0] == nil {
+	if len(newChunks) == 0 || newChunks[0] == nil {
 		return fmt.Errorf("No chunk : empty redirect file")
 	}
-	return sbl.load(newChunks)
+	if err := sbl.loadContext(ctx, newChunks); err != nil {
+		return err
+	}
+	sbl.DataRedirects = make([]string, 0)
+	return nil
 }
 
 func (sbl *SafeBrowsingList) load(newChunks []*ChunkData) (err error) {
+	return sbl.loadContext(context.Background(), newChunks)
+}
+
+// loadContext is load, traced as part of whatever ctx belongs to.
+func (sbl *SafeBrowsingList) loadContext(ctx context.Context, newChunks []*ChunkData) (err error) {
 	//	defer debug.FreeOSMemory()
 
+	if sbl.resetPending && len(newChunks) > 0 {
+		// part of the list downloaded again after a reset, which the
+		// existing data keeps serving until all of it is there
+		return sbl.stageReset(newChunks)
+	}
+
+	if UpdateInChild && !isUpdateChild {
+		if err = sbl.loadInChild(ctx, newChunks); err == nil {
+			return nil
+		}
+		sbl.Logger.Warn("Unable to reload %s in a child process, reloading here: %s", sbl.Name, err)
+	}
+
+	ctx, s := startSpan(ctx, "load", "list", sbl.Name)
+	defer s.end()
+
 	sbl.Logger.Info("Reloading %s", sbl.Name)
 	sbl.fsLock.Lock()
 	defer sbl.fsLock.Unlock()
+	defer acquireUpdateWorker()()
+	pace := newUpdatePacer()
 
 	//  get the input stream
 	f, err := os.Open(sbl.FileName)
-	if err != nil && !os.IsNotExist(err) {
-		sbl.Logger.Warn("Error opening data file for reading, assuming empty: %s", err)
+	if err != nil {
+		if !os.IsNotExist(err) {
+			sbl.Logger.Warn("Error opening data file for reading, assuming empty: %s", err)
+		}
+		f = nil
 	}
 	close_file := func(f *os.File) {
 		if f != nil {
@@ -170,23 +224,29 @@ func (sbl *SafeBrowsingList) load(newChunks []*ChunkData) (err error) {
 	addedChunkCount := 0
 
 	// Create new temprary map for the update.
-	sbl.tmpLookup = NewTrie()
+	sbl.tmpLookup = newListSet(sbl.Name, RoleLookup)
 
 	// Just clear all Full Hashes as the GSBv3 specification requests us
 	// to delete all FullHashes on update
 	// https://developers.google.com/safe-browsing/developers_guide_v3#Changes3.0
-	sbl.tmpFullHashes = NewTrie()
-	sbl.tmpFullHashRequested = NewTrie()
+	sbl.tmpFullHashes = newListSet(sbl.Name, RoleFullHashes)
+	sbl.tmpFullHashRequested = newListSet(sbl.Name, RoleFullHashRequested)
 
 	// load existing chunk
 	sbl.Logger.Info("Load existing data from files")
+	_, phase := startSpan(ctx, "reload", "phase", "reload")
+	defer func() { phase.end() }()
 	if dec != nil {
 		for {
-			chunk := &ChunkData{}
-			err = dec.Decode(&chunk)
+			stored := &storedChunk{}
+			err = dec.Decode(stored)
 			if err != nil {
 				break
 			}
+			chunk, err := stored.chunk()
+			if err != nil {
+				return err
+			}
 			cast := ChunkNum(chunk.GetChunkNumber())
 			if _, exists := sbl.DeleteChunks[chunk.GetChunkType()][cast]; exists {
 				// skip this chunk, we've been instructed to delete it
@@ -209,12 +269,13 @@ func (sbl *SafeBrowsingList) load(newChunks []*ChunkData) (err error) {
 			}
 
 			if enc != nil {
-				err = enc.Encode(chunk)
+				err = enc.Encode(storeChunk(chunk))
 				if err != nil {
 					return err
 				}
 			}
 			sbl.updateLookupMap(chunk)
+			pace.insertedChunk(chunk)
 			addedChunkCount++
 		}
 		if err != io.EOF {
@@ -233,6 +294,7 @@ func (sbl *SafeBrowsingList) load(newChunks []*ChunkData) (err error) {
 		addedChunkCount,
 	)
 
+	existingDeletedCount := deletedChunkCount
 	addPrefixCount = 0
 	subPrefixCount = 0
 	addFullHashCount = 0
@@ -241,6 +303,8 @@ func (sbl *SafeBrowsingList) load(newChunks []*ChunkData) (err error) {
 	addedChunkCount = len(newChunks)
 	// add on any new chunks
 	sbl.Logger.Info("Add updated chunks")
+	phase.end()
+	_, phase = startSpan(ctx, "insert", "phase", "insert")
 	if newChunks != nil {
 		for _, chunk := range newChunks {
 			cast := ChunkNum(chunk.GetChunkNumber())
@@ -267,21 +331,28 @@ func (sbl *SafeBrowsingList) load(newChunks []*ChunkData) (err error) {
 			}
 
 			if enc != nil {
-				err = enc.Encode(chunk)
+				err = enc.Encode(storeChunk(chunk))
 				if err != nil {
 					return err
 				}
 			}
 			sbl.updateLookupMap(chunk)
+			pace.insertedChunk(chunk)
 		}
 	}
 
 	// Replace current maps with the newly created ones.
 	sbl.Logger.Info("Replacing FullHashes and Lookup lists")
+	sbl.tmpLookup.Freeze()
+	sbl.tmpFullHashes.Freeze()
+	phase.end()
+	_, phase = startSpan(ctx, "swap", "phase", "swap")
 	sbl.Lookup = sbl.tmpLookup
 	// reset the FullHashes cache and reset the pending list
 	sbl.FullHashes = sbl.tmpFullHashes
 	sbl.FullHashRequested = sbl.tmpFullHashRequested
+	atomic.StoreInt32(&sbl.loaded, 1)
+	sbl.dropSnapshot()
 	sbl.Logger.Info("Replaced FullHashes and Lookup lists")
 
 	// now close off our files, discard the old and keep the new
@@ -295,6 +366,24 @@ func (sbl *SafeBrowsingList) load(newChunks []*ChunkData) (err error) {
 	if err != nil {
 		return err
 	}
+	if len(newChunks) > 0 {
+		// the update is in the data file now
+		sbl.clearStaging()
+	}
+
+	phase.end()
+	_, phase = startSpan(ctx, "snapshot", "phase", "snapshot")
+
+	// a plain reload of the existing data must rebuild exactly what was last
+	// snapshotted, anything else means one of the files has been damaged.
+	if len(newChunks) == 0 && existingDeletedCount == 0 {
+		if verr := sbl.VerifySnapshot(); verr != nil && !os.IsNotExist(verr) {
+			sbl.Logger.Warn("%s", verr)
+		}
+	}
+	if serr := sbl.saveSnapshot(); serr != nil {
+		sbl.Logger.Warn("Unable to save index snapshot for %s: %s", sbl.Name, serr)
+	}
 
 	sbl.ChunkRanges = map[ChunkData_ChunkType]string{
 		CHUNK_TYPE_ADD: buildChunkRanges(addChunkIndexes),
@@ -302,6 +391,7 @@ func (sbl *SafeBrowsingList) load(newChunks []*ChunkData) (err error) {
 	}
 	sbl.DeleteChunks = make(map[ChunkData_ChunkType]map[ChunkNum]bool)
 
+	sbl.Logger.Debug("Rebuilt %s: %s", sbl.Name, pace)
 	sbl.Logger.Info("Update added %d chunks and deleted %d chunks "+
 		"(%d ADD prefixes add, %d SUB prefixes, %d ADD full hashes, %d SUB full hashes)",
 		addedChunkCount,
@@ -325,6 +415,7 @@ func (sbl *SafeBrowsingList) updateLookupMap(chunk *ChunkData) {
 		hashlen = PREFIX_32B_SZ
 	}
 
+	debug := logEnabled(sbl.Logger, LogDebug)
 	for i := 0; (i + hashlen) <= hasheslen; i += hashlen {
 		hash := chunk.Hashes[i:(i + hashlen)]
 		switch hashlen {
@@ -342,10 +433,12 @@ func (sbl *SafeBrowsingList) updateLookupMap(chunk *ChunkData) {
 			lookupHash := string(hash)
 			switch chunk.GetChunkType() {
 			case CHUNK_TYPE_ADD:
-				sbl.Logger.Debug("Adding full length hash: %s", hex.EncodeToString([]byte(lookupHash)))
+				if debug {
+					sbl.Logger.Debug("Adding full length hash: %x", hash)
+				}
 				sbl.tmpFullHashes.Set(lookupHash)
 			case CHUNK_TYPE_SUB:
-				//sbl.Logger.Debug("sub full length hash: %s", hex.EncodeToString([]byte(lookupHash)))
+				//sbl.Logger.Debug("sub full length hash: %x", hash)
 				// delete will do nothing if lookupHash does not exist
 				sbl.tmpFullHashes.Delete(lookupHash)
 				// Mark that we have already requested this fullhash so that we don't keep asking
@@ -96,12 +96,9 @@ func TestLoad(t *testing.T) {
 	ssl.load(chunks)
 
 	// should now be empty
-	i := ssl.FullHashes.Iterator()
-	for key := i.Next(); key != ""; key = i.Next() {
-		if ssl.FullHashes.Get(key) {
-			t.Errorf("Failed to delete full length hash with prefix")
-			return
-		}
+	if ssl.FullHashes.Size() != 0 {
+		t.Errorf("Failed to delete full length hash with prefix")
+		return
 	}
 
 	// remove some of the chunks
@@ -113,11 +110,11 @@ func TestLoad(t *testing.T) {
 	ssl.load(nil)
 
 	// should have 2 of the entries in there again, test and 1234
-	i = ssl.Lookup.Iterator()
-	if ssl.Lookup.Get(i.Next()) != true || ssl.Lookup.Get(i.Next()) != true {
+	if ssl.Lookup.Size() != 2 || !ssl.Lookup.Get("test") || !ssl.Lookup.Get("1234") {
 		t.Errorf("Hashes were deleted from LookupMap")
 		return
 	}
 
 	os.Remove(testFilename)
+	os.Remove(ssl.snapshotFileName())
 }
@@ -0,0 +1,820 @@
+/*
+ * URL canonicalization and lookup candidates for the native lookups.
+ *
+ * This is a port of canonicalize.go, and has to produce exactly the same
+ * bytes or the hashes won't match what the Go library looks up. That
+ * includes its quirks: the regular expressions there are unanchored and
+ * substitutions replace the first occurrence of the matched text anywhere in
+ * the URL, so both are reproduced here rather than parsing the URL properly.
+ * The native conformance test checks the two against each other.
+ */
+
+#include "sblookup.h"
+#include "misc.h"
+#include "pstdint.h"
+#include "sbcase.h"
+#include "sha256.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+
+typedef struct str_t_
+{
+    char*  s;
+    size_t n;
+    size_t cap;
+} str_t;
+
+
+static void str_init(str_t* b, size_t cap)
+{
+    b->s   = malloc_or_die(cap + 1);
+    b->n   = 0;
+    b->cap = cap;
+}
+
+
+static void str_reserve(str_t* b, size_t n)
+{
+    if (b->n + n <= b->cap) return;
+    while (b->n + n > b->cap) b->cap = 2 * b->cap + 16;
+    b->s = realloc_or_die(b->s, b->cap + 1);
+}
+
+
+static void str_append(str_t* b, const char* s, size_t n)
+{
+    str_reserve(b, n);
+    memcpy(b->s + b->n, s, n);
+    b->n += n;
+}
+
+
+static void str_push(str_t* b, char c)
+{
+    str_reserve(b, 1);
+    b->s[b->n++] = c;
+}
+
+
+static void str_free(str_t* b)
+{
+    free_mem(b->s);
+    b->s = NULL;
+    b->n = b->cap = 0;
+}
+
+
+/* replace a with b, freeing a's old contents */
+static void str_swap(str_t* a, str_t* b)
+{
+    str_t t = *a;
+    *a = *b;
+    *b = t;
+    str_free(b);
+}
+
+
+/* index of the first occurrence of needle in s, or -1 */
+static long find(const char* s, size_t n, const char* needle, size_t m)
+{
+    size_t i;
+    if (m > n) return -1;
+    for (i = 0; i + m <= n; ++i) {
+        if (s[i] == needle[0] && memcmp(s + i, needle, m) == 0) return (long) i;
+    }
+    return -1;
+}
+
+
+/* strings.Replace(s, old, new, 1) */
+static void replace_first(const char* s, size_t n,
+                          const char* old, size_t oldlen,
+                          const char* new, size_t newlen, str_t* out)
+{
+    long i = find(s, n, old, oldlen);
+    if (i < 0) {
+        str_append(out, s, n);
+        return;
+    }
+    str_append(out, s, (size_t) i);
+    str_append(out, new, newlen);
+    str_append(out, s + i + oldlen, n - (size_t) i - oldlen);
+}
+
+
+/*
+ * UTF-8, decoding invalid sequences as U+FFFD one byte at a time the way Go
+ * does.
+ */
+
+#define RUNE_ERROR 0xfffd
+
+static uint32_t decode_rune(const unsigned char* s, size_t n, size_t* width)
+{
+    unsigned char b0 = s[0];
+    unsigned char lo = 0x80, hi = 0xbf;
+
+    *width = 1;
+    if (b0 < 0x80) return b0;
+    if (b0 < 0xc2 || b0 > 0xf4) return RUNE_ERROR;
+
+    if      (b0 == 0xe0) lo = 0xa0;
+    else if (b0 == 0xed) hi = 0x9f;
+    else if (b0 == 0xf0) lo = 0x90;
+    else if (b0 == 0xf4) hi = 0x8f;
+
+    if (b0 < 0xe0) {
+        if (n < 2 || s[1] < lo || s[1] > hi) return RUNE_ERROR;
+        *width = 2;
+        return (uint32_t) (b0 & 0x1f) << 6 | (s[1] & 0x3f);
+    }
+    if (b0 < 0xf0) {
+        if (n < 3 || s[1] < lo || s[1] > hi || (s[2] & 0xc0) != 0x80) return RUNE_ERROR;
+        *width = 3;
+        return (uint32_t) (b0 & 0x0f) << 12 | (uint32_t) (s[1] & 0x3f) << 6 | (s[2] & 0x3f);
+    }
+    if (n < 4 || s[1] < lo || s[1] > hi ||
+        (s[2] & 0xc0) != 0x80 || (s[3] & 0xc0) != 0x80) return RUNE_ERROR;
+    *width = 4;
+    return (uint32_t) (b0 & 0x07) << 18 | (uint32_t) (s[1] & 0x3f) << 12 |
+           (uint32_t) (s[2] & 0x3f) << 6 | (s[3] & 0x3f);
+}
+
+
+/* utf8.DecodeLastRune */
+static uint32_t decode_last_rune(const unsigned char* s, size_t n, size_t* width)
+{
+    size_t start = n - 1, lim = n > 4 ? n - 4 : 0, w;
+    uint32_t r;
+
+    *width = 1;
+    if (s[start] < 0x80) return s[start];
+
+    while (start > lim) {
+        --start;
+        if ((s[start] & 0xc0) != 0x80) break;
+    }
+    r = decode_rune(s + start, n - start, &w);
+    if (start + w != n) return RUNE_ERROR;
+    *width = w;
+    return r;
+}
+
+
+static void encode_rune(str_t* b, uint32_t r)
+{
+    if (r < 0x80) {
+        str_push(b, (char) r);
+    } else if (r < 0x800) {
+        str_push(b, (char) (0xc0 | r >> 6));
+        str_push(b, (char) (0x80 | (r & 0x3f)));
+    } else if (r < 0x10000) {
+        str_push(b, (char) (0xe0 | r >> 12));
+        str_push(b, (char) (0x80 | (r >> 6 & 0x3f)));
+        str_push(b, (char) (0x80 | (r & 0x3f)));
+    } else {
+        str_push(b, (char) (0xf0 | r >> 18));
+        str_push(b, (char) (0x80 | (r >> 12 & 0x3f)));
+        str_push(b, (char) (0x80 | (r >> 6 & 0x3f)));
+        str_push(b, (char) (0x80 | (r & 0x3f)));
+    }
+}
+
+
+/* unicode.IsSpace */
+static bool is_space(uint32_t r)
+{
+    switch (r) {
+        case '\t': case '\n': case '\v': case '\f': case '\r': case ' ':
+        case 0x85: case 0xa0: case 0x1680: case 0x2028: case 0x2029:
+        case 0x202f: case 0x205f: case 0x3000:
+            return true;
+    }
+    return r >= 0x2000 && r <= 0x200a;
+}
+
+
+/* unicode.ToLower */
+static uint32_t to_lower(uint32_t r)
+{
+    size_t lo = 0, hi = SB_LOWER_RANGES, mid;
+
+    if (r < 0x80) return r >= 'A' && r <= 'Z' ? r + 32 : r;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        const sb_case_range_t* cr = &sb_lower_ranges[mid];
+        if (r < cr->lo) hi = mid;
+        else if (r > cr->hi) lo = mid + 1;
+        else if (cr->delta == SB_UPPER_LOWER) return cr->lo + (((r - cr->lo) & ~1u) | 1);
+        else return (uint32_t) ((int32_t) r + cr->delta);
+    }
+    return r;
+}
+
+
+/* strings.ToLower, which turns invalid UTF-8 into U+FFFD as it goes */
+static void lower(const char* s, size_t n, str_t* out)
+{
+    size_t i, w;
+    bool ascii = true;
+
+    for (i = 0; i < n; ++i) {
+        if ((unsigned char) s[i] >= 0x80) {
+            ascii = false;
+            break;
+        }
+    }
+
+    if (ascii) {
+        for (i = 0; i < n; ++i) str_push(out, (char) to_lower((unsigned char) s[i]));
+        return;
+    }
+
+    for (i = 0; i < n; i += w) {
+        encode_rune(out, to_lower(decode_rune((const unsigned char*) s + i, n - i, &w)));
+    }
+}
+
+
+/* strings.TrimSpace */
+static void trim_space(const char* s, size_t n, size_t* start, size_t* end)
+{
+    const unsigned char* u = (const unsigned char*) s;
+    size_t i = 0, j = n, w;
+
+    while (i < j && is_space(decode_rune(u + i, j - i, &w))) i += w;
+    while (j > i && is_space(decode_last_rune(u + i, j - i, &w))) j -= w;
+
+    *start = i;
+    *end   = j;
+}
+
+
+/*
+ * Matching "[a-zA-Z][a-zA-Z0-9+-.]*://" followed by a host and path, the
+ * leftmost match as Go's regexp package finds it.
+ */
+
+typedef enum
+{
+    MATCH_SCHEME, // [a-zA-Z][a-zA-Z0-9+-.]*://
+    MATCH_HOST,   // ... ([^/]+)/[^?]*
+    MATCH_PATH    // ... ([^/]+)(/[^?]+)
+} match_kind_t;
+
+typedef struct url_match_t_
+{
+    size_t scheme;   // start of the match
+    size_t host;     // start of the host
+    size_t host_end; // the slash after the host
+    size_t path_end; // the first question mark after it, or the end
+} url_match_t;
+
+
+static bool is_alpha(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+
+static bool is_scheme_char(char c)
+{
+    /* "+-." in the class is the range '+' to '.', taking in ',' */
+    return is_alpha(c) || (c >= '0' && c <= '9') || (c >= '+' && c <= '.');
+}
+
+
+static bool match_url(const char* s, size_t n, match_kind_t kind, url_match_t* m)
+{
+    size_t k, r, j, e, p;
+
+    /* The scheme can't contain ':', so a match at any start runs right up
+     * to a "://"; trying those in turn finds the leftmost match. */
+    for (k = 0; k + 3 <= n; ++k) {
+        if (s[k] != ':' || s[k + 1] != '/' || s[k + 2] != '/') continue;
+
+        for (r = k; r > 0 && is_scheme_char(s[r - 1]); --r);
+        for (j = r; j < k && !is_alpha(s[j]); ++j);
+        if (j == k) continue;
+
+        m->scheme = j;
+        if (kind == MATCH_SCHEME) return true;
+
+        for (e = k + 3; e < n && s[e] != '/'; ++e);
+        if (e == k + 3 || e == n) continue;
+
+        for (p = e + 1; p < n && s[p] != '?'; ++p);
+        if (kind == MATCH_PATH && p == e + 1) continue;
+
+        m->host     = k + 3;
+        m->host_end = e;
+        m->path_end = p;
+        return true;
+    }
+
+    return false;
+}
+
+
+static bool is_hex(char c)
+{
+    return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') || (c >= 'A' && c <= 'F');
+}
+
+
+static unsigned char unhex(char c)
+{
+    if (c >= '0' && c <= '9') return (unsigned char) (c - '0');
+    if (c >= 'a' && c <= 'f') return (unsigned char) (c - 'a' + 10);
+    return (unsigned char) (c - 'A' + 10);
+}
+
+
+/* one pass of unescape(), returning whether anything was decoded */
+static bool unescape(const char* s, size_t n, str_t* out)
+{
+    size_t i = 0;
+    bool performed = false;
+
+    while (i < n) {
+        if (s[i] == '%' && i + 2 < n && is_hex(s[i + 1]) && is_hex(s[i + 2])) {
+            str_push(out, (char) (unhex(s[i + 1]) << 4 | unhex(s[i + 2])));
+            performed = true;
+            i += 3;
+        } else {
+            str_push(out, s[i++]);
+        }
+    }
+
+    return performed;
+}
+
+
+/*
+ * IP addresses, as net.ParseIP reads and IP.String writes them.
+ */
+
+static bool parse_ipv4(const char* s, size_t n, unsigned char ip[4])
+{
+    size_t i, pos = 0, digits = 0;
+    unsigned int val = 0;
+
+    for (i = 0; i < n; ++i) {
+        if (s[i] >= '0' && s[i] <= '9') {
+            if (digits == 1 && val == 0) return false;
+            val = val * 10 + (unsigned int) (s[i] - '0');
+            ++digits;
+            if (val > 255) return false;
+        } else if (s[i] == '.') {
+            if (i == 0 || i == n - 1 || s[i - 1] == '.') return false;
+            if (pos == 3) return false;
+            ip[pos++] = (unsigned char) val;
+            val = 0;
+            digits = 0;
+        } else {
+            return false;
+        }
+    }
+
+    if (pos < 3) return false;
+    ip[3] = (unsigned char) val;
+    return true;
+}
+
+
+static bool parse_ipv6(const char* s, size_t n, unsigned char ip[16])
+{
+    long ellipsis = -1;
+    size_t i = 0, off, j, shift;
+    uint32_t acc;
+
+    memset(ip, 0, 16);
+
+    if (n >= 2 && s[0] == ':' && s[1] == ':') {
+        ellipsis = 0;
+        s += 2;
+        n -= 2;
+        if (n == 0) return true;
+    }
+
+    while (i < 16) {
+        acc = 0;
+        for (off = 0; off < n && is_hex(s[off]); ++off) {
+            acc = (acc << 4) + unhex(s[off]);
+            if (acc > 0xffff) return false;
+        }
+        if (off == 0) return false;
+
+        /* trailing IPv4 */
+        if (off < n && s[off] == '.') {
+            if ((ellipsis < 0 && i != 12) || i + 4 > 16) return false;
+            if (!parse_ipv4(s, n, ip + i)) return false;
+            n = 0;
+            i += 4;
+            break;
+        }
+
+        ip[i]     = (unsigned char) (acc >> 8);
+        ip[i + 1] = (unsigned char) acc;
+        i += 2;
+
+        s += off;
+        n -= off;
+        if (n == 0) break;
+
+        if (s[0] != ':' || n == 1) return false;
+        ++s;
+        --n;
+
+        if (s[0] == ':') {
+            if (ellipsis >= 0) return false;
+            ellipsis = (long) i;
+            ++s;
+            --n;
+            if (n == 0) break;
+        }
+    }
+
+    if (n != 0) return false;
+
+    if (i < 16) {
+        if (ellipsis < 0) return false;
+        shift = 16 - i;
+        for (j = i; j > (size_t) ellipsis; --j) ip[j - 1 + shift] = ip[j - 1];
+        for (j = (size_t) ellipsis; j < (size_t) ellipsis + shift; ++j) ip[j] = 0;
+    } else if (ellipsis >= 0) {
+        return false;
+    }
+
+    return true;
+}
+
+
+/* net.ParseIP, giving the address in its 16 byte form */
+static bool parse_ip(const char* s, size_t n, unsigned char ip[16])
+{
+    size_t i;
+
+    /* a zone is never accepted */
+    if (memchr(s, '%', n) != NULL) return false;
+
+    for (i = 0; i < n; ++i) {
+        if (s[i] == '.') {
+            memset(ip, 0, 10);
+            ip[10] = ip[11] = 0xff;
+            return parse_ipv4(s, n, ip + 12);
+        }
+        if (s[i] == ':') return parse_ipv6(s, n, ip);
+    }
+
+    return false;
+}
+
+
+/* IP.String */
+static void format_ip(const unsigned char ip[16], str_t* out)
+{
+    static const unsigned char v4prefix[12] = {0,0,0,0,0,0,0,0,0,0,0xff,0xff};
+    char buf[64];
+    int len;
+    unsigned int i, j, zstart = 255, zend = 255;
+
+    if (memcmp(ip, v4prefix, 12) == 0) {
+        len = snprintf(buf, sizeof(buf), "%u.%u.%u.%u", ip[12], ip[13], ip[14], ip[15]);
+        str_append(out, buf, (size_t) len);
+        return;
+    }
+
+    /* compress the first longest run of at least two zero groups */
+    for (i = 0; i < 8; ++i) {
+        for (j = i; j < 8 && ip[2 * j] == 0 && ip[2 * j + 1] == 0; ++j);
+        if (j - i >= 2 && j - i > zend - zstart) {
+            zstart = i;
+            zend = j;
+        }
+    }
+
+    for (i = 0; i < 8; ++i) {
+        if (i == zstart) {
+            str_append(out, "::", 2);
+            i = zend;
+            if (i >= 8) break;
+        } else if (i > 0) {
+            str_push(out, ':');
+        }
+        len = snprintf(buf, sizeof(buf), "%x", (unsigned int) ip[2 * i] << 8 | ip[2 * i + 1]);
+        str_append(out, buf, (size_t) len);
+    }
+}
+
+
+/* strconv.ParseUint(s, 10, 64) */
+static bool parse_uint(const char* s, size_t n, uint64_t* v)
+{
+    size_t i;
+    uint64_t x = 0;
+
+    if (n == 0) return false;
+    for (i = 0; i < n; ++i) {
+        if (s[i] < '0' || s[i] > '9') return false;
+        if (x > (UINT64_MAX - (uint64_t) (s[i] - '0')) / 10) return false;
+        x = x * 10 + (uint64_t) (s[i] - '0');
+    }
+
+    *v = x;
+    return true;
+}
+
+
+/* canonicalizeHostname */
+static void canonicalize_hostname(const char* s, size_t n, str_t* out)
+{
+    url_match_t m;
+    str_t host, tmp;
+    size_t a, b, i;
+    unsigned char ip[16];
+    uint64_t v;
+    char buf[32];
+    int len;
+
+    if (!match_url(s, n, MATCH_HOST, &m)) {
+        str_append(out, s, n);
+        return;
+    }
+
+    /* trim dots and squash runs of them */
+    for (a = m.host; a < m.host_end && s[a] == '.'; ++a);
+    for (b = m.host_end; b > a && s[b - 1] == '.'; --b);
+
+    str_init(&host, b - a);
+    for (i = a; i < b; ++i) {
+        if (s[i] != '.' || host.n == 0 || host.s[host.n - 1] != '.') str_push(&host, s[i]);
+    }
+
+    if (parse_ip(host.s, host.n, ip)) {
+        str_init(&tmp, host.n);
+        format_ip(ip, &tmp);
+        str_swap(&host, &tmp);
+    }
+
+    if (parse_uint(host.s, host.n, &v)) {
+        len = snprintf(buf, sizeof(buf), "%u.%u.%u.%u",
+                       (unsigned int) (v >> 24 & 0xff), (unsigned int) (v >> 16 & 0xff),
+                       (unsigned int) (v >> 8 & 0xff), (unsigned int) (v & 0xff));
+        host.n = 0;
+        str_append(&host, buf, (size_t) len);
+    }
+
+    str_init(&tmp, host.n);
+    lower(host.s, host.n, &tmp);
+    str_swap(&host, &tmp);
+
+    replace_first(s, n, s + m.host, m.host_end - m.host, host.s, host.n, out);
+    str_free(&host);
+}
+
+
+/* ReplaceAllString(path, "/?[^/]+/\.\.(/|$)", "/"), returning the end of
+ * the match at i if there is one */
+static bool dot_dot_at(const char* s, size_t n, size_t i, size_t* end)
+{
+    size_t r = s[i] == '/' ? i + 1 : i, q;
+
+    for (q = r; q < n && s[q] != '/'; ++q);
+    if (q == r || q + 3 > n || s[q + 1] != '.' || s[q + 2] != '.') return false;
+
+    q += 3;
+    if (q == n) {
+        *end = n;
+        return true;
+    }
+    if (s[q] == '/') {
+        *end = q + 1;
+        return true;
+    }
+    return false;
+}
+
+
+/* canonicalizePath */
+static void canonicalize_path(const char* s, size_t n, str_t* out)
+{
+    url_match_t m;
+    str_t a, b;
+    size_t i, last, end;
+    const char* path;
+    size_t pathlen;
+
+    if (!match_url(s, n, MATCH_PATH, &m)) {
+        str_append(out, s, n);
+        if (n == 0 || s[n - 1] != '/') str_push(out, '/');
+        return;
+    }
+
+    path    = s + m.host_end;
+    pathlen = m.path_end - m.host_end;
+
+    /* "/./" becomes "/" */
+    str_init(&a, pathlen);
+    for (i = 0; i < pathlen;) {
+        if (i + 3 <= pathlen && memcmp(path + i, "/./", 3) == 0) {
+            str_push(&a, '/');
+            i += 3;
+        } else {
+            str_push(&a, path[i++]);
+        }
+    }
+
+    /* "/x/../" becomes "/" */
+    str_init(&b, a.n);
+    for (i = last = 0; i < a.n;) {
+        if (dot_dot_at(a.s, a.n, i, &end)) {
+            str_append(&b, a.s + last, i - last);
+            str_push(&b, '/');
+            i = last = end;
+        } else {
+            ++i;
+        }
+    }
+    str_append(&b, a.s + last, a.n - last);
+
+    /* squash runs of slashes */
+    a.n = 0;
+    for (i = 0; i < b.n; ++i) {
+        if (b.s[i] != '/' || i == 0 || b.s[i - 1] != '/') str_push(&a, b.s[i]);
+    }
+
+    replace_first(s, n, path, pathlen, a.s, a.n, out);
+    str_free(&a);
+    str_free(&b);
+}
+
+
+char* sb_canonicalize(const char* url, size_t len, size_t* outlen)
+{
+    static const char hex[] = "0123456789abcdef";
+    url_match_t m;
+    str_t u, t;
+    size_t start, end, i;
+    bool performed;
+
+    trim_space(url, len, &start, &end);
+    url += start;
+    len = end - start;
+
+    str_init(&u, len + 8);
+    if (!match_url(url, len, MATCH_SCHEME, &m)) str_append(&u, "http://", 7);
+
+    /* drop the fragment, tabs and line breaks */
+    for (i = 0; i < len && url[i] != '#'; ++i) {
+        if (url[i] != '\t' && url[i] != '\n' && url[i] != '\r') str_push(&u, url[i]);
+    }
+
+    /* unescape until there are no more encoded chars */
+    do {
+        str_init(&t, u.n);
+        performed = unescape(u.s, u.n, &t);
+        str_swap(&u, &t);
+    } while (performed);
+
+    str_init(&t, u.n);
+    canonicalize_hostname(u.s, u.n, &t);
+    str_swap(&u, &t);
+
+    str_init(&t, u.n + 1);
+    canonicalize_path(u.s, u.n, &t);
+    str_swap(&u, &t);
+
+    str_init(&t, u.n);
+    for (i = 0; i < u.n; ++i) {
+        unsigned char c = (unsigned char) u.s[i];
+        if (c <= 32 || c >= 127 || c == '#' || c == '%') {
+            str_push(&t, '%');
+            str_push(&t, hex[c >> 4]);
+            str_push(&t, hex[c & 0xf]);
+        } else {
+            str_push(&t, (char) c);
+        }
+    }
+    str_free(&u);
+
+    t.s[t.n] = '\0';
+    if (outlen != NULL) *outlen = t.n;
+    return t.s;
+}
+
+
+/* stripProtocol */
+static void emit_candidate(const char* s, size_t n,
+                           void (*f)(const char*, size_t, void*), void* arg)
+{
+    long i = find(s, n, "://", 3);
+    if (i >= 0) {
+        s += i + 3;
+        n -= (size_t) i + 3;
+    }
+    f(s, n, arg);
+}
+
+
+/* iteratePaths */
+static size_t iterate_paths(const char* s, size_t n,
+                            void (*f)(const char*, size_t, void*), void* arg)
+{
+    url_match_t m;
+    str_t prefix;
+    size_t count = 0, x, i, j;
+
+    if (memchr(s, '?', n) != NULL) {
+        emit_candidate(s, n, f, arg);
+        ++count;
+    }
+
+    if (!match_url(s, n, MATCH_HOST, &m)) return count;
+
+    str_init(&prefix, m.path_end - m.scheme + 1);
+    str_append(&prefix, s + m.scheme, m.path_end - m.scheme);
+    emit_candidate(prefix.s, prefix.n, f, arg);
+    ++count;
+
+    /* the host alone, then up to three leading path components */
+    prefix.n = m.host_end - m.scheme;
+    str_push(&prefix, '/');
+    emit_candidate(prefix.s, prefix.n, f, arg);
+    ++count;
+
+    i = m.host_end + 1;
+    for (x = 1; x < 4; ++x) {
+        for (j = i; j < m.path_end && s[j] != '/'; ++j);
+        if (j == m.path_end) break;  // the last component is never added
+        str_append(&prefix, s + i, j - i + 1);
+        emit_candidate(prefix.s, prefix.n, f, arg);
+        ++count;
+        i = j + 1;
+    }
+
+    str_free(&prefix);
+    return count;
+}
+
+
+/* iterateHostnames feeding GenerateTestCandidates */
+size_t sb_candidates(const char* url, size_t len,
+                     void (*f)(const char*, size_t, void*), void* arg)
+{
+    url_match_t m;
+    unsigned char ip[16];
+    str_t host, u;
+    const char* hostname;
+    size_t hostlen, count, i, start, parts, last, n, dots;
+
+    count = iterate_paths(url, len, f, arg);
+
+    if (!match_url(url, len, MATCH_HOST, &m)) return count;
+
+    hostname = url + m.host;
+    hostlen  = m.host_end - m.host;
+    if (parse_ip(hostname, hostlen, ip)) return count;
+
+    for (i = 0, parts = 1; i < hostlen; ++i) parts += hostname[i] == '.';
+    if (parts < 2) return count;
+
+    /* the last two parts, then one more at a time, stopping short of the
+     * full hostname (and of six parts) */
+    last = parts - 1 < 2 ? 2 : parts - 1;
+    if (last > 5) last = 5;
+
+    str_init(&host, hostlen);
+    str_init(&u, len);
+    for (n = 2; n <= last; ++n) {
+        /* just after the nth dot from the right */
+        for (start = hostlen, dots = 0; start > 0; --start) {
+            if (hostname[start - 1] == '.' && ++dots == n) break;
+        }
+
+        host.n = 0;
+        str_append(&host, hostname + start, hostlen - start);
+        u.n = 0;
+        replace_first(url, len, hostname, hostlen, host.s, host.n, &u);
+        count += iterate_paths(u.s, u.n, f, arg);
+    }
+
+    str_free(&host);
+    str_free(&u);
+    return count;
+}
+
+
+void sb_hash(const void* data, size_t len, unsigned char out[32])
+{
+    sb_sha256(data, len, out);
+}
+
+
+void sb_free(void* ptr)
+{
+    free_mem(ptr);
+}
@@ -0,0 +1,292 @@
+/*
+ * Native lookups over the index snapshots. See sblookup.h.
+ */
+
+#include "sblookup.h"
+#include "hat-trie.h"
+#include "misc.h"
+#include "pstdint.h"
+#include "sha256.h"
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+/* the snapshot layout written by snapshot.go */
+#define SNAPSHOT_MAGIC       "SBIX"
+#define SNAPSHOT_VERSION     1
+#define SNAPSHOT_HEADER_SIZE 40
+#define SNAPSHOT_SUFFIX      ".idx"
+#define PREFIX_SIZE          4
+#define FULL_HASH_SIZE       32
+
+/* keys are read this many at a time */
+#define READ_KEYS 4096
+
+typedef struct sb_list_t_
+{
+    char*      name;
+    hattrie_t* prefixes;
+    hattrie_t* full_hashes;
+} sb_list_t;
+
+struct sb_index_t_
+{
+    sb_list_t* lists; // sorted by name
+    size_t     n;
+};
+
+
+int sb_abi_version()
+{
+    return SB_ABI_VERSION;
+}
+
+
+const char* sb_strerror(int err)
+{
+    switch (err) {
+        case 0:              return "Success";
+        case SB_ERR_IO:      return "Unable to read index snapshot";
+        case SB_ERR_FORMAT:  return "Not an index snapshot, or truncated";
+        case SB_ERR_VERSION: return "Unsupported index snapshot version";
+        case SB_ERR_DIGEST:  return "Index snapshot does not match its digest";
+    }
+    return "Unknown error";
+}
+
+
+static uint64_t read_be(const unsigned char* p, size_t n)
+{
+    uint64_t x = 0;
+    size_t i;
+    for (i = 0; i < n; ++i) x = x << 8 | p[i];
+    return x;
+}
+
+
+/* Read count keys of len bytes into a new trie, checking them against the
+ * digest. */
+static int load_keys(FILE* f, uint64_t count, size_t len, uint64_t digest,
+                     hattrie_t** out)
+{
+    unsigned char* buf = malloc_or_die(READ_KEYS * len);
+    hattrie_t* T = hattrie_create();
+    uint64_t done = 0;
+    size_t n, i;
+
+    while (done < count) {
+        n = count - done < READ_KEYS ? (size_t) (count - done) : READ_KEYS;
+        if (fread(buf, len, n, f) != n) {
+            free_mem(buf);
+            hattrie_free(T);
+            return ferror(f) ? SB_ERR_IO : SB_ERR_FORMAT;
+        }
+        for (i = 0; i < n; ++i) *hattrie_get(T, (const char*) buf + i * len, len) = 1;
+        done += n;
+    }
+    free_mem(buf);
+
+    /* the digest is over distinct keys, so this also catches duplicates */
+    if (hattrie_size(T) != count || hattrie_digest(T) != digest) {
+        hattrie_free(T);
+        return SB_ERR_DIGEST;
+    }
+
+    *out = T;
+    return 0;
+}
+
+
+static int load_snapshot(const char* path, sb_list_t* list)
+{
+    unsigned char header[SNAPSHOT_HEADER_SIZE];
+    FILE* f;
+    int err;
+
+    f = fopen(path, "rb");
+    if (f == NULL) return SB_ERR_IO;
+
+    if (fread(header, 1, SNAPSHOT_HEADER_SIZE, f) != SNAPSHOT_HEADER_SIZE) {
+        err = ferror(f) ? SB_ERR_IO : SB_ERR_FORMAT;
+        fclose(f);
+        return err;
+    }
+    if (memcmp(header, SNAPSHOT_MAGIC, 4) != 0) {
+        fclose(f);
+        return SB_ERR_FORMAT;
+    }
+    if (read_be(header + 4, 4) != SNAPSHOT_VERSION) {
+        fclose(f);
+        return SB_ERR_VERSION;
+    }
+
+    /* prefixes, full hashes, prefix digest, full hash digest */
+    err = load_keys(f, read_be(header + 8, 8), PREFIX_SIZE,
+                    read_be(header + 24, 8), &list->prefixes);
+    if (err == 0) {
+        err = load_keys(f, read_be(header + 16, 8), FULL_HASH_SIZE,
+                        read_be(header + 32, 8), &list->full_hashes);
+        if (err != 0) hattrie_free(list->prefixes);
+    }
+
+    fclose(f);
+    return err;
+}
+
+
+sb_index_t* sb_index_create()
+{
+    sb_index_t* index = malloc_or_die(sizeof(sb_index_t));
+    index->lists = NULL;
+    index->n = 0;
+    return index;
+}
+
+
+int sb_index_load(sb_index_t* index, const char* name, const char* path)
+{
+    sb_list_t list;
+    size_t i;
+    int cmp = 1, err;
+
+    err = load_snapshot(path, &list);
+    if (err != 0) return err;
+
+    for (i = 0; i < index->n; ++i) {
+        cmp = strcmp(index->lists[i].name, name);
+        if (cmp >= 0) break;
+    }
+
+    if (cmp == 0) {
+        hattrie_free(index->lists[i].prefixes);
+        hattrie_free(index->lists[i].full_hashes);
+    } else {
+        index->lists = realloc_or_die(index->lists, (index->n + 1) * sizeof(sb_list_t));
+        memmove(index->lists + i + 1, index->lists + i, (index->n - i) * sizeof(sb_list_t));
+        index->lists[i].name = malloc_or_die(strlen(name) + 1);
+        strcpy(index->lists[i].name, name);
+        ++index->n;
+    }
+
+    index->lists[i].prefixes    = list.prefixes;
+    index->lists[i].full_hashes = list.full_hashes;
+    return 0;
+}
+
+
+int sb_index_open(const char* dir, sb_index_t** out)
+{
+    sb_index_t* index;
+    DIR* d;
+    struct dirent* e;
+    size_t dirlen = strlen(dir), len, suffix = strlen(SNAPSHOT_SUFFIX);
+    char* path;
+    int err = 0;
+
+    *out = NULL;
+    d = opendir(dir);
+    if (d == NULL) return SB_ERR_IO;
+
+    index = sb_index_create();
+    while (err == 0 && (e = readdir(d)) != NULL) {
+        len = strlen(e->d_name);
+        if (len <= suffix || strcmp(e->d_name + len - suffix, SNAPSHOT_SUFFIX) != 0) continue;
+
+        path = malloc_or_die(dirlen + len + 2);
+        sprintf(path, "%s/%s", dir, e->d_name);
+        e->d_name[len - suffix] = '\0';
+        err = sb_index_load(index, e->d_name, path);
+        free_mem(path);
+    }
+    closedir(d);
+
+    if (err != 0) {
+        sb_index_free(index);
+        return err;
+    }
+
+    *out = index;
+    return 0;
+}
+
+
+void sb_index_free(sb_index_t* index)
+{
+    size_t i;
+    if (index == NULL) return;
+
+    for (i = 0; i < index->n; ++i) {
+        free_mem(index->lists[i].name);
+        hattrie_free(index->lists[i].prefixes);
+        hattrie_free(index->lists[i].full_hashes);
+    }
+    free_mem(index->lists);
+    free_mem(index);
+}
+
+
+size_t sb_index_lists(const sb_index_t* index)
+{
+    return index->n;
+}
+
+
+const char* sb_index_list(const sb_index_t* index, size_t i)
+{
+    return i < index->n ? index->lists[i].name : NULL;
+}
+
+
+typedef struct hashes_t_
+{
+    unsigned char* h;
+    size_t n;
+    size_t cap;
+} hashes_t;
+
+
+static void add_candidate(const char* candidate, size_t len, void* arg)
+{
+    hashes_t* hs = arg;
+    if (hs->n == hs->cap) {
+        hs->cap = 2 * hs->cap + 16;
+        hs->h = realloc_or_die(hs->h, hs->cap * FULL_HASH_SIZE);
+    }
+    sb_sha256(candidate, len, hs->h + hs->n++ * FULL_HASH_SIZE);
+}
+
+
+int sb_lookup(const sb_index_t* index, const char* url, size_t len, const char** list)
+{
+    hashes_t hs = {NULL, 0, 0};
+    size_t canonlen, i, j;
+    char* canon;
+    int result = SB_NOT_LISTED;
+
+    if (list != NULL) *list = NULL;
+
+    canon = sb_canonicalize(url, len, &canonlen);
+    sb_candidates(canon, canonlen, add_candidate, &hs);
+    sb_free(canon);
+
+    /* lookups don't modify the tries, so sharing them between threads is safe */
+    for (i = 0; i < index->n && result == SB_NOT_LISTED; ++i) {
+        const sb_list_t* l = &index->lists[i];
+        for (j = 0; j < hs.n; ++j) {
+            const char* h = (const char*) hs.h + j * FULL_HASH_SIZE;
+            if (hattrie_tryget(l->full_hashes, h, FULL_HASH_SIZE) != NULL) {
+                result = SB_FULL_MATCH;
+                break;
+            }
+            if (hattrie_tryget(l->prefixes, h, PREFIX_SIZE) != NULL) {
+                result = SB_PREFIX_MATCH;
+                break;
+            }
+        }
+        if (result != SB_NOT_LISTED && list != NULL) *list = l->name;
+    }
+
+    free_mem(hs.h);
+    return result;
+}
@@ -0,0 +1,90 @@
+/*
+ * Native safe browsing lookups.
+ *
+ * A small C library answering the same question as MightBeListed, for
+ * programs that can't (or would rather not) call into Go. It loads the index
+ * snapshots (<list>.idx) the Go library writes into its data directory after
+ * every update, and checks URLs against them in-process: canonicalization and
+ * candidate generation follow the Go implementation byte for byte, the
+ * candidates are hashed with SHA-256 and looked up in a hat-trie per set.
+ *
+ * Only what the snapshot holds can be answered. A prefix match means the URL
+ * may be listed and needs a full hash request to the safe browsing servers
+ * before a warning can be shown; a full match means a full length hash of the
+ * URL was in the list (or was cached by the Go library) when the snapshot was
+ * written.
+ *
+ * The ABI is stable: the index is opaque and only grows new functions. All
+ * functions are safe to call concurrently on an index once it is loaded.
+ */
+
+#ifndef SB_LOOKUP_H
+#define SB_LOOKUP_H
+
+#include <stdlib.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SB_ABI_VERSION 1
+
+/* lookup results */
+#define SB_NOT_LISTED   0
+#define SB_PREFIX_MATCH 1
+#define SB_FULL_MATCH   2
+
+/* errors, always negative */
+#define SB_ERR_IO       -1  // reading the data directory or a snapshot failed, see errno
+#define SB_ERR_FORMAT   -2  // a snapshot is truncated or not a snapshot at all
+#define SB_ERR_VERSION  -3  // a snapshot was written by an unsupported version
+#define SB_ERR_DIGEST   -4  // a snapshot's contents don't match its digests
+
+typedef struct sb_index_t_ sb_index_t;
+
+/* SB_ABI_VERSION of the library actually linked */
+int         sb_abi_version  (void);
+const char* sb_strerror     (int err);
+
+/* Load every snapshot in a data directory. Returns 0 or an error, in which
+ * case *index is left NULL. */
+int         sb_index_open   (const char* dir, sb_index_t** index);
+
+/* An empty index, and loading a single snapshot into it as the given list.
+ * Loading a list a second time replaces it. */
+sb_index_t* sb_index_create (void);
+int         sb_index_load   (sb_index_t*, const char* list, const char* path);
+void        sb_index_free   (sb_index_t*);
+
+size_t      sb_index_lists  (const sb_index_t*);
+const char* sb_index_list   (const sb_index_t*, size_t i);
+
+/* Check a URL against each list in the order of sb_index_list, as
+ * MightBeListed does: every candidate is checked against the list's full
+ * hashes and then its prefixes, and the first match is returned with *list
+ * (if not NULL) set to the list's name. */
+int         sb_lookup       (const sb_index_t*, const char* url, size_t len,
+                             const char** list);
+
+/* Canonicalize a URL as the lookups do. The result is NUL terminated, its
+ * length stored in *outlen if that isn't NULL, and must be released with
+ * sb_free. */
+char*       sb_canonicalize (const char* url, size_t len, size_t* outlen);
+
+/* Call f with each lookup candidate of a canonicalized URL, in the same order
+ * (and with the same duplicates) as GenerateTestCandidates. Returns how many
+ * there were. */
+size_t      sb_candidates   (const char* url, size_t len,
+                             void (*f)(const char* candidate, size_t len, void* arg),
+                             void* arg);
+
+/* SHA-256 of len bytes of data. */
+void        sb_hash         (const void* data, size_t len, unsigned char out[32]);
+
+void        sb_free         (void* ptr);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,324 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import (
+	"fmt"
+	"sort"
+	"sync"
+)
+
+// SetBackend is a set of keys, as a list keeps its prefixes, full hashes and
+// the prefixes full hashes have been requested for.  HatTrie is the default;
+// others can be registered with RegisterSetBackend and chosen for each list
+// and role through ListBackends.  Implementations must be safe for
+// concurrent use.
+type SetBackend interface {
+	Get(key string) bool
+	Set(key string)
+	Delete(key string)
+
+	// the same for each of the keyLen byte keys packed in keys
+	CountKeys(keys []byte, keyLen int) int
+	SetKeys(keys []byte, keyLen int)
+	DeleteKeys(keys []byte, keyLen int)
+
+	// SortedKeys concatenates all keys in order, failing if any isn't
+	// keyLen bytes long.
+	SortedKeys(keyLen int) ([]byte, error)
+	// Iterate calls f with each key, in order, until it returns false.  f
+	// must not change the set.
+	Iterate(f func(key string) bool)
+
+	Size() int
+	// Digest is the sum of the keyDigest of each key, which must match
+	// HatTrie's so that sets can be checked against index snapshots.
+	Digest() uint64
+	Stats() SetStats
+
+	// Freeze says the set is about to be read much more than changed.
+	Freeze()
+	Clone() SetBackend
+}
+
+// SetStats describe a set.
+type SetStats struct {
+	Keys  int   `json:"keys"`
+	Bytes int64 `json:"bytes"` // memory in use, as near as can be told
+}
+
+// The roles a set plays in a list.
+const (
+	RoleLookup            = "lookup"
+	RoleFullHashes        = "fullHashes"
+	RoleFullHashRequested = "fullHashRequested"
+)
+
+// DefaultSetBackend is used where ListBackends doesn't say otherwise, but
+// for the sets lookups add to as they go, which default to the two tier
+// backend.
+const DefaultSetBackend = "hattrie"
+
+var roleBackends = map[string]string{
+	RoleFullHashes:        "tiered",
+	RoleFullHashRequested: "tiered",
+}
+
+// ListBackends chooses the backend of each set, by "list/role", then by
+// role, e.g. {"goog-malware-shavar/lookup": "sorted", "fullHashes": "map"}.
+var ListBackends map[string]string = nil
+
+// ListTrieParams tunes the sets left to the hattrie backend, keyed as
+// ListBackends.
+var ListTrieParams map[string]TrieParams = nil
+
+var setBackendsLock sync.RWMutex
+var setBackends = map[string]func() SetBackend{
+	"hattrie": func() SetBackend { return NewTrie() },
+	"map":     func() SetBackend { return newMapSet() },
+	"sorted":  func() SetBackend { return newSortedSet() },
+	"tiered":  func() SetBackend { return newTieredSet() },
+}
+
+// RegisterSetBackend makes a backend available by name.
+func RegisterSetBackend(name string, create func() SetBackend) {
+	setBackendsLock.Lock()
+	defer setBackendsLock.Unlock()
+	setBackends[name] = create
+}
+
+// SetBackends lists the registered backends by name.
+func SetBackends() []string {
+	setBackendsLock.RLock()
+	defer setBackendsLock.RUnlock()
+	names := make([]string, 0, len(setBackends))
+	for name, _ := range setBackends {
+		names = append(names, name)
+	}
+	sort.Strings(names)
+	return names
+}
+
+// NewSet returns an empty set of the named backend.
+func NewSet(backend string) (SetBackend, error) {
+	setBackendsLock.RLock()
+	create, ok := setBackends[backend]
+	setBackendsLock.RUnlock()
+	if !ok {
+		return nil, fmt.Errorf("Unknown set backend %q", backend)
+	}
+	return create(), nil
+}
+
+// listBackend is the name of the backend for a list's role.
+func listBackend(list string, role string) string {
+	if backend, ok := ListBackends[list+"/"+role]; ok {
+		return backend
+	}
+	if backend, ok := ListBackends[role]; ok {
+		return backend
+	}
+	if backend, ok := roleBackends[role]; ok {
+		return backend
+	}
+	return DefaultSetBackend
+}
+
+// CheckListBackends reports any backend named in ListBackends that isn't
+// registered.
+func CheckListBackends() error {
+	for key, backend := range ListBackends {
+		if _, err := NewSet(backend); err != nil {
+			return fmt.Errorf("%s: %s", key, err)
+		}
+	}
+	return nil
+}
+
+// newListSet returns an empty set for a list's role, falling back to the
+// default backend for one that isn't registered.
+func newListSet(list string, role string) SetBackend {
+	backend := listBackend(list, role)
+	if backend == DefaultSetBackend {
+		return newListTrie(list, role)
+	}
+	if set, err := NewSet(backend); err == nil {
+		return set
+	}
+	return newListTrie(list, role)
+}
+
+// newListTrie returns an empty trie for a list's role, with the parameters
+// ListTrieParams gives it.
+func newListTrie(list string, role string) *HatTrie {
+	if params, ok := ListTrieParams[list+"/"+role]; ok {
+		return NewTrieWithParams(params)
+	}
+	if params, ok := ListTrieParams[role]; ok {
+		return NewTrieWithParams(params)
+	}
+	return NewTrie()
+}
+
+// mapSet is a set in a Go map: quick, but costly in memory.
+type mapSet struct {
+	l      sync.RWMutex
+	keys   map[string]struct{}
+	digest uint64
+}
+
+func newMapSet() *mapSet {
+	return &mapSet{keys: make(map[string]struct{})}
+}
+
+func (m *mapSet) Get(key string) bool {
+	m.l.RLock()
+	defer m.l.RUnlock()
+	_, ok := m.keys[key]
+	return ok
+}
+
+func (m *mapSet) set(key string) {
+	if _, ok := m.keys[key]; !ok {
+		m.keys[key] = struct{}{}
+		m.digest += keyDigest([]byte(key))
+	}
+}
+
+func (m *mapSet) del(key string) {
+	if _, ok := m.keys[key]; ok {
+		delete(m.keys, key)
+		m.digest -= keyDigest([]byte(key))
+	}
+}
+
+func (m *mapSet) Set(key string) {
+	m.l.Lock()
+	defer m.l.Unlock()
+	m.set(key)
+}
+
+func (m *mapSet) Delete(key string) {
+	m.l.Lock()
+	defer m.l.Unlock()
+	m.del(key)
+}
+
+func (m *mapSet) CountKeys(keys []byte, keyLen int) int {
+	m.l.RLock()
+	defer m.l.RUnlock()
+	n := 0
+	for i := 0; i+keyLen <= len(keys); i += keyLen {
+		if _, ok := m.keys[string(keys[i:i+keyLen])]; ok {
+			n++
+		}
+	}
+	return n
+}
+
+func (m *mapSet) SetKeys(keys []byte, keyLen int) {
+	m.l.Lock()
+	defer m.l.Unlock()
+	for i := 0; i+keyLen <= len(keys); i += keyLen {
+		m.set(string(keys[i : i+keyLen]))
+	}
+}
+
+func (m *mapSet) DeleteKeys(keys []byte, keyLen int) {
+	m.l.Lock()
+	defer m.l.Unlock()
+	for i := 0; i+keyLen <= len(keys); i += keyLen {
+		m.del(string(keys[i : i+keyLen]))
+	}
+}
+
+func (m *mapSet) SortedKeys(keyLen int) ([]byte, error) {
+	m.l.RLock()
+	defer m.l.RUnlock()
+	keys := make([]string, 0, len(m.keys))
+	for key, _ := range m.keys {
+		if len(key) != keyLen {
+			return nil, fmt.Errorf("Set holds keys that are not %d bytes long", keyLen)
+		}
+		keys = append(keys, key)
+	}
+	sort.Strings(keys)
+	out := make([]byte, 0, len(keys)*keyLen)
+	for _, key := range keys {
+		out = append(out, key...)
+	}
+	return out, nil
+}
+
+func (m *mapSet) Iterate(f func(key string) bool) {
+	m.l.RLock()
+	keys := make([]string, 0, len(m.keys))
+	for key, _ := range m.keys {
+		keys = append(keys, key)
+	}
+	m.l.RUnlock()
+	sort.Strings(keys)
+	for _, key := range keys {
+		if !f(key) {
+			return
+		}
+	}
+}
+
+func (m *mapSet) Size() int {
+	m.l.RLock()
+	defer m.l.RUnlock()
+	return len(m.keys)
+}
+
+func (m *mapSet) Digest() uint64 {
+	m.l.RLock()
+	defer m.l.RUnlock()
+	return m.digest
+}
+
+// Stats estimates a map entry as the key, its string header and about as
+// much again in buckets and overflow.
+func (m *mapSet) Stats() SetStats {
+	m.l.RLock()
+	defer m.l.RUnlock()
+	stats := SetStats{Keys: len(m.keys)}
+	for key, _ := range m.keys {
+		stats.Bytes += int64(len(key)) + 32
+	}
+	return stats
+}
+
+func (m *mapSet) Freeze() {}
+
+func (m *mapSet) Clone() SetBackend {
+	m.l.RLock()
+	defer m.l.RUnlock()
+	c := &mapSet{keys: make(map[string]struct{}, len(m.keys)), digest: m.digest}
+	for key, _ := range m.keys {
+		c.keys[key] = struct{}{}
+	}
+	return c
+}
@@ -0,0 +1,188 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import (
+	"bytes"
+	"crypto/sha256"
+	"io/ioutil"
+	"os"
+	"path/filepath"
+	"strings"
+	"testing"
+)
+
+// TestSetBackends checks each registered backend against a HatTrie through
+// the same changes.
+func TestSetBackends(t *testing.T) {
+	var prefixes, fullHashes []byte
+	for i := 0; i < 10000; i++ {
+		h := sha256.Sum256([]byte{byte(i), byte(i >> 8)})
+		prefixes = append(prefixes, h[:PREFIX_4B_SZ]...)
+		if i%10 == 0 {
+			fullHashes = append(fullHashes, h[:]...)
+		}
+	}
+	for _, backend := range SetBackends() {
+		set, err := NewSet(backend)
+		if err != nil {
+			t.Fatal(err)
+		}
+		trie := NewTrie()
+		set.SetKeys(prefixes, PREFIX_4B_SZ)
+		trie.SetKeys(prefixes, PREFIX_4B_SZ)
+		set.DeleteKeys(prefixes[:400], PREFIX_4B_SZ)
+		trie.DeleteKeys(prefixes[:400], PREFIX_4B_SZ)
+		for i := 0; i < 50; i++ {
+			key := string(prefixes[i*PREFIX_4B_SZ : (i+1)*PREFIX_4B_SZ])
+			set.Set(key)
+			trie.Set(key)
+			set.Delete(key + "x")
+		}
+		if set.Size() != trie.Size() || set.Digest() != trie.Digest() {
+			t.Errorf("%s: %d keys, digest %x, expected %d, %x",
+				backend, set.Size(), set.Digest(), trie.Size(), trie.Digest())
+		}
+		if n := set.CountKeys(prefixes, PREFIX_4B_SZ); n != trie.CountKeys(prefixes, PREFIX_4B_SZ) {
+			t.Errorf("%s: counted %d keys", backend, n)
+		}
+		if set.Get(string(prefixes[300:304])) || !set.Get(string(prefixes[0:4])) {
+			t.Errorf("%s: wrong answer to Get", backend)
+		}
+
+		frozen := set.Clone()
+		frozen.Freeze()
+		sorted, err := frozen.SortedKeys(PREFIX_4B_SZ)
+		expected, _ := trie.SortedKeys(PREFIX_4B_SZ)
+		if err != nil || !bytes.Equal(sorted, expected) {
+			t.Errorf("%s: sorted keys differ: %s", backend, err)
+		}
+		var iterated []byte
+		frozen.Iterate(func(key string) bool {
+			iterated = append(iterated, key...)
+			return true
+		})
+		if !bytes.Equal(iterated, expected) {
+			t.Errorf("%s: iterated keys differ", backend)
+		}
+
+		// changes to a clone don't show in the original
+		frozen.Delete(string(prefixes[0:4]))
+		if !set.Get(string(prefixes[0:4])) || frozen.Get(string(prefixes[0:4])) {
+			t.Errorf("%s: clone shares its keys", backend)
+		}
+
+		// FullHashRequested mixes prefixes with full hashes
+		set.SetKeys(fullHashes, PREFIX_32B_SZ)
+		trie.SetKeys(fullHashes, PREFIX_32B_SZ)
+		if set.Digest() != trie.Digest() || !set.Get(string(fullHashes[:PREFIX_32B_SZ])) {
+			t.Errorf("%s: keys of mixed lengths not held", backend)
+		}
+		if _, err := set.SortedKeys(PREFIX_4B_SZ); err == nil {
+			t.Errorf("%s: sorted keys of mixed lengths", backend)
+		}
+		if stats := set.Stats(); stats.Keys != set.Size() || stats.Bytes <= 0 {
+			t.Errorf("%s: stats %+v", backend, stats)
+		}
+	}
+}
+
+func TestListBackends(t *testing.T) {
+	defer func() { ListBackends = nil }()
+	ListBackends = map[string]string{
+		"goog-malware-shavar/" + RoleLookup: "sorted",
+		RoleLookup:                          "map",
+	}
+	if _, ok := newListSet("goog-malware-shavar", RoleLookup).(*sortedSet); !ok {
+		t.Errorf("List's backend not used")
+	}
+	if _, ok := newListSet("googpub-phish-shavar", RoleLookup).(*mapSet); !ok {
+		t.Errorf("Role's backend not used")
+	}
+	if _, ok := newListSet("googpub-phish-shavar", RoleFullHashes).(*tieredSet); !ok {
+		t.Errorf("Role's default backend not used")
+	}
+	if _, ok := newListSet("googpub-phish-shavar", RoleFullHashRequested).(*tieredSet); !ok {
+		t.Errorf("Role's default backend not used")
+	}
+	if CheckListBackends() != nil {
+		t.Errorf("Backends reported missing")
+	}
+	ListBackends[RoleFullHashes] = "missing"
+	if CheckListBackends() == nil {
+		t.Errorf("Missing backend not reported")
+	}
+}
+
+func TestBenchSetBackends(t *testing.T) {
+	tmpDirName, err := ioutil.TempDir("", "safebrowsing")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer os.RemoveAll(tmpDirName)
+	defer func(n int) { setBenchLookups = n }(setBenchLookups)
+	setBenchLookups = 100
+
+	prefixes := []byte("aaaabbbbcccc")
+	fullHashes := bytes.Repeat([]byte{1}, PREFIX_32B_SZ)
+	header := &SnapshotHeader{
+		Prefixes:       3,
+		FullHashes:     1,
+		PrefixDigest:   digestKeys(prefixes, PREFIX_4B_SZ),
+		FullHashDigest: digestKeys(fullHashes, PREFIX_32B_SZ),
+	}
+	err = writeSnapshot(filepath.Join(tmpDirName, "test-list.idx"), header, prefixes, fullHashes)
+	if err != nil {
+		t.Fatal(err)
+	}
+	out := &bytes.Buffer{}
+	if err = BenchSetBackends(tmpDirName, out); err != nil {
+		t.Fatal(err)
+	}
+	// a header, then a lookup and full hash row for each backend
+	if lines := strings.Split(strings.TrimSpace(out.String()), "\n"); len(lines) != 1+2*len(SetBackends()) {
+		t.Errorf("Unexpected results:\n%s", out)
+	}
+	if BenchSetBackends(filepath.Join(tmpDirName, "none"), out) == nil {
+		t.Errorf("No error without snapshots")
+	}
+}
+
+func TestListTrieParams(t *testing.T) {
+	defer func(p map[string]TrieParams) { ListTrieParams = p }(ListTrieParams)
+	ListTrieParams = map[string]TrieParams{
+		"test-list/" + RoleLookup: {MaxBucketSize: 100},
+		RoleLookup:                {MaxBucketSize: 200},
+	}
+	for list, size := range map[string]int{"test-list": 100, "other-list": 200} {
+		trie, ok := newListSet(list, RoleLookup).(*HatTrie)
+		if !ok || trie.Params().MaxBucketSize != size {
+			t.Errorf("%s not tuned by ListTrieParams", list)
+		}
+	}
+	if trie := newListSet("test-list", RoleLookup+"x").(*HatTrie); trie.Params() != DefaultTrieParams() {
+		t.Errorf("Untuned role has parameters %s", trie.Params())
+	}
+}
@@ -0,0 +1,170 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import (
+	"fmt"
+	"io"
+	"math/rand"
+	"path/filepath"
+	"sort"
+	"strings"
+	"text/tabwriter"
+	"time"
+)
+
+// How many lookups each workload of BenchSetBackends makes.
+var setBenchLookups = 100000
+
+// SetBenchResult is how a backend fared with the keys of one set.
+type SetBenchResult struct {
+	List    string
+	Role    string
+	Backend string
+	Keys    int
+	Bytes   int64
+	Build   time.Duration
+	Hit     time.Duration // per lookup of a key in the set
+	Miss    time.Duration // per lookup of a key not in the set
+	Batch   time.Duration // per key of a CountKeys
+}
+
+// BenchSetBackends builds every registered backend from the index snapshots
+// in dataDir, times lookups in each and writes a table of the results to
+// out, so that ListBackends can be chosen for the data actually served.
+func BenchSetBackends(dataDir string, out io.Writer) error {
+	results, err := benchSetBackends(dataDir)
+	if err != nil {
+		return err
+	}
+	w := tabwriter.NewWriter(out, 0, 8, 2, ' ', tabwriter.AlignRight)
+	fmt.Fprintln(w, "list\trole\tbackend\tkeys\tbytes\tbytes/key\tbuild\thit\tmiss\tbatch/key\t")
+	for _, r := range results {
+		perKey := 0.0
+		if r.Keys > 0 {
+			perKey = float64(r.Bytes) / float64(r.Keys)
+		}
+		fmt.Fprintf(w, "%s\t%s\t%s\t%d\t%d\t%.1f\t%s\t%s\t%s\t%s\t\n",
+			r.List, r.Role, r.Backend, r.Keys, r.Bytes, perKey, r.Build, r.Hit, r.Miss, r.Batch)
+	}
+	return w.Flush()
+}
+
+func benchSetBackends(dataDir string) ([]SetBenchResult, error) {
+	files, err := filepath.Glob(filepath.Join(dataDir, "*.idx"))
+	if err != nil {
+		return nil, err
+	}
+	if len(files) == 0 {
+		return nil, fmt.Errorf("No index snapshots in %s", dataDir)
+	}
+	sort.Strings(files)
+
+	results := make([]SetBenchResult, 0)
+	for _, file := range files {
+		_, prefixes, fullHashes, err := readSnapshot(file)
+		if err != nil {
+			return nil, err
+		}
+		list := strings.TrimSuffix(filepath.Base(file), ".idx")
+		for _, backend := range SetBackends() {
+			for _, role := range []struct {
+				name   string
+				keys   []byte
+				keyLen int
+			}{
+				{RoleLookup, prefixes, PREFIX_4B_SZ},
+				{RoleFullHashes, fullHashes, PREFIX_32B_SZ},
+			} {
+				r, err := benchSet(backend, role.keys, role.keyLen)
+				if err != nil {
+					return nil, err
+				}
+				r.List, r.Role = list, role.name
+				results = append(results, r)
+			}
+		}
+	}
+	return results, nil
+}
+
+// benchSet times one backend holding the given keys.
+func benchSet(backend string, keys []byte, keyLen int) (SetBenchResult, error) {
+	set, err := NewSet(backend)
+	if err != nil {
+		return SetBenchResult{Backend: backend}, err
+	}
+	return benchSetOf(backend, set, keys, keyLen)
+}
+
+// benchSetOf times an empty set of the named backend filled with the keys.
+func benchSetOf(backend string, set SetBackend, keys []byte, keyLen int) (SetBenchResult, error) {
+	r := SetBenchResult{Backend: backend}
+	start := time.Now()
+	set.SetKeys(keys, keyLen)
+	set.Freeze()
+	r.Build = time.Since(start)
+	stats := set.Stats()
+	r.Keys, r.Bytes = stats.Keys, stats.Bytes
+	if digestKeys(keys, keyLen) != set.Digest() {
+		return r, fmt.Errorf("Backend %s doesn't hold the keys it was given", backend)
+	}
+
+	n := len(keys) / keyLen
+	rng := rand.New(rand.NewSource(1))
+	hits := make([]string, setBenchLookups)
+	misses := make([]string, setBenchLookups)
+	batch := make([]byte, 0, setBenchLookups*keyLen)
+	for i := 0; i < setBenchLookups; i++ {
+		if n > 0 {
+			x := rng.Intn(n) * keyLen
+			hits[i] = string(keys[x : x+keyLen])
+		}
+		miss := make([]byte, keyLen)
+		rng.Read(miss)
+		misses[i] = string(miss)
+		if i%2 == 0 && n > 0 {
+			batch = append(batch, hits[i]...)
+		} else {
+			batch = append(batch, miss...)
+		}
+	}
+	if n > 0 {
+		r.Hit = timeLookups(set, hits)
+	}
+	r.Miss = timeLookups(set, misses)
+	start = time.Now()
+	set.CountKeys(batch, keyLen)
+	r.Batch = time.Since(start) / time.Duration(setBenchLookups)
+	return r, nil
+}
+
+func timeLookups(set SetBackend, keys []string) time.Duration {
+	start := time.Now()
+	for _, key := range keys {
+		set.Get(key)
+	}
+	return time.Since(start) / time.Duration(len(keys))
+}
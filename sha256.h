@@ -0,0 +1,28 @@
+/*
+ * SHA-256, as used to hash URL candidates for lookups.
+ */
+
+#ifndef SB_SHA256_H
+#define SB_SHA256_H
+
+#include <stdlib.h>
+#include "pstdint.h"
+
+#define SB_SHA256_SIZE 32
+
+typedef struct sb_sha256_t_
+{
+    uint32_t state[8];
+    uint64_t len;       // bytes hashed so far
+    uint8_t  buf[64];
+    size_t   buflen;
+} sb_sha256_t;
+
+void sb_sha256_init   (sb_sha256_t*);
+void sb_sha256_update (sb_sha256_t*, const void* data, size_t len);
+void sb_sha256_final  (sb_sha256_t*, uint8_t out[SB_SHA256_SIZE]);
+
+/* hash len bytes of data in one go */
+void sb_sha256        (const void* data, size_t len, uint8_t out[SB_SHA256_SIZE]);
+
+#endif
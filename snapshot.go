@@ -0,0 +1,315 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import (
+	"bufio"
+	"bytes"
+	"encoding/binary"
+	"fmt"
+	"io"
+	"os"
+	"sort"
+	"strings"
+	"syscall"
+)
+
+// Index snapshots are a flat dump of a list's lookup structures, written next
+// to the chunk data file after every successful load.  A fixed size header
+// records the number of entries and the digest of each structure, followed by
+// the sorted 4 byte prefixes and then the sorted full length hashes.  All
+// integers are big endian.
+const snapshotMagic = "SBIX"
+const snapshotVersion = 1
+
+type SnapshotHeader struct {
+	Magic          [4]byte
+	Version        uint32
+	Prefixes       uint64
+	FullHashes     uint64
+	PrefixDigest   uint64
+	FullHashDigest uint64
+}
+
+var snapshotHeaderSize = binary.Size(SnapshotHeader{})
+
+func (sbl *SafeBrowsingList) snapshotFileName() string {
+	return strings.TrimSuffix(sbl.FileName, ".dat") + ".idx"
+}
+
+func (h *SnapshotHeader) check() error {
+	if string(h.Magic[:]) != snapshotMagic {
+		return fmt.Errorf("Not an index snapshot")
+	}
+	if h.Version != snapshotVersion {
+		return fmt.Errorf("Unsupported index snapshot version %d", h.Version)
+	}
+	return nil
+}
+
+// checkSize checks that the header's counts account for exactly n bytes of
+// keys.  The counts are bounded by n before multiplying, so a corrupt header
+// can't overflow its way past the check.
+func (h *SnapshotHeader) checkSize(n uint64) error {
+	if h.Prefixes > n/PREFIX_4B_SZ || h.FullHashes > n/PREFIX_32B_SZ ||
+		h.Prefixes*PREFIX_4B_SZ+h.FullHashes*PREFIX_32B_SZ != n {
+		return fmt.Errorf("Index snapshot header doesn't match its %d bytes of keys", n)
+	}
+	return nil
+}
+
+// ReadSnapshotHeader reads just the header of an index snapshot.
+func ReadSnapshotHeader(fileName string) (*SnapshotHeader, error) {
+	f, err := os.Open(fileName)
+	if err != nil {
+		return nil, err
+	}
+	defer f.Close()
+
+	header := &SnapshotHeader{}
+	if err = binary.Read(f, binary.BigEndian, header); err != nil {
+		return nil, fmt.Errorf("Unable to read index snapshot header: %s", err)
+	}
+	return header, header.check()
+}
+
+// writeSnapshot atomically replaces fileName with a snapshot of the given
+// sorted prefixes and full hashes.
+func writeSnapshot(fileName string, header *SnapshotHeader, prefixes []byte, fullHashes []byte) error {
+	copy(header.Magic[:], snapshotMagic)
+	header.Version = snapshotVersion
+	header.Prefixes = uint64(len(prefixes) / PREFIX_4B_SZ)
+	header.FullHashes = uint64(len(fullHashes) / PREFIX_32B_SZ)
+	return writeKeyFile(fileName, header, prefixes, fullHashes)
+}
+
+// writeKeyFile atomically replaces fileName with a big endian header (if not
+// nil) followed by runs of keys.
+func writeKeyFile(fileName string, header interface{}, keys ...[]byte) (err error) {
+	f, err := os.Create(fileName + ".tmp")
+	if err != nil {
+		return err
+	}
+	defer func() {
+		if err != nil {
+			f.Close()
+			os.Remove(fileName + ".tmp")
+		}
+	}()
+
+	w := bufio.NewWriter(f)
+	if header != nil {
+		if err = binary.Write(w, binary.BigEndian, header); err != nil {
+			return err
+		}
+	}
+	for _, k := range keys {
+		if _, err = w.Write(k); err != nil {
+			return err
+		}
+	}
+	if err = w.Flush(); err != nil {
+		return err
+	}
+	if err = f.Sync(); err != nil {
+		return err
+	}
+	if err = f.Close(); err != nil {
+		return err
+	}
+	return os.Rename(fileName+".tmp", fileName)
+}
+
+// readSnapshot reads a whole snapshot, checking the stored digests against
+// its contents.
+func readSnapshot(fileName string) (header *SnapshotHeader, prefixes []byte, fullHashes []byte, err error) {
+	f, err := os.Open(fileName)
+	if err != nil {
+		return nil, nil, nil, err
+	}
+	defer f.Close()
+	info, err := f.Stat()
+	if err != nil {
+		return nil, nil, nil, err
+	}
+	return readSnapshotFrom(bufio.NewReader(f), info.Size(), fileName)
+}
+
+// readSnapshotFrom is readSnapshot for a snapshot of size bytes read from
+// r, with name used in errors.  Nothing is allocated for the keys until the
+// header has been checked against the size.
+func readSnapshotFrom(r io.Reader, size int64, name string) (header *SnapshotHeader, prefixes []byte, fullHashes []byte, err error) {
+	header = &SnapshotHeader{}
+	if err = binary.Read(r, binary.BigEndian, header); err != nil {
+		return nil, nil, nil, fmt.Errorf("Unable to read index snapshot header: %s", err)
+	}
+	if err = header.check(); err != nil {
+		return nil, nil, nil, err
+	}
+	if size < int64(snapshotHeaderSize) {
+		return nil, nil, nil, fmt.Errorf("Truncated index snapshot %s", name)
+	}
+	if err = header.checkSize(uint64(size) - uint64(snapshotHeaderSize)); err != nil {
+		return nil, nil, nil, fmt.Errorf("%s: %s", name, err)
+	}
+	prefixes = make([]byte, header.Prefixes*PREFIX_4B_SZ)
+	if _, err = io.ReadFull(r, prefixes); err != nil {
+		return nil, nil, nil, fmt.Errorf("Truncated index snapshot: %s", err)
+	}
+	fullHashes = make([]byte, header.FullHashes*PREFIX_32B_SZ)
+	if _, err = io.ReadFull(r, fullHashes); err != nil {
+		return nil, nil, nil, fmt.Errorf("Truncated index snapshot: %s", err)
+	}
+	if digestKeys(prefixes, PREFIX_4B_SZ) != header.PrefixDigest ||
+		digestKeys(fullHashes, PREFIX_32B_SZ) != header.FullHashDigest {
+		return nil, nil, nil, fmt.Errorf("Index snapshot %s does not match its digest", name)
+	}
+	return header, prefixes, fullHashes, nil
+}
+
+// digestKeys computes the trie digest of a run of fixed length keys.
+func digestKeys(keys []byte, keyLen int) (digest uint64) {
+	for i := 0; i+keyLen <= len(keys); i += keyLen {
+		digest += keyDigest(keys[i : i+keyLen])
+	}
+	return digest
+}
+
+// saveSnapshot dumps the current lookup structures to the list's index
+// snapshot, and records them in its history.  fsLock must be held.
+func (sbl *SafeBrowsingList) saveSnapshot() error {
+	prefixes, err := sbl.Lookup.SortedKeys(PREFIX_4B_SZ)
+	if err != nil {
+		return err
+	}
+	fullHashes, err := sbl.FullHashes.SortedKeys(PREFIX_32B_SZ)
+	if err != nil {
+		return err
+	}
+	sbl.recordHistory(prefixes, fullHashes)
+	header := &SnapshotHeader{
+		PrefixDigest:   sbl.Lookup.Digest(),
+		FullHashDigest: sbl.FullHashes.Digest(),
+	}
+	return writeSnapshot(sbl.snapshotFileName(), header, prefixes, fullHashes)
+}
+
+// VerifySnapshot checks that the index snapshot on disk holds the same
+// prefixes as the in-memory lookup trie.  Only the header is read, so this is
+// cheap enough to run as a routine consistency check.  Full hashes are not
+// compared as gethash responses legitimately add to them after a load.
+func (sbl *SafeBrowsingList) VerifySnapshot() error {
+	header, err := ReadSnapshotHeader(sbl.snapshotFileName())
+	if err != nil {
+		return err
+	}
+	if header.Prefixes != uint64(sbl.Lookup.Size()) ||
+		header.PrefixDigest != sbl.Lookup.Digest() {
+		return fmt.Errorf("Index snapshot for %s does not match memory "+
+			"(%d prefixes, digest %016x on disk; %d prefixes, digest %016x in memory)",
+			sbl.Name,
+			header.Prefixes, header.PrefixDigest,
+			sbl.Lookup.Size(), sbl.Lookup.Digest())
+	}
+	return nil
+}
+
+// mappedSnapshot serves lookups straight from an index snapshot mapped into
+// memory, by binary search over its sorted prefixes and full hashes.  It is
+// much slower than the tries but ready as soon as the file is mapped, so it
+// covers for a list while its tries are built at startup.  Replacing the
+// snapshot on disk doesn't disturb an existing mapping.
+type mappedSnapshot struct {
+	header     SnapshotHeader
+	data       []byte
+	prefixes   []byte
+	fullHashes []byte
+}
+
+func openMappedSnapshot(fileName string) (*mappedSnapshot, error) {
+	f, err := os.Open(fileName)
+	if err != nil {
+		return nil, err
+	}
+	defer f.Close()
+	return mapSnapshotFile(f, fileName)
+}
+
+// mapSnapshotFile maps an open index snapshot, with fileName used in
+// errors.
+func mapSnapshotFile(f *os.File, fileName string) (*mappedSnapshot, error) {
+	info, err := f.Stat()
+	if err != nil {
+		return nil, err
+	}
+	if info.Size() < int64(snapshotHeaderSize) {
+		return nil, fmt.Errorf("Truncated index snapshot %s", fileName)
+	}
+	data, err := syscall.Mmap(int(f.Fd()), 0, int(info.Size()), syscall.PROT_READ, syscall.MAP_SHARED)
+	if err != nil {
+		return nil, err
+	}
+
+	m := &mappedSnapshot{data: data}
+	if err = binary.Read(bytes.NewReader(data), binary.BigEndian, &m.header); err == nil {
+		err = m.header.check()
+	}
+	// the digests aren't checked, that would take as long as loading the
+	// list; the sizes have to add up though
+	if err == nil && m.header.checkSize(uint64(len(data)-snapshotHeaderSize)) != nil {
+		err = fmt.Errorf("Index snapshot %s does not match its header", fileName)
+	}
+	if err != nil {
+		syscall.Munmap(data)
+		return nil, err
+	}
+
+	prefixEnd := uint64(snapshotHeaderSize) + m.header.Prefixes*PREFIX_4B_SZ
+	m.prefixes = data[snapshotHeaderSize:prefixEnd]
+	m.fullHashes = data[prefixEnd:]
+	return m, nil
+}
+
+// search looks for key in a sorted run of keys of the same length.
+func (m *mappedSnapshot) search(keys []byte, key []byte) bool {
+	n := len(key)
+	i := sort.Search(len(keys)/n, func(i int) bool {
+		return bytes.Compare(keys[i*n:(i+1)*n], key) >= 0
+	})
+	return i < len(keys)/n && bytes.Equal(keys[i*n:(i+1)*n], key)
+}
+
+func (m *mappedSnapshot) hasPrefix(prefix []byte) bool {
+	return m.search(m.prefixes, prefix)
+}
+
+func (m *mappedSnapshot) hasFullHash(hash []byte) bool {
+	return m.search(m.fullHashes, hash)
+}
+
+func (m *mappedSnapshot) close() error {
+	m.prefixes, m.fullHashes = nil, nil
+	return syscall.Munmap(m.data)
+}
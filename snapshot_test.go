@@ -0,0 +1,188 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import (
+	"bytes"
+	"encoding/binary"
+	"io/ioutil"
+	"os"
+	"testing"
+)
+
+import proto "github.com/golang/protobuf/proto"
+
+func TestSnapshot(t *testing.T) {
+	tmpDirName, err := ioutil.TempDir("", "safebrowsing")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer os.RemoveAll(tmpDirName)
+
+	sbl := newSafeBrowsingList("test", tmpDirName+"/test.dat")
+	chunks := []*ChunkData{
+		&ChunkData{
+			ChunkNumber: proto.Int32(1),
+			ChunkType:   CHUNK_TYPE_ADD.Enum(),
+			PrefixType:  PREFIX_4B.Enum(),
+			Hashes:      []byte("test1234abcd"),
+		},
+		&ChunkData{
+			ChunkNumber: proto.Int32(2),
+			ChunkType:   CHUNK_TYPE_ADD.Enum(),
+			PrefixType:  PREFIX_32B.Enum(),
+			Hashes:      []byte("0123456789abcdef0123456789abcdef"),
+		},
+	}
+	if err = sbl.load(chunks); err != nil {
+		t.Fatal(err)
+	}
+	if sbl.snapshotFileName() != tmpDirName+"/test.idx" {
+		t.Fatalf("Unexpected snapshot name %s", sbl.snapshotFileName())
+	}
+
+	header, prefixes, fullHashes, err := readSnapshot(sbl.snapshotFileName())
+	if err != nil {
+		t.Fatal(err)
+	}
+	if string(prefixes) != "1234abcdtest" {
+		t.Errorf("Unexpected snapshot prefixes %q", prefixes)
+	}
+	if string(fullHashes) != "0123456789abcdef0123456789abcdef" {
+		t.Errorf("Unexpected snapshot full hashes %q", fullHashes)
+	}
+	if header.PrefixDigest != sbl.Lookup.Digest() {
+		t.Error("Snapshot digest does not match the trie")
+	}
+	if err = sbl.VerifySnapshot(); err != nil {
+		t.Error(err)
+	}
+
+	// the same data rebuilt from the chunk file must verify too
+	reloaded := newSafeBrowsingList("test", tmpDirName+"/test.dat")
+	if err = reloaded.load(nil); err != nil {
+		t.Fatal(err)
+	}
+	if reloaded.Lookup.Digest() != sbl.Lookup.Digest() {
+		t.Error("Reloaded list has a different digest")
+	}
+
+	sbl.Lookup.Set("evil")
+	if err = sbl.VerifySnapshot(); err == nil {
+		t.Error("Snapshot verified against different contents")
+	}
+}
+
+func TestMappedSnapshot(t *testing.T) {
+	tmpDirName, err := ioutil.TempDir("", "safebrowsing")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer os.RemoveAll(tmpDirName)
+
+	sbl := newSafeBrowsingList("test", tmpDirName+"/test.dat")
+	for _, p := range []string{"bbbb", "aaaa", "cccc"} {
+		sbl.Lookup.Set(p)
+	}
+	sbl.FullHashes.Set("0123456789abcdef0123456789abcdef")
+	if err = sbl.saveSnapshot(); err != nil {
+		t.Fatal(err)
+	}
+
+	m, err := openMappedSnapshot(sbl.snapshotFileName())
+	if err != nil {
+		t.Fatal(err)
+	}
+	for _, p := range []string{"aaaa", "bbbb", "cccc"} {
+		if !m.hasPrefix([]byte(p)) {
+			t.Errorf("Prefix %s missing from the mapped snapshot", p)
+		}
+	}
+	if m.hasPrefix([]byte("abcd")) || m.hasPrefix([]byte("dddd")) {
+		t.Errorf("Unexpected prefix in the mapped snapshot")
+	}
+	if !m.hasFullHash([]byte("0123456789abcdef0123456789abcdef")) ||
+		m.hasFullHash([]byte("0123456789abcdef0123456789abcdeg")) {
+		t.Errorf("Unexpected full hash lookup from the mapped snapshot")
+	}
+	if err = m.close(); err != nil {
+		t.Fatal(err)
+	}
+
+	// truncated snapshots are refused
+	if err = os.Truncate(sbl.snapshotFileName(), 50); err != nil {
+		t.Fatal(err)
+	}
+	if _, err = openMappedSnapshot(sbl.snapshotFileName()); err == nil {
+		t.Fatalf("Mapped a truncated snapshot")
+	}
+}
+
+// corruptSnapshot is a snapshot whose header claims the given counts, with
+// keys of two prefixes following it.
+func corruptSnapshot(prefixes, fullHashes uint64) []byte {
+	header := SnapshotHeader{Version: snapshotVersion, Prefixes: prefixes, FullHashes: fullHashes,
+		PrefixDigest: digestKeys([]byte("aaaabbbb"), PREFIX_4B_SZ)}
+	copy(header.Magic[:], snapshotMagic)
+	buf := bytes.Buffer{}
+	binary.Write(&buf, binary.BigEndian, &header)
+	buf.WriteString("aaaabbbb")
+	return buf.Bytes()
+}
+
+func TestReadSnapshotCorrupt(t *testing.T) {
+	data := corruptSnapshot(2, 0)
+	if _, prefixes, _, err := readSnapshotFrom(bytes.NewReader(data), int64(len(data)), "test"); err != nil ||
+		string(prefixes) != "aaaabbbb" {
+		t.Fatalf("Unable to read snapshot: %v", err)
+	}
+
+	// counts that don't add up to the data, or only do once overflowed,
+	// are refused before anything is allocated
+	for _, counts := range [][2]uint64{{3, 0}, {1 << 40, 0}, {1 << 62, 0}, {2, 1 << 59}, {^uint64(0), ^uint64(0)}} {
+		data = corruptSnapshot(counts[0], counts[1])
+		if _, _, _, err := readSnapshotFrom(bytes.NewReader(data), int64(len(data)), "test"); err == nil {
+			t.Errorf("Snapshot claiming %d prefixes and %d full hashes read", counts[0], counts[1])
+		}
+	}
+}
+
+func TestMapSnapshotCorrupt(t *testing.T) {
+	dir, err := ioutil.TempDir("", "safebrowsing")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer os.RemoveAll(dir)
+
+	// counts that overflow to exactly the size of the keys
+	fileName := dir + "/test.idx"
+	if err = ioutil.WriteFile(fileName, corruptSnapshot(1<<61+2, 1<<58), 0600); err != nil {
+		t.Fatal(err)
+	}
+	if m, err := openMappedSnapshot(fileName); err == nil {
+		m.close()
+		t.Errorf("Mapped a snapshot whose counts overflow")
+	}
+}
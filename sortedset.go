@@ -0,0 +1,317 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import (
+	"bytes"
+	"fmt"
+	"sort"
+	"sync"
+)
+
+// sortedSet keeps its keys in a sorted array for each key length, searched
+// by bisection: about as compact as a set can be, at the cost of a
+// logarithmic search.  Changes collect in small maps and are merged into the
+// arrays by Freeze, or once there are enough of them to slow lookups down.
+type sortedSet struct {
+	l       sync.RWMutex
+	keys    map[int][]byte
+	empty   bool // whether the empty key is in the arrays
+	added   map[string]struct{}
+	deleted map[string]struct{}
+	size    int
+	digest  uint64
+}
+
+// Changes are merged once there are this many, or an eighth of the keys if
+// that is more.
+const sortedSetMinPending = 4096
+
+func newSortedSet() *sortedSet {
+	return &sortedSet{
+		keys:    make(map[int][]byte),
+		added:   make(map[string]struct{}),
+		deleted: make(map[string]struct{}),
+	}
+}
+
+// inArray is whether key is in the sorted keys.
+func (s *sortedSet) inArray(key string) bool {
+	n := len(key)
+	if n == 0 {
+		return s.empty
+	}
+	keys := s.keys[n]
+	b := []byte(key)
+	i := sort.Search(len(keys)/n, func(i int) bool { return bytes.Compare(keys[i*n:(i+1)*n], b) >= 0 })
+	return i < len(keys)/n && bytes.Equal(keys[i*n:(i+1)*n], b)
+}
+
+func (s *sortedSet) get(key string) bool {
+	if _, ok := s.added[key]; ok {
+		return true
+	}
+	if _, ok := s.deleted[key]; ok {
+		return false
+	}
+	return s.inArray(key)
+}
+
+func (s *sortedSet) set(key string) {
+	if s.get(key) {
+		return
+	}
+	if _, ok := s.deleted[key]; ok {
+		delete(s.deleted, key)
+	} else {
+		s.added[key] = struct{}{}
+	}
+	s.size++
+	s.digest += keyDigest([]byte(key))
+}
+
+func (s *sortedSet) del(key string) {
+	if !s.get(key) {
+		return
+	}
+	if _, ok := s.added[key]; ok {
+		delete(s.added, key)
+	} else {
+		s.deleted[key] = struct{}{}
+	}
+	s.size--
+	s.digest -= keyDigest([]byte(key))
+}
+
+// mergeIfDue merges the changes once there are enough of them.
+func (s *sortedSet) mergeIfDue() {
+	pending := len(s.added) + len(s.deleted)
+	if pending >= sortedSetMinPending && pending >= s.size/8 {
+		s.merge()
+	}
+}
+
+// merge writes the changes into the arrays.
+func (s *sortedSet) merge() {
+	if len(s.added) == 0 && len(s.deleted) == 0 {
+		return
+	}
+	added := make(map[int][]string)
+	for key, _ := range s.added {
+		added[len(key)] = append(added[len(key)], key)
+	}
+	lengths := make(map[int]bool)
+	for n, _ := range added {
+		lengths[n] = true
+	}
+	for key, _ := range s.deleted {
+		lengths[len(key)] = true
+	}
+
+	for n, _ := range lengths {
+		adds := added[n]
+		sort.Strings(adds)
+		old := s.keys[n]
+		merged := make([]byte, 0, len(old)+len(adds)*n)
+		i := 0
+		if n == 0 {
+			_, deleted := s.deleted[""]
+			s.empty = len(adds) > 0 || (s.empty && !deleted)
+			continue
+		}
+		for j := 0; j+n <= len(old); j += n {
+			key := old[j : j+n]
+			for i < len(adds) && adds[i] < string(key) {
+				merged = append(merged, adds[i]...)
+				i++
+			}
+			if _, ok := s.deleted[string(key)]; !ok {
+				merged = append(merged, key...)
+			}
+		}
+		for ; i < len(adds); i++ {
+			merged = append(merged, adds[i]...)
+		}
+		if len(merged) == 0 {
+			delete(s.keys, n)
+		} else {
+			s.keys[n] = merged
+		}
+	}
+	s.added = make(map[string]struct{})
+	s.deleted = make(map[string]struct{})
+}
+
+func (s *sortedSet) Get(key string) bool {
+	s.l.RLock()
+	defer s.l.RUnlock()
+	return s.get(key)
+}
+
+func (s *sortedSet) Set(key string) {
+	s.l.Lock()
+	defer s.l.Unlock()
+	s.set(key)
+	s.mergeIfDue()
+}
+
+func (s *sortedSet) Delete(key string) {
+	s.l.Lock()
+	defer s.l.Unlock()
+	s.del(key)
+	s.mergeIfDue()
+}
+
+func (s *sortedSet) CountKeys(keys []byte, keyLen int) int {
+	s.l.RLock()
+	defer s.l.RUnlock()
+	n := 0
+	for i := 0; i+keyLen <= len(keys); i += keyLen {
+		if s.get(string(keys[i : i+keyLen])) {
+			n++
+		}
+	}
+	return n
+}
+
+func (s *sortedSet) SetKeys(keys []byte, keyLen int) {
+	s.l.Lock()
+	defer s.l.Unlock()
+	if s.size == 0 && keyLen > 0 && strictlySorted(keys, keyLen) {
+		// as from a snapshot: take them as they are
+		s.keys[keyLen] = append([]byte{}, keys[:len(keys)/keyLen*keyLen]...)
+		s.size = len(keys) / keyLen
+		s.digest = digestKeys(keys, keyLen)
+		return
+	}
+	for i := 0; i+keyLen <= len(keys); i += keyLen {
+		s.set(string(keys[i : i+keyLen]))
+		s.mergeIfDue()
+	}
+}
+
+// strictlySorted is whether the keys are in order without repeats.
+func strictlySorted(keys []byte, keyLen int) bool {
+	for i := keyLen; i+keyLen <= len(keys); i += keyLen {
+		if bytes.Compare(keys[i-keyLen:i], keys[i:i+keyLen]) >= 0 {
+			return false
+		}
+	}
+	return true
+}
+
+func (s *sortedSet) DeleteKeys(keys []byte, keyLen int) {
+	s.l.Lock()
+	defer s.l.Unlock()
+	for i := 0; i+keyLen <= len(keys); i += keyLen {
+		s.del(string(keys[i : i+keyLen]))
+		s.mergeIfDue()
+	}
+}
+
+func (s *sortedSet) SortedKeys(keyLen int) ([]byte, error) {
+	s.l.Lock()
+	defer s.l.Unlock()
+	s.merge()
+	for n, _ := range s.keys {
+		if n != keyLen {
+			return nil, fmt.Errorf("Set holds keys that are not %d bytes long", keyLen)
+		}
+	}
+	if s.empty && keyLen != 0 {
+		return nil, fmt.Errorf("Set holds keys that are not %d bytes long", keyLen)
+	}
+	return append([]byte{}, s.keys[keyLen]...), nil
+}
+
+// Iterate walks the keys of each length in turn, shortest first, as they
+// are stored.
+func (s *sortedSet) Iterate(f func(key string) bool) {
+	s.l.Lock()
+	defer s.l.Unlock()
+	s.merge()
+	if s.empty && !f("") {
+		return
+	}
+	lengths := make([]int, 0, len(s.keys))
+	for n, _ := range s.keys {
+		lengths = append(lengths, n)
+	}
+	sort.Ints(lengths)
+	for _, n := range lengths {
+		keys := s.keys[n]
+		for i := 0; i+n <= len(keys); i += n {
+			if !f(string(keys[i : i+n])) {
+				return
+			}
+		}
+	}
+}
+
+func (s *sortedSet) Size() int {
+	s.l.RLock()
+	defer s.l.RUnlock()
+	return s.size
+}
+
+func (s *sortedSet) Digest() uint64 {
+	s.l.RLock()
+	defer s.l.RUnlock()
+	return s.digest
+}
+
+func (s *sortedSet) Stats() SetStats {
+	s.l.RLock()
+	defer s.l.RUnlock()
+	stats := SetStats{Keys: s.size}
+	for _, keys := range s.keys {
+		stats.Bytes += int64(cap(keys))
+	}
+	for key, _ := range s.added {
+		stats.Bytes += int64(len(key)) + 32
+	}
+	for key, _ := range s.deleted {
+		stats.Bytes += int64(len(key)) + 32
+	}
+	return stats
+}
+
+func (s *sortedSet) Freeze() {
+	s.l.Lock()
+	defer s.l.Unlock()
+	s.merge()
+}
+
+func (s *sortedSet) Clone() SetBackend {
+	s.l.Lock()
+	defer s.l.Unlock()
+	s.merge()
+	c := newSortedSet()
+	for n, keys := range s.keys {
+		c.keys[n] = append([]byte{}, keys...)
+	}
+	c.empty, c.size, c.digest = s.empty, s.size, s.digest
+	return c
+}
@@ -0,0 +1,397 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import (
+	"context"
+	"crypto/sha256"
+	"encoding/gob"
+	"encoding/hex"
+	"fmt"
+	"io"
+	"io/ioutil"
+	"os"
+	"path/filepath"
+	"strings"
+)
+
+// Updates are staged in a directory next to each list's data file
+// (listname.staging) so they survive a failed fetch or a restart:
+//
+//   - manifest, the pending redirects and chunk deletes of the last redirect
+//     list, and whether the list is being rebuilt after a reset, and
+//   - one file per downloaded redirect body, named after the hash of its URL.
+//
+// A retried update only fetches the bodies it doesn't have yet, and on
+// startup an update whose bodies were all downloaded is applied before
+// anything is requested.  Applying is a single atomic rewrite of the data
+// file, so there is never a partly applied update to recover; the staging
+// directory is emptied once it has been applied.
+//
+// After a reset the servers send the list again over as many updates as it
+// takes.  Those chunks go to a file of their own (listname.reset), the
+// existing data serving until an update has no more chunks for the list,
+// when the reset file replaces the data file.
+type updateManifest struct {
+	Redirects    []string
+	DeleteChunks map[ChunkData_ChunkType]map[ChunkNum]bool
+	Reset        bool
+}
+
+const manifestFileName = "manifest"
+
+func (sbl *SafeBrowsingList) stagingDir() string {
+	return strings.TrimSuffix(sbl.FileName, ".dat") + ".staging"
+}
+
+func (sbl *SafeBrowsingList) resetFileName() string {
+	return strings.TrimSuffix(sbl.FileName, ".dat") + ".reset"
+}
+
+func (sbl *SafeBrowsingList) stagedBodyFileName(url string) string {
+	hash := sha256.Sum256([]byte(url))
+	return filepath.Join(sbl.stagingDir(), hex.EncodeToString(hash[:16])+".chunks")
+}
+
+// writeStagingFile replaces a file in the staging directory atomically.
+func (sbl *SafeBrowsingList) writeStagingFile(fileName string, write func(f *os.File) error) error {
+	if err := os.MkdirAll(sbl.stagingDir(), 0755); err != nil {
+		return err
+	}
+	f, err := os.Create(fileName + ".tmp")
+	if err != nil {
+		return err
+	}
+	if err = write(f); err == nil {
+		err = f.Sync()
+	}
+	if cerr := f.Close(); err == nil {
+		err = cerr
+	}
+	if err == nil {
+		err = os.Rename(fileName+".tmp", fileName)
+	}
+	if err != nil {
+		os.Remove(fileName + ".tmp")
+	}
+	return err
+}
+
+// stageManifest records the list's pending update.  Lists without a data
+// file (as in the tests) aren't staged.
+func (sbl *SafeBrowsingList) stageManifest() {
+	if sbl.FileName == "" {
+		return
+	}
+	manifest := &updateManifest{
+		Redirects:    sbl.DataRedirects,
+		DeleteChunks: sbl.DeleteChunks,
+		Reset:        sbl.resetPending,
+	}
+	err := sbl.writeStagingFile(filepath.Join(sbl.stagingDir(), manifestFileName), func(f *os.File) error {
+		return gob.NewEncoder(f).Encode(manifest)
+	})
+	if err != nil {
+		sbl.Logger.Warn("Unable to stage update for %s: %s", sbl.Name, err)
+	}
+}
+
+func (sbl *SafeBrowsingList) readManifest() (*updateManifest, error) {
+	f, err := os.Open(filepath.Join(sbl.stagingDir(), manifestFileName))
+	if err != nil {
+		return nil, err
+	}
+	defer f.Close()
+	manifest := &updateManifest{}
+	if err = gob.NewDecoder(f).Decode(manifest); err != nil {
+		return nil, fmt.Errorf("Unable to read staged update for %s: %s", sbl.Name, err)
+	}
+	return manifest, nil
+}
+
+// fetchRedirect returns the body of a redirect, from the staging directory
+// if it was downloaded before.
+func (sbl *SafeBrowsingList) fetchRedirect(url string) ([]byte, error) {
+	fileName := sbl.stagedBodyFileName(url)
+	if sbl.FileName != "" {
+		if data, err := ioutil.ReadFile(fileName); err == nil {
+			sbl.Logger.Info("Using staged download of %s", url)
+			return data, nil
+		}
+	}
+
+	response, err := sbl.request(url, "", false)
+	if err != nil {
+		return nil, err
+	}
+	defer response.Body.Close()
+	if response.StatusCode != 200 {
+		return nil, fmt.Errorf("Unexpected server response code: %d",
+			response.StatusCode)
+	}
+	data, err := ioutil.ReadAll(response.Body)
+	if err != nil {
+		return nil, err
+	}
+
+	if sbl.FileName != "" {
+		err = sbl.writeStagingFile(fileName, func(f *os.File) error {
+			_, err := f.Write(data)
+			return err
+		})
+		if err != nil {
+			sbl.Logger.Warn("Unable to stage download of %s: %s", url, err)
+		}
+	}
+	return data, nil
+}
+
+// readChunks parses a redirect body.
+func readChunks(data []byte) ([]*ChunkData, error) {
+	chunks := make([]*ChunkData, 0)
+	length := uint32(len(data))
+	remaining := length
+	for remaining != 0 {
+		chunk, newRemaining, err := ReadChunk(data[(length-remaining):], remaining)
+		if err != nil {
+			return nil, err
+		}
+		remaining = newRemaining
+		chunks = append(chunks, chunk)
+	}
+	return chunks, nil
+}
+
+// unstage discards the staged body of a redirect that turned out corrupt.
+func (sbl *SafeBrowsingList) unstage(url string) {
+	if sbl.FileName == "" {
+		return
+	}
+	if err := os.Remove(sbl.stagedBodyFileName(url)); err != nil && !os.IsNotExist(err) {
+		sbl.Logger.Warn("Unable to discard staged download of %s: %s", url, err)
+	}
+}
+
+func (sbl *SafeBrowsingList) clearStaging() {
+	if sbl.FileName == "" {
+		return
+	}
+	if err := os.RemoveAll(sbl.stagingDir()); err != nil {
+		sbl.Logger.Warn("Unable to clear staged update for %s: %s", sbl.Name, err)
+	}
+}
+
+// readResetFile calls fn with each chunk downloaded since a reset.
+func (sbl *SafeBrowsingList) readResetFile(fn func(chunk *ChunkData) error) error {
+	f, err := os.Open(sbl.resetFileName())
+	if os.IsNotExist(err) {
+		return nil
+	} else if err != nil {
+		return err
+	}
+	defer f.Close()
+	dec := gob.NewDecoder(f)
+	for {
+		stored := &storedChunk{}
+		if err = dec.Decode(stored); err == io.EOF {
+			return nil
+		} else if err != nil {
+			return err
+		}
+		chunk, err := stored.chunk()
+		if err != nil {
+			return err
+		}
+		if err = fn(chunk); err != nil {
+			return err
+		}
+	}
+}
+
+// resetChunkRanges is what the reset file holds, which is asked for in place
+// of ChunkRanges while the reset is pending.
+func (sbl *SafeBrowsingList) resetChunkRanges() (map[ChunkData_ChunkType]string, error) {
+	indexes := map[ChunkData_ChunkType]map[ChunkNum]bool{
+		CHUNK_TYPE_ADD: make(map[ChunkNum]bool),
+		CHUNK_TYPE_SUB: make(map[ChunkNum]bool),
+	}
+	err := sbl.readResetFile(func(chunk *ChunkData) error {
+		if chunks, ok := indexes[chunk.GetChunkType()]; ok {
+			chunks[ChunkNum(chunk.GetChunkNumber())] = true
+		}
+		return nil
+	})
+	return map[ChunkData_ChunkType]string{
+		CHUNK_TYPE_ADD: buildChunkRanges(indexes[CHUNK_TYPE_ADD]),
+		CHUNK_TYPE_SUB: buildChunkRanges(indexes[CHUNK_TYPE_SUB]),
+	}, err
+}
+
+// stageReset adds chunks downloaded since a reset to the reset file, less
+// any the update deletes, leaving the data being served alone.
+func (sbl *SafeBrowsingList) stageReset(newChunks []*ChunkData) error {
+	sbl.fsLock.Lock()
+	defer sbl.fsLock.Unlock()
+
+	fileName := sbl.resetFileName()
+	fOut, err := os.Create(fileName + ".tmp")
+	if err != nil {
+		return err
+	}
+	defer os.Remove(fileName + ".tmp")
+	enc := gob.NewEncoder(fOut)
+	write := func(chunk *ChunkData) error {
+		cast := ChunkNum(chunk.GetChunkNumber())
+		if _, exists := sbl.DeleteChunks[chunk.GetChunkType()][cast]; exists {
+			return nil
+		}
+		return enc.Encode(storeChunk(chunk))
+	}
+	if err = sbl.readResetFile(write); err == nil {
+		for _, chunk := range newChunks {
+			if err = write(chunk); err != nil {
+				break
+			}
+		}
+	}
+	if err == nil {
+		err = fOut.Sync()
+	}
+	if cerr := fOut.Close(); err == nil {
+		err = cerr
+	}
+	if err == nil {
+		err = os.Rename(fileName+".tmp", fileName)
+	}
+	if err != nil {
+		return err
+	}
+
+	if sbl.resetRanges, err = sbl.resetChunkRanges(); err != nil {
+		return err
+	}
+	sbl.Logger.Info("Downloaded %d more chunks of %s since the reset (add chunks %s, sub chunks %s)",
+		len(newChunks), sbl.Name, sbl.resetRanges[CHUNK_TYPE_ADD], sbl.resetRanges[CHUNK_TYPE_SUB])
+	sbl.DeleteChunks = make(map[ChunkData_ChunkType]map[ChunkNum]bool)
+	sbl.DataRedirects = make([]string, 0)
+	// the bodies are in the reset file now, the reset itself still pending
+	sbl.clearStaging()
+	sbl.stageManifest()
+	return nil
+}
+
+// finishReset replaces the list's data with what was downloaded since the
+// reset, once an update has no more chunks for it.  Until anything has been
+// downloaded the reset carries on.
+func (sbl *SafeBrowsingList) finishReset(ctx context.Context) error {
+	sbl.fsLock.Lock()
+	_, err := os.Stat(sbl.resetFileName())
+	if err == nil {
+		err = os.Rename(sbl.resetFileName(), sbl.FileName)
+	}
+	if err == nil {
+		// the snapshot is of the data being replaced
+		if err = os.Remove(sbl.snapshotFileName()); os.IsNotExist(err) {
+			err = nil
+		}
+	}
+	sbl.fsLock.Unlock()
+	if os.IsNotExist(err) {
+		sbl.Logger.Info("Nothing downloaded of %s since the reset yet", sbl.Name)
+		return nil
+	} else if err != nil {
+		return err
+	}
+
+	sbl.Logger.Info("Replacing %s with the download since the reset", sbl.Name)
+	sbl.resetPending = false
+	sbl.resetRanges = nil
+	sbl.stageManifest()
+	if err = sbl.loadContext(ctx, nil); err != nil {
+		return err
+	}
+	sbl.Cache = make(map[FullHash]*FullHashCache)
+	sbl.clearStaging()
+	return nil
+}
+
+// clearReset discards what was downloaded since a reset.
+func (sbl *SafeBrowsingList) clearReset() {
+	sbl.resetRanges = nil
+	if sbl.FileName == "" {
+		return
+	}
+	if err := os.Remove(sbl.resetFileName()); err != nil && !os.IsNotExist(err) {
+		sbl.Logger.Warn("Unable to discard the reset download of %s: %s", sbl.Name, err)
+	}
+}
+
+// loadExisting loads the list from disk, applying a staged update first if
+// all of it was downloaded before the last run stopped.
+func (sbl *SafeBrowsingList) loadExisting() error {
+	manifest, err := sbl.readManifest()
+	if err != nil {
+		if !os.IsNotExist(err) {
+			sbl.Logger.Warn("%s, discarding it", err)
+			sbl.clearStaging()
+		}
+		return sbl.load(nil)
+	}
+
+	sbl.resetPending = manifest.Reset
+	if sbl.resetPending {
+		if sbl.resetRanges, err = sbl.resetChunkRanges(); err != nil {
+			sbl.Logger.Warn("Unable to read the reset download of %s, starting it again: %s", sbl.Name, err)
+			sbl.clearReset()
+		}
+	}
+	var chunks []*ChunkData
+	for _, url := range manifest.Redirects {
+		data, err := ioutil.ReadFile(sbl.stagedBodyFileName(url))
+		if err == nil {
+			var more []*ChunkData
+			if more, err = readChunks(data); err == nil {
+				chunks = append(chunks, more...)
+				continue
+			}
+			sbl.unstage(url)
+		}
+		// not all there, the next update will fetch the rest
+		sbl.Logger.Info("Staged update for %s is incomplete, resuming it later", sbl.Name)
+		chunks = nil
+		break
+	}
+	if len(chunks) == 0 {
+		return sbl.load(nil)
+	}
+
+	sbl.Logger.Info("Applying staged update for %s", sbl.Name)
+	sbl.DeleteChunks = manifest.DeleteChunks
+	if err = sbl.load(chunks); err != nil {
+		return err
+	}
+	sbl.DataRedirects = make([]string, 0)
+	return nil
+}
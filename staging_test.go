@@ -0,0 +1,312 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import (
+	"context"
+	"encoding/binary"
+	"fmt"
+	"io/ioutil"
+	"net/http"
+	"os"
+	"testing"
+)
+
+import proto "github.com/golang/protobuf/proto"
+
+// redirectBody encodes chunks as the redirect URLs serve them.
+func redirectBody(t *testing.T, chunks ...*ChunkData) string {
+	body := []byte{}
+	for _, chunk := range chunks {
+		data, err := proto.Marshal(chunk)
+		if err != nil {
+			t.Fatal(err)
+		}
+		size := make([]byte, 4)
+		binary.BigEndian.PutUint32(size, uint32(len(data)))
+		body = append(append(body, size...), data...)
+	}
+	return string(body)
+}
+
+func addChunk(num int32, hashes string) *ChunkData {
+	return &ChunkData{
+		ChunkNumber: proto.Int32(num),
+		ChunkType:   CHUNK_TYPE_ADD.Enum(),
+		PrefixType:  PREFIX_4B.Enum(),
+		Hashes:      []byte(hashes),
+	}
+}
+
+// redirectServer serves bodies by URL, failing those in down, and counts
+// the requests made for each.
+type redirectServer struct {
+	bodies   map[string]string
+	down     map[string]bool
+	requests map[string]int
+}
+
+func (rs *redirectServer) request(url string, data string, isPost bool) (*http.Response, error) {
+	rs.requests[url]++
+	if rs.down[url] {
+		return nil, fmt.Errorf("Error getting %s", url)
+	}
+	return &http.Response{StatusCode: 200, Body: NewMockReadCloser(rs.bodies[url])}, nil
+}
+
+func stagingTestList(t *testing.T, rs *redirectServer) (*SafeBrowsingList, string) {
+	dir, err := ioutil.TempDir("", "safebrowsing")
+	if err != nil {
+		t.Fatal(err)
+	}
+	sbl := newSafeBrowsingList("test", dir+"/test.dat")
+	sbl.request = rs.request
+	return sbl, dir
+}
+
+func TestStagedUpdateResumes(t *testing.T) {
+	rs := &redirectServer{
+		bodies: map[string]string{
+			"https://first":  redirectBody(t, addChunk(1, "aaaa")),
+			"https://second": redirectBody(t, addChunk(2, "bbbb")),
+		},
+		down:     map[string]bool{"https://second": true},
+		requests: map[string]int{},
+	}
+	sbl, dir := stagingTestList(t, rs)
+	defer os.RemoveAll(dir)
+
+	sbl.DataRedirects = []string{"https://first", "https://second"}
+	sbl.stageManifest()
+	if err := sbl.loadDataFromRedirectLists(context.Background()); err == nil {
+		t.Fatal("Expected the update to fail")
+	}
+	if _, err := os.Stat(sbl.stagedBodyFileName("https://first")); err != nil {
+		t.Fatalf("First redirect wasn't staged: %s", err)
+	}
+
+	// a restart finds the update incomplete and loads what it had
+	restarted := newSafeBrowsingList("test", sbl.FileName)
+	restarted.request = rs.request
+	if err := restarted.loadExisting(); err != nil {
+		t.Fatal(err)
+	}
+	if restarted.Lookup.Get("aaaa") {
+		t.Fatal("Applied an incomplete update")
+	}
+
+	rs.down = map[string]bool{}
+	restarted.DataRedirects = []string{"https://first", "https://second"}
+	if err := restarted.loadDataFromRedirectLists(context.Background()); err != nil {
+		t.Fatal(err)
+	}
+	if rs.requests["https://first"] != 1 || rs.requests["https://second"] != 2 {
+		t.Errorf("Unexpected requests when resuming: %v", rs.requests)
+	}
+	if !restarted.Lookup.Get("aaaa") || !restarted.Lookup.Get("bbbb") {
+		t.Errorf("Resumed update not applied")
+	}
+	if _, err := os.Stat(restarted.stagingDir()); !os.IsNotExist(err) {
+		t.Errorf("Staging directory not cleared after applying the update")
+	}
+}
+
+func TestCorruptStagedBodyFetchedAgain(t *testing.T) {
+	rs := &redirectServer{
+		bodies:   map[string]string{"https://first": "\x00\x00\x00\x04\xff\xff\xff\xff"},
+		down:     map[string]bool{},
+		requests: map[string]int{},
+	}
+	sbl, dir := stagingTestList(t, rs)
+	defer os.RemoveAll(dir)
+
+	sbl.DataRedirects = []string{"https://first"}
+	sbl.stageManifest()
+	if err := sbl.loadDataFromRedirectLists(context.Background()); err == nil {
+		t.Fatal("Expected the update to fail")
+	}
+	if _, err := os.Stat(sbl.stagedBodyFileName("https://first")); !os.IsNotExist(err) {
+		t.Fatalf("Corrupt redirect left staged: %v", err)
+	}
+
+	// so the same redirect is downloaded again, and works once it's fixed
+	rs.bodies["https://first"] = redirectBody(t, addChunk(1, "aaaa"))
+	if err := sbl.loadDataFromRedirectLists(context.Background()); err != nil {
+		t.Fatal(err)
+	}
+	if rs.requests["https://first"] != 2 || !sbl.Lookup.Get("aaaa") {
+		t.Errorf("Redirect not fetched again: %v", rs.requests)
+	}
+}
+
+func TestStagedUpdateAppliedOnLoad(t *testing.T) {
+	rs := &redirectServer{
+		bodies:   map[string]string{"https://first": redirectBody(t, addChunk(1, "aaaa"))},
+		requests: map[string]int{},
+	}
+	sbl, dir := stagingTestList(t, rs)
+	defer os.RemoveAll(dir)
+
+	// downloaded, but stopped before it was applied
+	sbl.DataRedirects = []string{"https://first"}
+	sbl.stageManifest()
+	if _, err := sbl.fetchRedirect("https://first"); err != nil {
+		t.Fatal(err)
+	}
+
+	restarted := newSafeBrowsingList("test", sbl.FileName)
+	if err := restarted.loadExisting(); err != nil {
+		t.Fatal(err)
+	}
+	if !restarted.Lookup.Get("aaaa") || restarted.ChunkRanges[CHUNK_TYPE_ADD] != "1" {
+		t.Errorf("Staged update not applied on load")
+	}
+	if _, err := os.Stat(restarted.stagingDir()); !os.IsNotExist(err) {
+		t.Errorf("Staging directory not cleared after applying the update")
+	}
+}
+
+func TestResetKeepsServing(t *testing.T) {
+	rs := &redirectServer{
+		bodies:   map[string]string{"https://fresh": redirectBody(t, addChunk(7, "cccc"))},
+		requests: map[string]int{},
+	}
+	sbl, dir := stagingTestList(t, rs)
+	defer os.RemoveAll(dir)
+
+	if err := sbl.load([]*ChunkData{addChunk(1, "aaaa")}); err != nil {
+		t.Fatal(err)
+	}
+	sb := &SafeBrowsing{
+		Lists:  map[string]*SafeBrowsingList{"test": sbl},
+		Logger: new(DefaultLogger),
+	}
+	sb.reset()
+	if !sbl.Lookup.Get("aaaa") {
+		t.Fatal("Reset stopped the existing data from serving")
+	}
+
+	// the reset survives a restart, still serving the old data
+	restarted := newSafeBrowsingList("test", sbl.FileName)
+	restarted.request = rs.request
+	if err := restarted.loadExisting(); err != nil {
+		t.Fatal(err)
+	}
+	if !restarted.resetPending || !restarted.Lookup.Get("aaaa") {
+		t.Fatal("Reset not resumed on restart")
+	}
+
+	restarted.DataRedirects = []string{"https://fresh"}
+	if err := restarted.loadDataFromRedirectLists(context.Background()); err != nil {
+		t.Fatal(err)
+	}
+	if !restarted.Lookup.Get("aaaa") || restarted.Lookup.Get("cccc") {
+		t.Errorf("Reset list replaced before an update had nothing more for it")
+	}
+
+	// an update with nothing more for the list finishes the reset
+	if err := restarted.loadDataFromRedirectLists(context.Background()); err != nil {
+		t.Fatal(err)
+	}
+	if restarted.Lookup.Get("aaaa") || !restarted.Lookup.Get("cccc") {
+		t.Errorf("Reset list not replaced by the new download")
+	}
+	if restarted.resetPending || restarted.ChunkRanges[CHUNK_TYPE_ADD] != "7" {
+		t.Errorf("Reset still pending after the new download")
+	}
+}
+
+func TestResetOverSeveralUpdates(t *testing.T) {
+	rs := &redirectServer{
+		bodies: map[string]string{
+			"https://part1": redirectBody(t, addChunk(7, "cccc")),
+			"https://part2": redirectBody(t, addChunk(8, "dddd")),
+		},
+		requests: map[string]int{},
+	}
+	sbl, dir := stagingTestList(t, rs)
+	defer os.RemoveAll(dir)
+
+	if err := sbl.load([]*ChunkData{addChunk(1, "aaaa")}); err != nil {
+		t.Fatal(err)
+	}
+	var asked string
+	redirects := ""
+	sb := &SafeBrowsing{
+		Lists:  map[string]*SafeBrowsingList{"test": sbl},
+		Logger: new(DefaultLogger),
+		request: func(url string, data string, isPost bool) (*http.Response, error) {
+			asked = data
+			return &http.Response{StatusCode: 200, Body: NewMockReadCloser(redirects)}, nil
+		},
+	}
+	sb.reset()
+
+	// each update brings part of the list, asking for what came before
+	update := func(body string) {
+		redirects = body
+		if err, _ := sb.requestRedirectList(); err != nil {
+			t.Fatal(err)
+		}
+		if err := sbl.loadDataFromRedirectLists(context.Background()); err != nil {
+			t.Fatal(err)
+		}
+	}
+	update("i:test\nu:part1\n")
+	if asked != "test;\n" {
+		t.Errorf("Reset asked for %q", asked)
+	}
+	update("i:test\nu:part2\n")
+	if asked != "test;a:7:\n" {
+		t.Errorf("Second part of the reset asked for %q", asked)
+	}
+	if !sbl.resetPending || !sbl.Lookup.Get("aaaa") || sbl.Lookup.Get("cccc") || sbl.Lookup.Get("dddd") {
+		t.Fatal("Partly downloaded reset replaced the list")
+	}
+
+	// a restart carries on from what was downloaded
+	restarted := newSafeBrowsingList("test", sbl.FileName)
+	restarted.request = rs.request
+	if err := restarted.loadExisting(); err != nil {
+		t.Fatal(err)
+	}
+	if !restarted.resetPending || restarted.resetRanges[CHUNK_TYPE_ADD] != "7-8" || !restarted.Lookup.Get("aaaa") {
+		t.Fatalf("Reset not resumed on restart, holding %v", restarted.resetRanges)
+	}
+
+	update("i:test\n")
+	if asked != "test;a:7-8:\n" {
+		t.Errorf("End of the reset asked for %q", asked)
+	}
+	if sbl.resetPending || sbl.Lookup.Get("aaaa") || !sbl.Lookup.Get("cccc") || !sbl.Lookup.Get("dddd") {
+		t.Errorf("Reset list not replaced once all of it was downloaded")
+	}
+	if sbl.ChunkRanges[CHUNK_TYPE_ADD] != "7-8" {
+		t.Errorf("Replaced list holds %s", sbl.ChunkRanges[CHUNK_TYPE_ADD])
+	}
+	if _, err := os.Stat(sbl.resetFileName()); !os.IsNotExist(err) {
+		t.Errorf("Reset file left behind")
+	}
+}
@@ -0,0 +1,239 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import (
+	"os"
+	"sync/atomic"
+	"time"
+)
+
+// ServingState is how well a SafeBrowsing instance can answer lookups, from
+// not at all to fully.
+type ServingState int
+
+const (
+	// no list can be checked yet
+	ServingUnavailable ServingState = iota
+	// lookups are answered from the index snapshots while the lists load
+	ServingSnapshot
+	// every list is loaded, but hasn't been updated in the last 45 mins
+	ServingStale
+	// every list is loaded and up to date
+	ServingReady
+)
+
+func (s ServingState) String() string {
+	switch s {
+	case ServingSnapshot:
+		return "snapshot"
+	case ServingStale:
+		return "stale"
+	case ServingReady:
+		return "ready"
+	}
+	return "unavailable"
+}
+
+// Weight is a suggested load balancer weight for an instance in this state,
+// out of 100.
+func (s ServingState) Weight() int {
+	switch s {
+	case ServingSnapshot:
+		return 25
+	case ServingStale:
+		return 50
+	case ServingReady:
+		return 100
+	}
+	return 0
+}
+
+// Readiness describes the serving state of an instance and each of its
+// lists, for health checks.
+type Readiness struct {
+	State  ServingState      `json:"-"`
+	Status string            `json:"status"`
+	Weight int               `json:"weight"`
+	Lists  map[string]string `json:"lists"`
+	// the last error from loading or updating the lists at startup
+	Error string `json:"error,omitempty"`
+}
+
+// How long progressive startup waits before retrying a failed update.
+var startupRetryDelay = time.Minute
+
+// Readiness reports how far along startup is.  The instance is only as ready
+// as its least ready list; one that can't be checked at all leaves it at
+// ServingSnapshot at best.
+func (sb *SafeBrowsing) Readiness() Readiness {
+	r := Readiness{
+		State: ServingReady,
+		Lists: make(map[string]string, len(sb.Lists)),
+	}
+	serving, unavailable := false, false
+	for name, sbl := range sb.Lists {
+		state := sbl.servingState()
+		r.Lists[name] = state.String()
+		if state == ServingUnavailable {
+			unavailable = true
+			continue
+		}
+		serving = true
+		if state < r.State {
+			r.State = state
+		}
+	}
+	switch {
+	case !serving:
+		r.State = ServingUnavailable
+	case unavailable && r.State > ServingSnapshot:
+		r.State = ServingSnapshot
+	case r.State == ServingReady && !OfflineMode && !sb.IsUpToDate():
+		r.State = ServingStale
+	}
+	r.Status = r.State.String()
+	r.Weight = r.State.Weight()
+
+	sb.startupLock.Lock()
+	if sb.startupErr != nil {
+		r.Error = sb.startupErr.Error()
+	}
+	sb.startupLock.Unlock()
+	return r
+}
+
+// startProgressive maps whatever index snapshots are in the data directory,
+// or were handed over, and leaves loading the lists to a goroutine.
+func (sb *SafeBrowsing) startProgressive() {
+	sb.mapSnapshots()
+	sb.takeHandedOver()
+	go sb.progressiveStartup(OfflineMode)
+}
+
+func (sb *SafeBrowsing) mapSnapshots() {
+	for listName, _ := range SupportedLists {
+		fileName := sb.DataDir + "/" + listName + ".dat"
+		sbl := newSafeBrowsingList(listName, fileName)
+		sbl.Logger = sb.Logger
+		snapshot, handed, err := mapHandedOver(listName)
+		if !handed {
+			snapshot, err = openMappedSnapshot(sbl.snapshotFileName())
+		}
+		if err == nil {
+			sbl.snapshot = snapshot
+			sb.Logger.Info("Serving %s from its index snapshot until loaded", listName)
+		} else if !os.IsNotExist(err) {
+			sb.Logger.Warn("Unable to map index snapshot for %s: %s", listName, err)
+		}
+		sb.Lists[listName] = sbl
+	}
+}
+
+// progressiveStartup loads what is on disk first, so the lists take over from
+// their snapshots even if the servers can't be reached, then updates them
+// unless offline, as OfflineMode was when it started.
+func (sb *SafeBrowsing) progressiveStartup(offline bool) {
+	sb.loadOffline()
+	sb.restoreCachedFullHashes()
+	if offline {
+		return
+	}
+	for {
+		err := sb.requestSafeBrowsingLists()
+		if err == nil {
+			err = sb.startUpdates()
+		}
+		sb.setStartupError(err)
+		if err == nil {
+			return
+		}
+		sb.Logger.Error("Startup update failed, retrying in %s: %s", startupRetryDelay, err)
+		time.Sleep(startupRetryDelay)
+	}
+}
+
+func (sb *SafeBrowsing) setStartupError(err error) {
+	sb.startupLock.Lock()
+	sb.startupErr = err
+	sb.startupLock.Unlock()
+}
+
+// snapshotLookup checks candidate hashes against the list's mapped snapshot,
+// as queryUrl would against the tries, and against any full hashes handed
+// over by the server this one replaced.  serving is false once the list is
+// loaded, or if it never had a snapshot.
+func (sbl *SafeBrowsingList) snapshotLookup(list string, hashes []LookupHash, ex *Explanation) (found, fullHashMatch, serving bool) {
+	if atomic.LoadInt32(&sbl.loaded) != 0 {
+		return false, false, false
+	}
+	sbl.snapshotLock.RLock()
+	defer sbl.snapshotLock.RUnlock()
+	if sbl.snapshot == nil {
+		return false, false, false
+	}
+	for i, urlHash := range hashes {
+		if sbl.FullHashes.Get(string(urlHash)) {
+			ex.probe(list, i, "fullHashes", true, "")
+			return true, true, true
+		}
+		if sbl.snapshot.hasFullHash([]byte(urlHash)) {
+			ex.probe(list, i, "snapshotFullHashes", true, "")
+			return true, true, true
+		}
+		ex.probe(list, i, "snapshotFullHashes", false, "")
+		if sbl.snapshot.hasPrefix([]byte(urlHash[:PREFIX_4B_SZ])) {
+			ex.probe(list, i, "snapshotPrefixes", true, "")
+			return true, false, true
+		}
+		ex.probe(list, i, "snapshotPrefixes", false, "")
+	}
+	return false, false, true
+}
+
+// dropSnapshot unmaps the list's snapshot once the tries have taken over.
+func (sbl *SafeBrowsingList) dropSnapshot() {
+	sbl.snapshotLock.Lock()
+	defer sbl.snapshotLock.Unlock()
+	if sbl.snapshot == nil {
+		return
+	}
+	if err := sbl.snapshot.close(); err != nil {
+		sbl.Logger.Warn("Error unmapping index snapshot for %s: %s", sbl.Name, err)
+	}
+	sbl.snapshot = nil
+}
+
+func (sbl *SafeBrowsingList) servingState() ServingState {
+	if atomic.LoadInt32(&sbl.loaded) != 0 {
+		return ServingReady
+	}
+	sbl.snapshotLock.RLock()
+	defer sbl.snapshotLock.RUnlock()
+	if sbl.snapshot != nil {
+		return ServingSnapshot
+	}
+	return ServingUnavailable
+}
@@ -0,0 +1,129 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import (
+	"io/ioutil"
+	"os"
+	"testing"
+	"time"
+)
+
+func TestProgressiveStartup(t *testing.T) {
+	dir, err := ioutil.TempDir("", "safebrowsing")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer os.RemoveAll(dir)
+
+	defer func(offline bool) { OfflineMode = offline }(OfflineMode)
+	OfflineMode = true
+
+	urls := nativeTestUrls(2000, 5)
+	want := nativeFixture(t, dir, urls)
+
+	sb := &SafeBrowsing{
+		DataDir: dir,
+		Lists:   map[string]*SafeBrowsingList{},
+		Logger:  new(DefaultLogger),
+	}
+	if r := sb.Readiness(); r.State != ServingUnavailable || r.Weight != 0 {
+		t.Fatalf("Expected unavailable without lists, got %+v", r)
+	}
+
+	sb.mapSnapshots()
+	r := sb.Readiness()
+	if r.State != ServingSnapshot || r.Weight != 25 || len(r.Lists) != len(SupportedLists) {
+		t.Fatalf("Expected to serve from snapshots, got %+v", r)
+	}
+
+	// a single list per instance, so the answer doesn't depend on map order
+	for name, sbl := range sb.Lists {
+		single := &SafeBrowsing{Lists: map[string]*SafeBrowsingList{name: sbl}}
+		reference := &SafeBrowsing{Lists: map[string]*SafeBrowsingList{name: want.Lists[name]}}
+		for _, url := range urls {
+			if !canonicalizes(url) {
+				continue
+			}
+			list, full, err := single.MightBeListed(url)
+			wantList, wantFull, _ := reference.MightBeListed(url)
+			if err != nil || list != wantList || full != wantFull {
+				t.Fatalf("%s: got %q %v %v from the snapshot, expected %q %v",
+					url, list, full, err, wantList, wantFull)
+			}
+		}
+	}
+
+	// loading takes the snapshots' place; there is no list data on disk, so
+	// the lists come up empty
+	sb.loadOffline()
+	if r = sb.Readiness(); r.State != ServingReady || r.Weight != 100 {
+		t.Fatalf("Expected ready once loaded, got %+v", r)
+	}
+	for name, sbl := range sb.Lists {
+		if sbl.snapshot != nil {
+			t.Fatalf("Snapshot of %s still mapped after loading", name)
+		}
+	}
+}
+
+func TestProgressiveStartupNewSafeBrowsing(t *testing.T) {
+	dir, err := ioutil.TempDir("", "safebrowsing")
+	if err != nil {
+		t.Fatal(err)
+	}
+	defer os.RemoveAll(dir)
+
+	defer func(offline, progressive bool) {
+		OfflineMode, ProgressiveStartup = offline, progressive
+	}(OfflineMode, ProgressiveStartup)
+	OfflineMode, ProgressiveStartup = true, true
+
+	nativeFixture(t, dir, nativeTestUrls(100, 6))
+	sb, err := NewSafeBrowsing("", dir)
+	if err != nil {
+		t.Fatal(err)
+	}
+	deadline := time.Now().Add(10 * time.Second)
+	for sb.Readiness().State != ServingReady {
+		if time.Now().After(deadline) {
+			t.Fatalf("Never became ready: %+v", sb.Readiness())
+		}
+		time.Sleep(10 * time.Millisecond)
+	}
+}
+
+func TestServingStateWeight(t *testing.T) {
+	last := -1
+	for _, s := range []ServingState{ServingUnavailable, ServingSnapshot, ServingStale, ServingReady} {
+		if s.Weight() <= last {
+			t.Errorf("Weight of %s isn't above the state before it", s)
+		}
+		last = s.Weight()
+	}
+	if ServingState(42).String() != "unavailable" {
+		t.Errorf("Unexpected name for an unknown state")
+	}
+}
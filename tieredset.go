@@ -0,0 +1,347 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import (
+	"bytes"
+	"fmt"
+	"sort"
+	"sync"
+	"sync/atomic"
+)
+
+// tieredSet is a two tier set in the manner of a log-structured merge tree,
+// for the sets lookups add to as they go: a base of sorted arrays that is
+// never changed once built, so lookups read it without locking, and a small
+// delta map of the changes since, adds and tombstones alike.  Lookups check
+// the delta, then the base.  Once the delta holds enough changes it is frozen
+// and a goroutine merges it into a new base while a fresh delta takes over.
+type tieredSet struct {
+	l       sync.RWMutex
+	delta   map[string]bool // true for an add, false for a tombstone
+	pending int32           // len(delta), read without the lock
+	base    atomic.Value    // *tieredBase
+	merging bool
+	merged  *sync.Cond
+	size    int
+	digest  uint64
+}
+
+// tieredBase is what lookups read without locking.  None of it changes once
+// stored; a merge stores a new one.
+type tieredBase struct {
+	keys  map[int][]byte // sorted keys of each length
+	empty bool           // whether the empty key is in the base
+	// the delta being merged into keys, if a merge is running
+	frozen map[string]bool
+}
+
+// The delta is merged once it holds this many changes, or an eighth of the
+// keys if that is more.
+const tieredSetMinDelta = 4096
+
+func newTieredSet() *tieredSet {
+	s := &tieredSet{delta: make(map[string]bool)}
+	s.merged = sync.NewCond(&s.l)
+	s.base.Store(&tieredBase{keys: make(map[int][]byte)})
+	return s
+}
+
+func (b *tieredBase) get(key string) bool {
+	if present, ok := b.frozen[key]; ok {
+		return present
+	}
+	n := len(key)
+	if n == 0 {
+		return b.empty
+	}
+	keys := b.keys[n]
+	k := []byte(key)
+	i := sort.Search(len(keys)/n, func(i int) bool { return bytes.Compare(keys[i*n:(i+1)*n], k) >= 0 })
+	return i < len(keys)/n && bytes.Equal(keys[i*n:(i+1)*n], k)
+}
+
+// get looks the key up with the lock held.
+func (s *tieredSet) get(key string) bool {
+	if present, ok := s.delta[key]; ok {
+		return present
+	}
+	return s.base.Load().(*tieredBase).get(key)
+}
+
+// change records an add or a tombstone for the key, with the write lock held.
+func (s *tieredSet) change(key string, present bool) {
+	if s.get(key) == present {
+		return
+	}
+	s.delta[key] = present
+	atomic.StoreInt32(&s.pending, int32(len(s.delta)))
+	if present {
+		s.size++
+		s.digest += keyDigest([]byte(key))
+	} else {
+		s.size--
+		s.digest -= keyDigest([]byte(key))
+	}
+}
+
+// mergeIfDue starts merging the delta in the background once it is big
+// enough and no other merge is running.
+func (s *tieredSet) mergeIfDue() {
+	if s.merging || len(s.delta) < tieredSetMinDelta || len(s.delta) < s.size/8 {
+		return
+	}
+	old := s.base.Load().(*tieredBase)
+	frozen := s.delta
+	s.base.Store(&tieredBase{keys: old.keys, empty: old.empty, frozen: frozen})
+	s.delta = make(map[string]bool)
+	atomic.StoreInt32(&s.pending, 0)
+	s.merging = true
+	go func() {
+		keys, empty := mergeTiers(old.keys, old.empty, frozen)
+		s.l.Lock()
+		s.base.Store(&tieredBase{keys: keys, empty: empty})
+		s.merging = false
+		s.merged.Broadcast()
+		s.l.Unlock()
+	}()
+}
+
+// compact waits for any merge to finish and merges what is left of the
+// delta, with the write lock held, leaving everything in the base.
+func (s *tieredSet) compact() *tieredBase {
+	for s.merging {
+		s.merged.Wait()
+	}
+	b := s.base.Load().(*tieredBase)
+	if len(s.delta) == 0 {
+		return b
+	}
+	keys, empty := mergeTiers(b.keys, b.empty, s.delta)
+	b = &tieredBase{keys: keys, empty: empty}
+	s.base.Store(b)
+	s.delta = make(map[string]bool)
+	atomic.StoreInt32(&s.pending, 0)
+	return b
+}
+
+// mergeTiers returns new sorted arrays with the changes applied.  Arrays of
+// lengths without changes are shared with the old ones.
+func mergeTiers(old map[int][]byte, empty bool, changes map[string]bool) (map[int][]byte, bool) {
+	adds := make(map[int][]string)
+	for key, present := range changes {
+		if len(key) == 0 {
+			empty = present
+		} else if present {
+			adds[len(key)] = append(adds[len(key)], key)
+		} else if _, ok := adds[len(key)]; !ok {
+			adds[len(key)] = nil
+		}
+	}
+	keys := make(map[int][]byte, len(old)+len(adds))
+	for n, k := range old {
+		keys[n] = k
+	}
+	for n, add := range adds {
+		sort.Strings(add)
+		prev := old[n]
+		merged := make([]byte, 0, len(prev)+len(add)*n)
+		i := 0
+		for j := 0; j+n <= len(prev); j += n {
+			key := prev[j : j+n]
+			for i < len(add) && add[i] < string(key) {
+				merged = append(merged, add[i]...)
+				i++
+			}
+			// a changed key is dropped here, and added back with the adds
+			// if it is present
+			if _, ok := changes[string(key)]; !ok {
+				merged = append(merged, key...)
+			}
+		}
+		for ; i < len(add); i++ {
+			merged = append(merged, add[i]...)
+		}
+		if len(merged) == 0 {
+			delete(keys, n)
+		} else {
+			keys[n] = merged
+		}
+	}
+	return keys, empty
+}
+
+// Get takes no lock at all while the delta is empty, as it is after a load.
+func (s *tieredSet) Get(key string) bool {
+	if atomic.LoadInt32(&s.pending) != 0 {
+		s.l.RLock()
+		present, ok := s.delta[key]
+		s.l.RUnlock()
+		if ok {
+			return present
+		}
+	}
+	return s.base.Load().(*tieredBase).get(key)
+}
+
+func (s *tieredSet) Set(key string) {
+	s.l.Lock()
+	defer s.l.Unlock()
+	s.change(key, true)
+	s.mergeIfDue()
+}
+
+func (s *tieredSet) Delete(key string) {
+	s.l.Lock()
+	defer s.l.Unlock()
+	s.change(key, false)
+	s.mergeIfDue()
+}
+
+func (s *tieredSet) CountKeys(keys []byte, keyLen int) int {
+	s.l.RLock()
+	defer s.l.RUnlock()
+	n := 0
+	for i := 0; i+keyLen <= len(keys); i += keyLen {
+		if s.get(string(keys[i : i+keyLen])) {
+			n++
+		}
+	}
+	return n
+}
+
+func (s *tieredSet) SetKeys(keys []byte, keyLen int) {
+	s.l.Lock()
+	defer s.l.Unlock()
+	if s.size == 0 && !s.merging && keyLen > 0 && strictlySorted(keys, keyLen) {
+		// as from a snapshot: they make the base as they are
+		keys = append([]byte{}, keys[:len(keys)/keyLen*keyLen]...)
+		s.base.Store(&tieredBase{keys: map[int][]byte{keyLen: keys}})
+		s.delta = make(map[string]bool)
+		atomic.StoreInt32(&s.pending, 0)
+		s.size = len(keys) / keyLen
+		s.digest = digestKeys(keys, keyLen)
+		return
+	}
+	for i := 0; i+keyLen <= len(keys); i += keyLen {
+		s.change(string(keys[i:i+keyLen]), true)
+	}
+	s.mergeIfDue()
+}
+
+func (s *tieredSet) DeleteKeys(keys []byte, keyLen int) {
+	s.l.Lock()
+	defer s.l.Unlock()
+	for i := 0; i+keyLen <= len(keys); i += keyLen {
+		s.change(string(keys[i:i+keyLen]), false)
+	}
+	s.mergeIfDue()
+}
+
+func (s *tieredSet) SortedKeys(keyLen int) ([]byte, error) {
+	s.l.Lock()
+	b := s.compact()
+	s.l.Unlock()
+	for n, _ := range b.keys {
+		if n != keyLen {
+			return nil, fmt.Errorf("Set holds keys that are not %d bytes long", keyLen)
+		}
+	}
+	if b.empty && keyLen != 0 {
+		return nil, fmt.Errorf("Set holds keys that are not %d bytes long", keyLen)
+	}
+	return append([]byte{}, b.keys[keyLen]...), nil
+}
+
+// Iterate walks the keys of each length in turn, shortest first, as
+// sortedSet does.  It compacts the set first, and walks that base without
+// the lock, so f may change the set.
+func (s *tieredSet) Iterate(f func(key string) bool) {
+	s.l.Lock()
+	b := s.compact()
+	s.l.Unlock()
+	if b.empty && !f("") {
+		return
+	}
+	lengths := make([]int, 0, len(b.keys))
+	for n, _ := range b.keys {
+		lengths = append(lengths, n)
+	}
+	sort.Ints(lengths)
+	for _, n := range lengths {
+		keys := b.keys[n]
+		for i := 0; i+n <= len(keys); i += n {
+			if !f(string(keys[i : i+n])) {
+				return
+			}
+		}
+	}
+}
+
+func (s *tieredSet) Size() int {
+	s.l.RLock()
+	defer s.l.RUnlock()
+	return s.size
+}
+
+func (s *tieredSet) Digest() uint64 {
+	s.l.RLock()
+	defer s.l.RUnlock()
+	return s.digest
+}
+
+func (s *tieredSet) Stats() SetStats {
+	s.l.RLock()
+	defer s.l.RUnlock()
+	stats := SetStats{Keys: s.size}
+	b := s.base.Load().(*tieredBase)
+	for _, keys := range b.keys {
+		stats.Bytes += int64(cap(keys))
+	}
+	for _, delta := range []map[string]bool{s.delta, b.frozen} {
+		for key, _ := range delta {
+			stats.Bytes += int64(len(key)) + 32
+		}
+	}
+	return stats
+}
+
+// Freeze merges the whole delta, so lookups go straight to the base.
+func (s *tieredSet) Freeze() {
+	s.l.Lock()
+	defer s.l.Unlock()
+	s.compact()
+}
+
+// Clone shares the base, which never changes, with the copy.
+func (s *tieredSet) Clone() SetBackend {
+	s.l.Lock()
+	defer s.l.Unlock()
+	b := s.compact()
+	c := newTieredSet()
+	c.base.Store(b)
+	c.size, c.digest = s.size, s.digest
+	return c
+}
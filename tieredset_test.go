@@ -0,0 +1,178 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import (
+	"crypto/sha256"
+	"encoding/binary"
+	"fmt"
+	"math/rand"
+	"sync"
+	"sync/atomic"
+	"testing"
+	"time"
+)
+
+func tieredTestKey(i int) string {
+	var b [8]byte
+	binary.BigEndian.PutUint64(b[:], uint64(i))
+	h := sha256.Sum256(b[:])
+	return string(h[:])
+}
+
+func TestTieredSet(t *testing.T) {
+	s := newTieredSet()
+	stable := make([]byte, 0)
+	for i := 0; i < 20000; i++ {
+		stable = append(stable, tieredTestKey(i)...)
+	}
+	expected := NewTrie()
+	expected.SetKeys(stable, PREFIX_32B_SZ)
+	// sorted, so they go straight into the base
+	stable, _ = expected.SortedKeys(PREFIX_32B_SZ)
+	s.SetKeys(stable, PREFIX_32B_SZ)
+
+	// readers must always find the keys nobody changes, while writers push
+	// several deltas through background merges
+	var stop int32
+	var missed int32
+	var readers sync.WaitGroup
+	for r := 0; r < 4; r++ {
+		readers.Add(1)
+		go func(r int) {
+			defer readers.Done()
+			rng := rand.New(rand.NewSource(int64(r)))
+			for atomic.LoadInt32(&stop) == 0 {
+				if !s.Get(tieredTestKey(rng.Intn(20000))) {
+					atomic.AddInt32(&missed, 1)
+				}
+			}
+		}(r)
+	}
+	for i := 20000; i < 60000; i++ {
+		s.Set(tieredTestKey(i))
+		expected.Set(tieredTestKey(i))
+		if i%3 == 0 {
+			s.Delete(tieredTestKey(i - 1))
+			expected.Delete(tieredTestKey(i - 1))
+		}
+		// bring some back, their tombstones merged or not
+		if i%5 == 0 {
+			s.Set(tieredTestKey(i - 4))
+			expected.Set(tieredTestKey(i - 4))
+		}
+	}
+	atomic.StoreInt32(&stop, 1)
+	readers.Wait()
+	if missed > 0 {
+		t.Errorf("Readers missed %d unchanged keys", missed)
+	}
+
+	if s.Size() != expected.Size() || s.Digest() != expected.Digest() {
+		t.Fatalf("%d keys, digest %x, expected %d, %x", s.Size(), s.Digest(), expected.Size(), expected.Digest())
+	}
+	for i := 0; i < 60000; i++ {
+		if s.Get(tieredTestKey(i)) != expected.Get(tieredTestKey(i)) {
+			t.Fatalf("Key %d wrong", i)
+		}
+	}
+	c := s.Clone()
+	s.Freeze()
+	if atomic.LoadInt32(&s.pending) != 0 || s.base.Load().(*tieredBase).frozen != nil {
+		t.Errorf("Freeze left a delta")
+	}
+	keys, err := s.SortedKeys(PREFIX_32B_SZ)
+	if err != nil {
+		t.Fatal(err)
+	}
+	want, _ := expected.SortedKeys(PREFIX_32B_SZ)
+	if string(keys) != string(want) {
+		t.Errorf("Sorted keys differ")
+	}
+	// the clone shares the base, but not later changes
+	s.Delete(tieredTestKey(0))
+	if !c.Get(tieredTestKey(0)) || c.Digest() != expected.Digest() {
+		t.Errorf("Clone changed with the original")
+	}
+}
+
+// benchmarkMixedLoad has parallel goroutines look up full hashes in a set of
+// 200k, one in every insertEvery operations adding a new one instead as
+// gethash responses do, and reports the mean latency of each.
+func benchmarkMixedLoad(b *testing.B, backend string, insertEvery int) {
+	set, err := NewSet(backend)
+	if err != nil {
+		b.Fatal(err)
+	}
+	keys := make([]byte, 0, 200000*PREFIX_32B_SZ)
+	for i := 0; i < 200000; i++ {
+		keys = append(keys, tieredTestKey(i)...)
+	}
+	set.SetKeys(keys, PREFIX_32B_SZ)
+	set.Freeze()
+
+	var next int64 = 200000
+	var lookups, inserts, lookupNs, insertNs int64
+	b.ResetTimer()
+	b.RunParallel(func(pb *testing.PB) {
+		rng := rand.New(rand.NewSource(atomic.AddInt64(&next, 1)))
+		var l, i, lns, ins int64
+		for n := 0; pb.Next(); n++ {
+			if n%insertEvery == 0 {
+				key := tieredTestKey(int(atomic.AddInt64(&next, 1)))
+				start := time.Now()
+				set.Set(key)
+				ins += int64(time.Since(start))
+				i++
+			} else {
+				key := tieredTestKey(rng.Intn(400000))
+				start := time.Now()
+				set.Get(key)
+				lns += int64(time.Since(start))
+				l++
+			}
+		}
+		atomic.AddInt64(&lookups, l)
+		atomic.AddInt64(&inserts, i)
+		atomic.AddInt64(&lookupNs, lns)
+		atomic.AddInt64(&insertNs, ins)
+	})
+	if lookups > 0 {
+		b.ReportMetric(float64(lookupNs)/float64(lookups), "lookup-ns")
+	}
+	if inserts > 0 {
+		b.ReportMetric(float64(insertNs)/float64(inserts), "insert-ns")
+	}
+}
+
+func BenchmarkMixedLoad(b *testing.B) {
+	for _, backend := range []string{"hattrie", "sorted", "tiered"} {
+		for _, insertEvery := range []int{10, 1000} {
+			b.Run(fmt.Sprintf("%s/1in%d", backend, insertEvery), func(b *testing.B) {
+				benchmarkMixedLoad(b, backend, insertEvery)
+			})
+		}
+	}
+}
@@ -0,0 +1,81 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import (
+	"context"
+	"runtime/pprof"
+	"runtime/trace"
+)
+
+// Lookups and updates are broken down for runtime/trace as tasks (a lookup,
+// an update) made of regions (canonicalize, hash, probe, gethash; download,
+// decode, reload, insert, swap, snapshot), and for CPU profiles by pprof
+// labels naming the lookup kind, the list and the update phase.  Tracing
+// costs next to nothing unless a trace is being captured; the labels are a
+// small allocation per lookup and per list probed.
+//
+// A goroutine's labels can't be read back, so spans only set them when the
+// context they start from says what to put back: one passed in by the
+// caller, as to IsListedContext, or the root of a goroutine of our own.
+// Otherwise the caller's labels are left alone.
+
+type goroutineLabelsKey struct{}
+
+// withGoroutineLabels marks ctx as carrying the labels of the goroutine it
+// is used on, so spans started from it may label the goroutine.
+func withGoroutineLabels(ctx context.Context) context.Context {
+	return context.WithValue(ctx, goroutineLabelsKey{}, true)
+}
+
+// span is a region of work on the current goroutine, carrying labels for
+// its duration.
+type span struct {
+	parent context.Context
+	region *trace.Region
+	label  bool
+}
+
+// startSpan starts a region and adds labels (key, value pairs) to the
+// goroutine until the span ends, if ctx allows it.  The labels also apply to
+// spans started from the returned context.
+func startSpan(ctx context.Context, region string, labels ...string) (context.Context, span) {
+	s := span{parent: ctx, label: ctx.Value(goroutineLabelsKey{}) != nil}
+	ctx = pprof.WithLabels(ctx, pprof.Labels(labels...))
+	if s.label {
+		pprof.SetGoroutineLabels(ctx)
+	}
+	s.region = trace.StartRegion(ctx, region)
+	return ctx, s
+}
+
+// end ends the region and puts back the labels of the context the span was
+// started from.
+func (s span) end() {
+	s.region.End()
+	if s.label {
+		pprof.SetGoroutineLabels(s.parent)
+	}
+}
@@ -0,0 +1,93 @@
+/*
+Copyright (c) 2013, Richard Johnson
+All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+ * Redistributions of source code must retain the above copyright notice, this
+   list of conditions and the following disclaimer.
+ * Redistributions in binary form must reproduce the above copyright notice,
+   this list of conditions and the following disclaimer in the documentation
+   and/or other materials provided with the distribution.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE LIABLE
+FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+package safebrowsing
+
+import (
+	"bytes"
+	"context"
+	"runtime/pprof"
+	"runtime/trace"
+	"testing"
+)
+
+func TestSpanLabels(t *testing.T) {
+	ctx, outer := startSpan(context.Background(), "outer", "list", "test")
+	inner, s := startSpan(ctx, "inner", "phase", "insert")
+	if list, _ := pprof.Label(inner, "list"); list != "test" {
+		t.Errorf("Outer label lost in a nested span: %q", list)
+	}
+	if phase, _ := pprof.Label(inner, "phase"); phase != "insert" {
+		t.Errorf("Unexpected phase label %q", phase)
+	}
+	s.end()
+	outer.end()
+}
+
+func TestSpanKeepsCallerLabels(t *testing.T) {
+	sbl := newSafeBrowsingList("test", "")
+	sb := &SafeBrowsing{Lists: map[string]*SafeBrowsingList{"test": sbl}}
+
+	// the goroutine's labels can only be checked through a context, so
+	// spans must not set any unless given one that says what to put back
+	ctx, s := startSpan(context.Background(), "plain", "list", "test")
+	if s.label {
+		t.Errorf("Span would overwrite the caller's labels")
+	}
+	s.end()
+	if list, _ := pprof.Label(ctx, "list"); list != "test" {
+		t.Errorf("Span context not labelled: %q", list)
+	}
+
+	pprof.Do(context.Background(), pprof.Labels("caller", "mine"), func(ctx context.Context) {
+		inner, s := startSpan(withGoroutineLabels(ctx), "labelled", "list", "test")
+		if !s.label {
+			t.Errorf("Span given the caller's labels doesn't label the goroutine")
+		}
+		if caller, _ := pprof.Label(inner, "caller"); caller != "mine" {
+			t.Errorf("Caller's label lost in the span: %q", caller)
+		}
+		s.end()
+		sb.MightBeListedContext(ctx, "http://www.example.com/")
+		sb.MightBeListed("http://www.example.com/")
+	})
+}
+
+func TestTraceRegions(t *testing.T) {
+	sbl := newSafeBrowsingList("test", "")
+	sb := &SafeBrowsing{Lists: map[string]*SafeBrowsingList{"test": sbl}}
+
+	buf := &bytes.Buffer{}
+	if err := trace.Start(buf); err != nil {
+		t.Skipf("Unable to trace: %s", err)
+	}
+	sb.MightBeListed("http://www.example.com/")
+	trace.Stop()
+
+	for _, name := range []string{"mightBeListed", "canonicalize", "hash", "probe"} {
+		if !bytes.Contains(buf.Bytes(), []byte(name)) {
+			t.Errorf("Trace is missing %s", name)
+		}
+	}
+}
@@ -25,29 +25,56 @@ OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 package main
 
 import (
+	"context"
 	"encoding/json"
 	"flag"
 	"fmt"
 	toml "github.com/BurntSushi/toml"
 	safebrowsing "github.com/rjohnsondev/go-safe-browsing-api"
+	"net"
 	"net/http"
 	"os"
+	"runtime/pprof"
+	"runtime/trace"
+	"strconv"
+	"time"
 )
 
 type Config struct {
-	Address        string
-	GoogleApiKey   string
-	DataDir        string
-	EnableFormPage bool
+	Address            string
+	GoogleApiKey       string
+	DataDir            string
+	EnableFormPage     bool
+	HugePages          string
+	LogLevel           string
+	ProgressiveStartup bool
+	EnableDebug        bool
+	FleetPublish       bool
+	FleetBuilder       string
+	FullHashPeers      []string
+	FullHashPeerSelf   string
+	FullHashPeerSecret string
+	UpdateInChild      bool
+	ListBackends       map[string]string
+	TrieParams         map[string]safebrowsing.TrieParams
+	HandoffSocket      string
+	KeepHistory        bool
 }
 
 var sb *safebrowsing.SafeBrowsing
 
 func main() {
+	if safebrowsing.RunUpdateChild() {
+		return
+	}
 
+	bench := flag.Bool("bench", false,
+		"time each set backend with the index snapshots in dataDir and exit")
+	autotune := flag.Bool("autotune", false,
+		"sweep the trie parameters with the index snapshots in dataDir and exit")
 	flag.Parse()
 	if len(flag.Args()) < 1 {
-		fmt.Printf("Usage: webserver config-file.toml")
+		fmt.Printf("Usage: webserver [-bench | -autotune] config-file.toml")
 		os.Exit(1)
 	}
 
@@ -61,7 +88,60 @@ func main() {
 		os.Exit(1)
 	}
 
-	var err error
+	hugePages, err := safebrowsing.ParseHugePageMode(conf.HugePages)
+	if err != nil {
+		fmt.Printf("Error reading config file %s: %s", flag.Arg(0), err)
+		os.Exit(1)
+	}
+	safebrowsing.SetHugePages(hugePages)
+	if safebrowsing.MinLogLevel, err = safebrowsing.ParseLogLevel(conf.LogLevel); err != nil {
+		fmt.Printf("Error reading config file %s: %s", flag.Arg(0), err)
+		os.Exit(1)
+	}
+	safebrowsing.ProgressiveStartup = conf.ProgressiveStartup
+	safebrowsing.FollowBuilder = conf.FleetBuilder
+	safebrowsing.FullHashPeers = conf.FullHashPeers
+	safebrowsing.FullHashPeerSelf = conf.FullHashPeerSelf
+	safebrowsing.FullHashPeerSecret = conf.FullHashPeerSecret
+	safebrowsing.UpdateInChild = conf.UpdateInChild
+	safebrowsing.KeepHistory = conf.KeepHistory
+	safebrowsing.ListBackends = conf.ListBackends
+	safebrowsing.ListTrieParams = conf.TrieParams
+	if err = safebrowsing.CheckListBackends(); err != nil {
+		fmt.Printf("Error reading config file %s: %s", flag.Arg(0), err)
+		os.Exit(1)
+	}
+
+	if *bench {
+		if err = safebrowsing.BenchSetBackends(conf.DataDir, os.Stdout); err != nil {
+			fmt.Printf("%s\n", err)
+			os.Exit(1)
+		}
+		return
+	}
+	if *autotune {
+		if err = safebrowsing.AutotuneTrieParams(conf.DataDir, os.Stdout); err != nil {
+			fmt.Printf("%s\n", err)
+			os.Exit(1)
+		}
+		return
+	}
+
+	// take over from a running server, or start listening afresh
+	safebrowsing.HandoffSocket = conf.HandoffSocket
+	handoff, err := safebrowsing.ReceiveHandoff()
+	if err != nil {
+		fmt.Printf("%s\n", err)
+		os.Exit(1)
+	}
+	var listener net.Listener
+	if handoff != nil && len(handoff.Listeners) > 0 {
+		listener = handoff.Listeners[0]
+	} else if listener, err = net.Listen("tcp", conf.Address); err != nil {
+		fmt.Printf("%s\n", err)
+		os.Exit(1)
+	}
+
 	sb, err = safebrowsing.NewSafeBrowsing(
 		conf.GoogleApiKey,
 		conf.DataDir,
@@ -73,8 +153,54 @@ func main() {
 	if conf.EnableFormPage {
 		http.HandleFunc("/form", handleHtml)
 	}
+	if conf.FleetPublish {
+		fb, err := safebrowsing.NewFleetBuilder(sb)
+		if err != nil {
+			panic(err)
+		}
+		go fb.PublishLoop(10 * time.Second)
+		http.Handle("/fleet/", http.StripPrefix("/fleet", fb))
+	}
+	if shared := sb.SharedFullHashes(); shared != nil {
+		http.Handle("/fullhashes/", http.StripPrefix("/fullhashes", shared))
+	}
+	if conf.EnableDebug {
+		http.HandleFunc("/debug/trace", handleTrace)
+		http.HandleFunc("/debug/profile", handleProfile)
+	}
+	http.HandleFunc("/ready", handleReady)
 	http.HandleFunc("/", handler)
-	http.ListenAndServe(conf.Address, nil)
+
+	server := &http.Server{}
+	served := make(chan error, 1)
+	go func() { served <- server.Serve(listener) }()
+	if handoff != nil {
+		if err = handoff.Complete(); err != nil {
+			fmt.Printf("Old server didn't let go: %s\n", err)
+		}
+	}
+
+	drained := make(chan bool)
+	if conf.HandoffSocket != "" {
+		go func() {
+			err := sb.ServeHandoff([]net.Listener{listener}, func() {
+				ctx, cancel := context.WithTimeout(context.Background(), time.Minute)
+				defer cancel()
+				server.Shutdown(ctx)
+			})
+			if err != nil {
+				fmt.Printf("Unable to hand over to a new server: %s\n", err)
+				return
+			}
+			close(drained)
+		}()
+	}
+	if err = <-served; err != http.ErrServerClosed {
+		fmt.Printf("%s\n", err)
+		os.Exit(1)
+	}
+	<-drained
+	safebrowsing.FlushLog()
 }
 
 type UrlResponse struct {
@@ -84,6 +210,10 @@ type UrlResponse struct {
 	WarningTitle      string `json:"warningTitle,omitempty"`
 	WarningText       string `json:"warningText,omitempty"`
 	FullHashRequested bool   `json:"fullHashRequested,omitempty"`
+	// how many seconds the answer may be cached for
+	MaxAge int `json:"maxAge"`
+
+	validUntil time.Time
 }
 
 var warnings map[string]map[string]string = map[string]map[string]string{
@@ -160,18 +290,19 @@ $.post("/", obj, function(data, textStatus, jqXHR) {
 	fmt.Fprint(w, html)
 }
 
-func queryUrl(url string, isBlocking bool) (response *UrlResponse) {
+func queryUrl(ctx context.Context, url string, isBlocking bool) (response *UrlResponse) {
 	response = new(UrlResponse)
 
 	list := ""
 	var err error
 	fullHashMatch := false
 
+	var validUntil time.Time
 	if isBlocking {
-		list, err = sb.IsListed(url)
+		list, validUntil, err = sb.IsListedUntilContext(ctx, url)
 		fullHashMatch = true
 	} else {
-		list, fullHashMatch, err = sb.MightBeListed(url)
+		list, fullHashMatch, validUntil, err = sb.MightBeListedUntilContext(ctx, url)
 	}
 
 	if err != nil {
@@ -183,6 +314,7 @@ func queryUrl(url string, isBlocking bool) (response *UrlResponse) {
 			response.List = list
 			response.WarningTitle = warnings[list]["title"]
 			response.WarningText = warnings[list]["text"]
+			response.setValidUntil(validUntil)
 		} else {
 			response.IsListed = false
 			response.List = list
@@ -190,11 +322,107 @@ func queryUrl(url string, isBlocking bool) (response *UrlResponse) {
 			// Requesting full hash in background...
 			go sb.IsListed(url)
 		}
+	} else if err == nil {
+		response.setValidUntil(validUntil)
 	}
 
 	return response
 }
 
+// queryUrlAt answers from the lists as they were at a past time.  Only a full
+// hash match is known to have been listed; a prefix match is reported with
+// its list, as full hashes can't be requested for the past.
+func queryUrlAt(url string, at time.Time) (response *UrlResponse) {
+	response = new(UrlResponse)
+
+	list, fullHashMatch, err := sb.IsListedAt(url, at)
+	if err != nil {
+		response.Error = fmt.Sprintf("Error looking up url: %s", err.Error())
+	}
+	response.IsListed = fullHashMatch
+	response.List = list
+	if fullHashMatch {
+		response.WarningTitle = warnings[list]["title"]
+		response.WarningText = warnings[list]["text"]
+	}
+	return response
+}
+
+func (response *UrlResponse) setValidUntil(validUntil time.Time) {
+	if maxAge := time.Until(validUntil) / time.Second; maxAge > 0 {
+		response.MaxAge = int(maxAge)
+		response.validUntil = validUntil
+	}
+}
+
+// setCacheHeaders lets HTTP caches keep the answer to a GET for a single
+// URL as long as the answer holds.  Anything else isn't worth caching.
+func setCacheHeaders(w http.ResponseWriter, r *http.Request, responses map[string]*UrlResponse) {
+	if r.Method != "GET" || len(responses) != 1 {
+		return
+	}
+	for _, response := range responses {
+		if response.MaxAge == 0 {
+			w.Header().Set("Cache-Control", "no-cache")
+			return
+		}
+		w.Header().Set("Cache-Control", fmt.Sprintf("public, max-age=%d", response.MaxAge))
+		w.Header().Set("Expires", response.validUntil.UTC().Format(http.TimeFormat))
+	}
+}
+
+// captureSeconds reads how long to capture a trace or profile for, 5
+// seconds unless the request asks otherwise.
+func captureSeconds(r *http.Request) time.Duration {
+	seconds, err := strconv.Atoi(r.FormValue("seconds"))
+	if err != nil || seconds <= 0 || seconds > 60 {
+		seconds = 5
+	}
+	return time.Duration(seconds) * time.Second
+}
+
+// handleTrace captures an execution trace of the next few seconds, for
+// go tool trace.  Lookups and updates show up as tasks and regions.
+func handleTrace(w http.ResponseWriter, r *http.Request) {
+	w.Header().Set("Content-Type", "application/octet-stream")
+	w.Header().Set("Content-Disposition", `attachment; filename="trace"`)
+	if err := trace.Start(w); err != nil {
+		w.Header().Del("Content-Disposition")
+		http.Error(w, fmt.Sprintf("Unable to start trace: %s", err), http.StatusInternalServerError)
+		return
+	}
+	time.Sleep(captureSeconds(r))
+	trace.Stop()
+}
+
+// handleProfile captures a CPU profile of the next few seconds, for go tool
+// pprof.  Samples are labelled with the lookup kind, list and update phase.
+func handleProfile(w http.ResponseWriter, r *http.Request) {
+	w.Header().Set("Content-Type", "application/octet-stream")
+	w.Header().Set("Content-Disposition", `attachment; filename="profile"`)
+	if err := pprof.StartCPUProfile(w); err != nil {
+		w.Header().Del("Content-Disposition")
+		http.Error(w, fmt.Sprintf("Unable to start profile: %s", err), http.StatusInternalServerError)
+		return
+	}
+	time.Sleep(captureSeconds(r))
+	pprof.StopCPUProfile()
+}
+
+func handleReady(w http.ResponseWriter, r *http.Request) {
+	readiness := sb.Readiness()
+	txtOutput, err := json.MarshalIndent(readiness, "", "    ")
+	if err != nil {
+		fmt.Fprintf(w, "Error marshalling response: %s", err.Error())
+		return
+	}
+	w.Header().Set("Content-Type", "application/json")
+	if readiness.Weight == 0 {
+		w.WriteHeader(http.StatusServiceUnavailable)
+	}
+	fmt.Fprint(w, string(txtOutput))
+}
+
 func handler(w http.ResponseWriter, r *http.Request) {
 	err := r.ParseForm()
 	if err != nil {
@@ -212,11 +440,42 @@ func handler(w http.ResponseWriter, r *http.Request) {
 		return
 	}
 
-	output := make(map[string]*UrlResponse, 0)
-	for _, url := range urls {
-		output[url] = queryUrl(url, isBlocking)
+	explain := (r.FormValue("explain") != "" &&
+		r.FormValue("explain") != "false" &&
+		r.FormValue("explain") != "0")
+
+	var at time.Time
+	if r.FormValue("at") != "" {
+		if at, err = time.Parse(time.RFC3339, r.FormValue("at")); err != nil {
+			fmt.Fprintf(w, "Error reading at: %s", err.Error())
+			return
+		}
+	}
+
+	var txtOutput []byte
+	if explain {
+		// how each lookup was answered, instead of the usual response
+		output := make(map[string]*safebrowsing.Explanation, 0)
+		for _, url := range urls {
+			if isBlocking {
+				output[url] = sb.ExplainIsListed(url)
+			} else {
+				output[url] = sb.Explain(url)
+			}
+		}
+		txtOutput, err = json.MarshalIndent(output, "", "    ")
+	} else {
+		output := make(map[string]*UrlResponse, 0)
+		for _, url := range urls {
+			if !at.IsZero() {
+				output[url] = queryUrlAt(url, at)
+			} else {
+				output[url] = queryUrl(r.Context(), url, isBlocking)
+			}
+		}
+		setCacheHeaders(w, r, output)
+		txtOutput, err = json.MarshalIndent(output, "", "    ")
 	}
-	txtOutput, err := json.MarshalIndent(output, "", "    ")
 	if err != nil {
 		fmt.Fprintf(w, "Error marshalling response: %s", err.Error())
 		return